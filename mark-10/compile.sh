@@ -1,8 +1,17 @@
 #! /bin/sh
 
-gcc ./net/server.c ./net/server-tools.c ./util/parser.c -O2 -lrt -lpthread -o server
-gcc ./net/first-worker.c ./net/client-tools.c ./util/parser.c -O2 -lrt -lm -o first-worker
-gcc ./net/second-worker.c ./net/client-tools.c ./util/parser.c -O2 -lrt -lm -o second-worker
-gcc ./net/third-worker.c ./net/client-tools.c ./util/parser.c -O2 -lrt -lm -o third-worker
-gcc ./net/logs-collector.c ./net/client-tools.c ./util/parser.c -O2 -lrt -lm -o logs-collector
-gcc ./net/manager.c ./net/client-tools.c ./util/parser.c -O2 -lrt -lm -o manager
+gcc ./net/server.c ./net/server-tools.c ./net/server-io.c ./net/io-uring.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./net/hot-restart.c ./net/server-peers.c ./net/stage-balance.c ./net/stage-queue.c ./net/pin-journal.c ./net/pipeline-config.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c ./util/failure-detector.c -O2 -lrt -lpthread -lm -o server
+gcc ./net/first-worker.c ./net/worker-stages.c ./net/worker-pool.c ./net/pin-journal.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./net/pin-trace.c ./net/pipeline-config.c ./net/stage-steps.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -ldl -o first-worker
+gcc ./net/second-worker.c ./net/worker-stages.c ./net/worker-pool.c ./net/pin-journal.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./net/pin-trace.c ./net/pipeline-config.c ./net/stage-steps.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -ldl -o second-worker
+gcc ./net/third-worker.c ./net/worker-stages.c ./net/worker-pool.c ./net/pin-journal.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./net/pin-trace.c ./net/pipeline-config.c ./net/stage-steps.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -ldl -o third-worker
+gcc ./net/worker.c ./net/worker-stages.c ./net/worker-pool.c ./net/pin-journal.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./net/pin-trace.c ./net/pipeline-config.c ./net/stage-steps.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -ldl -o worker
+gcc ./net/logs-collector.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -o logs-collector
+gcc ./net/manager.c ./net/manager-script.c ./net/client-tools.c ./net/message-pool.c ./net/shm-transport.c ./net/tcp-transport.c ./util/parser.c ./util/placement.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lm -lpthread -o manager
+gcc ./net/pin-journal-tool.c ./net/pin-journal.c ./util/parser.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lpthread -lm -o pin-journal
+gcc ./net/stats.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lpthread -o stats
+gcc ./test/failure-detector-test.c ./util/failure-detector.c -O2 -lm -o failure-detector-test
+gcc ./test/server-peers-test.c ./net/server-peers.c -O2 -o server-peers-test
+gcc ./net/example-stage-plugin.c -O2 -shared -fPIC -o example-stage-plugin.so
+gcc ./test/stage-queue-test.c ./net/stage-queue.c -O2 -o stage-queue-test
+gcc ./test/token-bucket-test.c -O2 -o token-bucket-test
+gcc ./test/pin-journal-test.c ./net/pin-journal.c ./util/parser.c ./util/histogram.c ./util/metrics.c ./util/metrics-export.c -O2 -lrt -lpthread -lm -o pin-journal-test
@@ -6,26 +6,240 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../util/clock.h"
 #include "../util/config.h"
+#include "../util/metrics-export.h"
+#include "../util/metrics.h"
+#include "../util/parser.h"
+#include "../util/placement.h"
+#include "../util/token-bucket.h"
 #include "client-tools.h"
+#include "message-pool.h"
 #include "net-config.h"
+#include "pin-trace.h"
+#include "shm-transport.h"
+#include "tcp-transport.h"
+
+/// @brief Worker attached to the shared memory transport checks UDP socket
+/// for the shutdown signal at least that often.
+enum { SHM_RECEIVE_POLL_MS = 100 };
+
+/// @brief Every pin_trace_sample_rate-th new pin is traced, 0 disables tracing.
+static uint32_t pin_trace_sample_rate = 0;
+/// @brief Pin::deadline_ms of the new pins.
+static uint32_t pin_deadline_ms = 0;
+
+/// @brief State of the worker of every stage, a process hosts a stage once.
+/// The counters are updated by the processing threads of the worker.
+static struct ClientStageState {
+    /// Pins the worker processes at once, set by the server at runtime.
+    uint32_t concurrency;
+    bool is_draining;
+    /// The server confirmed that it took the worker out of the routing.
+    bool has_left;
+    /// Pins that passed the worker, reported to the server once it drained or left.
+    PipelineDrainReport drain_report;
+    /// Work of the worker reported in the heartbeats.
+    uint32_t pins_processed;
+    uint64_t service_time_ns;
+    /// Pace of the new pins of an entry stage, no limit until the server sets it.
+    /// Guarded by client_admission_mutex.
+    TokenBucket admission;
+    uint32_t admission_rate;
+} client_stages[PIPELINE_STAGES];
+
+static pthread_mutex_t client_admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief Clients of the process, a multi-role worker has one for every stage
+/// it hosts. The first client starts the heartbeats, the message pool and the
+/// metrics export for all of them, the last one stops them.
+static struct ClientProcessState {
+    /// Guards everything below, the heartbeats are sent under it.
+    pthread_mutex_t mutex;
+    const struct Client* clients[CLIENT_MAX_PER_PROCESS];
+    uint32_t clients_count;
+    /// Stages of the multi-role worker, 0 for the other processes.
+    uint32_t roles;
+    /// Stages the server asked the multi-role worker to host.
+    uint32_t requested_roles;
+    bool has_requested_roles;
+} client_process = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/// @brief Thread that tells the server that the clients are alive while the
+/// other threads are busy with a pin or blocked on a receive.
+static struct ClientHeartbeatState {
+    uint32_t interval_ms;
+    pthread_t thread;
+    bool is_running;
+    /// Guarded by mutex.
+    bool should_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} client_heartbeat;
+
+/// @brief Id of the next command batch of the manager, 0 is never used.
+static uint32_t manager_next_request_id = 1;
+
+/// @brief Serializes the writes of the frames to the TCP connections and the
+/// pushes into the rings of the shared memory peers, the heartbeat thread and
+/// the processing threads of the workers send too.
+static pthread_mutex_t client_send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ClientMetrics {
+    MetricId messages_in[MESSAGE_TYPES_COUNT];
+    MetricId messages_out[MESSAGE_TYPES_COUNT];
+    MetricId pins_received;
+    MetricId pins_sent;
+    MetricId pins_rejected;
+    MetricId stage_processing_time;
+    MetricId logs_received;
+    MetricId commands_sent;
+    MetricId command_failures;
+} client_metrics;
+
+static void register_client_metrics(ComponentType type) {
+    char name[METRICS_MAX_NAME_SIZE];
+    for (uint32_t msg_type = 0; msg_type < MESSAGE_TYPES_COUNT; msg_type++) {
+        snprintf(name, sizeof(name), "messages in: %s",
+                 message_type_to_string((MessageType)msg_type));
+        client_metrics.messages_in[msg_type] = metrics_register_counter(name);
+        snprintf(name, sizeof(name), "messages out: %s",
+                 message_type_to_string((MessageType)msg_type));
+        client_metrics.messages_out[msg_type] = metrics_register_counter(name);
+    }
+
+    switch (type) {
+        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
+        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
+        case COMPONENT_TYPE_THIRD_STAGE_WORKER:
+        case COMPONENT_TYPE_FOURTH_STAGE_WORKER:
+        case COMPONENT_TYPE_FIFTH_STAGE_WORKER:
+            client_metrics.pins_received = metrics_register_counter("pins received");
+            client_metrics.pins_sent     = metrics_register_counter("pins sent");
+            client_metrics.pins_rejected = metrics_register_counter("pins rejected");
+            client_metrics.stage_processing_time =
+                metrics_register_histogram("stage processing time");
+            break;
+        case COMPONENT_TYPE_LOGS_COLLECTOR:
+            client_metrics.logs_received = metrics_register_counter("logs received");
+            break;
+        case COMPONENT_TYPE_MANAGER:
+            client_metrics.commands_sent    = metrics_register_counter("commands sent");
+            client_metrics.command_failures = metrics_register_counter("command failures");
+            break;
+        default:
+            break;
+    }
+}
+
+static struct ClientStageState* client_stage(const Client worker) {
+    const int32_t stage = pipeline_stage_index(worker->type);
+    assert(stage >= 0);
+    return &client_stages[stage];
+}
+
+static void count_message(const MetricId counters[MESSAGE_TYPES_COUNT], MessageType type) {
+    if (type < MESSAGE_TYPES_COUNT) {
+        metrics_counter_inc(counters[type]);
+    }
+}
+
+static bool send_message(const Client client, const UDPMessage* message) {
+    bool ok;
+    if (client->is_tcp_client) {
+        pthread_mutex_lock(&client_send_mutex);
+        ok = tcp_send_message(client->client_sock_fd, message);
+        pthread_mutex_unlock(&client_send_mutex);
+    } else {
+        ssize_t send_bytes = sendto(client->client_sock_fd, message, sizeof(*message),
+                                    MSG_NOSIGNAL,
+                                    (const struct sockaddr*)&client->server_broadcast_sock_addr,
+                                    sizeof(client->server_broadcast_sock_addr));
+        ok                 = send_bytes == sizeof(*message);
+    }
+    if (!ok) {
+        app_perror(client->is_tcp_client ? "writev" : "sendto");
+    } else {
+        count_message(client_metrics.messages_out, message->message_type);
+    }
+    return ok;
+}
+
+/// @brief Sends over the shared memory if the worker is attached to it: the
+/// server reads it in the order of the pins sent before.
+static bool send_worker_message(const Client worker, const UDPMessage* message) {
+    if (is_shm_peer_attached(&worker->shm)) {
+        pthread_mutex_lock(&client_send_mutex);
+        const bool ok = shm_peer_send(&worker->shm, message);
+        pthread_mutex_unlock(&client_send_mutex);
+        if (ok) {
+            count_message(client_metrics.messages_out, message->message_type);
+            return true;
+        }
+        // full ring means that the server is behind, UDP still delivers the message
+    }
+    return send_message(worker, message);
+}
+
+/// @brief recv(2) of one message from the server over the transport of the client.
+static ssize_t receive_message(const Client client, UDPMessage* message, int flags) {
+    if (client->is_tcp_client) {
+        return tcp_recv_message(client->client_sock_fd, message, flags);
+    }
+    return recv(client->client_sock_fd, message, sizeof(*message), flags);
+}
+
+static WorkerLoad current_client_load(const Client worker) {
+    const struct ClientStageState* stage = client_stage(worker);
+    const uint64_t service_time_ns = __atomic_load_n(&stage->service_time_ns, __ATOMIC_RELAXED);
+    return (WorkerLoad){
+        .pins_processed  = __atomic_load_n(&stage->pins_processed, __ATOMIC_RELAXED),
+        .service_time_ms = (uint32_t)(service_time_ns / 1000000),
+    };
+}
+
+static ClientHeartbeat current_heartbeat(const Client client, uint32_t sequence) {
+    ClientHeartbeat heartbeat = {
+        .pid      = (uint32_t)getpid(),
+        .sequence = sequence,
+        .roles    = __atomic_load_n(&client_process.roles, __ATOMIC_RELAXED),
+    };
+    if (is_worker(client)) {
+        heartbeat.concurrency = client_concurrency(client);
+        heartbeat.load        = current_client_load(client);
+    }
+    return heartbeat;
+}
 
 static bool send_client_type_info(const Client client) {
     const UDPMessage message = {
-        .sender_type           = client->type,
-        .receiver_type         = COMPONENT_TYPE_SERVER,
-        .message_type          = MESSAGE_TYPE_NEW_CLIENT,
-        .message_content.bytes = {0},
+        .sender_type               = client->type,
+        .receiver_type             = COMPONENT_TYPE_SERVER,
+        .message_type              = MESSAGE_TYPE_NEW_CLIENT,
+        .message_content.heartbeat = current_heartbeat(client, 0),
     };
-    if (sendto(client->client_sock_fd, &message, sizeof(message), 0,
-               (const struct sockaddr*)&client->server_broadcast_sock_addr,
-               sizeof(client->server_broadcast_sock_addr)) != sizeof(message)) {
-        app_perror("sendto");
+    bool is_sent = false;
+    if (is_shm_peer_attached(&client->shm)) {
+        // a role switch registers while the pool threads of the other stages send their pins
+        pthread_mutex_lock(&client_send_mutex);
+        is_sent = shm_peer_send(&client->shm, &message);
+        pthread_mutex_unlock(&client_send_mutex);
+    }
+    if (is_sent) {
+        count_message(client_metrics.messages_out, message.message_type);
+        printf("Sent type \"%s\" of this client to the server through the shared memory\n",
+               component_type_to_string(client->type));
+        return true;
+    }
+    if (!send_message(client, &message)) {
         return false;
     }
 
@@ -34,6 +248,149 @@ static bool send_client_type_info(const Client client) {
     return true;
 }
 
+static bool send_heartbeat(const Client client, uint32_t sequence) {
+    if (is_shm_peer_attached(&client->shm)) {
+        // the server reads the counters, the rings have a single producer
+        shm_peer_report_load(&client->shm, current_client_load(client));
+        shm_peer_heartbeat(&client->shm);
+        return true;
+    }
+    const UDPMessage message = {
+        .sender_type               = client->type,
+        .receiver_type             = COMPONENT_TYPE_SERVER,
+        .message_type              = MESSAGE_TYPE_HEARTBEAT,
+        .message_content.heartbeat = current_heartbeat(client, sequence),
+    };
+    return send_message(client, &message);
+}
+
+static void send_process_heartbeats(uint32_t sequence) {
+    pthread_mutex_lock(&client_process.mutex);
+    for (uint32_t i = 0; i < client_process.clients_count; i++) {
+        send_heartbeat(client_process.clients[i], sequence);
+    }
+    pthread_mutex_unlock(&client_process.mutex);
+}
+
+static void* heartbeat_sender(void* unused) {
+    (void)unused;
+    uint32_t sequence = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&client_heartbeat.mutex);
+    while (!client_heartbeat.should_stop) {
+        pthread_mutex_unlock(&client_heartbeat.mutex);
+        // the server notices a client that can not send as a dead one
+        send_process_heartbeats(sequence++);
+        pthread_mutex_lock(&client_heartbeat.mutex);
+
+        // fixed rate, the sends do not shift the period
+        deadline.tv_sec += client_heartbeat.interval_ms / 1000;
+        deadline.tv_nsec += (long)(client_heartbeat.interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int wait_ret = 0;
+        while (!client_heartbeat.should_stop && wait_ret != ETIMEDOUT) {
+            wait_ret =
+                pthread_cond_timedwait(&client_heartbeat.cond, &client_heartbeat.mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&client_heartbeat.mutex);
+    return NULL;
+}
+
+static void start_heartbeats(void) {
+    client_heartbeat.interval_ms =
+        parse_env_uint32(CLIENT_HEARTBEAT_INTERVAL_MS_ENV, CLIENT_HEARTBEAT_INTERVAL_MS);
+    if (client_heartbeat.interval_ms == 0) {
+        return;
+    }
+    client_heartbeat.should_stop = false;
+    pthread_mutex_init(&client_heartbeat.mutex, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&client_heartbeat.cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    int ret = pthread_create(&client_heartbeat.thread, NULL, &heartbeat_sender, NULL);
+    if (ret != 0) {
+        // the client works without them, the server may take it for a dead one
+        errno = ret;
+        app_perror("pthread_create");
+        pthread_cond_destroy(&client_heartbeat.cond);
+        pthread_mutex_destroy(&client_heartbeat.mutex);
+        return;
+    }
+    client_heartbeat.is_running = true;
+}
+
+static void stop_heartbeats(void) {
+    if (!client_heartbeat.is_running) {
+        return;
+    }
+    pthread_mutex_lock(&client_heartbeat.mutex);
+    client_heartbeat.should_stop = true;
+    pthread_cond_signal(&client_heartbeat.cond);
+    pthread_mutex_unlock(&client_heartbeat.mutex);
+    pthread_join(client_heartbeat.thread, NULL);
+    pthread_cond_destroy(&client_heartbeat.cond);
+    pthread_mutex_destroy(&client_heartbeat.mutex);
+    client_heartbeat.is_running = false;
+}
+
+static void set_worker_concurrency(const Client worker, uint32_t concurrency) {
+    if (concurrency == 0) {
+        concurrency = 1;
+    } else if (concurrency > WORKER_MAX_CONCURRENCY) {
+        concurrency = WORKER_MAX_CONCURRENCY;
+    }
+    __atomic_store_n(&client_stage(worker)->concurrency, concurrency, __ATOMIC_RELAXED);
+}
+
+uint32_t client_concurrency(const Client worker) {
+    return __atomic_load_n(&client_stage(worker)->concurrency, __ATOMIC_RELAXED);
+}
+
+/// @return true if the rate changed
+static bool set_client_admission_rate(const Client worker, const AdmissionRate* rate) {
+    struct ClientStageState* stage = client_stage(worker);
+    pthread_mutex_lock(&client_admission_mutex);
+    const bool is_changed = stage->admission_rate != rate->pins_per_minute;
+    stage->admission_rate = rate->pins_per_minute;
+    token_bucket_set_rate(&stage->admission, rate->pins_per_minute / 60.0, rate->burst,
+                          monotonic_time_ns());
+    pthread_mutex_unlock(&client_admission_mutex);
+    return is_changed;
+}
+
+bool wait_client_admission(const Client worker, uint32_t timeout_ms) {
+    struct ClientStageState* stage = client_stage(worker);
+    pthread_mutex_lock(&client_admission_mutex);
+    uint64_t now_ns        = monotonic_time_ns();
+    bool is_admitted       = token_bucket_take(&stage->admission, now_ns);
+    const uint64_t wait_ns = is_admitted ? 0 : token_bucket_wait_ns(&stage->admission, now_ns);
+    pthread_mutex_unlock(&client_admission_mutex);
+    if (is_admitted) {
+        return true;
+    }
+    const uint64_t timeout_ns      = timeout_ms * 1000000ull;
+    const uint64_t sleep_ns        = wait_ns < timeout_ns ? wait_ns : timeout_ns;
+    const struct timespec duration = {
+        .tv_sec  = (time_t)(sleep_ns / 1000000000u),
+        .tv_nsec = (long)(sleep_ns % 1000000000u),
+    };
+    nanosleep(&duration, NULL);
+    pthread_mutex_lock(&client_admission_mutex);
+    now_ns      = monotonic_time_ns();
+    is_admitted = token_bucket_take(&stage->admission, now_ns);
+    pthread_mutex_unlock(&client_admission_mutex);
+    return is_admitted;
+}
+
 static bool setup_client(int client_sock_fd, struct sockaddr_in* client_send_address,
                          uint16_t server_port) {
     if (-1 == setsockopt(client_sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){true}, sizeof(int))) {
@@ -61,27 +418,189 @@ static bool setup_client(int client_sock_fd, struct sockaddr_in* client_send_add
     return true;
 }
 
-bool init_client(Client client, uint16_t server_port, ComponentType type) {
-    client->type = type;
-    int sock_fd = client->client_sock_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+static int connect_to_server(Client client, uint16_t server_port,
+                             const char* server_ip_address) {
+    client->is_tcp_client = server_ip_address != NULL;
+    if (client->is_tcp_client) {
+        client->server_broadcast_sock_addr = (struct sockaddr_in){
+            .sin_family = AF_INET,
+            .sin_port   = htons(server_port),
+        };
+        inet_pton(AF_INET, server_ip_address, &client->server_broadcast_sock_addr.sin_addr);
+        return connect_tcp_client(server_ip_address, server_port);
+    }
+
+    int sock_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock_fd == -1) {
         app_perror("socket");
-        return false;
+        return -1;
+    }
+    if (!setup_client(sock_fd, &client->server_broadcast_sock_addr, server_port)) {
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+/// @brief The socket of the UDP manager is bound to the broadcast address and
+/// shared by all the clients of the host, so the results of its commands come
+/// to a socket of its own.
+static void close_client_sockets(const Client client) {
+    close(client->client_sock_fd);
+    if (client->command_sock_fd != -1) {
+        close(client->command_sock_fd);
     }
+}
 
-    if (!setup_client(sock_fd, &client->server_broadcast_sock_addr, server_port) ||
-        !send_client_type_info(client)) {
+static int open_manager_command_socket(void) {
+    int sock_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock_fd == -1) {
+        app_perror("socket");
+        return -1;
+    }
+    if (-1 == setsockopt(sock_fd, SOL_SOCKET, SO_BROADCAST, &(int){true}, sizeof(int))) {
+        app_perror("setsockopt[SOL_SOCKET,SO_BROADCAST]");
         close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+static void add_process_client(const Client client) {
+    pthread_mutex_lock(&client_process.mutex);
+    assert(client_process.clients_count < CLIENT_MAX_PER_PROCESS);
+    client_process.clients[client_process.clients_count++] = client;
+    pthread_mutex_unlock(&client_process.mutex);
+}
+
+/// @return true if the @a client was the last client of the process
+static bool remove_process_client(const Client client) {
+    pthread_mutex_lock(&client_process.mutex);
+    for (uint32_t i = 0; i < client_process.clients_count; i++) {
+        if (client_process.clients[i] == client) {
+            client_process.clients[i] = client_process.clients[--client_process.clients_count];
+            break;
+        }
+    }
+    const bool is_last = client_process.clients_count == 0;
+    pthread_mutex_unlock(&client_process.mutex);
+    return is_last;
+}
+
+static uint32_t count_process_clients(void) {
+    pthread_mutex_lock(&client_process.mutex);
+    const uint32_t count = client_process.clients_count;
+    pthread_mutex_unlock(&client_process.mutex);
+    return count;
+}
+
+bool init_client(Client client, uint16_t server_port, ComponentType type,
+                 const char* server_ip_address) {
+    client->type            = type;
+    client->command_sock_fd = -1;
+    client->makes_pins      = false;
+    // the clients are initialized by one thread, the others only use the initialized ones
+    const uint32_t clients_count = count_process_clients();
+    const bool is_first_client   = clients_count == 0;
+    if (clients_count == CLIENT_MAX_PER_PROCESS) {
+        fprintf(stderr, "The process already has %u clients\n", CLIENT_MAX_PER_PROCESS);
+        return false;
+    }
+    pin_trace_sample_rate = parse_env_uint32(PIN_TRACE_SAMPLE_RATE_ENV, 0);
+    pin_deadline_ms       = parse_env_uint32(PIN_DEADLINE_MS_ENV, 0);
+    register_client_metrics(type);
+    int sock_fd = client->client_sock_fd =
+        connect_to_server(client, server_port, server_ip_address);
+    if (sock_fd == -1) {
         return false;
     }
+    if (type == COMPONENT_TYPE_MANAGER && !client->is_tcp_client) {
+        client->command_sock_fd = open_manager_command_socket();
+        if (client->command_sock_fd == -1) {
+            close(sock_fd);
+            return false;
+        }
+    }
 
+    client->shm.segment = NULL;
+    if (is_worker(client) && parse_env_uint32(SHM_TRANSPORT_ENV, true) &&
+        attach_shm_transport(&client->shm, server_port, type)) {
+        printf("Attached to the shared memory transport of the server, slot %u\n",
+               client->shm.peer_index);
+    }
+    if (is_worker(client)) {
+        struct ClientStageState* stage = client_stage(client);
+        stage->is_draining             = false;
+        stage->has_left                = false;
+        set_worker_concurrency(client,
+                               parse_env_uint32(WORKER_CONCURRENCY_ENV, WORKER_CONCURRENCY));
+        // the counters of a stage the process hosted before go on from where they were
+        if (is_shm_peer_attached(&client->shm)) {
+            shm_peer_report_load(&client->shm, current_client_load(client));
+        }
+    }
+    if (is_worker(client) && is_first_client) {
+        // slots of the shared memory transport are unique among the workers of the host
+        const uint32_t index = is_shm_peer_attached(&client->shm) ? client->shm.peer_index : 0;
+        place_current_thread(WORKER_CPUS_ENV, index, component_type_to_string(type));
+    }
+    // the buffers are first touched after the pinning, so they are on the local node
+    if (is_first_client && !init_message_pool(CLIENT_MESSAGE_POOL_CAPACITY)) {
+        detach_shm_transport(&client->shm);
+        close_client_sockets(client);
+        return false;
+    }
+
+    if (!send_client_type_info(client)) {
+        detach_shm_transport(&client->shm);
+        close_client_sockets(client);
+        if (is_first_client) {
+            deinit_message_pool();
+        }
+        return false;
+    }
+
+    add_process_client(client);
+    if (is_first_client) {
+        start_heartbeats();
+        start_metrics_export(component_type_to_string(type));
+    }
     return true;
 }
 
 void deinit_client(Client client) {
-    int sock_fd = client->client_sock_fd;
-    assert(sock_fd != -1);
-    close(sock_fd);
+    assert(client->client_sock_fd != -1);
+    // the heartbeat thread does not send for the client once it is removed
+    const bool is_last_client = remove_process_client(client);
+    if (is_last_client) {
+        stop_heartbeats();
+        stop_metrics_export();
+    }
+    detach_shm_transport(&client->shm);
+    close_client_sockets(client);
+    if (is_last_client) {
+        deinit_message_pool();
+    }
+}
+
+void set_client_roles(uint32_t roles) {
+    pthread_mutex_lock(&client_process.mutex);
+    const bool has_changed = client_process.roles != roles;
+    __atomic_store_n(&client_process.roles, roles, __ATOMIC_RELAXED);
+    // the registration again tells the server the stages of the process
+    for (uint32_t i = 0; has_changed && i < client_process.clients_count; i++) {
+        send_client_type_info(client_process.clients[i]);
+    }
+    pthread_mutex_unlock(&client_process.mutex);
+}
+
+bool take_requested_client_roles(uint32_t* roles) {
+    pthread_mutex_lock(&client_process.mutex);
+    const bool has_requested_roles     = client_process.has_requested_roles;
+    *roles                             = client_process.requested_roles;
+    client_process.has_requested_roles = false;
+    pthread_mutex_unlock(&client_process.mutex);
+    return has_requested_roles;
 }
 
 void print_sock_addr_info(const struct sockaddr* socket_address,
@@ -139,11 +658,94 @@ enum MessageSkipResult {
     SOCKET_ERROR,
 };
 
+/// @brief The signal stops all the clients of the receiver type or only the one of its pid.
+static bool is_shutdown_signal_for(const Client client, const UDPMessage* message) {
+    const uint32_t pid = message->message_content.shutdown.pid;
+    return message->sender_type == COMPONENT_TYPE_SERVER &&
+           message->message_type == MESSAGE_TYPE_SHUTDOWN_MESSAGE &&
+           (message->receiver_type & client->type) != 0 &&
+           (pid == 0 || pid == (uint32_t)getpid());
+}
+
+/// @brief The pins the server gave to another worker of the host come to the socket too.
+static bool is_pin_of_other_worker(const UDPMessage* message) {
+    const uint32_t pid = message->message_content.pin.worker_pid;
+    return message->message_type == MESSAGE_TYPE_PIN_TRANSFERRING && pid != 0 &&
+           pid != (uint32_t)getpid();
+}
+
+/// @brief The concurrency, the roles, the leave and the admission messages are
+/// handled by the client itself, they never reach the callers of the receives.
+static bool is_control_message(const UDPMessage* message) {
+    switch (message->message_type) {
+        case MESSAGE_TYPE_WORKER_CONCURRENCY:
+        case MESSAGE_TYPE_WORKER_ROLES:
+        case MESSAGE_TYPE_WORKER_LEAVE:
+        case MESSAGE_TYPE_ADMISSION_RATE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_control_message_for(const Client client, const UDPMessage* message) {
+    // the pid is the first field of all of them
+    const uint32_t pid = message->message_content.concurrency.pid;
+    return message->sender_type == COMPONENT_TYPE_SERVER && is_control_message(message) &&
+           is_worker(client) && (message->receiver_type & client->type) != 0 &&
+           (pid == 0 || pid == (uint32_t)getpid());
+}
+
+/// @brief Takes the new concurrency, roles or admission rate if the @a message
+/// sets them for the @a client, or the confirmation that the server took it out of the routing.
+/// @return true if it did
+static bool take_control_message(const Client client, const UDPMessage* message) {
+    if (!is_control_message_for(client, message)) {
+        return false;
+    }
+    count_message(client_metrics.messages_in, message->message_type);
+    switch (message->message_type) {
+        case MESSAGE_TYPE_WORKER_CONCURRENCY:
+            set_worker_concurrency(client, message->message_content.concurrency.concurrency);
+            printf(
+                "+----------------------------------------+\n"
+                "| Server set the concurrency to %-8u |\n"
+                "+----------------------------------------+\n",
+                client_concurrency(client));
+            break;
+        case MESSAGE_TYPE_WORKER_ROLES:
+            pthread_mutex_lock(&client_process.mutex);
+            // only the multi-role workers change their stages
+            if (client_process.roles != 0) {
+                client_process.requested_roles     = message->message_content.roles.roles;
+                client_process.has_requested_roles = true;
+            }
+            pthread_mutex_unlock(&client_process.mutex);
+            break;
+        case MESSAGE_TYPE_WORKER_LEAVE:
+            __atomic_store_n(&client_stage(client)->has_left, true, __ATOMIC_RELAXED);
+            break;
+        case MESSAGE_TYPE_ADMISSION_RATE:
+            // the server repeats the rate, only the changes are printed
+            if (set_client_admission_rate(client, &message->message_content.admission)) {
+                printf(
+                    "+----------------------------------------------+\n"
+                    "| Server admits %-8u new pin(s) a minute     |\n"
+                    "+----------------------------------------------+\n",
+                    message->message_content.admission.pins_per_minute);
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
 static enum MessageSkipResult skip_messages_not_from_the_server(const Client client,
                                                                 UDPMessage* message) {
     while (true) {
-        ssize_t bytes_read = recv(client->client_sock_fd, message, sizeof(*message),
-                                  MSG_DONTWAIT | MSG_PEEK | MSG_NOSIGNAL);
+        ssize_t bytes_read =
+            receive_message(client, message, MSG_DONTWAIT | MSG_PEEK | MSG_NOSIGNAL);
         if (bytes_read != sizeof(UDPMessage)) {
             const int errno_val = errno;
             if (errno_val == EAGAIN || errno_val == EWOULDBLOCK) {
@@ -153,19 +755,24 @@ static enum MessageSkipResult skip_messages_not_from_the_server(const Client cli
                 "skip_messages_not_from_the_server[tried to skip message not from the server]");
             return SOCKET_ERROR;
         }
-        bool is_message_for_client = message->sender_type == COMPONENT_TYPE_SERVER &&
-                                     (message->receiver_type & client->type) != 0;
+        // the control messages are taken here, they would hide the messages behind them
+        bool is_message_for_client =
+            message->sender_type == COMPONENT_TYPE_SERVER &&
+            (message->receiver_type & client->type) != 0 && !is_control_message(message) &&
+            !is_pin_of_other_worker(message) &&
+            (message->message_type != MESSAGE_TYPE_SHUTDOWN_MESSAGE ||
+             is_shutdown_signal_for(client, message));
         if (is_message_for_client) {
             return RECEIVED_MESSAGE_FROM_SERVER;
         }
-        bytes_read =
-            recv(client->client_sock_fd, message, sizeof(*message), MSG_DONTWAIT | MSG_NOSIGNAL);
+        bytes_read = receive_message(client, message, MSG_DONTWAIT | MSG_NOSIGNAL);
         if (bytes_read != sizeof(UDPMessage)) {
             client_handle_errno(
                 "skip_messages_not_from_the_server[tried to peek message not from the server that "
                 "is to skip]");
             return SOCKET_ERROR;
         }
+        take_control_message(client, message);
     }
 }
 
@@ -200,32 +807,80 @@ static bool is_socket_alive(int sock_fd) {
     return error == 0;
 }
 
+static bool is_drain_request_for(const Client client, const UDPMessage* message) {
+    return message->sender_type == COMPONENT_TYPE_SERVER &&
+           message->message_type == MESSAGE_TYPE_DRAIN_REQUEST &&
+           (message->receiver_type & client->type) != 0;
+}
+
+/// @brief The workers that get their pins over the shared memory take the
+/// drain request from the ring, where it is behind the pins, and ignore its
+/// copy that comes to the socket.
+static bool takes_drain_request_from_socket(const Client client) {
+    return !is_shm_peer_attached(&client->shm) || client->makes_pins;
+}
+
+/// @return false if the worker is already draining, the request is a duplicate then
+static bool start_client_drain(const Client worker) {
+    struct ClientStageState* stage = client_stage(worker);
+    if (stage->is_draining) {
+        return false;
+    }
+    stage->is_draining = true;
+    count_message(client_metrics.messages_in, MESSAGE_TYPE_DRAIN_REQUEST);
+    printf(
+        "+----------------------------------------+\n"
+        "| Received drain request from the server |\n"
+        "+----------------------------------------+\n");
+    return true;
+}
+
+bool client_is_draining(const Client worker) {
+    return client_stage(worker)->is_draining;
+}
+
+bool client_has_left(const Client worker) {
+    return __atomic_load_n(&client_stage(worker)->has_left, __ATOMIC_RELAXED);
+}
+
 bool client_should_stop(const Client client) {
     if (!is_socket_alive(client->client_sock_fd)) {
         return true;
     }
 
-    UDPMessage message = {0};
-    switch (skip_messages_not_from_the_server(client, &message)) {
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return true;
+    }
+    bool should_stop = true;
+    switch (skip_messages_not_from_the_server(client, message)) {
         case RECEIVED_MESSAGE_FROM_SERVER:
+            assert(message->sender_type == COMPONENT_TYPE_SERVER);
+            assert(message->receiver_type & client->type);
+            should_stop = message->message_type == MESSAGE_TYPE_SHUTDOWN_MESSAGE;
+            if (message->message_type == MESSAGE_TYPE_DRAIN_REQUEST &&
+                takes_drain_request_from_socket(client)) {
+                // stays in the socket, the drain skips it while waiting for the shutdown
+                start_client_drain(client);
+                should_stop = true;
+            }
             break;
         case NO_MESSAGES_IN_SOCKET:
-            return false;
+            should_stop = is_worker(client) && client_has_left(client);
+            break;
         case SOCKET_ERROR:
         default:
             assert(false && "invalid return from skip_messages_not_from_the_server");
-            return true;
+            break;
     }
-
-    assert(message.sender_type == COMPONENT_TYPE_SERVER);
-    assert(message.receiver_type & client->type);
-    return message.message_type == MESSAGE_TYPE_SHUTDOWN_MESSAGE;
+    message_pool_release(message);
+    return should_stop;
 }
 
 static bool receive_data(const Client client, UDPMessage* message,
                          MessageType expected_message_type) {
     do {
-        ssize_t read_bytes = recv(client->client_sock_fd, message, sizeof(*message), MSG_NOSIGNAL);
+        ssize_t read_bytes = receive_message(client, message, MSG_NOSIGNAL);
         if (read_bytes == 0) {
             continue;
         }
@@ -237,8 +892,20 @@ static bool receive_data(const Client client, UDPMessage* message,
         if (message->sender_type != COMPONENT_TYPE_SERVER) {
             continue;
         }
-        if (message->message_type == MESSAGE_TYPE_SHUTDOWN_MESSAGE &&
-            (message->receiver_type & client->type) != 0) {
+        if (take_control_message(client, message)) {
+            if (is_worker(client) && client_has_left(client)) {
+                return false;
+            }
+            continue;
+        }
+        if (is_drain_request_for(client, message)) {
+            if (start_client_drain(client)) {
+                return false;
+            }
+            continue;
+        }
+        if (is_shutdown_signal_for(client, message)) {
+            count_message(client_metrics.messages_in, message->message_type);
             printf(
                 "+------------------------------------------+\n"
                 "| Received shutdown signal from the server |\n"
@@ -246,103 +913,387 @@ static bool receive_data(const Client client, UDPMessage* message,
             return false;
         }
     } while (message->message_type != expected_message_type ||
-             (message->receiver_type & client->type) == 0);
+             (message->receiver_type & client->type) == 0 || is_pin_of_other_worker(message));
+    count_message(client_metrics.messages_in, message->message_type);
     return true;
 }
 
 Pin receive_new_pin(void) {
-    Pin pin = {.pin_id = rand()};
-    return pin;
-}
-bool check_pin_crookness(Pin pin) {
-    uint32_t sleep_time = (uint32_t)rand() % (MAX_SLEEP_TIME - MIN_SLEEP_TIME + 1) + MIN_SLEEP_TIME;
-    sleep(sleep_time);
+    // the entry stages of a multi-role worker make their pins on their own threads
+    static uint32_t pins_made = 0;
 
-    uint32_t x = (uint32_t)pin.pin_id;
-#if defined(__GNUC__)
-    return __builtin_parity(x) & 1;
-#else
-    return x & 1;
-#endif
+    Pin pin      = {.pin_id = rand(), .deadline_ms = pin_deadline_ms};
+    pin.priority = (uint32_t)pin.pin_id % PIN_PRIORITY_CLASSES;
+    if (pin_trace_sample_rate != 0 &&
+        __atomic_add_fetch(&pins_made, 1, __ATOMIC_RELAXED) % pin_trace_sample_rate == 0) {
+        pin.flags |= PIN_FLAG_TRACED;
+        pin_trace_created(&pin);
+    }
+    return pin;
 }
-
-static bool send_message(const Client client, const UDPMessage* message) {
-    ssize_t send_bytes = sendto(client->client_sock_fd, message, sizeof(*message), MSG_NOSIGNAL,
-                                (const struct sockaddr*)&client->server_broadcast_sock_addr,
-                                sizeof(client->server_broadcast_sock_addr));
-    bool ok            = send_bytes == sizeof(*message);
-    if (!ok) {
-        app_perror("sendto");
+void record_client_processing(const Client worker, uint64_t started_ns, bool is_accepted) {
+    struct ClientStageState* stage = client_stage(worker);
+    const uint64_t elapsed_ns      = monotonic_time_ns() - started_ns;
+    metrics_histogram_record(client_metrics.stage_processing_time, elapsed_ns);
+    __atomic_add_fetch(&stage->service_time_ns, elapsed_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage->pins_processed, 1, __ATOMIC_RELAXED);
+    if (!is_accepted) {
+        metrics_counter_inc(client_metrics.pins_rejected);
     }
-    return ok;
 }
 
+/// @brief Called by the processing threads, the message is on the stack: the
+/// pool of the client is too small to give every thread a cache of buffers.
 static bool send_pin(const Client worker, Pin pin) {
+    // the server tells the UDP workers of a host apart by it
+    pin.worker_pid           = (uint32_t)getpid();
     const UDPMessage message = {
         .sender_type         = worker->type,
         .receiver_type       = COMPONENT_TYPE_SERVER,
         .message_type        = MESSAGE_TYPE_PIN_TRANSFERRING,
         .message_content.pin = pin,
     };
-    return send_message(worker, &message);
+    const bool ok = send_worker_message(worker, &message);
+    if (ok) {
+        metrics_counter_inc(client_metrics.pins_sent);
+        __atomic_add_fetch(&client_stage(worker)->drain_report.pins_sent, 1, __ATOMIC_RELAXED);
+    }
+    return ok;
 }
-bool send_not_croocked_pin(const Client worker, Pin pin) {
+bool send_stage_pin(const Client worker, Pin pin) {
     assert(is_worker(worker));
     return send_pin(worker, pin);
 }
+/// @brief Consumes everything pending in the socket of the worker attached
+/// to the shared memory transport: its pins come from the shared memory, so
+/// only the shutdown signal and the control messages matter here.
+/// @return false if the worker should stop
+static bool handle_socket_messages_of_shm_peer(const Client worker, UDPMessage* message) {
+    while (true) {
+        ssize_t read_bytes = receive_message(worker, message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (read_bytes != sizeof(*message)) {
+            client_handle_errno("recv");
+            return false;
+        }
+        if (is_shutdown_signal_for(worker, message)) {
+            count_message(client_metrics.messages_in, message->message_type);
+            printf(
+                "+------------------------------------------+\n"
+                "| Received shutdown signal from the server |\n"
+                "+------------------------------------------+\n");
+            return false;
+        }
+        take_control_message(worker, message);
+    }
+}
+
+static bool receive_data_from_shm(const Client worker, UDPMessage* message,
+                                  MessageType expected_message_type) {
+    while (true) {
+        if (shm_peer_receive(&worker->shm, message, SHM_RECEIVE_POLL_MS)) {
+            // the request and the leave come after all the pins the server forwarded to the worker
+            if (is_drain_request_for(worker, message) && start_client_drain(worker)) {
+                return false;
+            }
+            if (take_control_message(worker, message) && client_has_left(worker)) {
+                return false;
+            }
+            if (message->message_type == expected_message_type &&
+                (message->receiver_type & worker->type) != 0) {
+                count_message(client_metrics.messages_in, message->message_type);
+                return true;
+            }
+            continue;
+        }
+        if (!handle_socket_messages_of_shm_peer(worker, message)) {
+            return false;
+        }
+    }
+}
+
 static bool receive_pin(const Client worker, Pin* rec_pin) {
-    UDPMessage message = {0};
-    bool res           = receive_data(worker, &message, MESSAGE_TYPE_PIN_TRANSFERRING);
-    *rec_pin           = message.message_content.pin;
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return false;
+    }
+    bool res = is_shm_peer_attached(&worker->shm)
+                   ? receive_data_from_shm(worker, message, MESSAGE_TYPE_PIN_TRANSFERRING)
+                   : receive_data(worker, message, MESSAGE_TYPE_PIN_TRANSFERRING);
+    if (res) {
+        *rec_pin = message->message_content.pin;
+        metrics_counter_inc(client_metrics.pins_received);
+        __atomic_add_fetch(&client_stage(worker)->drain_report.pins_received, 1,
+                           __ATOMIC_RELAXED);
+    }
+    message_pool_release(message);
     return res;
 }
-bool receive_not_crooked_pin(const Client worker, Pin* rec_pin) {
+bool receive_stage_pin(const Client worker, Pin* rec_pin) {
     assert(is_worker(worker));
     return receive_pin(worker, rec_pin);
 }
-void sharpen_pin(Pin pin) {
-    (void)pin;
-    uint32_t sleep_time = (uint32_t)rand() % (MAX_SLEEP_TIME - MIN_SLEEP_TIME + 1) + MIN_SLEEP_TIME;
-    sleep(sleep_time);
+
+/// @brief Blocks until the server sends the shutdown signal to the @a client.
+static bool wait_for_shutdown_signal(const Client client, UDPMessage* message) {
+    while (true) {
+        ssize_t read_bytes = receive_message(client, message, MSG_NOSIGNAL);
+        if (read_bytes == 0) {
+            continue;
+        }
+        if (read_bytes != sizeof(*message)) {
+            return client_handle_errno("recv");
+        }
+        if (is_shutdown_signal_for(client, message)) {
+            count_message(client_metrics.messages_in, message->message_type);
+            return true;
+        }
+    }
+}
+
+static bool send_drain_report(const Client worker, PipelineDrainReport report) {
+    const UDPMessage message = {
+        .sender_type                  = worker->type,
+        .receiver_type                = COMPONENT_TYPE_SERVER,
+        .message_type                 = MESSAGE_TYPE_DRAIN_REPORT,
+        .message_content.drain_report = report,
+    };
+    return send_worker_message(worker, &message);
 }
-bool send_sharpened_pin(const Client worker, Pin pin) {
+
+bool finish_client_drain(const Client worker) {
     assert(is_worker(worker));
-    return send_pin(worker, pin);
+    struct ClientStageState* stage = client_stage(worker);
+    assert(stage->is_draining);
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return false;
+    }
+    const PipelineDrainReport report = stage->drain_report;
+    bool ok                          = send_drain_report(worker, report);
+    if (ok) {
+        printf(
+            "+-------------------------------------------+\n"
+            "| Drained: received %-6u sent %-6u pins |\n"
+            "+-------------------------------------------+\n",
+            report.pins_received, report.pins_sent);
+        ok = wait_for_shutdown_signal(worker, message);
+    }
+    message_pool_release(message);
+    return ok;
 }
-bool receive_sharpened_pin(const Client worker, Pin* rec_pin) {
+
+bool send_worker_leave(const Client worker) {
     assert(is_worker(worker));
-    return receive_pin(worker, rec_pin);
+    const UDPMessage message = {
+        .sender_type               = worker->type,
+        .receiver_type             = COMPONENT_TYPE_SERVER,
+        .message_type              = MESSAGE_TYPE_WORKER_LEAVE,
+        .message_content.heartbeat = current_heartbeat(worker, 0),
+    };
+    return send_worker_message(worker, &message);
 }
-bool check_sharpened_pin_quality(Pin sharpened_pin) {
-    uint32_t sleep_time = (uint32_t)rand() % (MAX_SLEEP_TIME - MIN_SLEEP_TIME + 1) + MIN_SLEEP_TIME;
-    sleep(sleep_time);
-    return cos(sharpened_pin.pin_id) >= 0;
+
+bool finish_client_leave(const Client worker) {
+    assert(is_worker(worker));
+    struct ClientStageState* stage = client_stage(worker);
+    PipelineDrainReport report     = stage->drain_report;
+    report.has_left                = true;
+    if (!send_drain_report(worker, report)) {
+        return false;
+    }
+    printf(
+        "+-------------------------------------------+\n"
+        "| Left: received %-6u sent %-6u pins    |\n"
+        "+-------------------------------------------+\n",
+        report.pins_received, report.pins_sent);
+    // the pins of a later worker of the stage are counted from the start
+    stage->drain_report = (PipelineDrainReport){0};
+    return true;
+}
+
+void hand_over_pin_locally(const Client from, const Client to, Pin* pin) {
+    assert(is_worker(from) && is_worker(to));
+    // the pin skips the server, its hop takes no time
+    const uint32_t hop = (uint32_t)pipeline_stage_index(from->type);
+    pin_trace_server_received(pin, hop);
+    pin_trace_server_forwarded(pin, hop);
+    pin->worker_pid = 0;
+    metrics_counter_inc(client_metrics.pins_sent);
+    metrics_counter_inc(client_metrics.pins_received);
+    __atomic_add_fetch(&client_stage(from)->drain_report.pins_sent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&client_stage(to)->drain_report.pins_received, 1, __ATOMIC_RELAXED);
 }
 
 bool receive_server_log(const Client logs_collector, ServerLog* log) {
     assert(logs_collector->type == COMPONENT_TYPE_LOGS_COLLECTOR);
-    UDPMessage message = {0};
-    bool res           = receive_data(logs_collector, &message, MESSAGE_TYPE_LOG);
-    memcpy(log, &message.message_content.bytes, sizeof(message.message_content.bytes));
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return false;
+    }
+    bool res = receive_data(logs_collector, message, MESSAGE_TYPE_LOG);
+    if (res) {
+        memcpy(log, &message->message_content.bytes, sizeof(message->message_content.bytes));
+        metrics_counter_inc(client_metrics.logs_received);
+    }
+    message_pool_release(message);
     return res;
 }
 
-ServerCommandResult send_manager_command_to_server(const Client manager, ServerCommand command) {
+static bool send_manager_message(const Client manager, const UDPMessage* message) {
+    if (manager->command_sock_fd == -1) {
+        return send_message(manager, message);
+    }
+    ssize_t send_bytes =
+        sendto(manager->command_sock_fd, message, sizeof(*message), MSG_NOSIGNAL,
+               (const struct sockaddr*)&manager->server_broadcast_sock_addr,
+               sizeof(manager->server_broadcast_sock_addr));
+    if (send_bytes != sizeof(*message)) {
+        app_perror("sendto");
+        return false;
+    }
+    count_message(client_metrics.messages_out, message->message_type);
+    return true;
+}
+
+uint32_t send_manager_commands(const Client manager, const ServerCommand* commands,
+                               uint32_t count) {
     assert(manager->type == COMPONENT_TYPE_MANAGER);
-    if (!send_message(manager, &(const UDPMessage){
-                                   .sender_type             = COMPONENT_TYPE_MANAGER,
-                                   .receiver_type           = COMPONENT_TYPE_SERVER,
-                                   .message_type            = MESSAGE_TYPE_MANAGER_COMMAND,
-                                   .message_content.command = command,
-                               })) {
-        return NO_CONNECTION;
+    assert(count <= MANAGER_MAX_BATCH_COMMANDS);
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        metrics_counter_add(client_metrics.command_failures, count);
+        return 0;
     }
+    const uint32_t request_id = manager_next_request_id;
+    manager_next_request_id   = request_id == UINT32_MAX ? 1 : request_id + 1;
 
-    UDPMessage message = {0};
-    if (!receive_data(manager, &message, MESSAGE_TYPE_MANAGER_COMMAND_RESULT)) {
-        return NO_CONNECTION;
+    message->sender_type   = COMPONENT_TYPE_MANAGER;
+    message->receiver_type = COMPONENT_TYPE_SERVER;
+    message->message_type  = MESSAGE_TYPE_MANAGER_COMMAND;
+    ManagerCommandBatch* batch = &message->message_content.command_batch;
+    batch->request_id          = request_id;
+    batch->count               = count;
+    memcpy(batch->commands, commands, count * sizeof(*commands));
+    const bool ok = send_manager_message(manager, message);
+    message_pool_release(message);
+    if (!ok) {
+        metrics_counter_add(client_metrics.command_failures, count);
+        return 0;
+    }
+    metrics_counter_add(client_metrics.commands_sent, count);
+    return request_id;
+}
+
+/// @brief Reads what came to the broadcast socket of the UDP manager while it
+/// waits for the results on its command socket.
+/// @return true if the server asked the manager to stop
+static bool receive_manager_broadcasts(const Client manager, UDPMessage* message) {
+    while (receive_message(manager, message, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*message)) {
+        if (is_shutdown_signal_for(manager, message)) {
+            count_message(client_metrics.messages_in, message->message_type);
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @return false if the connection broke or the server asked the manager to stop
+static bool receive_manager_message(const Client manager, UDPMessage* message) {
+    const ssize_t read_bytes =
+        manager->command_sock_fd != -1
+            ? recv(manager->command_sock_fd, message, sizeof(*message), MSG_NOSIGNAL)
+            : receive_message(manager, message, MSG_NOSIGNAL);
+    if (read_bytes != sizeof(*message)) {
+        client_handle_errno("recv");
+        return false;
     }
+    if (is_shutdown_signal_for(manager, message)) {
+        count_message(client_metrics.messages_in, message->message_type);
+        return false;
+    }
+    return true;
+}
+
+uint32_t manager_poll_fds(const Client manager, struct pollfd fds[MANAGER_POLL_FDS]) {
+    // the UDP manager gets the results to its own socket and the broadcasts to the shared one
+    if (manager->command_sock_fd == -1) {
+        fds[0] = (struct pollfd){.fd = manager->client_sock_fd, .events = POLLIN};
+        return 1;
+    }
+    fds[0] = (struct pollfd){.fd = manager->command_sock_fd, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = manager->client_sock_fd, .events = POLLIN};
+    return 2;
+}
 
-    assert(message.receiver_type == COMPONENT_TYPE_MANAGER);
-    return message.message_content.command_result;
+ManagerResultsStatus receive_manager_results(const Client manager, ManagerCommandResults* results,
+                                             uint32_t timeout_ms) {
+    assert(manager->type == COMPONENT_TYPE_MANAGER);
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return MANAGER_RESULTS_STOPPED;
+    }
+    struct pollfd fds[MANAGER_POLL_FDS];
+    const uint32_t fds_count    = manager_poll_fds(manager, fds);
+    const uint64_t deadline_ns  = monotonic_time_ns() + (uint64_t)timeout_ms * 1000000u;
+    ManagerResultsStatus status = MANAGER_RESULTS_TIMEOUT;
+    while (status == MANAGER_RESULTS_TIMEOUT) {
+        const uint64_t now_ns = monotonic_time_ns();
+        const int wait_ms =
+            now_ns < deadline_ns ? (int)((deadline_ns - now_ns + 999999u) / 1000000u) : 0;
+        int ret = poll(fds, fds_count, wait_ms);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            app_perror("poll");
+            status = MANAGER_RESULTS_STOPPED;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        if (fds_count == 2 && (fds[1].revents & POLLIN) != 0 &&
+            receive_manager_broadcasts(manager, message)) {
+            status = MANAGER_RESULTS_STOPPED;
+            break;
+        }
+        if ((fds[0].revents & (POLLIN | POLLERR | POLLHUP)) == 0) {
+            continue;
+        }
+        if (!receive_manager_message(manager, message)) {
+            status = MANAGER_RESULTS_STOPPED;
+        } else if (message->sender_type == COMPONENT_TYPE_SERVER &&
+                   message->message_type == MESSAGE_TYPE_MANAGER_COMMAND_RESULT) {
+            status = MANAGER_RESULTS_RECEIVED;
+        }
+    }
+    if (status == MANAGER_RESULTS_RECEIVED) {
+        count_message(client_metrics.messages_in, message->message_type);
+        *results = message->message_content.command_results;
+    }
+    message_pool_release(message);
+    return status;
+}
+
+ServerCommandResult send_manager_command_to_server(const Client manager, ServerCommand command) {
+    const uint32_t request_id = send_manager_commands(manager, &command, 1);
+    if (request_id == 0) {
+        return NO_CONNECTION;
+    }
+    ManagerCommandResults results;
+    do {
+        const ManagerResultsStatus status =
+            receive_manager_results(manager, &results, MANAGER_RESULTS_TIMEOUT_MS);
+        if (status != MANAGER_RESULTS_RECEIVED) {
+            if (status == MANAGER_RESULTS_TIMEOUT) {
+                fputs("Timed out waiting for the command results\n", stderr);
+            }
+            metrics_counter_inc(client_metrics.command_failures);
+            return NO_CONNECTION;
+        }
+    } while (results.request_id != request_id);
+    return results.count == 1 ? results.replies[0].result : SERVER_INTERNAL_ERROR;
 }
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,40 +22,118 @@
 #include "net-config.h"
 #include "pin.h"
 #include "server-log.h"
+#include "shm-transport.h"
+
+/// Time the new pins may wait in a server queue (Pin::deadline_ms), 0 (default)
+/// for the default of the server.
+#define PIN_DEADLINE_MS_ENV "PIN_DEADLINE_MS"
+
+enum {
+    /// A multi-role worker has a client for every stage it hosts.
+    CLIENT_MAX_PER_PROCESS = PIPELINE_STAGES,
+};
 
 typedef struct Client {
+    /// UDP socket bound to the broadcast address or TCP connection to the server.
     int client_sock_fd;
+    bool is_tcp_client;
     ComponentType type;
     struct sockaddr_in server_broadcast_sock_addr;
+    /// Pins go through the shared memory if the server runs on the same host.
+    ShmPeerHandle shm;
+    /// Socket the UDP manager sends its commands from, the server answers to
+    /// its address only. -1 for the other clients.
+    int command_sock_fd;
+    /// The worker makes its pins itself, it gets none from the server. Set
+    /// after init_client().
+    bool makes_pins;
 } Client[1];
 
-bool init_client(Client client, uint16_t server_port, ComponentType type);
+/// @brief The clients of a process share its heartbeat thread, message pool and
+/// metrics; a process has at most one worker of every stage. The clients are
+/// initialized and deinitialized by one thread.
+/// @param server_ip_address NULL to talk to the server over UDP broadcast,
+/// server address to connect to it over TCP otherwise
+bool init_client(Client client, uint16_t server_port, ComponentType type,
+                 const char* server_ip_address);
 void deinit_client(Client client);
+/// @brief Stages the multi-role worker process hosts (mask of the stage
+/// ComponentTypes), the clients tell the server when they change. 0, the
+/// default, for the processes that can not change them.
+void set_client_roles(uint32_t roles);
+/// @brief Takes the stages the server asked the multi-role worker to host.
+/// @return false if it did not ask since the last call
+bool take_requested_client_roles(uint32_t* roles);
 
 static inline bool is_worker(const Client client) {
-    switch (client->type) {
-        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
-        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
-        case COMPONENT_TYPE_THIRD_STAGE_WORKER:
-            return true;
-        default:
-            return false;
-    }
+    return pipeline_stage_index(client->type) >= 0;
 }
 
+/// @return true if the server asked the client to stop or, for a worker, to drain
 bool client_should_stop(const Client client);
+/// @brief Pins the worker processes at once: WORKER_CONCURRENCY_ENV at the
+/// start, the server changes it at runtime. The client must read the socket
+/// (client_should_stop() or the receives) for the changes to arrive.
+uint32_t client_concurrency(const Client worker);
+/// @brief Waits up to @a timeout_ms until the entry stage worker may make a
+/// new pin, at the rate the server admits (no limit until it sets one).
+/// @return false if the pin is not admitted yet
+bool wait_client_admission(const Client worker, uint32_t timeout_ms);
+/// @return true if the server asked the worker to drain: it must not take new
+/// pins, but the ones it already took are finished and sent
+bool client_is_draining(const Client worker);
+/// @brief Reports the pins that passed the draining worker to the server and
+/// waits for the shutdown signal that confirms the drain of the pipeline.
+bool finish_client_drain(const Client worker);
+/// @brief Asks the server to take the worker out of the routing. The server
+/// confirms it behind the pins it sent to the worker before, the receives
+/// of the worker fail once it came.
+bool send_worker_leave(const Client worker);
+/// @return true if the server confirmed that the worker left the routing
+bool client_has_left(const Client worker);
+/// @brief Reports the pins that passed the worker that left to the server.
+bool finish_client_leave(const Client worker);
+/// @brief Counts the @a pin that the @a from worker hands to the @a to worker
+/// of the next stage in the same process instead of sending it to the server.
+void hand_over_pin_locally(const Client from, const Client to, Pin* pin);
 void print_sock_addr_info(const struct sockaddr* address, socklen_t sock_addr_len);
 static inline void print_client_info(const Client client) {
     print_sock_addr_info((const struct sockaddr*)&client->server_broadcast_sock_addr,
                          sizeof(client->server_broadcast_sock_addr));
 }
+/// @brief Makes a pin of an entry stage, its priority class follows from its id.
 Pin receive_new_pin(void);
-bool check_pin_crookness(Pin pin);
-bool send_not_croocked_pin(const Client worker, Pin pin);
-bool receive_not_crooked_pin(const Client worker, Pin* rec_pin);
-void sharpen_pin(Pin pin);
-bool send_sharpened_pin(const Client worker, Pin pin);
-bool receive_sharpened_pin(const Client worker, Pin* rec_pin);
-bool check_sharpened_pin_quality(Pin sharpened_pin);
+/// @brief Sends the @a pin the worker passed to the server, which routes it
+/// to the next stages.
+bool send_stage_pin(const Client worker, Pin pin);
+bool receive_stage_pin(const Client worker, Pin* rec_pin);
+/// @brief Counts the pin the worker processed since @a started_ns in the
+/// metrics and in the load it reports to the server.
+void record_client_processing(const Client worker, uint64_t started_ns, bool is_accepted);
 bool receive_server_log(const Client logs_collector, ServerLog* log);
+/// @brief Sends the @a count commands in one datagram and does not wait for
+/// the results, any number of batches may be in flight.
+/// @return request id of the batch, 0 if it was not sent
+uint32_t send_manager_commands(const Client manager, const ServerCommand* commands,
+                               uint32_t count);
+typedef enum ManagerResultsStatus {
+    MANAGER_RESULTS_RECEIVED,
+    MANAGER_RESULTS_TIMEOUT,
+    /// Shutdown signal or broken connection.
+    MANAGER_RESULTS_STOPPED,
+} ManagerResultsStatus;
+
+/// @brief Waits up to @a timeout_ms for the results of any batch in flight,
+/// they come in any order. A 0 timeout only takes what already came.
+ManagerResultsStatus receive_manager_results(const Client manager, ManagerCommandResults* results,
+                                             uint32_t timeout_ms);
+
+enum { MANAGER_POLL_FDS = 2 };
+
+/// @brief Fills the descriptors that the results and the shutdown signal come
+/// to, so that the manager can wait for them together with its input.
+/// @return number of the filled ones
+uint32_t manager_poll_fds(const Client manager, struct pollfd fds[MANAGER_POLL_FDS]);
+/// @brief Sends one command and waits for its result, the late results of
+/// the other batches are skipped.
 ServerCommandResult send_manager_command_to_server(const Client manager, ServerCommand command);
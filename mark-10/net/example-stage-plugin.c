@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../util/config.h"
+#include "stage-plugin.h"
+
+/// @brief Example of the steps a pipeline loads at runtime, see example-pipeline.conf.
+
+static bool polish_pin(const Pin* pin) {
+    (void)pin;
+    uint32_t sleep_time = (uint32_t)rand() % (MAX_SLEEP_TIME - MIN_SLEEP_TIME + 1) + MIN_SLEEP_TIME;
+    sleep(sleep_time);
+    return true;
+}
+
+static bool pack_pin(const Pin* pin) {
+    sleep(MIN_SLEEP_TIME);
+    // every fourth pin has no box left
+    return pin->pin_id % 4 != 0;
+}
+
+static const PipelineStep example_steps[] = {
+    {"polish", &polish_pin},
+    {"pack", &pack_pin},
+};
+
+const PipelinePlugin pipeline_plugin = {
+    .api_version = PIPELINE_PLUGIN_API_VERSION,
+    .steps_count = sizeof(example_steps) / sizeof(example_steps[0]),
+    .steps       = example_steps,
+};
@@ -0,0 +1,185 @@
+#ifndef _GNU_SOURCE
+// accept4, MSG_CMSG_CLOEXEC
+#define _GNU_SOURCE
+#endif
+
+#include "hot-restart.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../util/config.h"
+
+static socklen_t fill_restart_address(uint16_t port, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    // abstract name (leading '\0'), nothing to unlink after a crash
+    int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1,
+                          "idz4-restart-%u", (unsigned)port);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + (size_t)length);
+}
+
+int listen_hot_restart(uint16_t port) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        app_perror("socket");
+        return -1;
+    }
+    struct sockaddr_un address;
+    socklen_t length = fill_restart_address(port, &address);
+    if (bind(fd, (const struct sockaddr*)&address, length) == -1) {
+        app_perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 1) == -1) {
+        app_perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool set_timeouts(int fd) {
+    const struct timeval timeout = {
+        .tv_sec  = HOT_RESTART_TIMEOUT_MS / 1000,
+        .tv_usec = (HOT_RESTART_TIMEOUT_MS % 1000) * 1000,
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        app_perror("setsockopt[SOL_SOCKET,SO_RCVTIMEO|SO_SNDTIMEO]");
+        return false;
+    }
+    return true;
+}
+
+int accept_hot_restart(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        app_perror("accept4");
+        return -1;
+    }
+    if (!set_timeouts(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_hot_restart(uint16_t port) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        app_perror("socket");
+        return -1;
+    }
+    struct sockaddr_un address;
+    socklen_t length = fill_restart_address(port, &address);
+    if (connect(fd, (const struct sockaddr*)&address, length) == -1) {
+        if (errno != ECONNREFUSED) {
+            app_perror("connect");
+        }
+        close(fd);
+        return -1;
+    }
+    if (!set_timeouts(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool hot_restart_send(int conn_fd, const void* data, size_t size, const int* fds,
+                      size_t fds_count) {
+    if (fds_count > HOT_RESTART_MAX_FDS) {
+        fputs("> Too many descriptors to hand over\n", stderr);
+        return false;
+    }
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fds_count > 0) {
+        message.msg_control    = control.buffer;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level     = SOL_SOCKET;
+        header->cmsg_type      = SCM_RIGHTS;
+        header->cmsg_len       = CMSG_LEN(sizeof(int) * fds_count);
+        memcpy(CMSG_DATA(header), fds, sizeof(int) * fds_count);
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(conn_fd, &message, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent != (ssize_t)size) {
+        app_perror("sendmsg");
+        return false;
+    }
+    return true;
+}
+
+bool hot_restart_receive(int conn_fd, void* data, size_t size, int* fds, size_t* fds_count) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov       = {.iov_base = data, .iov_len = size};
+    struct msghdr message  = {
+         .msg_iov        = &iov,
+         .msg_iovlen     = 1,
+         .msg_control    = control.buffer,
+         .msg_controllen = sizeof(control.buffer),
+    };
+    ssize_t received;
+    do {
+        received = recvmsg(conn_fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    if (received == -1) {
+        app_perror("recvmsg");
+        return false;
+    }
+
+    size_t capacity = fds_count != NULL ? *fds_count : 0;
+    size_t count    = 0;
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL;
+         header                 = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (count < capacity) {
+                fds[count++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (fds_count != NULL) {
+        *fds_count = count;
+    }
+
+    if ((size_t)received != size || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+        fprintf(stderr, "> Unexpected hot restart packet of %zd bytes\n", received);
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        if (fds_count != NULL) {
+            *fds_count = 0;
+        }
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Channel between a running server and the server process that replaces it.
+///
+/// Every server listens on the abstract unix socket "idz4-restart-<port>". A new
+/// server started with SERVER_HOT_RESTART=1 connects to it, the old server stops
+/// its threads without a shutdown and sends its sockets (SCM_RIGHTS) and routing
+/// state in packets, the new one acknowledges after it took them over. Datagrams
+/// received meanwhile wait in the socket buffers that are passed over.
+
+#define SERVER_HOT_RESTART_ENV "SERVER_HOT_RESTART"
+
+enum {
+    HOT_RESTART_MAX_FDS     = 64,
+    HOT_RESTART_ACK         = 'A',
+    HOT_RESTART_TIMEOUT_MS  = 5000,
+};
+
+/// @brief Starts listening for the server that will replace this one.
+/// @return listening socket or -1.
+int listen_hot_restart(uint16_t port);
+/// @brief Accepts the connection of the replacing server.
+/// @return connection or -1.
+int accept_hot_restart(int listen_fd);
+/// @brief Connects to the server running on the @a port.
+/// @return connection or -1 if no server listens on the port.
+int connect_hot_restart(uint16_t port);
+/// @brief Sends one packet with the @a fds attached.
+bool hot_restart_send(int conn_fd, const void* data, size_t size, const int* fds, size_t fds_count);
+/// @brief Receives one packet of exactly @a size bytes.
+/// @param fds_count in: capacity of @a fds, out: number of received fds.
+bool hot_restart_receive(int conn_fd, void* data, size_t size, int* fds, size_t* fds_count);
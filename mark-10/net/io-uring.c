@@ -0,0 +1,218 @@
+#ifndef _GNU_SOURCE
+// syscall(SYS_io_uring_*)
+#define _GNU_SOURCE
+#endif
+
+#include "io-uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+                              const void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, const void* arg, uint32_t nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool init_uring(Uring* ring, uint32_t entries, uint32_t setup_flags) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params = {
+        .flags          = setup_flags,
+        .sq_thread_idle = 1000,
+    };
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->setup_flags = setup_flags;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring_ptr == MAP_FAILED) {
+        goto init_uring_cleanup_fd;
+    }
+    ring->cq_ring_ptr = ring->sq_ring_ptr;
+    if (!single_mmap) {
+        ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring_ptr == MAP_FAILED) {
+            goto init_uring_cleanup_sq;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto init_uring_cleanup_cq;
+    }
+
+    unsigned char* sq    = ring->sq_ring_ptr;
+    ring->sq_head        = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail        = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_flags       = (uint32_t*)(sq + params.sq_off.flags);
+    ring->sq_array       = (uint32_t*)(sq + params.sq_off.array);
+    ring->sq_mask        = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries     = params.sq_entries;
+    ring->sq_local_tail  = *ring->sq_tail;
+    unsigned char* cq    = ring->cq_ring_ptr;
+    ring->cq_head        = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail        = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask        = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes           = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+
+init_uring_cleanup_cq:
+    if (!single_mmap) {
+        munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    }
+init_uring_cleanup_sq:
+    munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+init_uring_cleanup_fd: {
+    int errno_val = errno;
+    close(ring->fd);
+    errno = errno_val;
+}
+    return false;
+}
+
+void deinit_uring(Uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_ptr != ring->sq_ring_ptr) {
+        munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    const uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    const uint32_t index     = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit(Uring* ring, uint32_t wait_nr, uint32_t timeout_ms) {
+    const uint32_t to_submit = uring_sq_pending(ring);
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    uint32_t flags = 0;
+    if (ring->setup_flags & IORING_SETUP_SQPOLL) {
+        // kernel thread picks the entries up by itself unless it went to sleep
+        if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        } else if (wait_nr == 0) {
+            return (int)to_submit;
+        }
+    } else if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec  = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t)&ts,
+    };
+    const void* arg_ptr = NULL;
+    size_t arg_size     = 0;
+    if (wait_nr != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms != 0) {
+            flags |= IORING_ENTER_EXT_ARG;
+            arg_ptr  = &arg;
+            arg_size = sizeof(arg);
+        }
+    }
+    const uint32_t submit_count = (ring->setup_flags & IORING_SETUP_SQPOLL) ? 0 : to_submit;
+    int ret = sys_io_uring_enter(ring->fd, submit_count, wait_nr, flags, arg_ptr, arg_size);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring* ring) {
+    const uint32_t head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool init_uring_buffer_ring(Uring* ring, UringBufferRing* buffer_ring, uint16_t group_id,
+                            uint32_t entries, uint32_t buffer_size) {
+    memset(buffer_ring, 0, sizeof(*buffer_ring));
+    const size_t ring_size    = entries * sizeof(struct io_uring_buf);
+    const size_t buffers_size = (size_t)entries * buffer_size;
+    void* mem = mmap(NULL, ring_size + buffers_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    buffer_ring->ring        = mem;
+    buffer_ring->buffers     = (unsigned char*)mem + ring_size;
+    buffer_ring->entries     = entries;
+    buffer_ring->buffer_size = buffer_size;
+    buffer_ring->group_id    = group_id;
+
+    const struct io_uring_buf_reg reg = {
+        .ring_addr    = (uint64_t)(uintptr_t)mem,
+        .ring_entries = entries,
+        .bgid         = group_id,
+    };
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int errno_val = errno;
+        munmap(mem, ring_size + buffers_size);
+        errno = errno_val;
+        return false;
+    }
+    for (uint32_t i = 0; i < entries; i++) {
+        uring_buffer_ring_recycle(buffer_ring, (uint16_t)i);
+    }
+    return true;
+}
+
+void deinit_uring_buffer_ring(Uring* ring, UringBufferRing* buffer_ring) {
+    const struct io_uring_buf_reg reg = {.bgid = buffer_ring->group_id};
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(buffer_ring->ring, buffer_ring->entries * sizeof(struct io_uring_buf) +
+                                  (size_t)buffer_ring->entries * buffer_ring->buffer_size);
+}
+
+void uring_buffer_ring_recycle(UringBufferRing* buffer_ring, uint16_t buffer_id) {
+    const uint32_t slot      = buffer_ring->tail & (buffer_ring->entries - 1);
+    struct io_uring_buf* buf = &buffer_ring->ring->bufs[slot];
+    buf->addr                = (uint64_t)(uintptr_t)uring_buffer(buffer_ring, buffer_id);
+    buf->len                 = buffer_ring->buffer_size;
+    buf->bid                 = buffer_id;
+    buffer_ring->tail++;
+    __atomic_store_n(&buffer_ring->ring->tail, buffer_ring->tail, __ATOMIC_RELEASE);
+}
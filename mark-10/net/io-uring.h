@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Minimal io_uring(7) wrapper over the raw syscalls (no liburing in the build).
+typedef struct Uring {
+    int fd;
+    uint32_t setup_flags;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_flags;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    /// Tail of the prepared but not yet published entries.
+    uint32_t sq_local_tail;
+    struct io_uring_sqe* sqes;
+
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring_ptr;
+    size_t sq_ring_size;
+    void* cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+/// @param setup_flags IORING_SETUP_* flags, e.g. IORING_SETUP_SQPOLL
+/// @return false if the kernel does not support io_uring (errno is set)
+bool init_uring(Uring* ring, uint32_t entries, uint32_t setup_flags);
+void deinit_uring(Uring* ring);
+/// @return zeroed submission entry or NULL if the submission queue is full
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+/// @brief Publishes prepared entries and optionally waits for @a wait_nr completions.
+/// @param timeout_ms used only if @a wait_nr != 0, 0 means no timeout
+/// @return number of submitted entries or -errno
+int uring_submit(Uring* ring, uint32_t wait_nr, uint32_t timeout_ms);
+/// @return oldest completion or NULL, must be followed by uring_cqe_seen()
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);
+void uring_cqe_seen(Uring* ring);
+/// @return number of prepared but not published submission entries
+static inline uint32_t uring_sq_pending(const Uring* ring) {
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_tail, __ATOMIC_RELAXED);
+}
+
+/// @brief Ring of the buffers provided to the kernel for the multishot receives.
+typedef struct UringBufferRing {
+    struct io_uring_buf_ring* ring;
+    unsigned char* buffers;
+    uint32_t entries;
+    uint32_t buffer_size;
+    uint16_t group_id;
+    uint16_t tail;
+} UringBufferRing;
+
+bool init_uring_buffer_ring(Uring* ring, UringBufferRing* buffer_ring, uint16_t group_id,
+                            uint32_t entries, uint32_t buffer_size);
+void deinit_uring_buffer_ring(Uring* ring, UringBufferRing* buffer_ring);
+static inline unsigned char* uring_buffer(const UringBufferRing* buffer_ring, uint16_t buffer_id) {
+    return buffer_ring->buffers + (size_t)buffer_id * buffer_ring->buffer_size;
+}
+/// @brief Gives the buffer back to the kernel.
+void uring_buffer_ring_recycle(UringBufferRing* buffer_ring, uint16_t buffer_id);
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "../util/metrics.h"
 #include "../util/parser.h"
 #include "client-tools.h"
 #include "server-log.h"
@@ -34,14 +35,16 @@ static int start_runtime_loop(Client logs_col) {
     return ret;
 }
 
-static int run_logs_collector(uint16_t server_port) {
+static int run_logs_collector(uint16_t server_port, const char* server_ip_address) {
     Client logs_col;
-    if (!init_client(logs_col, server_port, COMPONENT_TYPE_LOGS_COLLECTOR)) {
+    if (!init_client(logs_col, server_port, COMPONENT_TYPE_LOGS_COLLECTOR,
+                     server_ip_address)) {
         return EXIT_FAILURE;
     }
 
     print_client_info(logs_col);
     int ret = start_runtime_loop(logs_col);
+    print_metrics(stdout);
     deinit_client(logs_col);
     return ret;
 }
@@ -53,5 +56,5 @@ int main(int argc, char const* argv[]) {
         return EXIT_FAILURE;
     }
 
-    return run_logs_collector(res.port);
+    return run_logs_collector(res.port, res.ip_address);
 }
@@ -0,0 +1,561 @@
+#include "manager-script.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/clock.h"
+#include "../util/config.h"
+#include "client-tools.h"
+#include "net-config.h"
+
+enum {
+    MANAGER_SCRIPT_MAX_PENDING = 64,
+    MANAGER_SCRIPT_BUFFER_SIZE = 4096,
+    MANAGER_SCRIPT_POLL_MS     = 1000,
+    MANAGER_SCRIPT_MAX_ARGS    = 3,
+};
+
+/// @brief How the value of the reply is printed.
+typedef enum ScriptValue {
+    SCRIPT_NO_VALUE,
+    SCRIPT_NUMBER_VALUE,
+    /// ComponentType, printed as its name.
+    SCRIPT_TYPE_VALUE,
+} ScriptValue;
+
+typedef struct ScriptCommand {
+    uint32_t line;
+    ScriptValue value;
+} ScriptCommand;
+
+/// @brief Batch in flight.
+typedef struct ScriptRequest {
+    uint32_t request_id;
+    uint64_t sent_ns;
+    /// Line of the list command the batch pages through, 0 for the other batches.
+    uint32_t list_line;
+    ComponentType list_type;
+    uint32_t list_position;
+    uint32_t count;
+    ScriptCommand commands[MANAGER_MAX_BATCH_COMMANDS];
+} ScriptRequest;
+
+typedef struct ManagerScript {
+    struct Client* manager;
+    const char* const* commands;
+    uint32_t commands_count;
+    uint32_t next_command;
+    uint32_t line;
+    /// Commands read but not sent yet.
+    uint32_t batch_count;
+    ServerCommand batch[MANAGER_MAX_BATCH_COMMANDS];
+    ScriptCommand batch_commands[MANAGER_MAX_BATCH_COMMANDS];
+    uint32_t pending_count;
+    ScriptRequest pending[MANAGER_SCRIPT_MAX_PENDING];
+    /// Set by wait, no line is read until all the results came.
+    bool is_waiting;
+    /// Set by quit.
+    bool is_input_closed;
+    bool is_eof;
+    bool is_stopped;
+    bool has_failures;
+    size_t buffered;
+    char buffer[MANAGER_SCRIPT_BUFFER_SIZE];
+} ManagerScript;
+
+static const struct {
+    const char* name;
+    ComponentType type;
+} component_type_names[] = {
+    {"server", COMPONENT_TYPE_SERVER},
+    {"first", COMPONENT_TYPE_FIRST_STAGE_WORKER},
+    {"second", COMPONENT_TYPE_SECOND_STAGE_WORKER},
+    {"third", COMPONENT_TYPE_THIRD_STAGE_WORKER},
+    {"fourth", COMPONENT_TYPE_FOURTH_STAGE_WORKER},
+    {"fifth", COMPONENT_TYPE_FIFTH_STAGE_WORKER},
+    {"logs-collector", COMPONENT_TYPE_LOGS_COLLECTOR},
+    {"manager", COMPONENT_TYPE_MANAGER},
+};
+
+static const char* const stat_names[SERVER_STATS_COUNT] = {
+    [SERVER_STAT_CLIENTS]           = "clients",
+    [SERVER_STAT_PINS_ROUTED]       = "pins-routed",
+    [SERVER_STAT_OUTSTANDING_PINS]  = "outstanding-pins",
+    [SERVER_STAT_PEERS_REMOVED]     = "peers-removed",
+    [SERVER_STAT_LOGS_QUEUE_DEPTH]  = "logs-queue",
+    [SERVER_STAT_CONCURRENCY]       = "concurrency",
+    [SERVER_STAT_ARRIVAL_RATE]      = "arrival-rate",
+    [SERVER_STAT_SERVICE_TIME]      = "service-time",
+    [SERVER_STAT_QUEUE_LENGTH]      = "queue-length",
+    [SERVER_STAT_BOTTLENECK]        = "bottleneck",
+    [SERVER_STAT_QUEUED_PINS]       = "queued-pins",
+    [SERVER_STAT_PINS_SHED]         = "pins-shed",
+    [SERVER_STAT_ADMISSION_RATE]    = "admission-rate",
+    [SERVER_STAT_PINS_NOT_ADMITTED] = "pins-not-admitted",
+};
+
+static const char* const log_level_names[] = {
+    [SERVER_LOG_ERRORS] = "errors",
+    [SERVER_LOG_EVENTS] = "events",
+    [SERVER_LOG_PINS]   = "pins",
+};
+
+static const char* const balance_mode_names[] = {
+    [SERVER_BALANCE_OFF]    = "off",
+    [SERVER_BALANCE_REPORT] = "report",
+    [SERVER_BALANCE_ADVISE] = "advise",
+    [SERVER_BALANCE_DIRECT] = "direct",
+};
+
+static bool parse_component_type(const char* name, ComponentType* type) {
+    for (size_t i = 0; i < sizeof(component_type_names) / sizeof(component_type_names[0]); i++) {
+        if (strcmp(component_type_names[i].name, name) == 0) {
+            *type = component_type_names[i].type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_stage(const char* name, ComponentType* type) {
+    return parse_component_type(name, type) && (*type & COMPONENT_TYPE_ANY_WORKER) != 0;
+}
+
+/// @brief Parses the stages separated by commas into the mask of their types.
+static bool parse_stages(const char* names, uint32_t* roles) {
+    char buffer[64];
+    if (strlen(names) >= sizeof(buffer)) {
+        return false;
+    }
+    strcpy(buffer, names);
+    *roles         = 0;
+    char* save_ptr = NULL;
+    for (const char* name = strtok_r(buffer, ",", &save_ptr); name != NULL;
+         name             = strtok_r(NULL, ",", &save_ptr)) {
+        ComponentType type;
+        if (!parse_stage(name, &type)) {
+            return false;
+        }
+        *roles |= type;
+    }
+    return *roles != 0;
+}
+
+static const char* component_type_name(ComponentType type) {
+    for (size_t i = 0; i < sizeof(component_type_names) / sizeof(component_type_names[0]); i++) {
+        if (component_type_names[i].type == type) {
+            return component_type_names[i].name;
+        }
+    }
+    return "unknown";
+}
+
+static bool parse_name(const char* const* names, uint32_t count, const char* name,
+                       uint32_t* index) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_uint32(const char* str, uint32_t* value) {
+    char* end_ptr           = NULL;
+    errno                   = 0;
+    const unsigned long val = strtoul(str, &end_ptr, 10);
+    const bool is_parsed    = errno == 0 && end_ptr != str && *end_ptr == '\0';
+    *value                  = (uint32_t)val;
+    return is_parsed && str[0] != '-' && val <= UINT32_MAX;
+}
+
+static const char* script_error_to_string(ServerCommandResult result) {
+    switch (result) {
+        case INVALID_SERVER_COMMAND_ARGS:
+            return "invalid-args";
+        case SERVER_INTERNAL_ERROR:
+            return "internal-error";
+        case NO_CONNECTION:
+            return "no-connection";
+        case SERVER_COMMAND_SUCCESS:
+        default:
+            return "unknown";
+    }
+}
+
+static void print_script_error(uint32_t line, const char* reason) {
+    printf("%u error %s\n", line, reason);
+}
+
+static void print_script_reply(const ScriptCommand* command, const ServerCommandReply* reply) {
+    if (reply->result != SERVER_COMMAND_SUCCESS) {
+        print_script_error(command->line, script_error_to_string(reply->result));
+    } else if (command->value == SCRIPT_TYPE_VALUE) {
+        printf("%u ok %s\n", command->line,
+               reply->value != 0 ? component_type_name((ComponentType)reply->value) : "none");
+    } else if (command->value == SCRIPT_NUMBER_VALUE) {
+        printf("%u ok %" PRIu64 "\n", command->line, reply->value);
+    } else {
+        printf("%u ok\n", command->line);
+    }
+}
+
+static void fail_script_request(ManagerScript* script, const ScriptRequest* request,
+                                const char* reason) {
+    script->has_failures = true;
+    if (request->list_line != 0) {
+        print_script_error(request->list_line, reason);
+        return;
+    }
+    for (uint32_t i = 0; i < request->count; i++) {
+        print_script_error(request->commands[i].line, reason);
+    }
+}
+
+static void remove_script_request(ManagerScript* script, uint32_t index) {
+    script->pending[index] = script->pending[--script->pending_count];
+}
+
+static void handle_script_results(ManagerScript* script, const ManagerCommandResults* results);
+
+static void receive_script_results(ManagerScript* script, uint32_t timeout_ms) {
+    ManagerCommandResults results;
+    ManagerResultsStatus status = receive_manager_results(script->manager, &results, timeout_ms);
+    while (status == MANAGER_RESULTS_RECEIVED) {
+        handle_script_results(script, &results);
+        status = receive_manager_results(script->manager, &results, 0);
+    }
+    if (status == MANAGER_RESULTS_STOPPED) {
+        script->is_stopped = true;
+    }
+    fflush(stdout);
+}
+
+static void expire_script_requests(ManagerScript* script) {
+    const uint64_t now_ns = monotonic_time_ns();
+    for (uint32_t i = script->pending_count; i > 0; i--) {
+        const ScriptRequest* request = &script->pending[i - 1];
+        if (now_ns - request->sent_ns >= (uint64_t)MANAGER_RESULTS_TIMEOUT_MS * 1000000u) {
+            fail_script_request(script, request, "timeout");
+            remove_script_request(script, i - 1);
+        }
+    }
+}
+
+/// @brief Waits for a free slot of the requests in flight.
+/// @return false if the manager stopped meanwhile
+static bool reserve_script_request(ManagerScript* script) {
+    while (script->pending_count == MANAGER_SCRIPT_MAX_PENDING && !script->is_stopped) {
+        receive_script_results(script, MANAGER_SCRIPT_POLL_MS);
+        expire_script_requests(script);
+    }
+    return !script->is_stopped;
+}
+
+static void send_script_request(ManagerScript* script, ScriptRequest* request,
+                                const ServerCommand* commands) {
+    if (!reserve_script_request(script)) {
+        fail_script_request(script, request, "no-connection");
+        return;
+    }
+    request->request_id = send_manager_commands(script->manager, commands, request->count);
+    if (request->request_id == 0) {
+        fail_script_request(script, request, "no-connection");
+        return;
+    }
+    request->sent_ns                         = monotonic_time_ns();
+    script->pending[script->pending_count++] = *request;
+}
+
+static void flush_script_batch(ManagerScript* script) {
+    if (script->batch_count == 0) {
+        return;
+    }
+    ScriptRequest request = {.count = script->batch_count};
+    memcpy(request.commands, script->batch_commands,
+           script->batch_count * sizeof(request.commands[0]));
+    script->batch_count = 0;
+    send_script_request(script, &request, script->batch);
+}
+
+/// @brief The clients are asked for by their positions in the dispatch list
+/// of the type, a full batch of them at a time.
+static void send_list_page(ManagerScript* script, uint32_t line, ComponentType type,
+                           uint32_t position) {
+    ServerCommand commands[MANAGER_MAX_BATCH_COMMANDS];
+    for (uint32_t i = 0; i < MANAGER_MAX_BATCH_COMMANDS; i++) {
+        commands[i] = (ServerCommand){
+            .type        = SERVER_COMMAND_GET_CLIENT,
+            .client_type = type,
+            .argument    = position + i,
+        };
+    }
+    ScriptRequest request = {
+        .list_line     = line,
+        .list_type     = type,
+        .list_position = position,
+        .count         = MANAGER_MAX_BATCH_COMMANDS,
+    };
+    send_script_request(script, &request, commands);
+}
+
+static void handle_list_results(ManagerScript* script, const ScriptRequest* request,
+                                const ManagerCommandResults* results) {
+    uint32_t found = 0;
+    while (found < results->count && results->replies[found].result == SERVER_COMMAND_SUCCESS) {
+        const uint64_t value = results->replies[found].value;
+        printf("%u client %u %s %u\n", request->list_line, (uint32_t)value,
+               component_type_name(request->list_type), (uint32_t)(value >> 32));
+        found++;
+    }
+    if (found == MANAGER_MAX_BATCH_COMMANDS) {
+        send_list_page(script, request->list_line, request->list_type,
+                       request->list_position + found);
+    } else {
+        printf("%u ok %u\n", request->list_line, request->list_position + found);
+    }
+}
+
+static void handle_script_results(ManagerScript* script, const ManagerCommandResults* results) {
+    uint32_t index = 0;
+    while (index < script->pending_count &&
+           script->pending[index].request_id != results->request_id) {
+        index++;
+    }
+    // the results of the timed out request
+    if (index == script->pending_count) {
+        return;
+    }
+    const ScriptRequest request = script->pending[index];
+    remove_script_request(script, index);
+    if (request.list_line != 0) {
+        handle_list_results(script, &request, results);
+        return;
+    }
+    for (uint32_t i = 0; i < request.count; i++) {
+        const ServerCommandReply missing = {.result = SERVER_INTERNAL_ERROR};
+        print_script_reply(&request.commands[i],
+                           i < results->count ? &results->replies[i] : &missing);
+    }
+}
+
+static void add_script_command(ManagerScript* script, const ServerCommand* command,
+                               ScriptValue value) {
+    if (script->batch_count == MANAGER_MAX_BATCH_COMMANDS) {
+        flush_script_batch(script);
+    }
+    script->batch[script->batch_count]          = *command;
+    script->batch_commands[script->batch_count] = (ScriptCommand){
+        .line  = script->line,
+        .value = value,
+    };
+    script->batch_count++;
+}
+
+static void handle_script_line(ManagerScript* script, char* line) {
+    script->line++;
+    char* save_ptr   = NULL;
+    const char* name = strtok_r(line, " \t\r", &save_ptr);
+    if (name == NULL || name[0] == '#') {
+        return;
+    }
+    const char* args[MANAGER_SCRIPT_MAX_ARGS];
+    uint32_t argc = 0;
+    while (argc < MANAGER_SCRIPT_MAX_ARGS &&
+           (args[argc] = strtok_r(NULL, " \t\r", &save_ptr)) != NULL) {
+        argc++;
+    }
+
+    ServerCommand command = {0};
+    ScriptValue value     = SCRIPT_NO_VALUE;
+    bool is_valid         = false;
+    uint32_t index        = 0;
+    if (strcmp(name, "stop") == 0) {
+        command.type = SERVER_COMMAND_SHUTDOWN_CLIENTS;
+        is_valid     = argc == 1 && parse_component_type(args[0], &command.client_type);
+    } else if (strcmp(name, "stop-client") == 0) {
+        command.type = SERVER_COMMAND_STOP_CLIENT;
+        is_valid     = argc == 1 && parse_uint32(args[0], &command.client_id);
+    } else if (strcmp(name, "drain") == 0) {
+        command.type = SERVER_COMMAND_DRAIN_STAGE;
+        is_valid     = argc == 1 && parse_stage(args[0], &command.client_type);
+    } else if (strcmp(name, "resize") == 0) {
+        command.type = SERVER_COMMAND_RESIZE_STAGE;
+        value        = SCRIPT_NUMBER_VALUE;
+        is_valid     = argc == 2 && parse_stage(args[0], &command.client_type) &&
+                       parse_uint32(args[1], &command.argument);
+    } else if (strcmp(name, "concurrency") == 0) {
+        command.type = SERVER_COMMAND_SET_STAGE_CONCURRENCY;
+        is_valid     = argc == 2 && parse_stage(args[0], &command.client_type) &&
+                       parse_uint32(args[1], &command.argument);
+    } else if (strcmp(name, "concurrency-client") == 0) {
+        command.type = SERVER_COMMAND_SET_CONCURRENCY;
+        is_valid     = argc == 2 && parse_uint32(args[0], &command.client_id) &&
+                       parse_uint32(args[1], &command.argument);
+    } else if (strcmp(name, "roles") == 0) {
+        command.type = SERVER_COMMAND_SET_WORKER_ROLES;
+        is_valid     = argc == 2 && parse_uint32(args[0], &command.client_id) &&
+                       parse_stages(args[1], &command.argument);
+    } else if (strcmp(name, "list") == 0) {
+        ComponentType type;
+        if (argc == 1 && parse_component_type(args[0], &type)) {
+            send_list_page(script, script->line, type, 0);
+            return;
+        }
+    } else if (strcmp(name, "stat") == 0) {
+        command.type     = SERVER_COMMAND_QUERY_STAT;
+        is_valid         = (argc == 1 || argc == 2) &&
+                           parse_name(stat_names, SERVER_STATS_COUNT, args[0], &index) &&
+                           (argc == 1 || parse_component_type(args[1], &command.client_type));
+        command.argument = index;
+        value = index == SERVER_STAT_BOTTLENECK ? SCRIPT_TYPE_VALUE : SCRIPT_NUMBER_VALUE;
+    } else if (strcmp(name, "log-level") == 0) {
+        const uint32_t levels = sizeof(log_level_names) / sizeof(log_level_names[0]);
+        command.type          = SERVER_COMMAND_SET_LOG_LEVEL;
+        is_valid              = argc == 1 && parse_name(log_level_names, levels, args[0], &index);
+        command.argument      = index;
+    } else if (strcmp(name, "balance") == 0) {
+        const uint32_t modes = sizeof(balance_mode_names) / sizeof(balance_mode_names[0]);
+        command.type         = SERVER_COMMAND_SET_BALANCE_MODE;
+        is_valid             = argc == 1 && parse_name(balance_mode_names, modes, args[0], &index);
+        command.argument     = index;
+    } else if (strcmp(name, "admission") == 0) {
+        command.type = SERVER_COMMAND_SET_ADMISSION_RATE;
+        is_valid     = argc == 1 && parse_uint32(args[0], &command.argument);
+    } else if (strcmp(name, "wait") == 0) {
+        flush_script_batch(script);
+        script->is_waiting = true;
+        return;
+    } else if (strcmp(name, "quit") == 0) {
+        script->is_input_closed = true;
+        return;
+    }
+    if (!is_valid) {
+        print_script_error(script->line, "syntax");
+        return;
+    }
+    add_script_command(script, &command, value);
+}
+
+static bool is_script_input_done(const ManagerScript* script) {
+    if (script->is_input_closed) {
+        return true;
+    }
+    if (script->commands != NULL) {
+        return script->next_command == script->commands_count;
+    }
+    return script->is_eof && script->buffered == 0;
+}
+
+/// @brief Runs the lines read so far, up to the next wait.
+static void handle_script_input(ManagerScript* script) {
+    while (!script->is_waiting && !script->is_stopped && !is_script_input_done(script)) {
+        if (script->commands != NULL) {
+            char line[MANAGER_SCRIPT_BUFFER_SIZE];
+            snprintf(line, sizeof(line), "%s", script->commands[script->next_command++]);
+            handle_script_line(script, line);
+            continue;
+        }
+        char* end = memchr(script->buffer, '\n', script->buffered);
+        if (end == NULL) {
+            break;
+        }
+        *end                  = '\0';
+        const size_t consumed = (size_t)(end - script->buffer) + 1;
+        handle_script_line(script, script->buffer);
+        script->buffered -= consumed;
+        memmove(script->buffer, script->buffer + consumed, script->buffered);
+    }
+}
+
+static void read_script_input(ManagerScript* script) {
+    // one byte is kept for the newline of the last line
+    const size_t capacity = sizeof(script->buffer) - 1;
+    if (script->buffered == capacity) {
+        script->line++;
+        print_script_error(script->line, "line-too-long");
+        script->buffered = 0;
+    }
+    const ssize_t read_bytes =
+        read(STDIN_FILENO, script->buffer + script->buffered, capacity - script->buffered);
+    if (read_bytes < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            app_perror("read");
+            script->is_input_closed = true;
+        }
+        return;
+    }
+    if (read_bytes == 0) {
+        script->is_eof = true;
+        if (script->buffered != 0) {
+            script->buffer[script->buffered++] = '\n';
+        }
+        return;
+    }
+    script->buffered += (size_t)read_bytes;
+}
+
+int run_manager_script(Client manager, const char* const* commands, uint32_t commands_count) {
+    static ManagerScript script;
+    memset(&script, 0, sizeof(script));
+    script.manager        = manager;
+    script.commands       = commands;
+    script.commands_count = commands_count;
+    // the results are read by another program as they come
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while (!script.is_stopped) {
+        handle_script_input(&script);
+        flush_script_batch(&script);
+        if (script.is_waiting && script.pending_count == 0) {
+            script.is_waiting = false;
+            continue;
+        }
+        if (is_script_input_done(&script) && script.pending_count == 0) {
+            break;
+        }
+
+        struct pollfd fds[1 + MANAGER_POLL_FDS];
+        uint32_t fds_count = 0;
+        const bool reads_stdin =
+            commands == NULL && !script.is_waiting && !script.is_eof && !script.is_input_closed;
+        if (reads_stdin) {
+            fds[fds_count++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+        }
+        const uint32_t manager_fds = fds_count;
+        fds_count += manager_poll_fds(manager, &fds[fds_count]);
+        int ret = poll(fds, fds_count, MANAGER_SCRIPT_POLL_MS);
+        if (ret == -1 && errno != EINTR) {
+            app_perror("poll");
+            script.has_failures = true;
+            break;
+        }
+        for (uint32_t i = manager_fds; ret > 0 && i < fds_count; i++) {
+            if (fds[i].revents != 0) {
+                receive_script_results(&script, 0);
+                break;
+            }
+        }
+        if (ret > 0 && reads_stdin && fds[0].revents != 0) {
+            read_script_input(&script);
+        }
+        expire_script_requests(&script);
+    }
+
+    for (uint32_t i = 0; i < script.pending_count; i++) {
+        fail_script_request(&script, &script.pending[i], "no-connection");
+    }
+    if (script.is_stopped) {
+        fputs("Received shutdown signal from the server or lost the connection\n", stderr);
+    }
+    fflush(stdout);
+    return script.has_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
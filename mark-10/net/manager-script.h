@@ -0,0 +1,51 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdint.h>
+
+#include "client-tools.h"
+
+/// Reads the manager commands from the standard input instead of the prompts if 1.
+#define MANAGER_SCRIPT_ENV "MANAGER_SCRIPT"
+
+/// @brief Non interactive manager: one command per line, the commands are
+/// sent as they come, several to a datagram, without waiting for the results
+/// of the previous ones. Every result is printed once it comes back, tagged
+/// with the number of the line of its command:
+///
+///     stop <type>                   shut down all the clients of the type
+///     stop-client <id>              shut down one client, see list
+///     drain <stage>                 the workers finish their pins and take no new ones
+///     resize <stage> <workers>      stop the workers of the stage above the count
+///     concurrency <stage> <pins>    pins every worker of the stage processes at once
+///     concurrency-client <id> <pins>
+///     roles <id> <stage>[,<stage>]  stages of the multi-role worker process of the client
+///     list <type>                   "<line> client <id> <type> <pid>" for every client
+///     stat <stat> [type]            clients, pins-routed, outstanding-pins,
+///                                   peers-removed, logs-queue, concurrency,
+///                                   arrival-rate (pins a minute), service-time (ms),
+///                                   queue-length, bottleneck (the stage),
+///                                   queued-pins or pins-shed (the server queues),
+///                                   admission-rate or pins-not-admitted
+///     log-level <level>             errors, events or pins
+///     balance <mode>                off, report, advise or direct (moves the
+///                                   multi-role workers to the bottleneck)
+///     admission <pins>              pins a minute the entry stages may make, 0 for no limit
+///     wait                          read on once all the results came
+///     quit
+///
+/// where the types are server, first, second, third, fourth, fifth,
+/// logs-collector and manager, the stages are first, second, third, fourth
+/// and fifth (see pipeline-config.h). Empty lines and the
+/// lines starting with '#' are skipped. A result line is "<line> ok [value]"
+/// or "<line> error <reason>".
+///
+/// @param commands the lines to run instead of the standard input, NULL to read it
+/// @return EXIT_FAILURE if the connection to the server broke or a result did not come
+int run_manager_script(Client manager, const char* const* commands, uint32_t commands_count);
@@ -2,9 +2,12 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "../util/metrics.h"
 #include "../util/parser.h"
 #include "client-tools.h"
+#include "manager-script.h"
 #include "net-config.h"
 
 static uint32_t next_uint(const char* prompt, uint32_t min_value, uint32_t max_value) {
@@ -53,6 +56,8 @@ static int start_runtime_loop(Client manager) {
         "> 3. Third stage workers\n"
         "> 4. Logs collectors\n"
         "> 5. Managers\n"
+        "> 6. Fourth stage workers\n"
+        "> 7. Fifth stage workers\n"
         "\n"
         "> ";
 
@@ -62,7 +67,7 @@ static int start_runtime_loop(Client manager) {
             break;
         }
 
-        const ServerCommand cmd = {.client_type = (ComponentType){1u << next_uint(prompt, 1, 5)}};
+        const ServerCommand cmd = {.client_type = (ComponentType){1u << next_uint(prompt, 1, 7)}};
         const ServerCommandResult resp = send_manager_command_to_server(manager, cmd);
         if (!handle_server_response(resp)) {
             ret = EXIT_FAILURE;
@@ -84,24 +89,45 @@ static int start_runtime_loop(Client manager) {
     return ret;
 }
 
-static int run_manager(uint16_t server_port) {
+/// @param commands run by the script mode, NULL to take the mode from MANAGER_SCRIPT
+static int run_manager(uint16_t server_port, const char* server_ip_address,
+                       const char* const* commands, uint32_t commands_count) {
     Client manager;
-    if (!init_client(manager, server_port, COMPONENT_TYPE_MANAGER)) {
+    if (!init_client(manager, server_port, COMPONENT_TYPE_MANAGER, server_ip_address)) {
         return EXIT_FAILURE;
     }
 
-    print_client_info(manager);
-    int ret = start_runtime_loop(manager);
+    int ret;
+    if (commands != NULL || parse_env_uint32(MANAGER_SCRIPT_ENV, false)) {
+        // the standard output is left to the results
+        ret = run_manager_script(manager, commands, commands_count);
+        print_metrics(stderr);
+    } else {
+        print_client_info(manager);
+        ret = start_runtime_loop(manager);
+        print_metrics(stdout);
+    }
     deinit_client(manager);
     return ret;
 }
 
+/// Usage: manager <server port> [server ip address] [-- command...], the
+/// commands after "--" are run as the lines of the script mode.
 int main(int argc, char const* argv[]) {
-    ParseResult res = parse_args(argc, argv);
+    int args_count = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            args_count = i;
+            break;
+        }
+    }
+    ParseResult res = parse_args(args_count, argv);
     if (res.status != PARSE_SUCCESS) {
         print_invalid_args_error(res.status, argv[0]);
         return EXIT_FAILURE;
     }
 
-    return run_manager(res.port);
+    const bool has_commands = args_count != argc;
+    return run_manager(res.port, res.ip_address, has_commands ? &argv[args_count + 1] : NULL,
+                       has_commands ? (uint32_t)(argc - args_count - 1) : 0);
 }
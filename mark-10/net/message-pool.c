@@ -0,0 +1,142 @@
+#include "message-pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/config.h"
+#include "../util/metrics.h"
+#include "net-config.h"
+
+static struct MessagePool {
+    MessageBuffer* buffers;
+    uint32_t capacity;
+    pthread_mutex_t free_list_mutex;
+    uint32_t* free_list;
+    uint32_t free_list_size;
+    MetricId buffers_in_use;
+    MetricId exhausted;
+} message_pool;
+
+static _Thread_local struct MessagePoolCache {
+    uint32_t size;
+    MessageBuffer* buffers[MESSAGE_POOL_CACHE_SIZE];
+} message_pool_cache;
+
+bool init_message_pool(uint32_t capacity) {
+    assert(message_pool.buffers == NULL);
+    MessageBuffer* buffers = aligned_alloc(MESSAGE_POOL_CACHE_LINE, capacity * sizeof(*buffers));
+    uint32_t* free_list    = malloc(capacity * sizeof(*free_list));
+    if (buffers == NULL || free_list == NULL) {
+        app_perror("message pool");
+        free(buffers);
+        free(free_list);
+        return false;
+    }
+    int ret = pthread_mutex_init(&message_pool.free_list_mutex, NULL);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_mutex_init");
+        free(buffers);
+        free(free_list);
+        return false;
+    }
+    memset(buffers, 0, capacity * sizeof(*buffers));
+    for (uint32_t i = 0; i < capacity; i++) {
+        buffers[i].index = i;
+        // hand out the low addresses first
+        free_list[i] = capacity - 1 - i;
+    }
+    message_pool.buffers        = buffers;
+    message_pool.capacity       = capacity;
+    message_pool.free_list      = free_list;
+    message_pool.free_list_size = capacity;
+    message_pool.buffers_in_use = metrics_register_gauge("message buffers in use");
+    message_pool.exhausted      = metrics_register_counter("message pool exhausted");
+    return true;
+}
+
+void deinit_message_pool(void) {
+    pthread_mutex_destroy(&message_pool.free_list_mutex);
+    free(message_pool.free_list);
+    free(message_pool.buffers);
+    message_pool.buffers        = NULL;
+    message_pool.free_list      = NULL;
+    message_pool.capacity       = 0;
+    message_pool.free_list_size = 0;
+    message_pool_cache.size     = 0;
+}
+
+static MessageBuffer* buffer_of(const UDPMessage* message) {
+    return (MessageBuffer*)((uintptr_t)message - offsetof(MessageBuffer, message));
+}
+
+bool message_pool_owns(const UDPMessage* message) {
+    const MessageBuffer* buffer = buffer_of(message);
+    return buffer >= message_pool.buffers && buffer < message_pool.buffers + message_pool.capacity;
+}
+
+static void refill_cache(void) {
+    pthread_mutex_lock(&message_pool.free_list_mutex);
+    while (message_pool.free_list_size != 0 &&
+           message_pool_cache.size < MESSAGE_POOL_CACHE_SIZE / 2) {
+        const uint32_t index = message_pool.free_list[--message_pool.free_list_size];
+        message_pool_cache.buffers[message_pool_cache.size++] = &message_pool.buffers[index];
+    }
+    pthread_mutex_unlock(&message_pool.free_list_mutex);
+}
+
+static void spill_cache(void) {
+    pthread_mutex_lock(&message_pool.free_list_mutex);
+    while (message_pool_cache.size > MESSAGE_POOL_CACHE_SIZE / 2) {
+        const MessageBuffer* buffer = message_pool_cache.buffers[--message_pool_cache.size];
+        message_pool.free_list[message_pool.free_list_size++] = buffer->index;
+    }
+    pthread_mutex_unlock(&message_pool.free_list_mutex);
+}
+
+void message_pool_return_cache(void) {
+    pthread_mutex_lock(&message_pool.free_list_mutex);
+    while (message_pool_cache.size != 0) {
+        const MessageBuffer* buffer = message_pool_cache.buffers[--message_pool_cache.size];
+        message_pool.free_list[message_pool.free_list_size++] = buffer->index;
+    }
+    pthread_mutex_unlock(&message_pool.free_list_mutex);
+}
+
+UDPMessage* message_pool_acquire(void) {
+    if (message_pool_cache.size == 0) {
+        refill_cache();
+        if (message_pool_cache.size == 0) {
+            metrics_counter_inc(message_pool.exhausted);
+            return NULL;
+        }
+    }
+    MessageBuffer* buffer = message_pool_cache.buffers[--message_pool_cache.size];
+    __atomic_store_n(&buffer->refs, 1, __ATOMIC_RELAXED);
+    metrics_gauge_add(message_pool.buffers_in_use, 1);
+    return &buffer->message;
+}
+
+void message_pool_retain(UDPMessage* message) {
+    assert(message_pool_owns(message));
+    __atomic_add_fetch(&buffer_of(message)->refs, 1, __ATOMIC_RELAXED);
+}
+
+void message_pool_release(UDPMessage* message) {
+    assert(message_pool_owns(message));
+    MessageBuffer* buffer = buffer_of(message);
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (message_pool_cache.size == MESSAGE_POOL_CACHE_SIZE) {
+        spill_cache();
+    }
+    message_pool_cache.buffers[message_pool_cache.size++] = buffer;
+    metrics_gauge_add(message_pool.buffers_in_use, -1);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net-config.h"
+
+/// @brief Process wide pool of the message buffers.
+///
+/// All the buffers are allocated once by init_message_pool(). Every thread
+/// takes and returns them through its own cache of free buffers and touches
+/// the shared free list only to move half a cache at once. Buffers are not
+/// zeroed between uses and are reference counted, so one buffer can be held
+/// by e.g. the logs queue and by the pending sends at the same time; it
+/// returns to the pool with the last message_pool_release().
+///
+/// Buffers cached by a thread that exits are not returned to the shared
+/// free list unless it calls message_pool_return_cache(), the server keeps
+/// its threads for the whole run.
+enum {
+    MESSAGE_POOL_CACHE_LINE      = 64,
+    MESSAGE_POOL_CACHE_SIZE      = 32,
+    SERVER_MESSAGE_POOL_CAPACITY = 1024,
+    /// A multi-role worker has a receiving thread for every stage.
+    CLIENT_MESSAGE_POOL_CAPACITY = 128,
+};
+
+typedef struct MessageBuffer {
+    UDPMessage message;
+    uint32_t refs;
+    uint32_t index;
+} __attribute__((aligned(MESSAGE_POOL_CACHE_LINE))) MessageBuffer;
+
+bool init_message_pool(uint32_t capacity);
+void deinit_message_pool(void);
+/// @return buffer with one reference and stale contents or NULL if the pool is exhausted
+UDPMessage* message_pool_acquire(void);
+void message_pool_retain(UDPMessage* message);
+void message_pool_release(UDPMessage* message);
+/// @brief Returns the buffers cached by the calling thread, before it exits.
+void message_pool_return_cache(void);
+/// @return true if the @a message is a buffer of the pool
+bool message_pool_owns(const UDPMessage* message);
@@ -9,13 +9,62 @@ typedef enum ComponentType {
     COMPONENT_TYPE_THIRD_STAGE_WORKER  = 1u << 3,
     COMPONENT_TYPE_LOGS_COLLECTOR      = 1u << 4,
     COMPONENT_TYPE_MANAGER             = 1u << 5,
+    /// Stages of the pipelines defined by the configuration, see pipeline-config.h.
+    COMPONENT_TYPE_FOURTH_STAGE_WORKER = 1u << 6,
+    COMPONENT_TYPE_FIFTH_STAGE_WORKER  = 1u << 7,
     COMPONENT_TYPE_ANY_WORKER          = COMPONENT_TYPE_FIRST_STAGE_WORKER |
                                 COMPONENT_TYPE_SECOND_STAGE_WORKER |
-                                COMPONENT_TYPE_THIRD_STAGE_WORKER,
+                                COMPONENT_TYPE_THIRD_STAGE_WORKER |
+                                COMPONENT_TYPE_FOURTH_STAGE_WORKER |
+                                COMPONENT_TYPE_FIFTH_STAGE_WORKER,
     COMPONENT_TYPE_ANY_CLIENT =
         COMPONENT_TYPE_ANY_WORKER | COMPONENT_TYPE_LOGS_COLLECTOR | COMPONENT_TYPE_MANAGER
 } ComponentType;
 
+/// Every stage has its slots in the trace of the pin.
+enum { PIPELINE_STAGES = PIN_TRACE_STAGES };
+
+/// @return zero based stage of the worker @a type, -1 for the other clients
+static inline int32_t pipeline_stage_index(ComponentType type) {
+    switch (type) {
+        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
+            return 0;
+        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
+            return 1;
+        case COMPONENT_TYPE_THIRD_STAGE_WORKER:
+            return 2;
+        case COMPONENT_TYPE_FOURTH_STAGE_WORKER:
+            return 3;
+        case COMPONENT_TYPE_FIFTH_STAGE_WORKER:
+            return 4;
+        default:
+            return -1;
+    }
+}
+
+/// @return worker type of the zero based @a stage
+static inline ComponentType pipeline_stage_type(uint32_t stage) {
+    switch (stage) {
+        case 0:
+            return COMPONENT_TYPE_FIRST_STAGE_WORKER;
+        case 1:
+            return COMPONENT_TYPE_SECOND_STAGE_WORKER;
+        case 2:
+            return COMPONENT_TYPE_THIRD_STAGE_WORKER;
+        case 3:
+            return COMPONENT_TYPE_FOURTH_STAGE_WORKER;
+        default:
+            return COMPONENT_TYPE_FIFTH_STAGE_WORKER;
+    }
+}
+
+/// @return "first", "second"... as the managers and the configuration name the stages
+static inline const char* pipeline_stage_name(uint32_t stage) {
+    static const char* const names[PIPELINE_STAGES] = {"first", "second", "third", "fourth",
+                                                       "fifth"};
+    return stage < PIPELINE_STAGES ? names[stage] : "unknown";
+}
+
 static inline const char* component_type_to_string(ComponentType type) {
     switch (type) {
         case COMPONENT_TYPE_SERVER:
@@ -26,6 +75,10 @@ static inline const char* component_type_to_string(ComponentType type) {
             return "second stage worker";
         case COMPONENT_TYPE_THIRD_STAGE_WORKER:
             return "third stage worker";
+        case COMPONENT_TYPE_FOURTH_STAGE_WORKER:
+            return "fourth stage worker";
+        case COMPONENT_TYPE_FIFTH_STAGE_WORKER:
+            return "fifth stage worker";
         case COMPONENT_TYPE_LOGS_COLLECTOR:
             return "logs collector";
         case COMPONENT_TYPE_MANAGER:
@@ -35,8 +88,128 @@ static inline const char* component_type_to_string(ComponentType type) {
     }
 }
 
+typedef enum ServerCommandType {
+    /// Shuts down all the clients of the client_type.
+    SERVER_COMMAND_SHUTDOWN_CLIENTS,
+    /// Shuts down the client with the client_id.
+    SERVER_COMMAND_STOP_CLIENT,
+    /// Asks the workers of the client_type stage to finish the pins in flight
+    /// and stop taking new ones.
+    SERVER_COMMAND_DRAIN_STAGE,
+    /// Shuts down the workers of the client_type stage above the argument
+    /// count, replies the count left.
+    SERVER_COMMAND_RESIZE_STAGE,
+    /// Replies the argument-th client of the client_type as
+    /// server_command_client_value().
+    SERVER_COMMAND_GET_CLIENT,
+    /// Replies the ServerStat in the argument, of the client_type if it is
+    /// counted per type.
+    SERVER_COMMAND_QUERY_STAT,
+    /// Sets the ServerLogLevel in the argument.
+    SERVER_COMMAND_SET_LOG_LEVEL,
+    /// Sets the number of the pins the worker with the client_id processes
+    /// at once to the argument, its share of the pins of its stage follows it.
+    SERVER_COMMAND_SET_CONCURRENCY,
+    /// Same for all the workers of the client_type stage.
+    SERVER_COMMAND_SET_STAGE_CONCURRENCY,
+    /// Sets the ServerBalanceMode in the argument.
+    SERVER_COMMAND_SET_BALANCE_MODE,
+    /// Moves the multi-role worker process of the client_id to the stages in
+    /// the argument (mask of the stage ComponentTypes).
+    SERVER_COMMAND_SET_WORKER_ROLES,
+    /// Sets the pins a minute the entry stages may make to the argument, 0 for no limit.
+    SERVER_COMMAND_SET_ADMISSION_RATE,
+} ServerCommandType;
+
+static inline const char* server_command_type_to_string(ServerCommandType type) {
+    switch (type) {
+        case SERVER_COMMAND_SHUTDOWN_CLIENTS:
+            return "shutdown clients";
+        case SERVER_COMMAND_STOP_CLIENT:
+            return "stop client";
+        case SERVER_COMMAND_DRAIN_STAGE:
+            return "drain stage";
+        case SERVER_COMMAND_RESIZE_STAGE:
+            return "resize stage";
+        case SERVER_COMMAND_GET_CLIENT:
+            return "get client";
+        case SERVER_COMMAND_QUERY_STAT:
+            return "query stat";
+        case SERVER_COMMAND_SET_LOG_LEVEL:
+            return "set log level";
+        case SERVER_COMMAND_SET_CONCURRENCY:
+            return "set concurrency";
+        case SERVER_COMMAND_SET_STAGE_CONCURRENCY:
+            return "set stage concurrency";
+        case SERVER_COMMAND_SET_BALANCE_MODE:
+            return "set balance mode";
+        case SERVER_COMMAND_SET_WORKER_ROLES:
+            return "set worker roles";
+        case SERVER_COMMAND_SET_ADMISSION_RATE:
+            return "set admission rate";
+        default:
+            return "unknown command";
+    }
+}
+
+typedef enum ServerStat {
+    /// Registered clients of the type.
+    SERVER_STAT_CLIENTS,
+    /// Pins the server forwarded to the workers of the type.
+    SERVER_STAT_PINS_ROUTED,
+    /// Pins forwarded to the stages that route them on and did not come back yet.
+    SERVER_STAT_OUTSTANDING_PINS,
+    /// Clients removed by the failure detector.
+    SERVER_STAT_PEERS_REMOVED,
+    /// Logs waiting for the logs collectors.
+    SERVER_STAT_LOGS_QUEUE_DEPTH,
+    /// Sum of the concurrency of the registered workers of the type.
+    SERVER_STAT_CONCURRENCY,
+    /// Pins per minute that reach the stage of the type, measured by the stage balance.
+    SERVER_STAT_ARRIVAL_RATE,
+    /// Mean time in milliseconds a worker of the stage spends on a pin.
+    SERVER_STAT_SERVICE_TIME,
+    /// Pins routed to the stage that its workers did not process yet.
+    SERVER_STAT_QUEUE_LENGTH,
+    /// ComponentType of the stage that limits the pipeline, 0 until it is measured.
+    SERVER_STAT_BOTTLENECK,
+    /// Pins waiting in the server queue of the stage of the type, see SERVER_QUEUE_POLICY_ENV.
+    SERVER_STAT_QUEUED_PINS,
+    /// Pins the server queue of the stage of the type shed or expired.
+    SERVER_STAT_PINS_SHED,
+    /// Pins a minute the entry stages may make, 0 for no limit.
+    SERVER_STAT_ADMISSION_RATE,
+    /// Pins of the entry stages the server dropped above their rate.
+    SERVER_STAT_PINS_NOT_ADMITTED,
+    SERVER_STATS_COUNT,
+} ServerStat;
+
+typedef enum ServerBalanceMode {
+    /// Nothing is logged, the stats still measure the stages.
+    SERVER_BALANCE_OFF,
+    /// The load of the stages and the bottleneck are logged.
+    SERVER_BALANCE_REPORT,
+    /// The server also logs which worker should move to the bottleneck stage.
+    SERVER_BALANCE_ADVISE,
+    /// The server also moves a multi-role worker process to the bottleneck stage.
+    SERVER_BALANCE_DIRECT,
+} ServerBalanceMode;
+
+typedef enum ServerLogLevel {
+    /// Errors only.
+    SERVER_LOG_ERRORS,
+    /// Clients, commands and drains, no pins.
+    SERVER_LOG_EVENTS,
+    /// Every pin as well.
+    SERVER_LOG_PINS,
+} ServerLogLevel;
+
 typedef struct ServerCommand {
+    ServerCommandType type;
     ComponentType client_type;
+    /// Index of the client in the server peer table, see SERVER_COMMAND_GET_CLIENT.
+    uint32_t client_id;
+    uint32_t argument;
 } ServerCommand;
 
 typedef enum ServerCommandResult {
@@ -61,13 +234,140 @@ static inline const char* server_command_result_to_string(ServerCommandResult re
     }
 }
 
+typedef struct ServerCommandReply {
+    ServerCommandResult result;
+    /// Answer of the queries, 0 for the other commands.
+    uint64_t value;
+} ServerCommandReply;
+
+/// @brief Value replied to SERVER_COMMAND_GET_CLIENT: the pid of the client
+/// (0 over TCP) in the high half and its client_id in the low one.
+static inline uint64_t server_command_client_value(uint32_t client_id, uint32_t pid) {
+    return (uint64_t)pid << 32 | client_id;
+}
+
+enum {
+    /// As many as fit into a datagram.
+    MANAGER_MAX_BATCH_COMMANDS = 30,
+    /// Manager gives up waiting for the results after that long. The server
+    /// handles the commands in turn with the pins, a message a second, so the
+    /// results may come several seconds later.
+    MANAGER_RESULTS_TIMEOUT_MS = 30000,
+};
+
+/// @brief Commands of one manager request, the server executes them in order.
+typedef struct ManagerCommandBatch {
+    /// Chosen by the manager, the results carry it back.
+    uint32_t request_id;
+    uint32_t count;
+    ServerCommand commands[MANAGER_MAX_BATCH_COMMANDS];
+} ManagerCommandBatch;
+
+/// @brief Reply to every command of the batch, in the order of the commands.
+/// The server sends it to the manager that sent the batch only.
+typedef struct ManagerCommandResults {
+    uint32_t request_id;
+    uint32_t count;
+    ServerCommandReply replies[MANAGER_MAX_BATCH_COMMANDS];
+} ManagerCommandResults;
+
+/// @brief Target of the shutdown signal.
+typedef struct ClientShutdown {
+    /// Only the client of this process stops, all the clients of the receiver type if 0.
+    uint32_t pid;
+} ClientShutdown;
+
+/// @brief Counts of the pins that passed a worker, sent by it once it drained
+/// or left its stage.
+typedef struct PipelineDrainReport {
+    uint32_t pins_received;
+    uint32_t pins_sent;
+    /// The worker left the stage: its pins count, but the drain does not wait for it.
+    bool has_left;
+} PipelineDrainReport;
+
+/// @brief Work the worker did since it started, the counters wrap around.
+typedef struct WorkerLoad {
+    uint32_t pins_processed;
+    /// Sum of the times the pins took, in milliseconds.
+    uint32_t service_time_ms;
+} WorkerLoad;
+
+/// @brief Identity of the client, sent in its registration and heartbeats:
+/// all the UDP clients of one host share the address of the server port.
+typedef struct ClientHeartbeat {
+    uint32_t pid;
+    uint32_t sequence;
+    /// Pins the worker processes at once, 0 for the other clients.
+    uint32_t concurrency;
+    WorkerLoad load;
+    /// Stages the multi-role worker process hosts, 0 if it can not change them.
+    uint32_t roles;
+} ClientHeartbeat;
+
+/// @brief New concurrency of the worker.
+typedef struct WorkerConcurrency {
+    /// Only the worker of this process takes it, all the workers of the receiver type if 0.
+    uint32_t pid;
+    uint32_t concurrency;
+} WorkerConcurrency;
+
+/// @brief New stages of the multi-role worker process.
+typedef struct WorkerRoles {
+    uint32_t pid;
+    /// Mask of the stage ComponentTypes.
+    uint32_t roles;
+} WorkerRoles;
+
+/// @brief Pins a minute the worker of an entry stage may make, its share of
+/// the admission rate of the server.
+typedef struct AdmissionRate {
+    uint32_t pid;
+    /// 0 for no limit.
+    uint32_t pins_per_minute;
+    /// Pins the worker may make at once above the rate.
+    uint32_t burst;
+} AdmissionRate;
+
+/// Pins the worker processes at once until the manager changes it.
+#define WORKER_CONCURRENCY_ENV "WORKER_CONCURRENCY"
+
+enum {
+    WORKER_CONCURRENCY     = 1,
+    WORKER_MAX_CONCURRENCY = 32,
+};
+
+/// Period of the client heartbeats in milliseconds, 0 disables them.
+#define CLIENT_HEARTBEAT_INTERVAL_MS_ENV "CLIENT_HEARTBEAT_INTERVAL_MS"
+
+enum { CLIENT_HEARTBEAT_INTERVAL_MS = 1000 };
+
 typedef enum MessageType {
     MESSAGE_TYPE_PIN_TRANSFERRING,
     MESSAGE_TYPE_NEW_CLIENT,
+    /// Carries a ManagerCommandBatch.
     MESSAGE_TYPE_MANAGER_COMMAND,
+    /// Carries the ManagerCommandResults of the batch.
     MESSAGE_TYPE_MANAGER_COMMAND_RESULT,
+    /// Carries a ClientShutdown.
     MESSAGE_TYPE_SHUTDOWN_MESSAGE,
     MESSAGE_TYPE_LOG,
+    /// Server asks the workers of a stage to finish the pins in flight and stop taking new ones.
+    MESSAGE_TYPE_DRAIN_REQUEST,
+    /// Worker tells the server that it drained, carries a PipelineDrainReport.
+    MESSAGE_TYPE_DRAIN_REPORT,
+    /// Client tells the server that it is alive, carries a ClientHeartbeat.
+    MESSAGE_TYPE_HEARTBEAT,
+    /// Server sets the concurrency of the workers, carries a WorkerConcurrency.
+    MESSAGE_TYPE_WORKER_CONCURRENCY,
+    /// Server moves a multi-role worker process to other stages, carries WorkerRoles.
+    MESSAGE_TYPE_WORKER_ROLES,
+    /// Worker asks the server to take it out of the routing, carries its ClientHeartbeat.
+    /// The server confirms it with the same message behind the pins it sent to the worker.
+    MESSAGE_TYPE_WORKER_LEAVE,
+    /// Server sets the pace of a worker of an entry stage, carries an AdmissionRate.
+    MESSAGE_TYPE_ADMISSION_RATE,
+    MESSAGE_TYPES_COUNT,
 } MessageType;
 
 static inline const char* message_type_to_string(MessageType type) {
@@ -84,6 +384,20 @@ static inline const char* message_type_to_string(MessageType type) {
             return "manager command";
         case MESSAGE_TYPE_MANAGER_COMMAND_RESULT:
             return "manager command result";
+        case MESSAGE_TYPE_DRAIN_REQUEST:
+            return "drain request";
+        case MESSAGE_TYPE_DRAIN_REPORT:
+            return "drain report";
+        case MESSAGE_TYPE_HEARTBEAT:
+            return "heartbeat";
+        case MESSAGE_TYPE_WORKER_CONCURRENCY:
+            return "worker concurrency";
+        case MESSAGE_TYPE_WORKER_ROLES:
+            return "worker roles";
+        case MESSAGE_TYPE_WORKER_LEAVE:
+            return "worker leave";
+        case MESSAGE_TYPE_ADMISSION_RATE:
+            return "admission rate";
         default:
             return "unknown message";
     }
@@ -101,8 +415,14 @@ typedef struct UDPMessage {
     MessageType message_type;
     union {
         Pin pin;
-        ServerCommand command;
-        ServerCommandResult command_result;
+        ManagerCommandBatch command_batch;
+        ManagerCommandResults command_results;
+        ClientShutdown shutdown;
+        PipelineDrainReport drain_report;
+        ClientHeartbeat heartbeat;
+        WorkerConcurrency concurrency;
+        WorkerRoles roles;
+        AdmissionRate admission;
         char bytes[UDP_MESSAGE_BUFFER_SIZE];
     } message_content;
 } UDPMessage;
@@ -0,0 +1,81 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "net-config.h"
+#include "pin-journal.h"
+
+/// @brief The journals of the workers and of the server keep fewer pins in flight.
+enum { JOURNAL_TOOL_MAX_LIVE_PINS = 1u << 16 };
+
+typedef struct JournalSummary {
+    uint64_t records[PIPELINE_STAGES][PIN_JOURNAL_REJECTED + 1];
+    PinJournalLive live;
+    bool has_lost_live;
+} JournalSummary;
+
+static void summarize_record(const PinJournalRecord* record, void* context) {
+    JournalSummary* summary = context;
+    summary->records[record->stage][record->kind]++;
+    if (!pin_journal_track(&summary->live, record)) {
+        summary->has_lost_live = true;
+    }
+}
+
+static void print_usage(const char* program_path) {
+    fprintf(stderr,
+            "Usage: %s <journal>\n"
+            "Prints the records of the pin journal of a worker or of the server (see %s)\n"
+            "by stage and the pins in flight, that the process replays once it runs again\n"
+            "Example: %s /var/lib/pins/first-worker.journal\n",
+            program_path, PIN_JOURNAL_ENV, program_path);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    JournalSummary summary = {0};
+    if (!init_pin_journal_live(&summary.live, JOURNAL_TOOL_MAX_LIVE_PINS)) {
+        perror("pin journal");
+        return EXIT_FAILURE;
+    }
+    uint64_t valid_size = 0;
+    if (!read_pin_journal(argv[1], &summarize_record, &summary, &valid_size)) {
+        deinit_pin_journal_live(&summary.live);
+        return EXIT_FAILURE;
+    }
+    struct stat file_stat;
+    const uint64_t size = stat(argv[1], &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0;
+    printf("%s: %llu record(s)", argv[1],
+           (unsigned long long)(valid_size / sizeof(PinJournalRecord)));
+    if (size > valid_size) {
+        printf(", %llu torn byte(s) at the end", (unsigned long long)(size - valid_size));
+    }
+    printf("\n");
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        const uint64_t* records = summary.records[stage];
+        if (records[PIN_JOURNAL_STARTED] != 0) {
+            printf("%-6s stage: %llu started, %llu passed, %llu rejected\n",
+                   pipeline_stage_name(stage), (unsigned long long)records[PIN_JOURNAL_STARTED],
+                   (unsigned long long)records[PIN_JOURNAL_PASSED],
+                   (unsigned long long)records[PIN_JOURNAL_REJECTED]);
+        }
+    }
+    printf("%u pin(s) in flight%s\n", summary.live.count, summary.live.count != 0 ? ":" : "");
+    for (uint32_t i = 0; i < summary.live.count; i++) {
+        const PinJournalRecord* record = &summary.live.records[i];
+        printf("  pin[pin_id=%d] at the %s stage, priority %u, deadline %u ms\n", record->pin_id,
+               pipeline_stage_name(record->stage), (uint32_t)record->priority,
+               record->deadline_ms);
+    }
+    if (summary.has_lost_live) {
+        printf("More than %u pins in flight, the rest is not shown\n",
+               (uint32_t)JOURNAL_TOOL_MAX_LIVE_PINS);
+    }
+    deinit_pin_journal_live(&summary.live);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,549 @@
+#include "pin-journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/clock.h"
+#include "../util/config.h"
+#include "../util/metrics.h"
+#include "../util/parser.h"
+
+enum { PIN_JOURNAL_READ_BATCH = 256 };
+
+static struct {
+    MetricId records;
+    MetricId commits;
+    MetricId commit_time;
+} journal_metrics;
+
+static uint32_t record_checksum(const PinJournalRecord* record) {
+    const uint8_t* bytes = (const uint8_t*)record + sizeof(record->checksum);
+    uint32_t hash        = 2166136261u;
+    for (size_t i = 0; i < sizeof(*record) - sizeof(record->checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool is_valid_record(const PinJournalRecord* record) {
+    return record->kind >= PIN_JOURNAL_STARTED && record->kind <= PIN_JOURNAL_REJECTED &&
+           record->stage < PIPELINE_STAGES && record->checksum == record_checksum(record);
+}
+
+static PinJournalRecord make_record(PinJournalRecordKind kind, uint32_t stage, const Pin* pin) {
+    PinJournalRecord record = {
+        .pin_id      = pin->pin_id,
+        .deadline_ms = pin->deadline_ms,
+        .kind        = (uint8_t)kind,
+        .stage       = (uint8_t)stage,
+        .priority    = (uint8_t)pin->priority,
+    };
+    record.checksum = record_checksum(&record);
+    return record;
+}
+
+Pin pin_journal_record_pin(const PinJournalRecord* record) {
+    return (Pin){
+        .pin_id      = record->pin_id,
+        .priority    = record->priority,
+        .deadline_ms = record->deadline_ms,
+    };
+}
+
+const char* pin_journal_record_kind_to_string(PinJournalRecordKind kind) {
+    switch (kind) {
+        case PIN_JOURNAL_STARTED:
+            return "started";
+        case PIN_JOURNAL_PASSED:
+            return "passed";
+        case PIN_JOURNAL_REJECTED:
+            return "rejected";
+        default:
+            return "unknown";
+    }
+}
+
+static uint32_t live_bucket(const PinJournalLive* live, int32_t pin_id, uint32_t stage) {
+    const uint64_t key = ((uint64_t)(uint32_t)pin_id << 8) | stage;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (live->buckets_count - 1);
+}
+
+bool init_pin_journal_live(PinJournalLive* live, uint32_t capacity) {
+    uint32_t buckets_count = 1;
+    while (buckets_count < 2 * capacity) {
+        buckets_count *= 2;
+    }
+    live->records = malloc(capacity * sizeof(*live->records));
+    live->buckets = calloc(buckets_count, sizeof(*live->buckets));
+    if (live->records == NULL || live->buckets == NULL) {
+        deinit_pin_journal_live(live);
+        return false;
+    }
+    live->count         = 0;
+    live->capacity      = capacity;
+    live->buckets_count = buckets_count;
+    return true;
+}
+
+void deinit_pin_journal_live(PinJournalLive* live) {
+    free(live->records);
+    free(live->buckets);
+    live->records = NULL;
+    live->buckets = NULL;
+}
+
+void clear_pin_journal_live(PinJournalLive* live) {
+    memset(live->buckets, 0, live->buckets_count * sizeof(*live->buckets));
+    live->count = 0;
+}
+
+/// @return bucket of the record of the pin, the empty bucket its probe ends at if there is none
+static uint32_t find_live_bucket(const PinJournalLive* live, int32_t pin_id, uint32_t stage) {
+    const uint32_t mask = live->buckets_count - 1;
+    uint32_t bucket     = live_bucket(live, pin_id, stage);
+    while (live->buckets[bucket] != 0) {
+        const PinJournalRecord* record = &live->records[live->buckets[bucket] - 1];
+        if (record->pin_id == pin_id && record->stage == stage) {
+            return bucket;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+/// @brief Empties the @a bucket and shifts back the records probed past it,
+/// so that no probe sequence has a hole.
+static void empty_live_bucket(PinJournalLive* live, uint32_t bucket) {
+    const uint32_t mask = live->buckets_count - 1;
+    uint32_t next       = (bucket + 1) & mask;
+    while (live->buckets[next] != 0) {
+        const PinJournalRecord* record = &live->records[live->buckets[next] - 1];
+        const uint32_t home            = live_bucket(live, record->pin_id, record->stage);
+        // the record moves back unless its home lies cyclically in (bucket, next]
+        if (((next - home) & mask) >= ((next - bucket) & mask)) {
+            live->buckets[bucket] = live->buckets[next];
+            bucket                = next;
+        }
+        next = (next + 1) & mask;
+    }
+    live->buckets[bucket] = 0;
+}
+
+bool pin_journal_track(PinJournalLive* live, const PinJournalRecord* record) {
+    const uint32_t bucket = find_live_bucket(live, record->pin_id, record->stage);
+    if (live->buckets[bucket] != 0) {
+        // a replayed pin starts its step again
+        if (record->kind != PIN_JOURNAL_STARTED) {
+            const uint32_t index = live->buckets[bucket] - 1;
+            empty_live_bucket(live, bucket);
+            live->count--;
+            // the last record fills the hole
+            if (index != live->count) {
+                const PinJournalRecord* last = &live->records[live->count];
+                live->buckets[find_live_bucket(live, last->pin_id, last->stage)] = index + 1;
+                live->records[index] = *last;
+            }
+        }
+        return true;
+    }
+    if (record->kind != PIN_JOURNAL_STARTED) {
+        return true;
+    }
+    if (live->count == live->capacity) {
+        return false;
+    }
+    live->records[live->count] = *record;
+    live->buckets[bucket]      = ++live->count;
+    return true;
+}
+
+/// @brief Doubles the capacity of the @a live records.
+static bool grow_pin_journal_live(PinJournalLive* live) {
+    PinJournalLive grown;
+    if (!init_pin_journal_live(&grown, 2 * live->capacity)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < live->count; i++) {
+        pin_journal_track(&grown, &live->records[i]);
+    }
+    deinit_pin_journal_live(live);
+    *live = grown;
+    return true;
+}
+
+typedef struct LiveTracking {
+    PinJournalLive* live;
+    bool has_failed;
+} LiveTracking;
+
+/// @brief The records grow as needed: a pin that finishes later in the file
+/// takes room only meanwhile.
+static void track_read_record(const PinJournalRecord* record, void* context) {
+    LiveTracking* tracking = context;
+    while (!tracking->has_failed && !pin_journal_track(tracking->live, record)) {
+        tracking->has_failed = !grow_pin_journal_live(tracking->live);
+    }
+}
+
+bool read_pin_journal(const char* path,
+                      void (*handle_record)(const PinJournalRecord* record, void* context),
+                      void* context, uint64_t* valid_size) {
+    *valid_size = 0;
+    FILE* file  = fopen(path, "rb");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        app_perror(path);
+        return false;
+    }
+    PinJournalRecord records[PIN_JOURNAL_READ_BATCH];
+    bool is_torn = false;
+    size_t count = 0;
+    while (!is_torn && (count = fread(records, sizeof(records[0]), PIN_JOURNAL_READ_BATCH,
+                                      file)) != 0) {
+        for (size_t i = 0; i < count && !is_torn; i++) {
+            is_torn = !is_valid_record(&records[i]);
+            if (!is_torn) {
+                handle_record(&records[i], context);
+                *valid_size += sizeof(records[i]);
+            }
+        }
+    }
+    const bool ok = !ferror(file);
+    if (!ok) {
+        app_perror(path);
+    }
+    fclose(file);
+    return ok;
+}
+
+static bool write_records(int fd, const PinJournalRecord* records, uint32_t count) {
+    const char* buffer = (const char*)records;
+    size_t left        = count * sizeof(*records);
+    while (left != 0) {
+        const ssize_t written = write(fd, buffer, left);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += written;
+        left -= (size_t)written;
+    }
+    return true;
+}
+
+/// @brief The rename is durable once the directory is synced.
+static bool sync_parent_directory(const char* path) {
+    char directory[PIN_JOURNAL_MAX_PATH_SIZE];
+    strcpy(directory, path);
+    const int fd = open(dirname(directory), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/// @brief Replaces the file of the journal by one with the @a records only.
+/// Called by the writer, or before it starts.
+static bool rewrite_pin_journal(PinJournal* journal, const PinJournalRecord* records,
+                                uint32_t count) {
+    char new_path[PIN_JOURNAL_MAX_PATH_SIZE + 8];
+    snprintf(new_path, sizeof(new_path), "%s.new", journal->path);
+    const int fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        app_perror(new_path);
+        return false;
+    }
+    if (!write_records(fd, records, count) || (journal->is_synced && fdatasync(fd) == -1) ||
+        rename(new_path, journal->path) == -1 ||
+        (journal->is_synced && !sync_parent_directory(journal->path))) {
+        app_perror(new_path);
+        close(fd);
+        unlink(new_path);
+        return false;
+    }
+    if (journal->fd != -1) {
+        close(journal->fd);
+    }
+    journal->fd              = fd;
+    journal->size            = count * sizeof(*records);
+    journal->compaction_size = journal->max_size;
+    return true;
+}
+
+/// @brief Keeps the file of the journal without its torn end. Called before the writer starts.
+static bool reopen_pin_journal(PinJournal* journal, uint64_t valid_size) {
+    const int fd = open(journal->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, (off_t)valid_size) == -1) {
+        app_perror(journal->path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    journal->fd   = fd;
+    journal->size = valid_size;
+    return true;
+}
+
+static bool commit_records(PinJournal* journal, const PinJournalRecord* records, uint32_t count) {
+    if (!write_records(journal->fd, records, count) ||
+        (journal->is_synced && fdatasync(journal->fd) == -1)) {
+        app_perror(journal->path);
+        return false;
+    }
+    journal->size += count * sizeof(*records);
+    return true;
+}
+
+/// @brief Reads the pins in flight from the file into reread. Called before
+/// the writer starts or by it, once the records of the last batch are committed.
+/// @return false if the file could not be read or there was no memory
+static bool reread_live_pins(PinJournal* journal, uint64_t* valid_size) {
+    clear_pin_journal_live(&journal->reread);
+    LiveTracking tracking = {.live = &journal->reread};
+    if (!read_pin_journal(journal->path, &track_read_record, &tracking, valid_size)) {
+        return false;
+    }
+    if (tracking.has_failed) {
+        app_perror("pin journal");
+    }
+    return !tracking.has_failed;
+}
+
+/// @brief The reread pins replace the live ones.
+/// @return false if they do not fit, the live ones are the first of them then
+static bool adopt_reread_live_pins(PinJournal* journal) {
+    clear_pin_journal_live(&journal->live);
+    for (uint32_t i = 0; i < journal->reread.count; i++) {
+        if (!pin_journal_track(&journal->live, &journal->reread.records[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief The pins read from the file by the writer replace the live ones, the
+/// records appended meanwhile are tracked as well. The journal mutex must be held.
+static void finish_live_pins_reread(PinJournal* journal, bool is_reread) {
+    LiveTracking tracking = {.live = &journal->reread, .has_failed = !is_reread};
+    for (uint32_t i = 0; i < journal->pending_count; i++) {
+        track_read_record(&journal->pending[i], &tracking);
+    }
+    if (!tracking.has_failed && journal->reread.count <= journal->live.capacity) {
+        adopt_reread_live_pins(journal);
+        journal->has_lost_live = false;
+        return;
+    }
+    journal->compaction_size = journal->size + journal->max_size;
+    fprintf(stderr,
+            "%s: more than %u pins in flight, the journal is not compacted until it "
+            "grows by %llu byte(s)\n",
+            journal->path, journal->live.capacity, (unsigned long long)journal->max_size);
+}
+
+/// @brief Commits all the records appended meanwhile at once, once the file
+/// is too big the pins in flight replace it.
+static void* run_pin_journal_writer(void* arg) {
+    PinJournal* journal = arg;
+    pthread_mutex_lock(&journal->mutex);
+    while (!journal->has_failed) {
+        while (journal->pending_count == 0 && !journal->should_close) {
+            pthread_cond_wait(&journal->appended, &journal->mutex);
+        }
+        if (journal->pending_count == 0) {
+            break;
+        }
+        PinJournalRecord* records  = journal->pending;
+        const uint32_t count       = journal->pending_count;
+        const uint64_t last_record = journal->appended_records;
+        journal->pending           = journal->writing;
+        journal->writing           = records;
+        journal->pending_count     = 0;
+        // the pins in flight take the records of the batch into account already
+        const bool is_oversized   = journal->size >= journal->compaction_size;
+        const bool is_rewritten   = is_oversized && !journal->has_lost_live;
+        const bool is_reread      = is_oversized && journal->has_lost_live;
+        const uint32_t live_count = is_rewritten ? journal->live.count : 0;
+        memcpy(journal->rewritten, journal->live.records,
+               live_count * sizeof(journal->rewritten[0]));
+        pthread_mutex_unlock(&journal->mutex);
+
+        const uint64_t started_ns = monotonic_time_ns();
+        bool ok                   = false;
+        if (is_rewritten) {
+            ok = rewrite_pin_journal(journal, journal->rewritten, live_count);
+        } else {
+            ok = commit_records(journal, records, count);
+        }
+        metrics_histogram_record(journal_metrics.commit_time, monotonic_time_ns() - started_ns);
+        metrics_counter_inc(journal_metrics.commits);
+        metrics_counter_add(journal_metrics.records, count);
+        // the next batch rewrites the file with them
+        uint64_t valid_size   = 0;
+        const bool has_reread = ok && is_reread && reread_live_pins(journal, &valid_size);
+
+        pthread_mutex_lock(&journal->mutex);
+        if (ok && is_reread) {
+            finish_live_pins_reread(journal, has_reread);
+        }
+        journal->has_failed        = !ok;
+        journal->committed_records = last_record;
+        pthread_cond_broadcast(&journal->committed);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return NULL;
+}
+
+static void free_pin_journal_memory(PinJournal* journal) {
+    deinit_pin_journal_live(&journal->live);
+    deinit_pin_journal_live(&journal->reread);
+    free(journal->rewritten);
+    free(journal->buffers);
+}
+
+bool open_pin_journal(PinJournal* journal, uint32_t max_live_pins, bool* is_enabled) {
+    const char* path = getenv(PIN_JOURNAL_ENV);
+    *is_enabled      = path != NULL && *path != '\0';
+    if (!*is_enabled) {
+        return true;
+    }
+    if (strlen(path) >= PIN_JOURNAL_MAX_PATH_SIZE) {
+        fprintf(stderr, "%s: too long path of the pin journal\n", path);
+        return false;
+    }
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    strcpy(journal->path, path);
+    journal->is_synced = parse_env_uint32(PIN_JOURNAL_SYNC_ENV, 1) != 0;
+    uint32_t max_size_mb =
+        parse_env_uint32(PIN_JOURNAL_MAX_SIZE_MB_ENV, PIN_JOURNAL_MAX_SIZE_MB);
+    journal->max_size        = (uint64_t)(max_size_mb != 0 ? max_size_mb : 1) << 20;
+    journal->compaction_size = journal->max_size;
+    journal->buffers         = malloc(2 * PIN_JOURNAL_BATCH * sizeof(*journal->buffers));
+    journal->rewritten       = malloc(max_live_pins * sizeof(*journal->rewritten));
+    if (journal->buffers == NULL || journal->rewritten == NULL ||
+        !init_pin_journal_live(&journal->live, max_live_pins) ||
+        !init_pin_journal_live(&journal->reread, max_live_pins)) {
+        app_perror("pin journal");
+        free_pin_journal_memory(journal);
+        return false;
+    }
+
+    uint64_t valid_size = 0;
+    if (!reread_live_pins(journal, &valid_size)) {
+        free_pin_journal_memory(journal);
+        return false;
+    }
+    bool ok = false;
+    if (!adopt_reread_live_pins(journal)) {
+        // the rest of the pins is recovered by a later run
+        fprintf(stderr, "%s: more than %u pins in flight, the rest stays in the journal\n",
+                path, max_live_pins);
+        journal->has_lost_live = true;
+        ok                     = reopen_pin_journal(journal, valid_size);
+    } else {
+        // the pins in flight start the new file, the torn end of the old one is dropped with it
+        ok = rewrite_pin_journal(journal, journal->live.records, journal->live.count);
+    }
+    if (!ok) {
+        free_pin_journal_memory(journal);
+        return false;
+    }
+    journal->pending = journal->buffers;
+    journal->writing = journal->buffers + PIN_JOURNAL_BATCH;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->appended, NULL);
+    pthread_cond_init(&journal->committed, NULL);
+    journal_metrics.records     = metrics_register_counter("journal records");
+    journal_metrics.commits     = metrics_register_counter("journal commits");
+    journal_metrics.commit_time = metrics_register_histogram("journal commit time");
+    const int ret = pthread_create(&journal->writer, NULL, &run_pin_journal_writer, journal);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_create");
+        pthread_cond_destroy(&journal->committed);
+        pthread_cond_destroy(&journal->appended);
+        pthread_mutex_destroy(&journal->mutex);
+        free_pin_journal_memory(journal);
+        close(journal->fd);
+        return false;
+    }
+    printf("Pin journal %s%s: %u pin(s) in flight recovered from %llu byte(s)\n", path,
+           journal->is_synced ? "" : " (not synced)", journal->live.count,
+           (unsigned long long)valid_size);
+    return true;
+}
+
+void close_pin_journal(PinJournal* journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->should_close = true;
+    pthread_cond_signal(&journal->appended);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->writer, NULL);
+    if (journal->has_failed) {
+        fprintf(stderr, "%s: the pin journal failed, the last pins are not in it\n",
+                journal->path);
+    }
+    pthread_cond_destroy(&journal->committed);
+    pthread_cond_destroy(&journal->appended);
+    pthread_mutex_destroy(&journal->mutex);
+    free_pin_journal_memory(journal);
+    close(journal->fd);
+}
+
+uint64_t pin_journal_append(PinJournal* journal, PinJournalRecordKind kind, uint32_t stage,
+                            const Pin* pin) {
+    const PinJournalRecord record = make_record(kind, stage, pin);
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->pending_count == PIN_JOURNAL_BATCH && !journal->has_failed) {
+        pthread_cond_wait(&journal->committed, &journal->mutex);
+    }
+    if (!journal->has_failed) {
+        journal->pending[journal->pending_count++] = record;
+        journal->appended_records++;
+        if (!pin_journal_track(&journal->live, &record)) {
+            journal->has_lost_live = true;
+        }
+        pthread_cond_signal(&journal->appended);
+    }
+    const uint64_t number = journal->appended_records;
+    pthread_mutex_unlock(&journal->mutex);
+    return number;
+}
+
+bool pin_journal_wait(PinJournal* journal, uint64_t number) {
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->committed_records < number && !journal->has_failed) {
+        pthread_cond_wait(&journal->committed, &journal->mutex);
+    }
+    const bool ok = !journal->has_failed;
+    pthread_mutex_unlock(&journal->mutex);
+    return ok;
+}
+
+uint32_t pin_journal_live_pins(PinJournal* journal, uint32_t stage, Pin* pins,
+                               uint32_t max_pins) {
+    uint32_t count = 0;
+    pthread_mutex_lock(&journal->mutex);
+    for (uint32_t i = 0; i < journal->live.count && count < max_pins; i++) {
+        if (journal->live.records[i].stage == stage) {
+            pins[count++] = pin_journal_record_pin(&journal->live.records[i]);
+        }
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return count;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net-config.h"
+#include "pin.h"
+
+/// Path of the journal of the pins of the process, no journal if it is not
+/// set: the pins a worker works on, the pins waiting in the queues of the
+/// server. Every process needs its own file, a restarted one recovers its pins from it.
+#define PIN_JOURNAL_ENV "PIN_JOURNAL"
+/// 1 (default) to fdatasync every commit, 0 to only write it: the pins then
+/// survive a crash of the process but not of the host.
+#define PIN_JOURNAL_SYNC_ENV "PIN_JOURNAL_SYNC"
+/// Size in MiB above which the journal is rewritten with the pins in flight only.
+#define PIN_JOURNAL_MAX_SIZE_MB_ENV "PIN_JOURNAL_MAX_SIZE_MB"
+
+/// @brief Write-ahead journal of the pins a worker process works on.
+///
+/// The server journals the pins of its stage queues the same way: the push is
+/// the start of the step, the release to a worker passes it, the drop rejects it.
+///
+/// A stage journals a pin when it starts its step (for an entry stage it is
+/// the creation of the pin) and once the pin passed the step, and was sent
+/// on, or was rejected. A pin that started a step and did not finish it was in
+/// flight when the process crashed, the restarted process replays it.
+///
+/// The processing threads append the records to a buffer and the writer
+/// thread commits all of them at once: one write and one fdatasync for all
+/// the pins that came meanwhile (group commit). A pin starts its step only
+/// once its record is committed, the records of the finished pins are not
+/// waited for: a pin is replayed twice rather than lost.
+///
+/// The records are PinJournalRecord, the file holds nothing else. Once it
+/// grows above the maximum size it is replaced by a file with the records of
+/// the pins in flight only. If more pins were in flight than the journal
+/// keeps, the pins in flight are read from the file again first.
+enum {
+    PIN_JOURNAL_MAX_SIZE_MB = 64,
+    /// Records the processing threads append while the writer commits the previous ones.
+    PIN_JOURNAL_BATCH = 1024,
+    /// Every stage of a worker has at most that many pins in flight, the
+    /// recovered ones are kept as well.
+    PIN_JOURNAL_MAX_LIVE_PINS = 2 * PIPELINE_STAGES * WORKER_MAX_CONCURRENCY,
+    PIN_JOURNAL_MAX_PATH_SIZE = 256,
+};
+
+typedef enum PinJournalRecordKind {
+    /// The stage started its step on the pin.
+    PIN_JOURNAL_STARTED = 1,
+    /// The pin passed the step and was sent to the next stages, if there are any.
+    PIN_JOURNAL_PASSED,
+    PIN_JOURNAL_REJECTED,
+} PinJournalRecordKind;
+
+/// @brief 16 bytes, the traces of the pins are not kept.
+typedef struct PinJournalRecord {
+    /// FNV-1a of the rest of the record, a record torn by the crash does not match it.
+    uint32_t checksum;
+    int32_t pin_id;
+    uint32_t deadline_ms;
+    uint8_t kind;
+    uint8_t stage;
+    uint8_t priority;
+    uint8_t reserved;
+} PinJournalRecord;
+
+/// @brief Started records of the pins in flight. A record is found by an
+/// open addressing hash map (linear probing, backward shift deletion, at most
+/// half full) keyed by the pin id and the stage.
+typedef struct PinJournalLive {
+    PinJournalRecord* records;
+    uint32_t count;
+    uint32_t capacity;
+    /// Index of the record plus 1, 0 marks an empty bucket.
+    uint32_t* buckets;
+    /// Power of 2.
+    uint32_t buckets_count;
+} PinJournalLive;
+
+typedef struct PinJournal {
+    int fd;
+    char path[PIN_JOURNAL_MAX_PATH_SIZE];
+    bool is_synced;
+    uint64_t max_size;
+    uint64_t size;
+    /// The file is rewritten once it grows above it.
+    uint64_t compaction_size;
+    pthread_t writer;
+    /// Guards everything below.
+    pthread_mutex_t mutex;
+    /// Signaled when a record is appended and on the close.
+    pthread_cond_t appended;
+    /// Signaled when the records are committed and on a failure.
+    pthread_cond_t committed;
+    /// Both halves of the buffers below.
+    PinJournalRecord* buffers;
+    /// The appended records, swapped with the committed ones by the writer.
+    PinJournalRecord* pending;
+    PinJournalRecord* writing;
+    uint32_t pending_count;
+    uint64_t appended_records;
+    uint64_t committed_records;
+    PinJournalLive live;
+    /// A pin did not fit into live, the file is rewritten only once the pins
+    /// in flight read from it fit.
+    bool has_lost_live;
+    /// Used by the writer only: the pins in flight read from the file and the
+    /// copy of the live records the file is rewritten with.
+    PinJournalLive reread;
+    PinJournalRecord* rewritten;
+    bool should_close;
+    bool has_failed;
+} PinJournal;
+
+/// @brief Opens the journal in PIN_JOURNAL_ENV and recovers the pins that
+/// were in flight in it, see pin_journal_live_pins(). @a is_enabled is false
+/// if the journal is not set.
+/// @param max_live_pins pins in flight the journal keeps, the ones above it
+/// stay in the file for a later run
+/// @return false if it could not be opened, the error is printed
+bool open_pin_journal(PinJournal* journal, uint32_t max_live_pins, bool* is_enabled);
+/// @brief Commits the records appended so far and stops the writer.
+void close_pin_journal(PinJournal* journal);
+/// @brief Appends the record of the @a pin at the @a stage, it is committed soon.
+/// @return number of the record to wait for with pin_journal_wait()
+uint64_t pin_journal_append(PinJournal* journal, PinJournalRecordKind kind, uint32_t stage,
+                            const Pin* pin);
+/// @brief Waits until the record @a number and the ones before it are committed.
+/// @return false if the journal failed
+bool pin_journal_wait(PinJournal* journal, uint64_t number);
+/// @brief Copies the pins in flight of the @a stage. Right after the open they
+/// are the ones the journal recovered, they stay in it until their stage finishes them.
+/// @return number of the pins, at most @a max_pins
+uint32_t pin_journal_live_pins(PinJournal* journal, uint32_t stage, Pin* pins,
+                               uint32_t max_pins);
+
+/// @brief Reads the records of the journal file up to the first torn one, a
+/// missing file has none.
+/// @param handle_record called for every valid record
+/// @param valid_size size of the valid records
+/// @return false if the file could not be read, the error is printed
+bool read_pin_journal(const char* path,
+                      void (*handle_record)(const PinJournalRecord* record, void* context),
+                      void* context, uint64_t* valid_size);
+/// @return false if there is no memory for @a capacity records
+bool init_pin_journal_live(PinJournalLive* live, uint32_t capacity);
+void deinit_pin_journal_live(PinJournalLive* live);
+void clear_pin_journal_live(PinJournalLive* live);
+/// @brief Keeps the started records of the pins in flight in @a live: a
+/// started record is added once, the finished pins are removed.
+/// @return false if there was no room for the pin
+bool pin_journal_track(PinJournalLive* live, const PinJournalRecord* record);
+/// @return the pin the @a record was made of, without its trace
+Pin pin_journal_record_pin(const PinJournalRecord* record);
+const char* pin_journal_record_kind_to_string(PinJournalRecordKind kind);
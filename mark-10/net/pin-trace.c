@@ -0,0 +1,143 @@
+#include "pin-trace.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../util/histogram.h"
+#include "pin.h"
+
+static const char* const pin_trace_stage_names[PIN_TRACE_STAGES] = {
+    "first", "second", "third", "fourth", "fifth",
+};
+
+void pin_trace_hop_name(uint32_t hop, char* buffer, size_t size) {
+    if (hop >= PIN_TRACE_HOPS_COUNT) {
+        snprintf(buffer, size, "unknown hop");
+        return;
+    }
+    if (hop == PIN_TRACE_HOP_END_TO_END) {
+        snprintf(buffer, size, "end to end");
+        return;
+    }
+    const uint32_t stage = hop / PIN_TRACE_STAGE_HOPS;
+    const char* name     = pin_trace_stage_names[stage];
+    switch ((PinTraceStageHop)(hop % PIN_TRACE_STAGE_HOPS)) {
+        case PIN_TRACE_HOP_FROM_SERVER:
+            snprintf(buffer, size, "server -> %s stage", name);
+            break;
+        case PIN_TRACE_HOP_STAGE:
+            snprintf(buffer, size, "%s stage", name);
+            break;
+        case PIN_TRACE_HOP_TO_SERVER:
+            snprintf(buffer, size, "%s stage -> server", name);
+            break;
+        case PIN_TRACE_HOP_SERVER_ROUTING:
+        default:
+            snprintf(buffer, size, "server routing (%u -> next)", stage + 1);
+            break;
+    }
+}
+
+/// @return false if the pin did not take the hop, one of its ends is not stamped, or the ends
+/// are stamped by the clocks of the different hosts that are not comparable
+static bool hop_duration(uint64_t from_ns, uint64_t to_ns, uint64_t* duration_ns) {
+    if (from_ns == 0 || to_ns == 0 || to_ns < from_ns) {
+        return false;
+    }
+    *duration_ns = to_ns - from_ns;
+    return true;
+}
+
+/// @brief The pin passes the stages in their order, but not necessarily all
+/// of them: it comes to a stage from the last one it passed before.
+static void fill_hop_durations(const PinTrace* trace, uint64_t durations[PIN_TRACE_HOPS_COUNT],
+                               bool has_hops[PIN_TRACE_HOPS_COUNT]) {
+    int32_t previous = -1;
+    for (uint32_t stage = 0; stage < PIN_TRACE_STAGES; stage++) {
+        const uint32_t from_hop    = pin_trace_hop(stage, PIN_TRACE_HOP_FROM_SERVER);
+        const uint32_t stage_hop   = pin_trace_hop(stage, PIN_TRACE_HOP_STAGE);
+        const uint32_t to_hop      = pin_trace_hop(stage, PIN_TRACE_HOP_TO_SERVER);
+        const uint32_t routing_hop = pin_trace_hop(stage, PIN_TRACE_HOP_SERVER_ROUTING);
+        // a stage sends its pins to the later ones only, the hops are indexed by the sender
+        has_hops[from_hop] = previous >= 0 && hop_duration(trace->server_forwarded_ns[previous],
+                                                           trace->stage_started_ns[stage],
+                                                           &durations[from_hop]);
+        has_hops[stage_hop] = hop_duration(trace->stage_started_ns[stage],
+                                           trace->stage_finished_ns[stage], &durations[stage_hop]);
+        const bool sends_pins = stage < PIN_TRACE_SERVER_HOPS;
+        has_hops[to_hop]      = sends_pins && hop_duration(trace->stage_finished_ns[stage],
+                                                           trace->server_received_ns[stage],
+                                                           &durations[to_hop]);
+        has_hops[routing_hop] = sends_pins && hop_duration(trace->server_received_ns[stage],
+                                                           trace->server_forwarded_ns[stage],
+                                                           &durations[routing_hop]);
+        if (trace->stage_finished_ns[stage] != 0) {
+            previous = (int32_t)stage;
+        }
+    }
+    has_hops[PIN_TRACE_HOP_END_TO_END] =
+        previous >= 0 && hop_duration(trace->created_ns, trace->stage_finished_ns[previous],
+                                      &durations[PIN_TRACE_HOP_END_TO_END]);
+}
+
+void init_pin_trace_stats(PinTraceStats* stats) {
+    for (size_t i = 0; i < PIN_TRACE_HOPS_COUNT; i++) {
+        histogram_reset(&stats->hops[i]);
+    }
+}
+
+void pin_trace_stats_record(PinTraceStats* stats, const Pin* pin) {
+    if (!pin_is_traced(pin)) {
+        return;
+    }
+    uint64_t durations[PIN_TRACE_HOPS_COUNT];
+    bool has_hops[PIN_TRACE_HOPS_COUNT];
+    fill_hop_durations(&pin->trace, durations, has_hops);
+    for (size_t i = 0; i < PIN_TRACE_HOPS_COUNT; i++) {
+        if (has_hops[i]) {
+            histogram_record(&stats->hops[i], durations[i]);
+        }
+    }
+}
+
+void print_pin_trace_record(const Pin* pin) {
+    uint64_t durations[PIN_TRACE_HOPS_COUNT];
+    bool has_hops[PIN_TRACE_HOPS_COUNT];
+    fill_hop_durations(&pin->trace, durations, has_hops);
+    printf(
+        "+------------------------------------------------------------\n"
+        "| Trace of the pin[pin_id=%d] (microseconds):\n",
+        pin->pin_id);
+    char name[32];
+    for (uint32_t i = 0; i < PIN_TRACE_HOPS_COUNT; i++) {
+        if (has_hops[i]) {
+            pin_trace_hop_name(i, name, sizeof(name));
+            printf("| %-26s %12" PRIu64 "\n", name, durations[i] / 1000);
+        }
+    }
+    printf("+------------------------------------------------------------\n");
+}
+
+void print_pin_trace_stats(const PinTraceStats* stats) {
+    printf(
+        "+-------------------------------------------------------------------------------\n"
+        "| Pin trace latencies over %" PRIu64 " pins (microseconds):\n"
+        "| %-26s %10s %10s %10s %10s %10s\n",
+        stats->hops[PIN_TRACE_HOP_END_TO_END].count, "hop", "p50", "p90", "p99", "max", "mean");
+    char name[32];
+    for (uint32_t i = 0; i < PIN_TRACE_HOPS_COUNT; i++) {
+        const Histogram* hist = &stats->hops[i];
+        if (hist->count == 0) {
+            continue;
+        }
+        pin_trace_hop_name(i, name, sizeof(name));
+        printf("| %-26s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+               name, histogram_value_at_percentile(hist, 50.0) / 1000,
+               histogram_value_at_percentile(hist, 90.0) / 1000,
+               histogram_value_at_percentile(hist, 99.0) / 1000, hist->max / 1000,
+               histogram_mean(hist) / 1000);
+    }
+    printf("+-------------------------------------------------------------------------------\n");
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../util/clock.h"
+#include "../util/histogram.h"
+#include "pin.h"
+
+/// @brief Environment variable with pin sampling rate: every N-th created pin
+/// is traced, 0 (default) disables tracing.
+#define PIN_TRACE_SAMPLE_RATE_ENV "PIN_TRACE_SAMPLE_RATE"
+
+static inline bool pin_is_traced(const Pin* pin) {
+    return (pin->flags & PIN_FLAG_TRACED) != 0;
+}
+
+static inline void pin_trace_created(Pin* pin) {
+    if (pin_is_traced(pin)) {
+        pin->trace.created_ns = monotonic_time_ns();
+    }
+}
+
+/// @param stage zero based stage index
+static inline void pin_trace_stage_started(Pin* pin, uint32_t stage) {
+    if (pin_is_traced(pin) && stage < PIN_TRACE_STAGES) {
+        pin->trace.stage_started_ns[stage] = monotonic_time_ns();
+    }
+}
+
+static inline void pin_trace_stage_finished(Pin* pin, uint32_t stage) {
+    if (pin_is_traced(pin) && stage < PIN_TRACE_STAGES) {
+        pin->trace.stage_finished_ns[stage] = monotonic_time_ns();
+    }
+}
+
+/// @param hop zero based stage that sent the pin to the server
+static inline void pin_trace_server_received(Pin* pin, uint32_t hop) {
+    if (pin_is_traced(pin) && hop < PIN_TRACE_SERVER_HOPS) {
+        pin->trace.server_received_ns[hop] = monotonic_time_ns();
+    }
+}
+
+static inline void pin_trace_server_forwarded(Pin* pin, uint32_t hop) {
+    if (pin_is_traced(pin) && hop < PIN_TRACE_SERVER_HOPS) {
+        pin->trace.server_forwarded_ns[hop] = monotonic_time_ns();
+    }
+}
+
+/// @brief Hops of every stage: the way of the pin from the server, the
+/// processing, the way to the server and the routing of the pin there.
+typedef enum PinTraceStageHop {
+    PIN_TRACE_HOP_FROM_SERVER,
+    PIN_TRACE_HOP_STAGE,
+    PIN_TRACE_HOP_TO_SERVER,
+    PIN_TRACE_HOP_SERVER_ROUTING,
+    PIN_TRACE_STAGE_HOPS,
+} PinTraceStageHop;
+
+enum {
+    /// From the creation of the pin to the end of the last stage it passed.
+    PIN_TRACE_HOP_END_TO_END = PIN_TRACE_STAGES * PIN_TRACE_STAGE_HOPS,
+    PIN_TRACE_HOPS_COUNT,
+};
+
+/// @return index of the @a hop of the zero based @a stage in PinTraceStats.hops
+static inline uint32_t pin_trace_hop(uint32_t stage, PinTraceStageHop hop) {
+    return stage * PIN_TRACE_STAGE_HOPS + (uint32_t)hop;
+}
+
+/// @brief Per-hop latency histograms built from completed traces, the hops
+/// that no pin took stay empty.
+typedef struct PinTraceStats {
+    Histogram hops[PIN_TRACE_HOPS_COUNT];
+} PinTraceStats;
+
+void pin_trace_hop_name(uint32_t hop, char* buffer, size_t size);
+void init_pin_trace_stats(PinTraceStats* stats);
+/// @brief Adds durations of every hop of the completed trace to the histograms, skips the hops
+/// that end before they start on the clock of another host.
+void pin_trace_stats_record(PinTraceStats* stats, const Pin* pin);
+void print_pin_trace_record(const Pin* pin);
+void print_pin_trace_stats(const PinTraceStats* stats);
@@ -1,6 +1,43 @@
 #pragma once
 
+#include <stdint.h>
+
+/// The hops through the server are indexed by the stage that sends the pin,
+/// the last stage sends it nowhere.
+enum {
+    PIN_TRACE_STAGES      = 5,
+    PIN_TRACE_SERVER_HOPS = PIN_TRACE_STAGES - 1,
+};
+
+/// The server queues order the pins by their priority, see stage-queue.h.
+enum { PIN_PRIORITY_CLASSES = 4 };
+
+typedef enum PinFlags {
+    PIN_FLAG_TRACED = 1u << 0,
+    /// The stage the pin was handed over to in the process journaled its start already.
+    PIN_FLAG_JOURNALED = 1u << 1,
+} PinFlags;
+
+/// @brief Optional per-hop timestamps (monotonic ns) carried inside the pin.
+/// Filled only when PIN_FLAG_TRACED is set, zero otherwise.
+typedef struct PinTrace {
+    uint64_t created_ns;
+    uint64_t stage_started_ns[PIN_TRACE_STAGES];
+    uint64_t stage_finished_ns[PIN_TRACE_STAGES];
+    uint64_t server_received_ns[PIN_TRACE_SERVER_HOPS];
+    uint64_t server_forwarded_ns[PIN_TRACE_SERVER_HOPS];
+} PinTrace;
+
 /// @brief Pin that workers pass to each other.
 typedef struct Pin {
     int pin_id;
+    uint32_t flags;
+    /// Worker of the next stage the server gave the pin to, 0 if any of them takes it.
+    /// On the way to the server the worker that sends it.
+    uint32_t worker_pid;
+    /// Below PIN_PRIORITY_CLASSES, the higher the more the pin is worth.
+    uint32_t priority;
+    /// Time the pin may wait in a server queue, 0 for the default of the server.
+    uint32_t deadline_ms;
+    PinTrace trace;
 } Pin;
@@ -0,0 +1,192 @@
+#include "pipeline-config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/config.h"
+#include "net-config.h"
+
+enum { PIPELINE_CONFIG_MAX_LINE_SIZE = 512 };
+
+static void init_default_pipeline(PipelineConfig* config) {
+    static const char* const steps[] = {"check-crookness", "sharpen", "check-quality"};
+    *config = (PipelineConfig){0};
+    for (uint32_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        PipelineStageConfig* stage = &config->stages[i];
+        stage->is_used             = true;
+        strcpy(stage->step, steps[i]);
+    }
+    config->stages[0].next_stages = COMPONENT_TYPE_SECOND_STAGE_WORKER;
+    config->stages[1].next_stages = COMPONENT_TYPE_THIRD_STAGE_WORKER;
+}
+
+static bool parse_pipeline_stage(const char* name, size_t length, uint32_t* stage) {
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const char* stage_name = pipeline_stage_name(i);
+        if (strlen(stage_name) == length && strncmp(name, stage_name, length) == 0) {
+            *stage = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_pipeline_stages(const char* names, uint32_t* stages) {
+    *stages = 0;
+    while (*names != '\0') {
+        const size_t length = strcspn(names, ",");
+        uint32_t stage      = 0;
+        if (!parse_pipeline_stage(names, length, &stage)) {
+            return false;
+        }
+        *stages |= pipeline_stage_type(stage);
+        names += length + (names[length] == ',');
+    }
+    return *stages != 0;
+}
+
+/// @return error of the line, NULL if it is fine
+static const char* parse_pipeline_line(PipelineConfig* config, char* line) {
+    char* save_ptr   = NULL;
+    const char* kind = strtok_r(line, " \t\r\n", &save_ptr);
+    if (kind == NULL || kind[0] == '#') {
+        return NULL;
+    }
+    const char* first_arg  = strtok_r(NULL, " \t\r\n", &save_ptr);
+    const char* second_arg = first_arg != NULL ? strtok_r(NULL, " \t\r\n", &save_ptr) : NULL;
+    const char* extra_arg  = second_arg != NULL ? strtok_r(NULL, " \t\r\n", &save_ptr) : NULL;
+    if (extra_arg != NULL && extra_arg[0] != '#') {
+        return "too many arguments";
+    }
+
+    uint32_t stage = 0;
+    if (strcmp(kind, "plugin") == 0) {
+        if (first_arg == NULL || second_arg != NULL) {
+            return "expected: plugin <path>";
+        }
+        if (config->plugins_count == PIPELINE_MAX_PLUGINS) {
+            return "too many plugins";
+        }
+        if (strlen(first_arg) >= PIPELINE_MAX_PATH_SIZE) {
+            return "too long path";
+        }
+        strcpy(config->plugins[config->plugins_count++], first_arg);
+    } else if (strcmp(kind, "stage") == 0) {
+        if (first_arg == NULL || second_arg == NULL ||
+            !parse_pipeline_stage(first_arg, strlen(first_arg), &stage)) {
+            return "expected: stage <stage> <step>";
+        }
+        if (config->stages[stage].is_used) {
+            return "the stage is defined twice";
+        }
+        if (strlen(second_arg) >= PIPELINE_MAX_NAME_SIZE) {
+            return "too long step name";
+        }
+        config->stages[stage].is_used = true;
+        strcpy(config->stages[stage].step, second_arg);
+    } else if (strcmp(kind, "route") == 0) {
+        uint32_t next_stages = 0;
+        if (first_arg == NULL || second_arg == NULL ||
+            !parse_pipeline_stage(first_arg, strlen(first_arg), &stage) ||
+            !parse_pipeline_stages(second_arg, &next_stages)) {
+            return "expected: route <stage> <stage>[,<stage>...]";
+        }
+        config->stages[stage].next_stages |= next_stages;
+    } else {
+        return "unknown definition";
+    }
+    return NULL;
+}
+
+/// @return error of the pipeline, NULL if it is fine
+static const char* check_pipeline_config(PipelineConfig* config) {
+    bool has_stages = false;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        config->stages[i].is_entry = config->stages[i].is_used;
+    }
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const PipelineStageConfig* stage = &config->stages[i];
+        has_stages |= stage->is_used;
+        if (stage->next_stages != 0 && !stage->is_used) {
+            return "route of an undefined stage";
+        }
+        for (uint32_t next = 0; next < PIPELINE_STAGES; next++) {
+            if ((stage->next_stages & pipeline_stage_type(next)) == 0) {
+                continue;
+            }
+            if (!config->stages[next].is_used) {
+                return "route to an undefined stage";
+            }
+            // the drain goes through the stages in their order
+            if (next <= i) {
+                return "a stage routes its pins to the later stages only";
+            }
+            config->stages[next].is_entry = false;
+        }
+    }
+    return has_stages ? NULL : "no stages";
+}
+
+bool load_pipeline_config(PipelineConfig* config) {
+    const char* path = getenv(PIPELINE_CONFIG_ENV);
+    if (path == NULL || *path == '\0') {
+        init_default_pipeline(config);
+        check_pipeline_config(config);
+        return true;
+    }
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        app_perror(path);
+        return false;
+    }
+    *config              = (PipelineConfig){0};
+    const char* error    = NULL;
+    uint32_t line_number = 0;
+    char line[PIPELINE_CONFIG_MAX_LINE_SIZE];
+    while (error == NULL && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        error = parse_pipeline_line(config, line);
+    }
+    if (error == NULL && ferror(file)) {
+        app_perror("fgets");
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    if (error != NULL) {
+        fprintf(stderr, "%s:%u: %s\n", path, line_number, error);
+        return false;
+    }
+    error = check_pipeline_config(config);
+    if (error != NULL) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        return false;
+    }
+    return true;
+}
+
+void describe_pipeline_config(const PipelineConfig* config, char* buffer, size_t size) {
+    size_t length = 0;
+    buffer[0]     = '\0';
+    for (uint32_t i = 0; i < PIPELINE_STAGES && length < size; i++) {
+        const PipelineStageConfig* stage = &config->stages[i];
+        if (!stage->is_used) {
+            continue;
+        }
+        int ret = snprintf(buffer + length, size - length, "%s%s (%s)", length != 0 ? "; " : "",
+                           pipeline_stage_name(i), stage->step);
+        length += ret > 0 ? (size_t)ret : 0;
+        const char* separator = " -> ";
+        for (uint32_t next = 0; next < PIPELINE_STAGES && length < size; next++) {
+            if ((stage->next_stages & pipeline_stage_type(next)) != 0) {
+                ret = snprintf(buffer + length, size - length, "%s%s", separator,
+                               pipeline_stage_name(next));
+                length += ret > 0 ? (size_t)ret : 0;
+                separator = ",";
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net-config.h"
+
+/// Path of the file that defines the pipeline. Without it the pipeline is
+/// first (check-crookness) -> second (sharpen) -> third (check-quality).
+#define PIPELINE_CONFIG_ENV "PIPELINE_CONFIG"
+
+/// @brief Topology of the pipeline, read by the server and by the workers from
+/// the same file. One definition per line, '#' starts a comment:
+///
+///     plugin <path>                   shared library with more steps, see stage-plugin.h
+///     stage <stage> <step>            the workers of the stage run the step on every pin
+///     route <stage> <stage>[,<stage>] the next stages get a copy of every pin the stage passes
+///
+/// where the stages are first, second, third, fourth and fifth. A stage
+/// routes its pins to the later stages only, so the pins never come back and
+/// the pipeline drains stage by stage in their order. A stage without a
+/// route is the last one of its pins; a stage that no route leads to makes
+/// its pins itself.
+enum {
+    PIPELINE_MAX_NAME_SIZE = 32,
+    PIPELINE_MAX_PLUGINS   = 8,
+    PIPELINE_MAX_PATH_SIZE = 256,
+};
+
+typedef struct PipelineStageConfig {
+    bool is_used;
+    /// No route leads to the stage, its workers make the pins.
+    bool is_entry;
+    /// Step the workers of the stage run on every pin.
+    char step[PIPELINE_MAX_NAME_SIZE];
+    /// Mask of the stage ComponentTypes that get the pins the stage passes, 0 if they stop there.
+    uint32_t next_stages;
+} PipelineStageConfig;
+
+typedef struct PipelineConfig {
+    PipelineStageConfig stages[PIPELINE_STAGES];
+    uint32_t plugins_count;
+    char plugins[PIPELINE_MAX_PLUGINS][PIPELINE_MAX_PATH_SIZE];
+} PipelineConfig;
+
+/// @brief Reads the pipeline from the file in PIPELINE_CONFIG_ENV, the
+/// default pipeline if it is not set.
+/// @return false if the file is missing or malformed, the error is printed
+bool load_pipeline_config(PipelineConfig* config);
+/// @brief Parses the stage names separated by commas (e.g. "first,second").
+/// @return false if a name is unknown, @a stages is the mask of their ComponentTypes otherwise
+bool parse_pipeline_stages(const char* names, uint32_t* stages);
+/// @brief Writes the routes as "first (check-crookness) -> second; ...".
+void describe_pipeline_config(const PipelineConfig* config, char* buffer, size_t size);
+
+/// @return number of the copies of every pin the @a stage passes
+static inline uint32_t pipeline_fan_out(const PipelineConfig* config, uint32_t stage) {
+    return (uint32_t)__builtin_popcount(config->stages[stage].next_stages);
+}
@@ -0,0 +1,646 @@
+#include "server-io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../util/clock.h"
+#include "../util/config.h"
+#include "../util/metrics.h"
+#include "../util/parser.h"
+#include "../util/placement.h"
+#include "io-uring.h"
+#include "message-pool.h"
+#include "net-config.h"
+
+enum {
+    SERVER_IO_RECV_USER_DATA    = 1,
+    SERVER_IO_WAKEUP_USER_DATA  = 2,
+    SERVER_IO_CANCEL_USER_DATA  = 3,
+    SERVER_IO_RECV_BUFFER_GROUP = 0,
+    SERVER_IO_RECV_BUFFER_SIZE  = sizeof(struct io_uring_recvmsg_out) +
+                                 sizeof(struct sockaddr_storage) + sizeof(UDPMessage),
+};
+
+static struct {
+    MetricId spin_time;
+    MetricId idle_time;
+    MetricId spin_hits;
+    MetricId back_offs;
+} busy_poll_metrics;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+const char* server_io_backend_to_string(ServerIoBackend backend) {
+    switch (backend) {
+        case SERVER_IO_BACKEND_BLOCKING:
+            return "blocking";
+        case SERVER_IO_BACKEND_IO_URING:
+            return "io_uring";
+        default:
+            return "unknown";
+    }
+}
+
+static bool arm_multishot_receive(ServerIo* io) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&io->recv_ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return false;
+    }
+    sqe->opcode    = IORING_OP_RECVMSG;
+    sqe->fd        = io->sock_fd;
+    sqe->addr      = (uint64_t)(uintptr_t)&io->recv_header;
+    sqe->len       = 1;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = io->recv_buffers.group_id;
+    sqe->user_data = SERVER_IO_RECV_USER_DATA;
+    int ret        = uring_submit(&io->recv_ring, 0, 0);
+    if (ret < 0) {
+        errno = -ret;
+        return false;
+    }
+    io->is_recv_armed = true;
+    return true;
+}
+
+/// @brief Stops the multishot receive, so the datagrams that come after the
+/// wake-up stay in the socket (e.g. for the server taking it over).
+static bool cancel_multishot_receive(ServerIo* io) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&io->recv_ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return false;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = SERVER_IO_RECV_USER_DATA;
+    sqe->user_data = SERVER_IO_CANCEL_USER_DATA;
+    int ret        = uring_submit(&io->recv_ring, 0, 0);
+    if (ret < 0) {
+        errno = -ret;
+        return false;
+    }
+    return true;
+}
+
+static bool init_recv_ring(ServerIo* io) {
+    if (!init_uring(&io->recv_ring, SERVER_IO_RECV_BUFFERS, 0)) {
+        return false;
+    }
+    if (!init_uring_buffer_ring(&io->recv_ring, &io->recv_buffers, SERVER_IO_RECV_BUFFER_GROUP,
+                                SERVER_IO_RECV_BUFFERS, SERVER_IO_RECV_BUFFER_SIZE)) {
+        int errno_val = errno;
+        deinit_uring(&io->recv_ring);
+        errno = errno_val;
+        return false;
+    }
+    // the kernel lays out io_uring_recvmsg_out, the address and the payload into every buffer
+    io->recv_header = (struct msghdr){
+        .msg_namelen = sizeof(struct sockaddr_storage),
+    };
+    // one-shot poll of the wake-up fd, submitted together with the receive
+    struct io_uring_sqe* sqe = uring_get_sqe(&io->recv_ring);
+    sqe->opcode              = IORING_OP_POLL_ADD;
+    sqe->fd                  = io->wakeup_fd;
+    sqe->poll32_events       = POLLIN;
+    sqe->user_data           = SERVER_IO_WAKEUP_USER_DATA;
+    if (!arm_multishot_receive(io)) {
+        int errno_val = errno;
+        deinit_uring_buffer_ring(&io->recv_ring, &io->recv_buffers);
+        deinit_uring(&io->recv_ring);
+        errno = errno_val;
+        return false;
+    }
+    return true;
+}
+
+static bool init_send_ring(ServerIo* io) {
+    const bool use_sqpoll = parse_env_uint32(SERVER_IO_SQPOLL_ENV, false) != 0;
+    if (use_sqpoll && init_uring(&io->send_ring, SERVER_IO_SEND_SLOTS, IORING_SETUP_SQPOLL)) {
+        printf("> Submitting server sends with the SQPOLL kernel thread\n");
+    } else if (!init_uring(&io->send_ring, SERVER_IO_SEND_SLOTS, 0)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < SERVER_IO_SEND_SLOTS; i++) {
+        ServerIoSendSlot* slot = &io->send_slots[i];
+        slot->iov              = (struct iovec){
+                         .iov_base = &slot->message,
+                         .iov_len  = sizeof(slot->message),
+        };
+        slot->header = (struct msghdr){
+            .msg_name    = &io->send_address,
+            .msg_namelen = sizeof(io->send_address),
+            .msg_iov     = &slot->iov,
+            .msg_iovlen  = 1,
+        };
+        slot->lent_recv_buffer = -1;
+        slot->pooled_message   = NULL;
+        io->free_send_slots[i] = SERVER_IO_SEND_SLOTS - 1 - i;
+    }
+    io->free_send_slots_size = SERVER_IO_SEND_SLOTS;
+    return true;
+}
+
+static bool init_blocking_wait(ServerIo* io) {
+    io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epoll_fd == -1) {
+        app_perror("epoll_create1");
+        return false;
+    }
+    const int fds[] = {io->sock_fd, io->wakeup_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        struct epoll_event event = {
+            .events  = EPOLLIN,
+            .data.fd = fds[i],
+        };
+        if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+            app_perror("epoll_ctl");
+            close(io->epoll_fd);
+            io->epoll_fd = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void init_busy_poll(ServerIo* io) {
+    ServerIoBusyPoll* busy_poll = &io->busy_poll;
+    if (!parse_env_uint32(SERVER_BUSY_POLL_ENV, false)) {
+        return;
+    }
+
+#ifdef SO_BUSY_POLL
+    const int socket_us = (int)parse_env_uint32(SERVER_BUSY_POLL_SOCKET_US_ENV,
+                                                SERVER_IO_BUSY_POLL_SOCKET_US);
+    if (socket_us != 0 &&
+        setsockopt(io->sock_fd, SOL_SOCKET, SO_BUSY_POLL, &socket_us, sizeof(socket_us)) == -1) {
+        // raising it over net.core.busy_read needs CAP_NET_ADMIN, the spinning works without it
+        app_perror("setsockopt(SO_BUSY_POLL)");
+    }
+#endif
+
+    const uint32_t spin_us =
+        parse_env_uint32(SERVER_BUSY_POLL_SPIN_US_ENV, SERVER_IO_BUSY_POLL_SPIN_US);
+    busy_poll->max_spin_ns    = (uint64_t)spin_us * 1000u;
+    busy_poll->spin_budget_ns = busy_poll->max_spin_ns;
+    busy_poll->is_enabled     = true;
+
+    busy_poll_metrics.spin_time = metrics_register_counter("busy poll spin ns");
+    busy_poll_metrics.idle_time = metrics_register_counter("busy poll idle ns");
+    busy_poll_metrics.spin_hits = metrics_register_counter("busy poll spin hits");
+    busy_poll_metrics.back_offs = metrics_register_counter("busy poll back-offs");
+    printf("> Busy polling the server socket for up to %u us before blocking\n", spin_us);
+}
+
+bool init_server_io(ServerIo* io, int sock_fd, const struct sockaddr_in* send_address,
+                    int wakeup_fd) {
+    memset(io, 0, sizeof(*io));
+    io->backend      = SERVER_IO_BACKEND_BLOCKING;
+    io->sock_fd      = sock_fd;
+    io->send_address = *send_address;
+    io->wakeup_fd    = wakeup_fd;
+    io->epoll_fd     = -1;
+    int ret          = pthread_mutex_init(&io->send_mutex, NULL);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_mutex_init");
+        return false;
+    }
+    if (parse_env_uint32(SERVER_IO_URING_ENV, true)) {
+        if (!init_recv_ring(io)) {
+            app_perror("io_uring receive ring");
+        } else if (!init_send_ring(io)) {
+            app_perror("io_uring send ring");
+            deinit_uring_buffer_ring(&io->recv_ring, &io->recv_buffers);
+            deinit_uring(&io->recv_ring);
+        } else {
+            io->backend = SERVER_IO_BACKEND_IO_URING;
+        }
+        printf("> Using %s server I/O\n", server_io_backend_to_string(io->backend));
+    }
+    if (io->backend == SERVER_IO_BACKEND_BLOCKING && !init_blocking_wait(io)) {
+        pthread_mutex_destroy(&io->send_mutex);
+        return false;
+    }
+    init_busy_poll(io);
+    return true;
+}
+
+static int32_t recv_buffer_id(const ServerIo* io, const UDPMessage* message) {
+    if (io->backend != SERVER_IO_BACKEND_IO_URING) {
+        return -1;
+    }
+    const unsigned char* ptr   = (const unsigned char*)message;
+    const unsigned char* begin = io->recv_buffers.buffers;
+    const size_t pool_size     = (size_t)io->recv_buffers.entries * io->recv_buffers.buffer_size;
+    if (ptr < begin || ptr >= begin + pool_size) {
+        return -1;
+    }
+    return (int32_t)((size_t)(ptr - begin) / io->recv_buffers.buffer_size);
+}
+
+static void reap_send_completions(ServerIo* io) {
+    struct io_uring_cqe* cqe = NULL;
+    while ((cqe = uring_peek_cqe(&io->send_ring)) != NULL) {
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            app_perror("sendmsg");
+        }
+        const uint32_t slot_index = (uint32_t)cqe->user_data;
+        ServerIoSendSlot* slot    = &io->send_slots[slot_index];
+        if (slot->lent_recv_buffer >= 0) {
+            const uint16_t buffer_id = (uint16_t)slot->lent_recv_buffer;
+            if (__atomic_sub_fetch(&io->recv_buffer_refs[buffer_id], 1, __ATOMIC_ACQ_REL) == 0) {
+                // only the receiving thread may touch the buffer ring
+                io->returned_recv_buffers[io->returned_recv_buffers_tail % SERVER_IO_RECV_BUFFERS] =
+                    buffer_id;
+                __atomic_store_n(&io->returned_recv_buffers_tail,
+                                 io->returned_recv_buffers_tail + 1, __ATOMIC_RELEASE);
+            }
+            slot->lent_recv_buffer = -1;
+            slot->iov.iov_base     = &slot->message;
+        } else if (slot->pooled_message != NULL) {
+            message_pool_release(slot->pooled_message);
+            slot->pooled_message = NULL;
+            slot->iov.iov_base   = &slot->message;
+        }
+        io->free_send_slots[io->free_send_slots_size++] = slot_index;
+        uring_cqe_seen(&io->send_ring);
+    }
+}
+
+void deinit_server_io(ServerIo* io) {
+    if (io->backend == SERVER_IO_BACKEND_IO_URING) {
+        pthread_mutex_lock(&io->send_mutex);
+        uring_submit(&io->send_ring, 0, 0);
+        reap_send_completions(io);
+        while (io->free_send_slots_size < SERVER_IO_SEND_SLOTS) {
+            int ret = uring_submit(&io->send_ring, 1, SERVER_IO_SEND_TIMEOUT_MS);
+            if (ret < 0 && ret != -EINTR) {
+                break;
+            }
+            reap_send_completions(io);
+        }
+        pthread_mutex_unlock(&io->send_mutex);
+        deinit_uring(&io->send_ring);
+        deinit_uring_buffer_ring(&io->recv_ring, &io->recv_buffers);
+        deinit_uring(&io->recv_ring);
+    }
+    if (io->epoll_fd != -1) {
+        close(io->epoll_fd);
+    }
+    pthread_mutex_destroy(&io->send_mutex);
+}
+
+/// @brief Spends the spin as the busy time and adapts the budget to whether it
+/// caught anything.
+static void end_busy_poll_spin(ServerIoBusyPoll* busy_poll, uint64_t spin_started_ns,
+                               bool is_hit) {
+    metrics_counter_add(busy_poll_metrics.spin_time, monotonic_time_ns() - spin_started_ns);
+    if (is_hit) {
+        metrics_counter_inc(busy_poll_metrics.spin_hits);
+        busy_poll->spin_budget_ns *= 2;
+        if (busy_poll->spin_budget_ns > busy_poll->max_spin_ns) {
+            busy_poll->spin_budget_ns = busy_poll->max_spin_ns;
+        }
+    } else {
+        metrics_counter_inc(busy_poll_metrics.back_offs);
+        busy_poll->spin_budget_ns /= 2;
+        if (busy_poll->spin_budget_ns < busy_poll->max_spin_ns / 16) {
+            busy_poll->spin_budget_ns = busy_poll->max_spin_ns / 16;
+        }
+    }
+}
+
+static ssize_t busy_poll_recvfrom(ServerIo* io, UDPMessage* message,
+                                  struct sockaddr_storage* sender_address,
+                                  socklen_t* sender_address_size) {
+    ServerIoBusyPoll* busy_poll    = &io->busy_poll;
+    const socklen_t address_size   = *sender_address_size;
+    const uint64_t spin_started_ns = monotonic_time_ns();
+    do {
+        *sender_address_size  = address_size;
+        ssize_t received_size = recvfrom(io->sock_fd, message, sizeof(*message), MSG_DONTWAIT,
+                                         (struct sockaddr*)sender_address, sender_address_size);
+        if (received_size >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            end_busy_poll_spin(busy_poll, spin_started_ns, received_size >= 0);
+            return received_size;
+        }
+        cpu_relax();
+    } while (monotonic_time_ns() - spin_started_ns < busy_poll->spin_budget_ns);
+    end_busy_poll_spin(busy_poll, spin_started_ns, false);
+    errno = EAGAIN;
+    return -1;
+}
+
+/// @brief Waits until the socket is readable or the wake-up fd is signalled.
+static bool wait_for_blocking_receive(ServerIo* io) {
+    const uint64_t idle_started_ns = monotonic_time_ns();
+    struct epoll_event events[2];
+    int ret = epoll_wait(io->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (io->busy_poll.is_enabled) {
+        metrics_counter_add(busy_poll_metrics.idle_time, monotonic_time_ns() - idle_started_ns);
+    }
+    if (ret == -1) {
+        return errno == EINTR;
+    }
+    for (int i = 0; i < ret; i++) {
+        if (events[i].data.fd == io->wakeup_fd) {
+            io->is_woken = true;
+        }
+    }
+    return true;
+}
+
+static ssize_t blocking_recvfrom(ServerIo* io, UDPMessage* message,
+                                 struct sockaddr_storage* sender_address,
+                                 socklen_t* sender_address_size) {
+    const socklen_t address_size = *sender_address_size;
+    for (;;) {
+        *sender_address_size = address_size;
+        ssize_t received_size =
+            io->busy_poll.is_enabled
+                ? busy_poll_recvfrom(io, message, sender_address, sender_address_size)
+                : recvfrom(io->sock_fd, message, sizeof(*message), MSG_DONTWAIT,
+                           (struct sockaddr*)sender_address, sender_address_size);
+        if (received_size >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return received_size;
+        }
+        if (io->is_woken) {
+            io->is_drained = true;
+            errno          = ECANCELED;
+            return -1;
+        }
+        if (!wait_for_blocking_receive(io)) {
+            app_perror("epoll_wait");
+            return -1;
+        }
+    }
+}
+
+static UDPMessage* blocking_receive(ServerIo* io, struct sockaddr_storage* sender_address,
+                                    socklen_t* sender_address_size) {
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        errno = ENOBUFS;
+        app_perror("message_pool_acquire");
+        return NULL;
+    }
+    ssize_t received_size = blocking_recvfrom(io, message, sender_address, sender_address_size);
+    if (received_size < 0) {
+        int errno_val = errno;
+        if (errno_val != ECANCELED) {
+            app_perror("recvfrom");
+        }
+        message_pool_release(message);
+        errno = errno_val;
+        return NULL;
+    }
+    if ((size_t)received_size < sizeof(*message)) {
+        memset((unsigned char*)message + received_size, 0,
+               sizeof(*message) - (size_t)received_size);
+    }
+    return message;
+}
+
+static void recycle_returned_recv_buffers(ServerIo* io) {
+    const uint32_t tail = __atomic_load_n(&io->returned_recv_buffers_tail, __ATOMIC_ACQUIRE);
+    while (io->returned_recv_buffers_head != tail) {
+        uring_buffer_ring_recycle(
+            &io->recv_buffers,
+            io->returned_recv_buffers[io->returned_recv_buffers_head % SERVER_IO_RECV_BUFFERS]);
+        io->returned_recv_buffers_head++;
+    }
+}
+
+static UDPMessage* take_received_datagram(ServerIo* io, uint16_t buffer_id,
+                                          struct sockaddr_storage* sender_address,
+                                          socklen_t* sender_address_size) {
+    unsigned char* buffer = uring_buffer(&io->recv_buffers, buffer_id);
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buffer, sizeof(out));
+    const unsigned char* name = buffer + sizeof(out);
+    unsigned char* payload    = buffer + sizeof(out) + io->recv_header.msg_namelen;
+
+    socklen_t name_size = out.namelen;
+    if (name_size > *sender_address_size) {
+        name_size = *sender_address_size;
+    }
+    memcpy(sender_address, name, name_size);
+    *sender_address_size = out.namelen;
+    if (out.payloadlen < sizeof(UDPMessage)) {
+        memset(payload + out.payloadlen, 0, sizeof(UDPMessage) - out.payloadlen);
+    }
+    __atomic_store_n(&io->recv_buffer_refs[buffer_id], 1, __ATOMIC_RELAXED);
+    return (UDPMessage*)payload;
+}
+
+static struct io_uring_cqe* busy_poll_completion(ServerIo* io) {
+    ServerIoBusyPoll* busy_poll    = &io->busy_poll;
+    const uint64_t spin_started_ns = monotonic_time_ns();
+    do {
+        struct io_uring_cqe* cqe = uring_peek_cqe(&io->recv_ring);
+        if (cqe != NULL) {
+            end_busy_poll_spin(busy_poll, spin_started_ns, true);
+            return cqe;
+        }
+        cpu_relax();
+    } while (monotonic_time_ns() - spin_started_ns < busy_poll->spin_budget_ns);
+    end_busy_poll_spin(busy_poll, spin_started_ns, false);
+    return NULL;
+}
+
+UDPMessage* server_io_receive(ServerIo* io, struct sockaddr_storage* sender_address,
+                              socklen_t* sender_address_size) {
+    if (io->backend == SERVER_IO_BACKEND_BLOCKING) {
+        return blocking_receive(io, sender_address, sender_address_size);
+    }
+
+    for (;;) {
+        recycle_returned_recv_buffers(io);
+        if (!io->is_recv_armed && !io->is_woken && !arm_multishot_receive(io)) {
+            app_perror("io_uring recvmsg");
+            return NULL;
+        }
+        struct io_uring_cqe* cqe = uring_peek_cqe(&io->recv_ring);
+        if (cqe == NULL && io->busy_poll.is_enabled) {
+            cqe = busy_poll_completion(io);
+        }
+        if (cqe == NULL) {
+            if (io->is_woken && !io->is_recv_armed) {
+                io->is_drained = true;
+                errno          = ECANCELED;
+                return NULL;
+            }
+            const uint64_t idle_started_ns = monotonic_time_ns();
+            int ret                        = uring_submit(&io->recv_ring, 1, 0);
+            if (io->busy_poll.is_enabled) {
+                metrics_counter_add(busy_poll_metrics.idle_time,
+                                    monotonic_time_ns() - idle_started_ns);
+            }
+            if (ret < 0 && ret != -EINTR) {
+                errno = -ret;
+                app_perror("io_uring_enter");
+                return NULL;
+            }
+            continue;
+        }
+
+        const uint64_t user_data = cqe->user_data;
+        const int32_t res        = cqe->res;
+        const uint32_t flags     = cqe->flags;
+        uring_cqe_seen(&io->recv_ring);
+        if (user_data == SERVER_IO_WAKEUP_USER_DATA) {
+            // hand out the datagrams that are already buffered first
+            io->is_woken = true;
+            if (io->is_recv_armed && !cancel_multishot_receive(io)) {
+                app_perror("io_uring async cancel");
+                return NULL;
+            }
+            continue;
+        }
+        if (user_data == SERVER_IO_CANCEL_USER_DATA) {
+            continue;
+        }
+        if ((flags & IORING_CQE_F_MORE) == 0) {
+            // the kernel stops the multishot receive e.g. when it runs out of buffers
+            io->is_recv_armed = false;
+        }
+        if (res < 0) {
+            if (res == -ENOBUFS || res == -ECANCELED) {
+                continue;
+            }
+            errno = -res;
+            app_perror("recvmsg");
+            return NULL;
+        }
+        if ((flags & IORING_CQE_F_BUFFER) == 0) {
+            continue;
+        }
+        return take_received_datagram(io, (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT),
+                                      sender_address, sender_address_size);
+    }
+}
+
+void server_io_release(ServerIo* io, UDPMessage* message) {
+    if (io->backend == SERVER_IO_BACKEND_BLOCKING) {
+        message_pool_release(message);
+        return;
+    }
+    const int32_t buffer_id = recv_buffer_id(io, message);
+    assert(buffer_id >= 0);
+    if (__atomic_sub_fetch(&io->recv_buffer_refs[buffer_id], 1, __ATOMIC_ACQ_REL) == 0) {
+        uring_buffer_ring_recycle(&io->recv_buffers, (uint16_t)buffer_id);
+    }
+}
+
+bool server_io_has_buffered_receive(ServerIo* io) {
+    return io->backend == SERVER_IO_BACKEND_IO_URING && uring_peek_cqe(&io->recv_ring) != NULL;
+}
+
+bool server_io_send_to(ServerIo* io, const UDPMessage* message,
+                       const struct sockaddr_in* address) {
+    bool ok = sendto(io->sock_fd, message, sizeof(*message), 0, (const struct sockaddr*)address,
+                     sizeof(*address)) == sizeof(*message);
+    if (!ok) {
+        app_perror("sendto");
+    }
+    return ok;
+}
+
+static bool blocking_send(ServerIo* io, const UDPMessage* message) {
+    return server_io_send_to(io, message, &io->send_address);
+}
+
+bool server_io_send(ServerIo* io, const UDPMessage* message) {
+    if (io->backend == SERVER_IO_BACKEND_BLOCKING) {
+        return blocking_send(io, message);
+    }
+
+    pthread_mutex_lock(&io->send_mutex);
+    reap_send_completions(io);
+    while (io->free_send_slots_size == 0) {
+        int ret = uring_submit(&io->send_ring, 1, 0);
+        if (ret < 0 && ret != -EINTR) {
+            pthread_mutex_unlock(&io->send_mutex);
+            errno = -ret;
+            app_perror("io_uring_enter");
+            return false;
+        }
+        reap_send_completions(io);
+    }
+
+    const uint32_t slot_index = io->free_send_slots[--io->free_send_slots_size];
+    ServerIoSendSlot* slot    = &io->send_slots[slot_index];
+    const int32_t buffer_id   = recv_buffer_id(io, message);
+    if (buffer_id >= 0) {
+        // forwarded datagram goes out of the receive buffer it came in
+        __atomic_add_fetch(&io->recv_buffer_refs[buffer_id], 1, __ATOMIC_RELAXED);
+        slot->lent_recv_buffer = buffer_id;
+        slot->iov.iov_base     = (void*)message;
+    } else if (message_pool_owns(message)) {
+        message_pool_retain((UDPMessage*)message);
+        slot->pooled_message = (UDPMessage*)message;
+        slot->iov.iov_base   = (void*)message;
+    } else {
+        memcpy(&slot->message, message, sizeof(*message));
+    }
+    // there are as many submission entries as the send slots
+    struct io_uring_sqe* sqe = uring_get_sqe(&io->send_ring);
+    sqe->opcode              = IORING_OP_SENDMSG;
+    sqe->fd                  = io->sock_fd;
+    sqe->addr                = (uint64_t)(uintptr_t)&slot->header;
+    sqe->len                 = 1;
+    sqe->user_data           = slot_index;
+    if (uring_sq_pending(&io->send_ring) >= SERVER_IO_SEND_BATCH) {
+        uring_submit(&io->send_ring, 0, 0);
+    }
+    pthread_mutex_unlock(&io->send_mutex);
+    return true;
+}
+
+void server_io_flush(ServerIo* io) {
+    if (io->backend == SERVER_IO_BACKEND_BLOCKING) {
+        return;
+    }
+    pthread_mutex_lock(&io->send_mutex);
+    int ret = uring_submit(&io->send_ring, 0, 0);
+    if (ret < 0) {
+        errno = -ret;
+        app_perror("io_uring_enter");
+    }
+    reap_send_completions(io);
+    pthread_mutex_unlock(&io->send_mutex);
+}
+
+bool server_io_is_busy_polling(const ServerIo* io) {
+    return io->busy_poll.is_enabled;
+}
+
+void server_io_bind_memory(ServerIo* io, int32_t node) {
+    placement_bind_memory(io, sizeof(*io), node);
+    if (io->backend == SERVER_IO_BACKEND_IO_URING) {
+        const UringBufferRing* buffers = &io->recv_buffers;
+        placement_bind_memory(buffers->ring,
+                              buffers->entries * sizeof(struct io_uring_buf) +
+                                  (size_t)buffers->entries * buffers->buffer_size,
+                              node);
+    }
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "io-uring.h"
+#include "net-config.h"
+
+/// @brief Datagram I/O of the server UDP socket.
+///
+/// The io_uring backend keeps one multishot recvmsg armed over a ring of
+/// provided buffers, so the poller thread enters the kernel only when
+/// there is nothing buffered, and queues the sends into a batch that is
+/// submitted by one io_uring_enter(2) on server_io_flush() (or by the
+/// kernel thread itself with SQPOLL). Kernels without io_uring fall back
+/// to the blocking recvfrom(2)/sendto(2).
+///
+/// Received datagrams are handed out in place. Passing one back to
+/// server_io_send() sends the same buffer without copying it, the buffer
+/// returns to the kernel once the send completes and the receiver
+/// released it. Buffers of the message pool are sent in place as well.
+///
+/// In the busy-poll mode the receiving thread spins on the non-blocking
+/// receives for up to its spin budget before it backs off to the blocking
+/// wait (epoll_wait(2) or io_uring_enter(2)). The budget grows while the
+/// spins catch datagrams and shrinks while they time out, so an idle
+/// dispatcher does not keep burning its CPU.
+///
+/// Every blocking wait also watches the wake-up eventfd of the server. Once
+/// it is signalled server_io_receive() hands out what is still buffered
+/// and then fails with ECANCELED, see server_io_is_drained(). The io_uring
+/// receive is cancelled on the wake-up, the datagrams that arrive later
+/// stay in the socket buffer.
+
+#define SERVER_IO_URING_ENV "SERVER_IO_URING"
+#define SERVER_IO_SQPOLL_ENV "SERVER_IO_SQPOLL"
+#define SERVER_BUSY_POLL_ENV "SERVER_BUSY_POLL"
+#define SERVER_BUSY_POLL_SPIN_US_ENV "SERVER_BUSY_POLL_SPIN_US"
+#define SERVER_BUSY_POLL_SOCKET_US_ENV "SERVER_BUSY_POLL_SOCKET_US"
+
+enum {
+    SERVER_IO_RECV_BUFFERS    = 64,
+    SERVER_IO_SEND_SLOTS      = 64,
+    SERVER_IO_SEND_BATCH      = 16,
+    SERVER_IO_SEND_TIMEOUT_MS = 100,
+    /// Default longest spin before backing off to the blocking wait.
+    SERVER_IO_BUSY_POLL_SPIN_US = 200,
+    /// Default SO_BUSY_POLL of the socket, the kernel polls the device queue for that long.
+    SERVER_IO_BUSY_POLL_SOCKET_US = 50,
+};
+
+typedef enum ServerIoBackend {
+    SERVER_IO_BACKEND_BLOCKING,
+    SERVER_IO_BACKEND_IO_URING,
+} ServerIoBackend;
+
+typedef struct ServerIoSendSlot {
+    UDPMessage message;
+    struct iovec iov;
+    struct msghdr header;
+    /// Id of the receive buffer sent in place or -1.
+    int32_t lent_recv_buffer;
+    /// Buffer of the message pool sent in place or NULL.
+    UDPMessage* pooled_message;
+} ServerIoSendSlot;
+
+typedef struct ServerIoBusyPoll {
+    bool is_enabled;
+    uint64_t max_spin_ns;
+    uint64_t spin_budget_ns;
+} ServerIoBusyPoll;
+
+typedef struct ServerIo {
+    ServerIoBackend backend;
+    int sock_fd;
+    struct sockaddr_in send_address;
+    /// Eventfd signalled on the shutdown, owned by the caller.
+    int wakeup_fd;
+
+    /// Owned by the thread calling server_io_receive().
+    /// The blocking backend waits for the socket and the wakeup_fd with epoll_wait(2).
+    int epoll_fd;
+    bool is_woken;
+    bool is_drained;
+    Uring recv_ring;
+    UringBufferRing recv_buffers;
+    struct msghdr recv_header;
+    bool is_recv_armed;
+    /// Number of the holders of every receive buffer (the receiver and the sends).
+    uint8_t recv_buffer_refs[SERVER_IO_RECV_BUFFERS];
+    /// Buffers released by the send completions, recycled by the receiving thread.
+    uint16_t returned_recv_buffers[SERVER_IO_RECV_BUFFERS];
+    uint32_t returned_recv_buffers_head;
+    uint32_t returned_recv_buffers_tail;
+    ServerIoBusyPoll busy_poll;
+
+    /// Guards everything below, the sends come from all the server threads.
+    pthread_mutex_t send_mutex;
+    Uring send_ring;
+    ServerIoSendSlot send_slots[SERVER_IO_SEND_SLOTS];
+    uint32_t free_send_slots[SERVER_IO_SEND_SLOTS];
+    uint32_t free_send_slots_size;
+} ServerIo;
+
+/// @brief Picks the io_uring backend if it is enabled and supported,
+/// enables the busy-poll mode if it is requested.
+/// @param sock_fd bound UDP socket, owned by the caller
+/// @param wakeup_fd eventfd that interrupts the receives once it is signalled
+bool init_server_io(ServerIo* io, int sock_fd, const struct sockaddr_in* send_address,
+                    int wakeup_fd);
+/// @brief Waits for all the queued sends to complete.
+void deinit_server_io(ServerIo* io);
+const char* server_io_backend_to_string(ServerIoBackend backend);
+/// @brief Receives the next datagram, blocks until there is one or the
+/// wake-up fd is signalled.
+/// @return datagram that stays valid until server_io_release() or NULL on error
+/// or with errno ECANCELED once drained, the blocking backend receives into the
+/// buffers of the message pool
+UDPMessage* server_io_receive(ServerIo* io, struct sockaddr_storage* sender_address,
+                              socklen_t* sender_address_size);
+void server_io_release(ServerIo* io, UDPMessage* message);
+/// @return true if server_io_receive() would not block
+bool server_io_has_buffered_receive(ServerIo* io);
+/// @return true if the wake-up fd was signalled and all the datagrams
+/// received before it were handed out
+static inline bool server_io_is_drained(const ServerIo* io) {
+    return io->is_drained;
+}
+/// @brief Sends the @a message to the send address, the io_uring backend only
+/// queues it until the batch is full or server_io_flush() is called.
+/// The message returned by server_io_receive() or taken from the message
+/// pool is sent in place.
+bool server_io_send(ServerIo* io, const UDPMessage* message);
+void server_io_flush(ServerIo* io);
+/// @brief Sends the @a message to the @a address right away with sendto(2),
+/// bypassing the batch: the replies to a single client are rare.
+bool server_io_send_to(ServerIo* io, const UDPMessage* message,
+                       const struct sockaddr_in* address);
+/// @return true if server_io_receive() spins before it blocks
+bool server_io_is_busy_polling(const ServerIo* io);
+/// @brief Moves the state and the receive buffers of the @a io to the NUMA @a node.
+void server_io_bind_memory(ServerIo* io, int32_t node);
@@ -11,25 +11,47 @@
 #include <string.h>
 
 #include "../util/config.h"
+#include "net-config.h"
 #include "server-log.h"
 
-enum { SERVER_LOGS_QUEUE_MAX_SIZE = 16 };
+enum {
+    SERVER_LOGS_QUEUE_MAX_SIZE      = 16,
+    SERVER_LOGS_QUEUE_MAX_PRODUCERS = 16,
+    /// Shared by the threads that came after all the other slots were claimed.
+    SERVER_LOGS_QUEUE_OVERFLOW_PRODUCER = SERVER_LOGS_QUEUE_MAX_PRODUCERS - 1,
+    SERVER_LOGS_QUEUE_CACHE_LINE        = 64,
+};
+
+/// @brief Single producer ring of the log messages of one thread.
+struct ServerLogsProducer {
+    UDPMessage* array[SERVER_LOGS_QUEUE_MAX_SIZE];
+    uint32_t read_index __attribute__((aligned(SERVER_LOGS_QUEUE_CACHE_LINE)));
+    uint32_t write_index __attribute__((aligned(SERVER_LOGS_QUEUE_CACHE_LINE)));
+};
 
+/// @brief Queue of the log messages (buffers of the message pool) to send.
+///
+/// Every thread that logs claims its own producer ring on the first enqueue,
+/// so the dispatcher threads never contend for a lock. The logs sender
+/// drains the rings round robin.
 struct ServerLogsQueue {
-    ServerLog array[SERVER_LOGS_QUEUE_MAX_SIZE];
-    size_t size;
-    pthread_mutex_t queue_access_mutex;
+    struct ServerLogsProducer producers[SERVER_LOGS_QUEUE_MAX_PRODUCERS];
+    uint32_t claimed_producers;
+    uint32_t next_producer_to_read;
+    pthread_mutex_t overflow_producer_mutex;
     sem_t added_elems_sem;
-    sem_t free_elems_sem;
-    size_t read_index;
-    size_t write_index;
 };
 
+static _Thread_local struct ServerLogsProducerSlot {
+    const struct ServerLogsQueue* queue;
+    uint32_t index;
+} server_logs_producer_slot;
+
 static inline bool init_server_logs_queue(struct ServerLogsQueue* queue) {
     memset(queue, 0, sizeof(*queue));
     int err_code            = 0;
     const char* error_cause = "";
-    err_code                = pthread_mutex_init(&queue->queue_access_mutex, NULL);
+    err_code                = pthread_mutex_init(&queue->overflow_producer_mutex, NULL);
     if (err_code != 0) {
         error_cause = "pthread_mutex_init";
         goto init_server_logs_queue_empty_cleanup;
@@ -39,18 +61,11 @@ static inline bool init_server_logs_queue(struct ServerLogsQueue* queue) {
         error_cause = "sem_init";
         goto init_server_logs_queue_mutex_cleanup;
     }
-    if (sem_init(&queue->free_elems_sem, true, SERVER_LOGS_QUEUE_MAX_SIZE) == -1) {
-        err_code    = errno;
-        error_cause = "sem_init";
-        goto init_server_logs_queue_mutex_sem_1_cleanup;
-    }
 
     return true;
 
-init_server_logs_queue_mutex_sem_1_cleanup:
-    sem_destroy(&queue->added_elems_sem);
 init_server_logs_queue_mutex_cleanup:
-    pthread_mutex_destroy(&queue->queue_access_mutex);
+    pthread_mutex_destroy(&queue->overflow_producer_mutex);
 init_server_logs_queue_empty_cleanup:
     errno = err_code;
     app_perror(error_cause);
@@ -58,73 +73,99 @@ init_server_logs_queue_empty_cleanup:
 }
 
 static inline void deinit_server_logs_queue(struct ServerLogsQueue* queue) {
-    sem_destroy(&queue->free_elems_sem);
     sem_destroy(&queue->added_elems_sem);
-    pthread_mutex_destroy(&queue->queue_access_mutex);
+    pthread_mutex_destroy(&queue->overflow_producer_mutex);
 }
 
-static inline bool server_logs_queue_nonblocking_enqueue(struct ServerLogsQueue* queue,
-                                                         const ServerLog* log) {
-    if (sem_trywait(&queue->free_elems_sem) == -1) {
-        if (errno != EAGAIN) {
-            app_perror("sem_trywait[server_logs_queue_nonblocking_enqueue]");
-        }
-        return false;
-    }
-    int ret = pthread_mutex_trylock(&queue->queue_access_mutex);
-    if (ret != 0) {
-        if (ret != EBUSY) {
-            errno = ret;
-            app_perror("pthread_mutex_trylock[server_logs_queue_nonblocking_enqueue]");
+static inline uint32_t server_logs_queue_producer_index(struct ServerLogsQueue* queue) {
+    if (server_logs_producer_slot.queue != queue) {
+        uint32_t index = __atomic_fetch_add(&queue->claimed_producers, 1, __ATOMIC_RELAXED);
+        if (index > SERVER_LOGS_QUEUE_OVERFLOW_PRODUCER) {
+            index = SERVER_LOGS_QUEUE_OVERFLOW_PRODUCER;
         }
-        sem_post(&queue->free_elems_sem);
-        return false;
+        server_logs_producer_slot.queue = queue;
+        server_logs_producer_slot.index = index;
     }
+    return server_logs_producer_slot.index;
+}
 
-    size_t write_index = queue->write_index;
-    memcpy(queue->array[write_index].message, log->message, sizeof(log->message));
-    queue->write_index = (write_index + 1) % SERVER_LOGS_QUEUE_MAX_SIZE;
-    assert(queue->size < SERVER_LOGS_QUEUE_MAX_SIZE);
-    queue->size++;
-
-    if (sem_post(&queue->added_elems_sem) == -1) {
-        app_perror("sem_post[server_logs_queue_nonblocking_enqueue]");
+static inline bool server_logs_queue_nonblocking_enqueue(struct ServerLogsQueue* queue,
+                                                         UDPMessage* log) {
+    const uint32_t index = server_logs_queue_producer_index(queue);
+    const bool is_shared = index == SERVER_LOGS_QUEUE_OVERFLOW_PRODUCER;
+    if (is_shared) {
+        pthread_mutex_lock(&queue->overflow_producer_mutex);
     }
-    ret = pthread_mutex_unlock(&queue->queue_access_mutex);
-    if (ret != 0) {
-        errno = ret;
-        app_perror("pthread_mutex_unlock[server_logs_queue_nonblocking_enqueue]");
+
+    struct ServerLogsProducer* producer = &queue->producers[index];
+    const uint32_t write_index          = producer->write_index;
+    const bool has_space =
+        write_index - __atomic_load_n(&producer->read_index, __ATOMIC_ACQUIRE) <
+        SERVER_LOGS_QUEUE_MAX_SIZE;
+    if (has_space) {
+        producer->array[write_index % SERVER_LOGS_QUEUE_MAX_SIZE] = log;
+        __atomic_store_n(&producer->write_index, write_index + 1, __ATOMIC_RELEASE);
     }
-    return true;
-}
 
-static inline bool server_logs_queue_dequeue(struct ServerLogsQueue* queue, ServerLog* log) {
-    if (sem_wait(&queue->added_elems_sem) == -1) {
-        app_perror("sem_wait[server_logs_queue_dequeue]");
-        return false;
+    if (is_shared) {
+        pthread_mutex_unlock(&queue->overflow_producer_mutex);
     }
-    int ret = pthread_mutex_lock(&queue->queue_access_mutex);
-    if (ret != 0) {
-        errno = ret;
-        app_perror("pthread_mutex_trylock[server_logs_queue_dequeue]");
-        sem_post(&queue->added_elems_sem);
-        return false;
+    if (has_space && sem_post(&queue->added_elems_sem) == -1) {
+        app_perror("sem_post[server_logs_queue_nonblocking_enqueue]");
     }
+    return has_space;
+}
 
-    size_t read_index = queue->read_index;
-    memcpy(log->message, queue->array[read_index].message, sizeof(log->message));
-    queue->read_index = (read_index + 1) % SERVER_LOGS_QUEUE_MAX_SIZE;
-    assert(queue->size > 0);
-    queue->size--;
+/// @brief Takes the next log of some ring round robin.
+/// @return NULL if all the rings are empty
+static inline UDPMessage* server_logs_queue_take(struct ServerLogsQueue* queue) {
+    for (uint32_t i = 0; i < SERVER_LOGS_QUEUE_MAX_PRODUCERS; i++) {
+        const uint32_t index         = queue->next_producer_to_read;
+        queue->next_producer_to_read = (index + 1) % SERVER_LOGS_QUEUE_MAX_PRODUCERS;
 
-    if (sem_post(&queue->free_elems_sem) == -1) {
-        app_perror("sem_post[server_logs_queue_dequeue]");
+        struct ServerLogsProducer* producer = &queue->producers[index];
+        const uint32_t read_index           = producer->read_index;
+        if (read_index == __atomic_load_n(&producer->write_index, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        UDPMessage* log = producer->array[read_index % SERVER_LOGS_QUEUE_MAX_SIZE];
+        __atomic_store_n(&producer->read_index, read_index + 1, __ATOMIC_RELEASE);
+        return log;
     }
-    ret = pthread_mutex_unlock(&queue->queue_access_mutex);
-    if (ret != 0) {
-        errno = ret;
-        app_perror("pthread_mutex_unlock[server_logs_queue_dequeue]");
+    return NULL;
+}
+
+/// @brief Blocks until there is a log or server_logs_queue_wake_up() is called.
+/// @param log set to NULL if woken up with no log in the queue
+static inline bool server_logs_queue_dequeue(struct ServerLogsQueue* queue, UDPMessage** log) {
+    while (sem_wait(&queue->added_elems_sem) == -1) {
+        if (errno != EINTR) {
+            app_perror("sem_wait[server_logs_queue_dequeue]");
+            return false;
+        }
     }
+    // every post is either a log of some ring or a wake-up
+    *log = server_logs_queue_take(queue);
+    return true;
+}
 
+/// @return false if the queue is empty
+static inline bool server_logs_queue_try_dequeue(struct ServerLogsQueue* queue, UDPMessage** log) {
+    do {
+        if (sem_trywait(&queue->added_elems_sem) == -1) {
+            if (errno != EAGAIN) {
+                app_perror("sem_trywait[server_logs_queue_try_dequeue]");
+            }
+            return false;
+        }
+        *log = server_logs_queue_take(queue);
+    } while (*log == NULL);
     return true;
 }
+
+/// @brief Makes the blocked server_logs_queue_dequeue() return without a log.
+static inline void server_logs_queue_wake_up(struct ServerLogsQueue* queue) {
+    if (sem_post(&queue->added_elems_sem) == -1) {
+        app_perror("sem_post[server_logs_queue_wake_up]");
+    }
+}
@@ -0,0 +1,269 @@
+#include "server-peers.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/config.h"
+
+static uint32_t server_peer_hash(const ServerPeer* peer) {
+    const uint64_t key = ((uint64_t)peer->address.sin_addr.s_addr << 32) ^
+                         ((uint64_t)peer->address.sin_port << 16) ^ ((uint64_t)peer->pid << 24) ^
+                         ((uint64_t)peer->type << 8) ^ ((uint64_t)peer->slot << 2) ^
+                         (uint64_t)peer->transport;
+    const uint32_t hash = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+    return hash != 0 ? hash : 1;
+}
+
+static bool is_same_peer(const ServerPeer* lhs, const ServerPeer* rhs) {
+    return lhs->type == rhs->type && lhs->transport == rhs->transport && lhs->pid == rhs->pid &&
+           lhs->slot == rhs->slot && lhs->address.sin_addr.s_addr == rhs->address.sin_addr.s_addr &&
+           lhs->address.sin_port == rhs->address.sin_port;
+}
+
+static bool allocate_buckets(ServerPeerTable* table, uint32_t buckets_count) {
+    uint32_t* hashes = calloc(buckets_count, sizeof(*hashes));
+    uint32_t* peers  = malloc(buckets_count * sizeof(*peers));
+    if (hashes == NULL || peers == NULL) {
+        app_perror("peer table buckets");
+        free(hashes);
+        free(peers);
+        return false;
+    }
+    table->buckets_count = buckets_count;
+    table->bucket_hashes = hashes;
+    table->bucket_peers  = peers;
+    return true;
+}
+
+static void insert_bucket(ServerPeerTable* table, uint32_t hash, uint32_t index) {
+    const uint32_t mask = table->buckets_count - 1;
+    uint32_t bucket     = hash & mask;
+    while (table->bucket_hashes[bucket] != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    table->bucket_hashes[bucket] = hash;
+    table->bucket_peers[bucket]  = index;
+}
+
+bool init_server_peer_table(ServerPeerTable* table) {
+    memset(table, 0, sizeof(*table));
+    return allocate_buckets(table, 2 * SERVER_PEER_TABLE_MIN_SIZE);
+}
+
+void deinit_server_peer_table(ServerPeerTable* table) {
+    for (uint32_t i = 0; i < MAX_COMPONENT_TYPES; i++) {
+        free(table->stages[i].peers);
+        free(table->stages[i].transports);
+        free(table->stages[i].slots);
+        free(table->stages[i].weights);
+    }
+    free(table->bucket_hashes);
+    free(table->bucket_peers);
+    free(table->free_peers);
+    free(table->peers);
+    memset(table, 0, sizeof(*table));
+}
+
+uint32_t server_peer_table_find(const ServerPeerTable* table, const ServerPeer* peer) {
+    const uint32_t hash = server_peer_hash(peer);
+    const uint32_t mask = table->buckets_count - 1;
+    uint32_t bucket     = hash & mask;
+    while (table->bucket_hashes[bucket] != 0) {
+        if (table->bucket_hashes[bucket] == hash &&
+            is_same_peer(&table->peers[table->bucket_peers[bucket]], peer)) {
+            return table->bucket_peers[bucket];
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return SERVER_NO_PEER;
+}
+
+static bool grow_peers(ServerPeerTable* table) {
+    const uint32_t capacity =
+        table->capacity != 0 ? 2 * table->capacity : SERVER_PEER_TABLE_MIN_SIZE;
+    ServerPeer* peers = realloc(table->peers, capacity * sizeof(*peers));
+    if (peers == NULL) {
+        app_perror("peer table");
+        return false;
+    }
+    table->peers         = peers;
+    uint32_t* free_peers = realloc(table->free_peers, capacity * sizeof(*free_peers));
+    if (free_peers == NULL) {
+        app_perror("peer table");
+        return false;
+    }
+    table->free_peers = free_peers;
+    memset(&peers[table->capacity], 0, (capacity - table->capacity) * sizeof(*peers));
+    // hand out the low indices first
+    for (uint32_t i = capacity; i > table->capacity; i--) {
+        table->free_peers[table->free_count++] = i - 1;
+    }
+    table->capacity = capacity;
+    return true;
+}
+
+/// @brief Doubles the buckets once they are half full, so the probes stay short.
+static bool grow_buckets(ServerPeerTable* table) {
+    if (2 * (table->count + 1) <= table->buckets_count) {
+        return true;
+    }
+    uint32_t* old_hashes       = table->bucket_hashes;
+    uint32_t* old_peers        = table->bucket_peers;
+    const uint32_t old_buckets = table->buckets_count;
+    if (!allocate_buckets(table, 2 * old_buckets)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < old_buckets; i++) {
+        if (old_hashes[i] != 0) {
+            insert_bucket(table, old_hashes[i], old_peers[i]);
+        }
+    }
+    free(old_hashes);
+    free(old_peers);
+    return true;
+}
+
+static bool grow_stage(ServerStagePeers* stage) {
+    if (stage->count < stage->capacity) {
+        return true;
+    }
+    const uint32_t capacity =
+        stage->capacity != 0 ? 2 * stage->capacity : SERVER_PEER_TABLE_MIN_SIZE;
+    uint32_t* peers = realloc(stage->peers, capacity * sizeof(*peers));
+    if (peers != NULL) {
+        stage->peers = peers;
+    }
+    ServerPeerTransport* transports = realloc(stage->transports, capacity * sizeof(*transports));
+    if (transports != NULL) {
+        stage->transports = transports;
+    }
+    uint32_t* slots = realloc(stage->slots, capacity * sizeof(*slots));
+    if (slots != NULL) {
+        stage->slots = slots;
+    }
+    uint32_t* weights = realloc(stage->weights, capacity * sizeof(*weights));
+    if (weights != NULL) {
+        stage->weights = weights;
+    }
+    if (peers == NULL || transports == NULL || slots == NULL || weights == NULL) {
+        app_perror("peer dispatch list");
+        return false;
+    }
+    stage->capacity = capacity;
+    return true;
+}
+
+uint32_t server_peer_table_add(ServerPeerTable* table, const ServerPeer* peer) {
+    assert(server_peer_table_find(table, peer) == SERVER_NO_PEER);
+    ServerStagePeers* stage = &table->stages[component_type_index(peer->type)];
+    if ((table->free_count == 0 && !grow_peers(table)) || !grow_buckets(table) ||
+        !grow_stage(stage)) {
+        return SERVER_NO_PEER;
+    }
+    const uint32_t index  = table->free_peers[--table->free_count];
+    ServerPeer* added     = &table->peers[index];
+    *added                = *peer;
+    added->is_used        = true;
+    added->stage_position = stage->count;
+    added->weight         = peer->weight != 0 ? peer->weight : 1;
+    insert_bucket(table, server_peer_hash(added), index);
+    table->count++;
+
+    stage->peers[stage->count]      = index;
+    stage->transports[stage->count] = added->transport;
+    stage->slots[stage->count]      = added->slot;
+    stage->weights[stage->count]    = added->weight;
+    stage->total_weight += added->weight;
+    stage->count++;
+    return index;
+}
+
+/// @brief Empties the bucket of the @a index peer and shifts back the peers
+/// probed past it, so that no probe sequence has a hole.
+static void remove_bucket(ServerPeerTable* table, uint32_t index) {
+    const uint32_t mask = table->buckets_count - 1;
+    uint32_t bucket     = server_peer_hash(&table->peers[index]) & mask;
+    // the peer is in the table, the probe ends at its bucket
+    while (table->bucket_hashes[bucket] == 0 || table->bucket_peers[bucket] != index) {
+        bucket = (bucket + 1) & mask;
+    }
+    uint32_t next = (bucket + 1) & mask;
+    while (table->bucket_hashes[next] != 0) {
+        const uint32_t home = table->bucket_hashes[next] & mask;
+        if (((next - home) & mask) >= ((next - bucket) & mask)) {
+            table->bucket_hashes[bucket] = table->bucket_hashes[next];
+            table->bucket_peers[bucket]  = table->bucket_peers[next];
+            bucket                       = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->bucket_hashes[bucket] = 0;
+}
+
+void server_peer_table_remove(ServerPeerTable* table, uint32_t index) {
+    assert(index < table->capacity && table->peers[index].is_used);
+    ServerPeer* peer = &table->peers[index];
+    remove_bucket(table, index);
+
+    // the last member of the dispatch list takes the place of the removed one
+    ServerStagePeers* stage     = &table->stages[component_type_index(peer->type)];
+    const uint32_t position     = peer->stage_position;
+    const uint32_t last         = --stage->count;
+    const uint32_t moved        = stage->peers[last];
+    stage->peers[position]      = moved;
+    stage->transports[position] = stage->transports[last];
+    stage->slots[position]      = stage->slots[last];
+    stage->weights[position]    = stage->weights[last];
+    stage->total_weight -= peer->weight;
+    if (stage->next == position) {
+        stage->next_credit = 0;
+    }
+
+    table->peers[moved].stage_position     = position;
+    peer->is_used                          = false;
+    table->free_peers[table->free_count++] = index;
+    table->count--;
+}
+
+void server_peer_table_set_weight(ServerPeerTable* table, uint32_t index, uint32_t weight) {
+    assert(index < table->capacity && table->peers[index].is_used);
+    ServerPeer* peer        = &table->peers[index];
+    ServerStagePeers* stage = &table->stages[component_type_index(peer->type)];
+    weight                  = weight != 0 ? weight : 1;
+    stage->total_weight     = stage->total_weight - peer->weight + weight;
+    stage->weights[peer->stage_position] = weight;
+    if (stage->next == peer->stage_position && stage->next_credit > weight) {
+        stage->next_credit = weight;
+    }
+    peer->weight = weight;
+}
+
+uint32_t server_peer_table_dispatch(ServerPeerTable* table, ComponentType type) {
+    ServerStagePeers* stage = &table->stages[component_type_index(type)];
+    if (stage->count == 0) {
+        return SERVER_NO_PEER;
+    }
+    if (stage->next >= stage->count) {
+        stage->next        = 0;
+        stage->next_credit = 0;
+    }
+    if (stage->next_credit == 0) {
+        stage->next_credit = stage->weights[stage->next];
+    }
+    const uint32_t index = stage->peers[stage->next];
+    if (--stage->next_credit == 0) {
+        stage->next = (stage->next + 1) % stage->count;
+    }
+    return index;
+}
+
+void server_peer_table_pass_over(ServerPeerTable* table, ComponentType type) {
+    ServerStagePeers* stage = &table->stages[component_type_index(type)];
+    if (stage->count != 0 && stage->next_credit != 0) {
+        stage->next        = (stage->next + 1) % stage->count;
+        stage->next_credit = 0;
+    }
+}
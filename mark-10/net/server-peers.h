@@ -0,0 +1,130 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../util/token-bucket.h"
+#include "net-config.h"
+
+/// @brief Table of the clients registered on the server, it grows with them.
+///
+/// The peers live in one array and keep their index while they are
+/// registered, so the failure detector and the dispatch lists refer to them
+/// by it. The index is found by an open addressing hash map (linear probing,
+/// backward shift deletion, at most half full) keyed by the address, the
+/// role and the transport slot of the peer. The bucket hashes and the bucket
+/// peers are separate arrays, so a probe reads one cache line of hashes.
+///
+/// Every component type has its own dispatch list: the peer indices, the
+/// transports and the transport slots of its members in struct of arrays
+/// layout. A peer knows its position in the list, so adding and removing
+/// it costs O(1) as well as the lookups, whatever the number of the peers.
+///
+/// The pins go to the workers of a stage in turn, as many in a row to a
+/// worker as its weight, so that every worker gets the share of the pins
+/// that its concurrency takes.
+enum {
+    MAX_COMPONENT_TYPES        = 8,
+    SERVER_PEER_TABLE_MIN_SIZE = 16,
+    SERVER_NO_PEER             = UINT32_MAX,
+};
+
+typedef enum ServerPeerTransport {
+    SERVER_PEER_UDP,
+    SERVER_PEER_SHM,
+    SERVER_PEER_TCP,
+} ServerPeerTransport;
+
+/// @brief Registered client.
+typedef struct ServerPeer {
+    bool is_used;
+    ComponentType type;
+    ServerPeerTransport transport;
+    /// Sender address of the UDP peer, address of the TCP connection.
+    struct sockaddr_in address;
+    /// Process of the UDP and the shared memory peers.
+    uint32_t pid;
+    /// Slot of the shared memory peer, index of the TCP connection.
+    uint32_t slot;
+    /// Last seen heartbeat counter of the shared memory peer.
+    uint64_t shm_heartbeats;
+    /// Position in the dispatch list of the type.
+    uint32_t stage_position;
+    /// Concurrency of the worker, at least 1.
+    uint32_t weight;
+    /// Last work the worker reported, its stage is credited with the difference.
+    WorkerLoad load;
+    bool has_load;
+    /// Stages of the multi-role worker process, 0 if it can not change them.
+    uint32_t roles;
+    /// Pins a minute the worker of an entry stage was told it may make, 0 for no limit.
+    uint32_t admission_rate;
+    /// Checks the pins the worker of an entry stage sends against its admission_rate.
+    TokenBucket admission;
+} ServerPeer;
+
+typedef struct ServerStagePeers {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* peers;
+    ServerPeerTransport* transports;
+    uint32_t* slots;
+    uint32_t* weights;
+    uint32_t total_weight;
+    /// Position of the peer that gets the next pins and the number of the pins it has left.
+    uint32_t next;
+    uint32_t next_credit;
+} ServerStagePeers;
+
+typedef struct ServerPeerTable {
+    ServerPeer* peers;
+    uint32_t capacity;
+    uint32_t count;
+    /// Stack of the unused indices below capacity.
+    uint32_t* free_peers;
+    uint32_t free_count;
+    /// Power of two, at least twice the count.
+    uint32_t buckets_count;
+    /// 0 marks an empty bucket, the hashes of the peers are never 0.
+    uint32_t* bucket_hashes;
+    uint32_t* bucket_peers;
+    ServerStagePeers stages[MAX_COMPONENT_TYPES];
+} ServerPeerTable;
+
+/// @brief Index of the @a type in the arrays indexed by the component types.
+static inline uint32_t component_type_index(ComponentType type) {
+    return (uint32_t)__builtin_ctz((uint32_t)type) % MAX_COMPONENT_TYPES;
+}
+
+bool init_server_peer_table(ServerPeerTable* table);
+void deinit_server_peer_table(ServerPeerTable* table);
+/// @return index of the peer with the identity of @a peer or SERVER_NO_PEER
+uint32_t server_peer_table_find(const ServerPeerTable* table, const ServerPeer* peer);
+/// @brief Registers the @a peer, that must not be registered yet.
+/// @return its index or SERVER_NO_PEER if the table could not grow
+uint32_t server_peer_table_add(ServerPeerTable* table, const ServerPeer* peer);
+void server_peer_table_remove(ServerPeerTable* table, uint32_t index);
+/// @brief Sets the share of the pins of the @a index peer, 0 counts as 1.
+void server_peer_table_set_weight(ServerPeerTable* table, uint32_t index, uint32_t weight);
+/// @brief Picks the peer of the @a type that gets the next pin.
+/// @return its index or SERVER_NO_PEER if there are no peers of the type
+uint32_t server_peer_table_dispatch(ServerPeerTable* table, ComponentType type);
+/// @brief The peer of the @a type that got the last pin gets no more of them in its turn,
+/// the next pin goes to the next peer.
+void server_peer_table_pass_over(ServerPeerTable* table, ComponentType type);
+static inline ServerPeer* server_peer_at(const ServerPeerTable* table, uint32_t index) {
+    return &table->peers[index];
+}
+/// @brief Dispatch list of the peers of the @a type.
+static inline const ServerStagePeers* server_stage_peers(const ServerPeerTable* table,
+                                                         ComponentType type) {
+    return &table->stages[component_type_index(type)];
+}
@@ -1,30 +1,119 @@
+#ifndef _GNU_SOURCE
+// SO_REUSEPORT
+#define _GNU_SOURCE
+#endif
+
 #include "server-tools.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "../util/clock.h"
 #include "../util/config.h"
+#include "../util/metrics.h"
+#include "../util/parser.h"
+#include "../util/placement.h"
 #include "net-config.h"
+#include "pin-trace.h"
+#include "message-pool.h"
+#include "server-io.h"
 #include "server-log.h"
+#include "shm-transport.h"
+#include "tcp-transport.h"
+
+static struct ServerMetrics {
+    MetricId messages_in[MESSAGE_TYPES_COUNT];
+    MetricId messages_out[MESSAGE_TYPES_COUNT];
+    /// Indexed by the stage, the entry stages get no pins from the server.
+    MetricId pins_routed[PIPELINE_STAGES];
+    MetricId pins_from_invalid_source;
+    MetricId logs_dropped;
+    MetricId logs_sent;
+    MetricId logs_queue_depth;
+    MetricId shm_messages_in;
+    MetricId shm_messages_out;
+    MetricId shm_ring_overflows;
+    MetricId tcp_messages_in;
+    MetricId tcp_messages_out;
+    MetricId message_handling_time;
+    MetricId peers_removed;
+    MetricId pins_reassigned;
+    MetricId pins_shed;
+    MetricId pins_expired;
+    MetricId queued_pins;
+    MetricId pin_queue_time;
+    MetricId pins_not_admitted;
+    /// Outstanding pins forgotten for the newer ones, they are not reassigned anymore.
+    MetricId pins_evicted;
+    /// Pins a worker could not take, they went to the next worker of the stage.
+    MetricId pin_sends_failed;
+    /// Pins no worker of the stage could take.
+    MetricId pins_undelivered;
+} server_metrics;
+
+static void register_server_metrics(void) {
+    char name[METRICS_MAX_NAME_SIZE];
+    for (uint32_t type = 0; type < MESSAGE_TYPES_COUNT; type++) {
+        snprintf(name, sizeof(name), "messages in: %s", message_type_to_string((MessageType)type));
+        server_metrics.messages_in[type] = metrics_register_counter(name);
+        snprintf(name, sizeof(name), "messages out: %s",
+                 message_type_to_string((MessageType)type));
+        server_metrics.messages_out[type] = metrics_register_counter(name);
+    }
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        snprintf(name, sizeof(name), "pins routed to the %s stage", pipeline_stage_name(stage));
+        server_metrics.pins_routed[stage] = metrics_register_counter(name);
+    }
+    server_metrics.pins_from_invalid_source = metrics_register_counter("pins from invalid source");
+    server_metrics.logs_dropped             = metrics_register_counter("logs dropped");
+    server_metrics.logs_sent                = metrics_register_counter("logs sent");
+    server_metrics.shm_messages_in          = metrics_register_counter("shm messages in");
+    server_metrics.shm_messages_out         = metrics_register_counter("shm messages out");
+    server_metrics.shm_ring_overflows       = metrics_register_counter("shm ring overflows");
+    server_metrics.tcp_messages_in          = metrics_register_counter("tcp messages in");
+    server_metrics.tcp_messages_out         = metrics_register_counter("tcp messages out");
+    server_metrics.logs_queue_depth         = metrics_register_gauge("logs queue depth");
+    server_metrics.message_handling_time = metrics_register_histogram("message handling time");
+    server_metrics.peers_removed         = metrics_register_counter("peers removed");
+    server_metrics.pins_reassigned       = metrics_register_counter("pins reassigned");
+    server_metrics.pins_shed             = metrics_register_counter("pins shed");
+    server_metrics.pins_expired          = metrics_register_counter("pins expired");
+    server_metrics.queued_pins           = metrics_register_gauge("queued pins");
+    server_metrics.pin_queue_time        = metrics_register_histogram("pin queue time");
+    server_metrics.pins_not_admitted     = metrics_register_counter("pins not admitted");
+    server_metrics.pins_evicted          = metrics_register_counter("outstanding pins evicted");
+    server_metrics.pin_sends_failed      = metrics_register_counter("pin sends failed");
+    server_metrics.pins_undelivered      = metrics_register_counter("pins undelivered");
+}
 
 static bool setup_server(int server_sock_fd, struct sockaddr_in* server_address,
-                         uint16_t server_port) {
+                         uint16_t server_port, bool reuse_port) {
     if (-1 == setsockopt(server_sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){true}, sizeof(int))) {
         app_perror("setsockopt[SOL_SOCKET,SO_REUSEADDR]");
         return false;
     }
 
+    if (reuse_port &&
+        -1 == setsockopt(server_sock_fd, SOL_SOCKET, SO_REUSEPORT, &(int){true}, sizeof(int))) {
+        app_perror("setsockopt[SOL_SOCKET,SO_REUSEPORT]");
+        return false;
+    }
+
     if (-1 == setsockopt(server_sock_fd, SOL_SOCKET, SO_BROADCAST, &(int){true}, sizeof(int))) {
         app_perror("setsockopt[SOL_SOCKET,SO_BROADCAST]");
         return false;
@@ -44,40 +133,712 @@ static bool setup_server(int server_sock_fd, struct sockaddr_in* server_address,
     return true;
 }
 
-bool init_server(Server server, uint16_t server_port) {
-    memset(server, 0, sizeof(*server));
-    server->sock_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (server->sock_fd == -1) {
+/// Fibonacci hashing multiplier, 2^32 divided by the golden ratio.
+#define SENDER_HASH_MULTIPLIER 0x9E3779B1u
+
+/// @brief Every dispatcher socket gets every broadcast datagram (the kernel
+/// balances only the unicast ones over a SO_REUSEPORT group, a
+/// SO_ATTACH_REUSEPORT_CBPF program steers them only), so the dispatchers
+/// split the senders between them by the address hash. All the messages of
+/// one sender are handled by one thread and stay ordered.
+static uint32_t sender_dispatcher(const struct sockaddr_in* sender, uint32_t dispatchers_count) {
+    const uint32_t key = ntohl(sender->sin_addr.s_addr) ^ ntohs(sender->sin_port);
+    return ((key * SENDER_HASH_MULTIPLIER) >> 16) % dispatchers_count;
+}
+
+/// @brief Attaches the socket filter that computes sender_dispatcher() in the
+/// kernel and drops the datagrams of the other dispatchers before they are
+/// queued to the socket, so the dispatcher neither receives nor wakes up for them.
+/// @return false if the kernel did not take it, the dispatcher drops them itself then
+static bool steer_server_dispatcher(ServerDispatcher* dispatcher, uint32_t index,
+                                    uint32_t dispatchers_count) {
+    struct sock_filter code[] = {
+        // the filter of a UDP socket sees the UDP header at 0, the IP header at SKF_NET_OFF
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 12),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, SENDER_HASH_MULTIPLIER),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, dispatchers_count),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, index, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    const struct sock_fprog program = {
+        .len    = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    dispatcher->is_steered = setsockopt(dispatcher->sock_fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                                        &program, sizeof(program)) == 0;
+    if (!dispatcher->is_steered) {
+        app_perror("setsockopt[SOL_SOCKET,SO_ATTACH_FILTER]");
+    }
+    return dispatcher->is_steered;
+}
+
+static bool init_server_dispatcher(ServerDispatcher* dispatcher, struct sockaddr_in* sock_addr,
+                                   uint16_t server_port, uint32_t index,
+                                   uint32_t dispatchers_count, int wakeup_fd) {
+    dispatcher->sock_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (dispatcher->sock_fd == -1) {
         app_perror("socket");
         return false;
     }
-    if (!setup_server(server->sock_fd, &server->sock_addr, server_port) ||
-        !init_server_logs_queue(&server->logs_queue)) {
-        close(server->sock_fd);
+    // before the bind, so that no datagram of the other dispatchers gets queued
+    dispatcher->is_steered = false;
+    if (dispatchers_count > 1) {
+        steer_server_dispatcher(dispatcher, index, dispatchers_count);
+    }
+    if (!setup_server(dispatcher->sock_fd, sock_addr, server_port, dispatchers_count > 1) ||
+        !init_server_io(&dispatcher->io, dispatcher->sock_fd, sock_addr, wakeup_fd)) {
+        close(dispatcher->sock_fd);
         return false;
     }
     return true;
 }
 
-void deinit_server(Server server) {
-    int sock_fd = server->sock_fd;
+static void deinit_server_dispatcher(ServerDispatcher* dispatcher) {
+    int sock_fd = dispatcher->sock_fd;
     assert(sock_fd != -1);
+    deinit_server_io(&dispatcher->io);
     if (close(sock_fd) == -1) {
         app_perror("close");
     }
 }
 
-static bool send_message(const Server server, const UDPMessage* message) {
-    bool ok = sendto(server->sock_fd, message, sizeof(*message), 0,
-                     (const struct sockaddr*)&server->sock_addr,
-                     sizeof(server->sock_addr)) == sizeof(*message);
+enum { SERVER_SNAPSHOT_MAGIC = 0x48525354u };  // "HRST"
+
+/// First packet of the hot restart, followed by one TcpConnectionSnapshot per
+/// connection, the registered peers in ServerPeersSnapshot chunks, the pins of
+/// the stage queues in ServerQueueSnapshot chunks and one UDPMessage per
+/// queued log. Carries the dispatcher sockets, the hot restart listener and
+/// the TCP listener, in this order.
+typedef struct ServerSnapshot {
+    uint32_t magic;
+    uint32_t dispatchers_count;
+    bool has_shm_transport;
+    bool has_tcp_transport;
+    uint32_t shm_next_peer;
+    uint32_t udp_clients[MAX_COMPONENT_TYPES];
+    uint32_t clients[MAX_COMPONENT_TYPES];
+    uint32_t tcp_connections;
+    uint32_t logs;
+    uint32_t peers;
+    uint32_t queued_pins;
+    OutstandingPins outstanding_pins;
+} ServerSnapshot;
+
+/// Carries the fd of the connection.
+typedef struct TcpConnectionSnapshot {
+    uint32_t index;
+    TcpConnection connection;
+} TcpConnectionSnapshot;
+
+enum { SERVER_PEERS_PER_SNAPSHOT = 128 };
+
+typedef struct ServerPeersSnapshot {
+    uint32_t count;
+    ServerPeer peers[SERVER_PEERS_PER_SNAPSHOT];
+    /// Indices of the peers on the old server, the outstanding pins refer to them.
+    uint32_t indices[SERVER_PEERS_PER_SNAPSHOT];
+} ServerPeersSnapshot;
+
+enum { SERVER_QUEUED_PINS_PER_SNAPSHOT = 64 };
+
+/// Pins of the queue of a stage, in the order they came.
+typedef struct ServerQueueSnapshot {
+    uint32_t stage;
+    uint32_t count;
+    StageQueueEntry entries[SERVER_QUEUED_PINS_PER_SNAPSHOT];
+} ServerQueueSnapshot;
+
+static bool init_server_dispatchers(Server server, uint16_t server_port) {
+    uint32_t dispatchers_count = parse_env_uint32(SERVER_DISPATCHERS_ENV, 1);
+    if (dispatchers_count == 0) {
+        dispatchers_count = 1;
+    } else if (dispatchers_count > MAX_SERVER_DISPATCHERS) {
+        dispatchers_count = MAX_SERVER_DISPATCHERS;
+    }
+    for (uint32_t i = 0; i < dispatchers_count; i++) {
+        if (!init_server_dispatcher(&server->dispatchers[i], &server->sock_addr, server_port, i,
+                                    dispatchers_count, server->wakeup_fd)) {
+            while (i > 0) {
+                deinit_server_dispatcher(&server->dispatchers[--i]);
+            }
+            return false;
+        }
+    }
+    server->dispatchers_count = dispatchers_count;
+    return true;
+}
+
+static void deinit_server_queues(Server server) {
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        deinit_stage_queue(&server->queues[i].queue);
+    }
+    pthread_mutex_destroy(&server->queues_mutex);
+}
+
+/// @brief Every used stage that gets its pins from the server has a queue.
+/// The windows are measured by the load in the heartbeats, so the queues are
+/// off without the failure detector.
+static bool init_server_queues(Server server) {
+    pthread_mutex_init(&server->queues_mutex, NULL);
+    uint32_t policy = parse_env_uint32(SERVER_QUEUE_POLICY_ENV, STAGE_QUEUE_OFF);
+    if (policy >= STAGE_QUEUE_POLICIES_COUNT) {
+        policy = STAGE_QUEUE_EDF;
+    }
+    if (policy != STAGE_QUEUE_OFF && !has_failure_detector(server)) {
+        fputs("> The stage queues need the failure detector, the pins are sent as they come\n",
+              stderr);
+        policy = STAGE_QUEUE_OFF;
+    }
+    server->queue_policy = (StageQueuePolicy)policy;
+    if (policy == STAGE_QUEUE_OFF) {
+        return true;
+    }
+    uint32_t capacity = parse_env_uint32(SERVER_QUEUE_CAPACITY_ENV, SERVER_QUEUE_CAPACITY);
+    if (capacity == 0 || capacity > SERVER_QUEUE_MAX_CAPACITY) {
+        capacity = capacity == 0 ? 1 : SERVER_QUEUE_MAX_CAPACITY;
+    }
+    server->queue_window = parse_env_uint32(SERVER_QUEUE_WINDOW_ENV, SERVER_QUEUE_WINDOW);
+    if (server->queue_window == 0) {
+        server->queue_window = 1;
+    }
+    server->queue_deadline_ns =
+        parse_env_uint32(SERVER_QUEUE_DEADLINE_MS_ENV, SERVER_QUEUE_DEADLINE_MS) * 1000000ull;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const PipelineStageConfig* stage = &server->pipeline.stages[i];
+        if (stage->is_used && !stage->is_entry &&
+            !init_stage_queue(&server->queues[i].queue, server->queue_policy, capacity)) {
+            deinit_server_queues(server);
+            return false;
+        }
+    }
+    printf("> Stage queues: %s, %u pin(s) each, window of %u pin(s) per pin of concurrency\n",
+           stage_queue_policy_to_string(server->queue_policy), capacity, server->queue_window);
+    return true;
+}
+
+static bool init_server_peers(Server server) {
+    if (!init_server_peer_table(&server->peers)) {
+        return false;
+    }
+    pthread_mutex_init(&server->peers_mutex, NULL);
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        server->shm_peers[i] = SERVER_NO_PEER;
+    }
+
+    uint32_t mode = parse_env_uint32(SERVER_FAILURE_DETECTOR_ENV, FAILURE_DETECTOR_PHI_ACCRUAL);
+    if (mode > FAILURE_DETECTOR_PHI_ACCRUAL) {
+        mode = FAILURE_DETECTOR_PHI_ACCRUAL;
+    }
+    const uint64_t heartbeat_interval_ms =
+        parse_env_uint32(CLIENT_HEARTBEAT_INTERVAL_MS_ENV, CLIENT_HEARTBEAT_INTERVAL_MS);
+    if (heartbeat_interval_ms == 0) {
+        // the clients do not send heartbeats, all of them would be taken for dead
+        mode = FAILURE_DETECTOR_DISABLED;
+    }
+    uint32_t phi_threshold = parse_env_uint32(SERVER_PHI_THRESHOLD_ENV, SERVER_PHI_THRESHOLD);
+    if (phi_threshold == 0) {
+        phi_threshold = 1;
+    }
+    const FailureDetectorConfig config = {
+        .mode          = (FailureDetectorMode)mode,
+        .tick_ns       = SERVER_FAILURE_DETECTOR_TICK_MS * 1000000ull,
+        .timeout_ns    = (uint64_t)parse_env_uint32(SERVER_HEARTBEAT_TIMEOUT_MS_ENV,
+                                                 SERVER_HEARTBEAT_TIMEOUT_MS) *
+                      1000000u,
+        .phi_threshold       = phi_threshold,
+        .first_interval_ns   = heartbeat_interval_ms * 1000000u,
+        .acceptable_pause_ns = (uint64_t)parse_env_uint32(SERVER_HEARTBEAT_PAUSE_MS_ENV,
+                                                          SERVER_HEARTBEAT_PAUSE_MS) *
+                               1000000u,
+    };
+    init_failure_detector(&server->failure_detector, &config, monotonic_time_ns());
+    printf("> Failure detector of the clients: %s\n", failure_detector_mode_to_string(config.mode));
+
+    server->balance_mode = parse_env_uint32(SERVER_BALANCE_MODE_ENV, SERVER_BALANCE_REPORT);
+    if (server->balance_mode > SERVER_BALANCE_DIRECT) {
+        server->balance_mode = SERVER_BALANCE_DIRECT;
+    }
+    uint32_t balance_interval_ms =
+        parse_env_uint32(SERVER_BALANCE_INTERVAL_MS_ENV, SERVER_BALANCE_INTERVAL_MS);
+    if (balance_interval_ms < SERVER_FAILURE_DETECTOR_TICK_MS) {
+        balance_interval_ms = SERVER_FAILURE_DETECTOR_TICK_MS;
+    }
+    server->balance_interval_ns = balance_interval_ms * 1000000ull;
+    init_stage_balance(&server->balance, monotonic_time_ns());
+    server->admission_rate  = parse_env_uint32(SERVER_ADMISSION_RATE_ENV, 0);
+    server->admission_burst = parse_env_uint32(SERVER_ADMISSION_BURST_ENV, SERVER_ADMISSION_BURST);
+    init_token_bucket(&server->admission, 0, 1, monotonic_time_ns());
+    if (server->admission_rate != 0) {
+        printf("> Admission rate of the entry stages: %u pin(s) a minute\n",
+               server->admission_rate);
+    }
+    if (!init_server_queues(server)) {
+        deinit_failure_detector(&server->failure_detector);
+        pthread_mutex_destroy(&server->peers_mutex);
+        deinit_server_peer_table(&server->peers);
+        return false;
+    }
+    return true;
+}
+
+static void deinit_server_peers(Server server) {
+    deinit_server_queues(server);
+    deinit_failure_detector(&server->failure_detector);
+    pthread_mutex_destroy(&server->peers_mutex);
+    deinit_server_peer_table(&server->peers);
+}
+
+static void close_fds(const int* fds, size_t fds_count) {
+    for (size_t i = 0; i < fds_count; i++) {
+        close(fds[i]);
+    }
+}
+
+static bool take_over_dispatchers(Server server, const int* fds, uint32_t dispatchers_count) {
+    // the same address setup_server() binds the sockets to
+    server->sock_addr = (struct sockaddr_in){
+        .sin_family      = AF_INET,
+        .sin_port        = htons(server->port),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST)
+    };
+    for (uint32_t i = 0; i < dispatchers_count; i++) {
+        ServerDispatcher* dispatcher = &server->dispatchers[i];
+        dispatcher->sock_fd          = fds[i];
+        // the socket keeps its filter, it is attached again in case the old server had none
+        dispatcher->is_steered = false;
+        if (dispatchers_count > 1) {
+            steer_server_dispatcher(dispatcher, i, dispatchers_count);
+        }
+        if (!init_server_io(&dispatcher->io, dispatcher->sock_fd, &server->sock_addr,
+                            server->wakeup_fd)) {
+            close_fds(fds + i, dispatchers_count - i);
+            while (i > 0) {
+                deinit_server_dispatcher(&server->dispatchers[--i]);
+            }
+            return false;
+        }
+    }
+    server->dispatchers_count = dispatchers_count;
+    return true;
+}
+
+static bool take_over_tcp_connections(Server server, int conn_fd, uint32_t connections) {
+    for (uint32_t i = 0; i < connections; i++) {
+        TcpConnectionSnapshot snapshot;
+        int fd           = -1;
+        size_t fds_count = 1;
+        if (!hot_restart_receive(conn_fd, &snapshot, sizeof(snapshot), &fd, &fds_count)) {
+            return false;
+        }
+        if (fds_count != 1) {
+            fputs("> TCP connection handed over without its socket\n", stderr);
+            return false;
+        }
+        snapshot.connection.fd = fd;
+        if (!server->has_tcp_transport ||
+            !tcp_server_adopt_connection(&server->tcp_transport, snapshot.index,
+                                         &snapshot.connection)) {
+            // the client reconnects
+            close(fd);
+        }
+    }
+    return true;
+}
+
+static bool register_server_peer(Server server, const ServerPeer* peer, uint64_t now_ns);
+static bool send_drain_request(Server server, ComponentType stage);
+static void queue_routed_pin(Server server, const Pin* pin, uint32_t from, uint32_t stage);
+static void push_queue_entry(Server server, const StageQueueEntry* entry, uint32_t stage);
+static bool send_routed_pin(Server server, UDPMessage* message, uint32_t from, uint32_t stage);
+static ServerIo* current_server_io(Server server);
+
+/// @brief The outstanding pins of the @a old_index peer of the old server go
+/// to its @a new_index, the @a is_mapped pins were mapped already.
+static void map_outstanding_pins(OutstandingPins* pins, uint32_t old_index, uint32_t new_index,
+                                 bool* is_mapped) {
+    for (uint32_t i = 0; i < SERVER_MAX_OUTSTANDING_PINS; i++) {
+        if (pins->is_used[i] && !is_mapped[i] && pins->peers[i] == old_index) {
+            pins->peers[i] = new_index;
+            is_mapped[i]   = true;
+        }
+    }
+}
+
+static bool take_over_peers(Server server, int conn_fd, uint32_t peers) {
+    bool is_mapped[SERVER_MAX_OUTSTANDING_PINS] = {false};
+    // the peers get a fresh heartbeat history, the handover is a pause of theirs
+    const uint64_t now_ns = monotonic_time_ns();
+    uint32_t received     = 0;
+    while (received < peers) {
+        ServerPeersSnapshot snapshot;
+        if (!hot_restart_receive(conn_fd, &snapshot, sizeof(snapshot), NULL, NULL)) {
+            return false;
+        }
+        if (snapshot.count == 0 || snapshot.count > SERVER_PEERS_PER_SNAPSHOT) {
+            fputs("> Invalid snapshot of the peers\n", stderr);
+            return false;
+        }
+        for (uint32_t i = 0; i < snapshot.count; i++) {
+            // the counters came with the snapshot, a peer that does not fit is not watched
+            register_server_peer(server, &snapshot.peers[i], now_ns);
+            map_outstanding_pins(&server->outstanding_pins, snapshot.indices[i],
+                                 server_peer_table_find(&server->peers, &snapshot.peers[i]),
+                                 is_mapped);
+        }
+        received += snapshot.count;
+    }
+    // the pins of the peers that were not taken over wait for the other workers
+    for (uint32_t i = 0; i < SERVER_MAX_OUTSTANDING_PINS; i++) {
+        if (!is_mapped[i]) {
+            server->outstanding_pins.peers[i] = SERVER_NO_PEER;
+        }
+    }
+    return true;
+}
+
+static bool take_over_logs(Server server, int conn_fd, uint32_t logs) {
+    for (uint32_t i = 0; i < logs; i++) {
+        UDPMessage* log = message_pool_acquire();
+        if (log == NULL) {
+            fputs("> No buffer for the handed over log\n", stderr);
+            return false;
+        }
+        if (!hot_restart_receive(conn_fd, log, sizeof(*log), NULL, NULL)) {
+            message_pool_release(log);
+            return false;
+        }
+        nonblocking_enqueue_log(server, log);
+    }
+    return true;
+}
+
+/// @brief Queues the pins of the queues of the old server again, the
+/// stages without a queue get them right away.
+static bool take_over_queues(Server server, int conn_fd, uint32_t pins) {
+    UDPMessage message = {
+        .sender_type  = COMPONENT_TYPE_SERVER,
+        .message_type = MESSAGE_TYPE_PIN_TRANSFERRING,
+    };
+    bool is_sent      = false;
+    uint32_t received = 0;
+    while (received < pins) {
+        ServerQueueSnapshot snapshot;
+        if (!hot_restart_receive(conn_fd, &snapshot, sizeof(snapshot), NULL, NULL)) {
+            return false;
+        }
+        if (snapshot.count == 0 || snapshot.count > SERVER_QUEUED_PINS_PER_SNAPSHOT ||
+            snapshot.stage >= PIPELINE_STAGES) {
+            fputs("> Invalid snapshot of the queues\n", stderr);
+            return false;
+        }
+        for (uint32_t i = 0; i < snapshot.count; i++) {
+            const StageQueueEntry* entry = &snapshot.entries[i];
+            if (server->queues[snapshot.stage].queue.entries != NULL) {
+                push_queue_entry(server, entry, snapshot.stage);
+            } else {
+                message.message_content.pin = entry->pin;
+                send_routed_pin(server, &message, entry->from_stage, snapshot.stage);
+                is_sent = true;
+            }
+        }
+        received += snapshot.count;
+    }
+    if (is_sent) {
+        server_io_flush(current_server_io(server));
+    }
+    return true;
+}
+
+/// @brief Takes over the server that runs on the port, see hand_over_server().
+static bool take_over_server(Server server, int conn_fd, const char* tcp_listen_address) {
+    ServerSnapshot snapshot;
+    int fds[HOT_RESTART_MAX_FDS];
+    size_t fds_count = HOT_RESTART_MAX_FDS;
+    if (!hot_restart_receive(conn_fd, &snapshot, sizeof(snapshot), fds, &fds_count)) {
+        return false;
+    }
+    if (snapshot.magic != SERVER_SNAPSHOT_MAGIC || snapshot.dispatchers_count == 0 ||
+        snapshot.dispatchers_count > MAX_SERVER_DISPATCHERS ||
+        fds_count != snapshot.dispatchers_count + 1 + snapshot.has_tcp_transport) {
+        fputs("> Invalid hot restart snapshot\n", stderr);
+        close_fds(fds, fds_count);
+        return false;
+    }
+    if (!take_over_dispatchers(server, fds, snapshot.dispatchers_count)) {
+        close_fds(fds + snapshot.dispatchers_count, fds_count - snapshot.dispatchers_count);
+        return false;
+    }
+    server->hot_restart_fd = fds[snapshot.dispatchers_count];
+    if (snapshot.has_tcp_transport) {
+        const int listen_fd = fds[snapshot.dispatchers_count + 1];
+        server->has_tcp_transport = adopt_tcp_server(&server->tcp_transport, listen_fd);
+        if (!server->has_tcp_transport) {
+            close(listen_fd);
+        }
+    } else if (parse_env_uint32(TCP_TRANSPORT_ENV, true)) {
+        server->has_tcp_transport =
+            init_tcp_server(&server->tcp_transport, tcp_listen_address, server->port);
+    }
+    if (snapshot.has_shm_transport) {
+        // the attached workers keep their rings
+        server->shm_transport = open_shm_transport(server->port);
+        server->shm_next_peer = snapshot.shm_next_peer;
+    } else if (parse_env_uint32(SHM_TRANSPORT_ENV, true)) {
+        server->shm_transport = create_shm_transport(server->port);
+    }
+    memcpy(server->udp_clients, snapshot.udp_clients, sizeof(server->udp_clients));
+    memcpy(server->clients, snapshot.clients, sizeof(server->clients));
+    server->outstanding_pins = snapshot.outstanding_pins;
+
+    if (!take_over_tcp_connections(server, conn_fd, snapshot.tcp_connections) ||
+        !take_over_peers(server, conn_fd, snapshot.peers) ||
+        !take_over_queues(server, conn_fd, snapshot.queued_pins) ||
+        !take_over_logs(server, conn_fd, snapshot.logs) ||
+        !hot_restart_send(conn_fd, &(char){HOT_RESTART_ACK}, 1, NULL, 0)) {
+        // the old server shuts down as usual, the segment is its to remove
+        if (server->shm_transport != NULL) {
+            close_shm_transport(server->shm_transport);
+            server->shm_transport = NULL;
+        }
+        if (server->has_tcp_transport) {
+            deinit_tcp_server(&server->tcp_transport);
+            server->has_tcp_transport = false;
+        }
+        close(server->hot_restart_fd);
+        server->hot_restart_fd = -1;
+        for (uint32_t i = 0; i < server->dispatchers_count; i++) {
+            deinit_server_dispatcher(&server->dispatchers[i]);
+        }
+        server->dispatchers_count = 0;
+        return false;
+    }
+    printf("> Took over %u dispatcher socket(s), %u TCP connection(s), %u queued pin(s) and %u "
+           "log(s)\n",
+           snapshot.dispatchers_count, snapshot.tcp_connections, snapshot.queued_pins,
+           snapshot.logs);
+    return true;
+}
+
+/// @return connection to the server to take over, -1 to start anew
+static int connect_to_restarted_server(uint16_t server_port) {
+    if (!parse_env_uint32(SERVER_HOT_RESTART_ENV, false)) {
+        return -1;
+    }
+    int conn_fd = connect_hot_restart(server_port);
+    if (conn_fd == -1) {
+        fprintf(stderr, "> No server to take over on port %u, starting anew\n",
+                (unsigned)server_port);
+    }
+    return conn_fd;
+}
+
+/// @brief Opens the journal of the pins of the queues and queues the pins a
+/// crashed server left in them again. The server that took over another one
+/// got the queues from it.
+static bool open_server_journal(Server server, bool is_taken_over) {
+    if (server->queue_policy == STAGE_QUEUE_OFF) {
+        return true;
+    }
+    uint32_t max_pins = 0;
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        max_pins += server->queues[stage].queue.capacity;
+    }
+    if (!open_pin_journal(&server->journal, max_pins, &server->has_journal)) {
+        return false;
+    }
+    if (!server->has_journal || is_taken_over) {
+        return true;
+    }
+    Pin* pins = malloc(SERVER_QUEUE_MAX_CAPACITY * sizeof(*pins));
+    if (pins == NULL) {
+        app_perror("malloc");
+        close_pin_journal(&server->journal);
+        server->has_journal = false;
+        return false;
+    }
+    uint32_t recovered = 0;
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        const uint32_t count = pin_journal_live_pins(&server->journal, stage, pins,
+                                                     server->queues[stage].queue.capacity);
+        // the pins of the stages the pipeline does not route to anymore stay in the journal
+        uint32_t from = 0;
+        while (from < PIPELINE_STAGES &&
+               (server->pipeline.stages[from].next_stages & pipeline_stage_type(stage)) == 0) {
+            from++;
+        }
+        for (uint32_t i = 0; i < count && from < PIPELINE_STAGES; i++) {
+            queue_routed_pin(server, &pins[i], from, stage);
+            recovered++;
+        }
+    }
+    free(pins);
+    printf("> Queued %u pin(s) recovered from the journal\n", recovered);
+    return true;
+}
+
+/// @brief The taken over and the recovered pins are sent before init_server() returns.
+static void init_server_locks(Server server) {
+    pthread_mutex_init(&server->shm_send_mutex, NULL);
+    pthread_mutex_init(&server->drain_mutex, NULL);
+    pthread_condattr_t drain_cond_attr;
+    pthread_condattr_init(&drain_cond_attr);
+    pthread_condattr_setclock(&drain_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&server->drain_cond, &drain_cond_attr);
+    pthread_condattr_destroy(&drain_cond_attr);
+}
+
+static void deinit_server_locks(Server server) {
+    pthread_mutex_destroy(&server->shm_send_mutex);
+    pthread_cond_destroy(&server->drain_cond);
+    pthread_mutex_destroy(&server->drain_mutex);
+}
+
+bool init_server(Server server, uint16_t server_port, const char* tcp_listen_address) {
+    memset(server, 0, sizeof(*server));
+    register_server_metrics();
+    if (!load_pipeline_config(&server->pipeline)) {
+        return false;
+    }
+    char pipeline[MAX_SERVER_LOG_SIZE];
+    describe_pipeline_config(&server->pipeline, pipeline, sizeof(pipeline));
+    printf("> Pipeline: %s\n", pipeline);
+    if (!init_message_pool(SERVER_MESSAGE_POOL_CAPACITY)) {
+        return false;
+    }
+    if (!init_server_logs_queue(&server->logs_queue)) {
+        deinit_message_pool();
+        return false;
+    }
+    server->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (server->wakeup_fd == -1) {
+        app_perror("eventfd");
+        deinit_server_logs_queue(&server->logs_queue);
+        deinit_message_pool();
+        return false;
+    }
+    if (!init_server_peers(server)) {
+        close(server->wakeup_fd);
+        deinit_server_logs_queue(&server->logs_queue);
+        deinit_message_pool();
+        return false;
+    }
+    init_server_locks(server);
+    server->port           = server_port;
+    server->hot_restart_fd = -1;
+    server->log_level      = parse_env_uint32(SERVER_LOG_LEVEL_ENV, SERVER_LOG_PINS);
+    const int conn_fd      = connect_to_restarted_server(server_port);
+    const bool ok          = conn_fd != -1
+                                 ? take_over_server(server, conn_fd, tcp_listen_address)
+                                 : init_server_dispatchers(server, server_port);
+    if (conn_fd != -1) {
+        close(conn_fd);
+    }
     if (!ok) {
-        app_perror("sendto");
+        deinit_server_locks(server);
+        deinit_server_peers(server);
+        close(server->wakeup_fd);
+        deinit_server_logs_queue(&server->logs_queue);
+        deinit_message_pool();
+        return false;
+    }
+    if (!open_server_journal(server, conn_fd != -1)) {
+        for (uint32_t i = 0; i < server->dispatchers_count; i++) {
+            deinit_server_dispatcher(&server->dispatchers[i]);
+        }
+        deinit_server_locks(server);
+        deinit_server_peers(server);
+        close(server->wakeup_fd);
+        deinit_server_logs_queue(&server->logs_queue);
+        deinit_message_pool();
+        return false;
+    }
+    if (conn_fd != -1) {
+        return true;
+    }
+    if (parse_env_uint32(SHM_TRANSPORT_ENV, true)) {
+        // workers on the other hosts keep using UDP, so it is not an error
+        server->shm_transport = create_shm_transport(server_port);
+    }
+    if (parse_env_uint32(TCP_TRANSPORT_ENV, true)) {
+        server->has_tcp_transport =
+            init_tcp_server(&server->tcp_transport, tcp_listen_address, server_port);
+    }
+    // the server runs without the hot restart, e.g. if another one holds the name
+    server->hot_restart_fd = listen_hot_restart(server_port);
+    return true;
+}
+
+void deinit_server(Server server) {
+    assert(server->dispatchers_count != 0);
+    if (server->shm_transport != NULL) {
+        if (server->is_handed_over) {
+            close_shm_transport(server->shm_transport);
+        } else {
+            destroy_shm_transport(server->shm_transport, server->port);
+        }
+        server->shm_transport = NULL;
+    }
+    if (server->hot_restart_fd != -1) {
+        close(server->hot_restart_fd);
+        server->hot_restart_fd = -1;
+    }
+    if (server->has_tcp_transport) {
+        deinit_tcp_server(&server->tcp_transport);
+        server->has_tcp_transport = false;
+    }
+    deinit_server_locks(server);
+    if (server->has_journal) {
+        close_pin_journal(&server->journal);
+        server->has_journal = false;
+    }
+    deinit_server_peers(server);
+    for (uint32_t i = 0; i < server->dispatchers_count; i++) {
+        deinit_server_dispatcher(&server->dispatchers[i]);
+    }
+    server->dispatchers_count = 0;
+    if (close(server->wakeup_fd) == -1) {
+        app_perror("close");
+    }
+    // buffers still queued in the logs queue are freed together with the pool
+    deinit_message_pool();
+}
+
+/// I/O of the dispatcher that runs on the current thread.
+static _Thread_local ServerIo* dispatcher_io = NULL;
+
+/// @brief The threads that are not dispatchers send through the first dispatcher.
+static ServerIo* current_server_io(Server server) {
+    return dispatcher_io != NULL ? dispatcher_io : &server->dispatchers[0].io;
+}
+
+static uint32_t send_message_to_tcp_clients(Server server, const UDPMessage* message) {
+    if (!server->has_tcp_transport) {
+        return 0;
+    }
+    uint32_t delivered = tcp_server_broadcast(&server->tcp_transport, message);
+    metrics_counter_add(server_metrics.tcp_messages_out, delivered);
+    return delivered;
+}
+
+static bool send_message_over_udp(Server server, const UDPMessage* message) {
+    bool ok = server_io_send(current_server_io(server), message);
+    if (ok && message->message_type < MESSAGE_TYPES_COUNT) {
+        metrics_counter_inc(server_metrics.messages_out[message->message_type]);
     }
     return ok;
 }
 
-void send_shutdown_signal_to_all(const Server server) {
+static bool send_message(Server server, const UDPMessage* message) {
+    send_message_to_tcp_clients(server, message);
+    return send_message_over_udp(server, message);
+}
+
+void send_shutdown_signal_to_all(Server server) {
     UDPMessage message = {
         .sender_type           = COMPONENT_TYPE_SERVER,
         .receiver_type         = COMPONENT_TYPE_ANY_CLIENT,
@@ -85,9 +846,10 @@ void send_shutdown_signal_to_all(const Server server) {
         .message_content.bytes = {0},
     };
     send_message(server, &message);
+    server_io_flush(current_server_io(server));
 }
 
-static bool send_shutdown_signal_to_client(const Server server, ComponentType client) {
+static bool send_shutdown_signal_to_client(Server server, ComponentType client) {
     UDPMessage message = {
         .sender_type           = COMPONENT_TYPE_SERVER,
         .receiver_type         = client,
@@ -102,6 +864,9 @@ typedef struct ClientMetaInfo {
     char port[16];
     char numeric_host[48];
     char numeric_port[16];
+    bool is_shm_peer;
+    bool is_tcp_peer;
+    ServerPeer peer;
 } ClientMetaInfo;
 
 static void fill_client_metainfo(ClientMetaInfo* info, const struct sockaddr_in* client_addr) {
@@ -123,236 +888,2235 @@ static void fill_client_metainfo(ClientMetaInfo* info, const struct sockaddr_in*
     }
 }
 
-static const struct sockaddr_in* cast_to_sockaddr_in(
-    const struct sockaddr_storage* broadcast_address_storage, socklen_t broadcast_address_size) {
-    return broadcast_address_size == sizeof(struct sockaddr_in)
-               ? (const struct sockaddr_in*)broadcast_address_storage
-               : NULL;
+static void fill_udp_client_metainfo(ClientMetaInfo* info, const UDPMessage* message,
+                                     const struct sockaddr_in* client_addr) {
+    info->peer = (ServerPeer){
+        .type      = message->sender_type,
+        .transport = SERVER_PEER_UDP,
+        .address   = *client_addr,
+        // the workers stamp their pins with the pid in place of the heartbeat one
+        .pid       = message->message_type == MESSAGE_TYPE_PIN_TRANSFERRING
+                             ? message->message_content.pin.worker_pid
+                             : message->message_content.heartbeat.pid,
+    };
+    // the name lookups are too slow for the heartbeats
+    if (message->message_type != MESSAGE_TYPE_HEARTBEAT) {
+        fill_client_metainfo(info, client_addr);
+    }
 }
 
-static bool handle_log(Server server, const ServerLog* log) {
-    assert(log && log->message[0] != '\0');
-    puts(log->message);
-    return nonblocking_enqueue_log(server, log);
+static void fill_shm_client_metainfo(ClientMetaInfo* info, const UDPMessage* message,
+                                     const ShmPeer* peer, uint32_t peer_index) {
+    info->peer = (ServerPeer){
+        .type      = message->sender_type,
+        .transport = SERVER_PEER_SHM,
+        .pid       = (uint32_t)peer->pid,
+        .slot      = peer_index,
+    };
+    strcpy(info->host, "shared memory");
+    snprintf(info->port, sizeof(info->port), "slot %u", peer_index);
+    snprintf(info->numeric_host, sizeof(info->numeric_host), "pid %d", (int)peer->pid);
+    snprintf(info->numeric_port, sizeof(info->numeric_port), "%u", peer_index);
+    info->is_shm_peer = true;
 }
 
-static bool server_handle_pin_from_first_stage_worker(Server server, Pin pin) {
-    ServerLog log;
-    int ret = snprintf(log.message, sizeof(log.message),
-                       "> Transferring pin[pin_id=%d] to the second stage workers\n", pin.pin_id);
-    if (ret <= 0) {
-        app_perror("snprintf");
-    }
-    handle_log(server, &log);
+static const ComponentType pipeline_stages[PIPELINE_STAGES] = {
+    COMPONENT_TYPE_FIRST_STAGE_WORKER,
+    COMPONENT_TYPE_SECOND_STAGE_WORKER,
+    COMPONENT_TYPE_THIRD_STAGE_WORKER,
+    COMPONENT_TYPE_FOURTH_STAGE_WORKER,
+    COMPONENT_TYPE_FIFTH_STAGE_WORKER,
+};
 
-    UDPMessage message = {
-        .sender_type         = COMPONENT_TYPE_SERVER,
-        .receiver_type       = COMPONENT_TYPE_SECOND_STAGE_WORKER,
-        .message_type        = MESSAGE_TYPE_PIN_TRANSFERRING,
-        .message_content.pin = pin,
-    };
-    return send_message(server, &message);
+static const char* const pipeline_stage_names[PIPELINE_STAGES] = {
+    "first stage",
+    "second stage",
+    "third stage",
+    "fourth stage",
+    "fifth stage",
+};
+
+static void count_server_client(Server server, const ServerPeer* peer, int32_t delta) {
+    const uint32_t type_index = component_type_index(peer->type);
+    if (peer->transport == SERVER_PEER_UDP) {
+        __atomic_fetch_add(&server->udp_clients[type_index], (uint32_t)delta, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&server->clients[type_index], (uint32_t)delta, __ATOMIC_RELAXED);
 }
 
-static bool server_handle_pin_from_second_stage_worker(Server server, Pin pin) {
-    ServerLog log;
-    int ret = snprintf(log.message, sizeof(log.message),
-                       "> Transferring pin[pin_id=%d] to the third stage workers\n", pin.pin_id);
-    if (ret <= 0) {
-        app_perror("snprintf");
+static void describe_server_peer(const ServerPeer* peer, char* buffer, size_t size) {
+    char host[INET_ADDRSTRLEN] = "unknown host";
+    inet_ntop(AF_INET, &peer->address.sin_addr, host, sizeof(host));
+    switch (peer->transport) {
+        case SERVER_PEER_SHM:
+            snprintf(buffer, size, "shared memory:slot %u | pid %u", peer->slot, peer->pid);
+            break;
+        case SERVER_PEER_TCP:
+            snprintf(buffer, size, "%s:%u over TCP", host, (unsigned)ntohs(peer->address.sin_port));
+            break;
+        case SERVER_PEER_UDP:
+        default:
+            snprintf(buffer, size, "%s | pid %u", host, peer->pid);
+            break;
     }
-    handle_log(server, &log);
+}
 
-    UDPMessage message = {
-        .sender_type         = COMPONENT_TYPE_SERVER,
-        .receiver_type       = COMPONENT_TYPE_THIRD_STAGE_WORKER,
-        .message_type        = MESSAGE_TYPE_PIN_TRANSFERRING,
-        .message_content.pin = pin,
-    };
-    return send_message(server, &message);
+/// @brief Puts the @a peer into the table and starts watching it, peers_mutex must be held.
+/// @return false if there is no memory for it
+static bool register_server_peer(Server server, const ServerPeer* peer, uint64_t now_ns) {
+    const uint32_t index = server_peer_table_add(&server->peers, peer);
+    if (index == SERVER_NO_PEER) {
+        return false;
+    }
+    if (!failure_detector_reserve(&server->failure_detector, server->peers.capacity)) {
+        app_perror("failure detector");
+        server_peer_table_remove(&server->peers, index);
+        return false;
+    }
+    ServerPeer* registered = server_peer_at(&server->peers, index);
+    if (registered->transport == SERVER_PEER_SHM && server->shm_transport != NULL &&
+        registered->slot < SHM_TRANSPORT_MAX_PEERS) {
+        registered->shm_heartbeats =
+            shm_transport_peer_heartbeats(server->shm_transport, registered->slot);
+        registered->load     = shm_transport_peer_load(server->shm_transport, registered->slot);
+        registered->has_load = true;
+        server->shm_peers[registered->slot] = index;
+    }
+    failure_detector_track(&server->failure_detector, index, now_ns);
+    return true;
 }
 
-static void server_handle_invalid_pin_source(ComponentType pin_source, Server server, Pin pin,
-                                             const ClientMetaInfo* info) {
-    ServerLog log;
-    int ret = snprintf(log.message, sizeof(log.message),
-                       "> Error: invalid source %s[address=%s:%s | %s:%s] of the pin[pin_id=%d]\n",
-                       component_type_to_string(pin_source), info->host, info->port,
-                       info->numeric_host, info->numeric_port, pin.pin_id);
-    if (ret <= 0) {
-        app_perror("snprintf");
+/// @brief Takes the concurrency the worker reports, 0 if it does not report any.
+/// peers_mutex must be held.
+static void update_server_peer_weight(Server server, uint32_t index, uint32_t weight) {
+    if (weight != 0 && server_peer_at(&server->peers, index)->weight != weight) {
+        server_peer_table_set_weight(&server->peers, index, weight);
     }
-    handle_log(server, &log);
 }
 
-static bool server_handle_pin_transferring(Server server, const UDPMessage* message,
-                                           const ClientMetaInfo* info) {
-    if (message->receiver_type != COMPONENT_TYPE_SERVER) {
-        return true;
+/// @brief Credits the stage of the worker with the pins it processed since its
+/// previous report, the first report is the baseline. peers_mutex must be held.
+static void record_server_peer_load(Server server, uint32_t index, WorkerLoad load) {
+    ServerPeer* peer    = server_peer_at(&server->peers, index);
+    const int32_t stage = pipeline_stage_index(peer->type);
+    if (stage >= 0 && peer->has_load) {
+        // the differences of the wrapped around counters are still right
+        stage_balance_record(&server->balance, (uint32_t)stage,
+                             load.pins_processed - peer->load.pins_processed,
+                             load.service_time_ms - peer->load.service_time_ms);
     }
+    peer->load     = load;
+    peer->has_load = true;
+}
 
-    Pin pin = message->message_content.pin;
-    ServerLog log;
-    int ret = snprintf(log.message, sizeof(log.message),
-                       "> Received pin[pin_id=%d] from the\n> %s[address=%s:%s | %s:%s]\n",
-                       pin.pin_id, component_type_to_string(message->sender_type), info->host,
-                       info->port, info->numeric_host, info->numeric_port);
-    if (ret <= 0) {
-        app_perror("snprintf");
+/// @brief Registers the @a peer, counts it and starts watching it,
+/// a registered one is only taken as alive. peers_mutex must be held.
+/// @return true if the peer is the only live worker of a stage with
+/// outstanding pins, so that they are forwarded to it
+static bool add_server_peer(Server server, const ServerPeer* peer, uint64_t now_ns) {
+    const uint32_t index = server_peer_table_find(&server->peers, peer);
+    if (index != SERVER_NO_PEER) {
+        failure_detector_heartbeat(&server->failure_detector, index, now_ns);
+        update_server_peer_weight(server, index, peer->weight);
+        // a multi-role worker registers again once its stages change
+        server_peer_at(&server->peers, index)->roles = peer->roles;
+        if (peer->has_load && peer->transport != SERVER_PEER_SHM) {
+            record_server_peer_load(server, index, peer->load);
+        }
+        return false;
     }
-    handle_log(server, &log);
-    switch (message->sender_type) {
-        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
-            return server_handle_pin_from_first_stage_worker(server, pin);
-        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
-            return server_handle_pin_from_second_stage_worker(server, pin);
-        default:
-            server_handle_invalid_pin_source(message->sender_type, server, pin, info);
-            return true;
+    count_server_client(server, peer, 1);
+    if (!register_server_peer(server, peer, now_ns)) {
+        fputs("> No memory for the new client, it is not watched by the failure detector\n",
+              stderr);
     }
+    const int32_t stage = pipeline_stage_index(peer->type);
+    return stage >= 0 && server->clients[component_type_index(peer->type)] == 1 &&
+           server->outstanding_pins.stage_counts[stage] != 0;
 }
 
-static bool server_handle_new_client(Server server, const UDPMessage* message,
-                                     const ClientMetaInfo* info) {
-    const char* client_type_str = component_type_to_string(message->sender_type);
-    ServerLog log;
-    int ret =
-        snprintf(log.message, sizeof(log.message),
-                 "> New client with type \"%s\"[address=%s:%s | %s:%s] sent signal of presence\n",
-                 client_type_str, info->host, info->port, info->numeric_host, info->numeric_port);
-    if (ret <= 0) {
-        app_perror("snprintf");
+static UDPMessage* new_log_message(void) {
+    UDPMessage* message = message_pool_acquire();
+    if (message == NULL) {
+        return NULL;
     }
-    return handle_log(server, &log);
+    message->sender_type   = COMPONENT_TYPE_SERVER;
+    message->receiver_type = COMPONENT_TYPE_LOGS_COLLECTOR;
+    message->message_type  = MESSAGE_TYPE_LOG;
+    return message;
 }
 
-static bool server_handle_invalid_message_type(Server server, const UDPMessage* message,
-                                               const ClientMetaInfo* info) {
-    ServerLog log;
-    int ret = snprintf(
-        log.message, sizeof(log.message),
-        "> Error: invalid message type %s[value=%u] from the\n> %s[address=%s:%s | %s:%s]\n",
-        message_type_to_string(message->message_type), (uint32_t)message->message_type,
-        component_type_to_string(message->sender_type), info->host, info->port, info->numeric_host,
-        info->numeric_port);
-    if (ret <= 0) {
-        app_perror("snprintf");
-    }
-    return handle_log(server, &log);
+static bool is_server_log_enabled(const Server server, ServerLogLevel level) {
+    return __atomic_load_n(&server->log_level, __ATOMIC_RELAXED) >= (uint32_t)level;
 }
 
-static ServerCommandResult execute_command(Server server, const ServerCommand cmd) {
-    switch (cmd.client_type) {
-        case COMPONENT_TYPE_SERVER:
-            alarm(1);
-            return SERVER_COMMAND_SUCCESS;
-        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
-        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
-        case COMPONENT_TYPE_THIRD_STAGE_WORKER:
-        case COMPONENT_TYPE_LOGS_COLLECTOR:
-        case COMPONENT_TYPE_MANAGER:
-            return send_shutdown_signal_to_client(server, cmd.client_type) ? SERVER_COMMAND_SUCCESS
-                                                                           : SERVER_INTERNAL_ERROR;
-        default:
-            return INVALID_SERVER_COMMAND_ARGS;
+/// @brief Prints the log and queues it for the logs collectors. The log is
+/// formatted right into the message buffer that is sent later.
+static bool handle_log_args(Server server, ServerLogLevel level, const char* format,
+                            va_list args) {
+    if (!is_server_log_enabled(server, level)) {
+        return true;
+    }
+    UDPMessage* message = new_log_message();
+    if (message == NULL) {
+        metrics_counter_inc(server_metrics.logs_dropped);
+        return false;
+    }
+    ServerLog* log = (ServerLog*)message->message_content.bytes;
+    int ret        = vsnprintf(log->message, sizeof(log->message), format, args);
+    if (ret <= 0) {
+        app_perror("vsnprintf");
+        message_pool_release(message);
+        return false;
     }
+    puts(log->message);
+    return nonblocking_enqueue_log(server, message);
 }
 
-static bool send_command_result_to_managers(Server server, ServerCommandResult res) {
-    UDPMessage message = {
-        .sender_type                    = COMPONENT_TYPE_SERVER,
-        .receiver_type                  = COMPONENT_TYPE_MANAGER,
-        .message_type                   = MESSAGE_TYPE_MANAGER_COMMAND_RESULT,
-        .message_content.command_result = res,
-    };
-    return send_message(server, &message);
+__attribute__((format(printf, 2, 3))) static bool handle_log(Server server, const char* format,
+                                                             ...) {
+    va_list args;
+    va_start(args, format);
+    bool ret = handle_log_args(server, SERVER_LOG_EVENTS, format, args);
+    va_end(args);
+    return ret;
 }
 
-static bool server_handler_manager_command(Server server, const UDPMessage* message,
-                                           const ClientMetaInfo* info) {
-    ServerLog log           = {0};
-    const ServerCommand cmd = message->message_content.command;
-
-    int ret = snprintf(log.message, sizeof(log.message),
-                       "> Received command to shutdown clients of type \"%s\"\n"
-                       "> from manager[address=%s:%s | %s:%s]\n",
-                       component_type_to_string(cmd.client_type), info->host, info->port,
-                       info->numeric_host, info->numeric_port);
-    assert(ret > 0);
-    bool success                  = handle_log(server, &log);
-    const ServerCommandResult res = execute_command(server, cmd);
-
-    ret = snprintf(log.message, sizeof(log.message),
-                   "> Executed command to shutdownn clients of type \"%s\"\n"
-                   "> Server result: %s\n",
-                   component_type_to_string(cmd.client_type), server_command_result_to_string(res));
-    assert(ret > 0);
-    success &= handle_log(server, &log);
-    if (!send_command_result_to_managers(server, res)) {
-        fputs("> Could not send command result to manges\n", stderr);
-        success = false;
-    }
+/// @brief Logs of every pin, the most of the logs under load.
+__attribute__((format(printf, 2, 3))) static bool handle_pin_log(Server server,
+                                                                 const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    bool ret = handle_log_args(server, SERVER_LOG_PINS, format, args);
+    va_end(args);
+    return ret;
+}
 
-    memcpy(log.message, "> Sent command result to managers\n",
-           sizeof("> Sent command result to managers\n"));
-    success &= handle_log(server, &log);
+__attribute__((format(printf, 2, 3))) static bool handle_error_log(Server server,
+                                                                   const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    bool ret = handle_log_args(server, SERVER_LOG_ERRORS, format, args);
+    va_end(args);
+    return ret;
+}
 
-    return success;
+static uint32_t outstanding_pin_bucket(ComponentType stage, int32_t pin_id) {
+    const uint64_t key = ((uint64_t)(uint32_t)pin_id << 32) | (uint32_t)stage;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) % SERVER_OUTSTANDING_PIN_BUCKETS;
 }
 
-bool nonblocking_poll(Server server) {
-    UDPMessage message                                = {0};
-    struct sockaddr_storage broadcast_address_storage = {0};
-    socklen_t broadcast_address_size                  = sizeof(broadcast_address_storage);
-    ssize_t received_size =
-        recvfrom(server->sock_fd, &message, sizeof(message), 0,
-                 (struct sockaddr*)&broadcast_address_storage, &broadcast_address_size);
-    if (received_size < 0) {
-        app_perror("recvfrom");
-        return false;
+/// @return slot of the pin the @a stage got or SERVER_MAX_OUTSTANDING_PINS if it is not there
+static uint32_t find_outstanding_pin(const OutstandingPins* pins, ComponentType stage,
+                                     int32_t pin_id) {
+    uint32_t bucket = outstanding_pin_bucket(stage, pin_id);
+    while (pins->buckets[bucket] != 0) {
+        const uint32_t slot = pins->buckets[bucket] - 1u;
+        if (pins->pin_ids[slot] == pin_id && pins->stages[slot] == stage) {
+            return slot;
+        }
+        bucket = (bucket + 1) % SERVER_OUTSTANDING_PIN_BUCKETS;
     }
+    return SERVER_MAX_OUTSTANDING_PINS;
+}
 
-    const struct sockaddr_in* sock_addr =
-        cast_to_sockaddr_in(&broadcast_address_storage, broadcast_address_size);
-    if (sock_addr == NULL) {
-        fprintf(stderr, "> Unknown message sender of size %u\n", broadcast_address_size);
+/// @brief Empties the bucket of the pin in the @a slot and shifts back the
+/// pins probed past it, so that no probe sequence has a hole. Frees the slot.
+static void forget_outstanding_pin(OutstandingPins* pins, uint32_t slot) {
+    uint32_t bucket = outstanding_pin_bucket(pins->stages[slot], pins->pin_ids[slot]);
+    // the pin is in the map, the probe ends at its bucket
+    while (pins->buckets[bucket] != slot + 1u) {
+        bucket = (bucket + 1) % SERVER_OUTSTANDING_PIN_BUCKETS;
+    }
+    uint32_t next = (bucket + 1) % SERVER_OUTSTANDING_PIN_BUCKETS;
+    while (pins->buckets[next] != 0) {
+        const uint32_t moved = pins->buckets[next] - 1u;
+        const uint32_t home  = outstanding_pin_bucket(pins->stages[moved], pins->pin_ids[moved]);
+        // the pin moves back unless its home lies cyclically in (bucket, next]
+        if ((next - home) % SERVER_OUTSTANDING_PIN_BUCKETS >=
+            (next - bucket) % SERVER_OUTSTANDING_PIN_BUCKETS) {
+            pins->buckets[bucket] = pins->buckets[next];
+            bucket                = next;
+        }
+        next = (next + 1) % SERVER_OUTSTANDING_PIN_BUCKETS;
+    }
+    pins->buckets[bucket] = 0;
+
+    if (slot == pins->oldest) {
+        pins->oldest = pins->newer[slot];
+    } else {
+        pins->newer[pins->older[slot]] = pins->newer[slot];
+    }
+    if (slot == pins->newest) {
+        pins->newest = pins->older[slot];
+    } else {
+        pins->older[pins->newer[slot]] = pins->older[slot];
+    }
+    pins->free_slots[pins->free_count++] = (uint16_t)slot;
+    pins->is_used[slot]                  = false;
+    pins->count--;
+    pins->stage_counts[pipeline_stage_index(pins->stages[slot])]--;
+}
+
+/// @brief Takes a free slot for the pin the @a stage got and makes it the newest one.
+/// @return the slot, the pins must not be full
+static uint32_t add_outstanding_pin(OutstandingPins* pins, ComponentType stage, int32_t pin_id) {
+    const uint32_t slot =
+        pins->free_count != 0 ? pins->free_slots[--pins->free_count] : pins->allocated++;
+    uint32_t bucket = outstanding_pin_bucket(stage, pin_id);
+    while (pins->buckets[bucket] != 0) {
+        bucket = (bucket + 1) % SERVER_OUTSTANDING_PIN_BUCKETS;
+    }
+    pins->buckets[bucket] = (uint16_t)(slot + 1);
+
+    pins->older[slot] = pins->newest;
+    if (pins->count == 0) {
+        pins->oldest = (uint16_t)slot;
+    } else {
+        pins->newer[pins->newest] = (uint16_t)slot;
+    }
+    pins->newest        = (uint16_t)slot;
+    pins->is_used[slot] = true;
+    pins->pin_ids[slot] = pin_id;
+    pins->stages[slot]  = stage;
+    pins->count++;
+    pins->stage_counts[pipeline_stage_index(stage)]++;
+    return slot;
+}
+
+/// @brief Keeps the pin the @a peer of the @a stage got until it comes back,
+/// a pin dispatched again keeps its slot. Once they are full the oldest pin
+/// is evicted, it is counted and logged. peers_mutex must be held.
+static void assign_outstanding_pin(Server server, ComponentType stage, const Pin* pin,
+                                   uint32_t peer) {
+    OutstandingPins* pins = &server->outstanding_pins;
+    uint32_t slot         = find_outstanding_pin(pins, stage, pin->pin_id);
+    if (slot == SERVER_MAX_OUTSTANDING_PINS) {
+        if (pins->count == SERVER_MAX_OUTSTANDING_PINS) {
+            const uint32_t oldest = pins->oldest;
+            metrics_counter_inc(server_metrics.pins_evicted);
+            handle_error_log(server,
+                             "> %u pins are outstanding, pin[pin_id=%d] of the %s is not "
+                             "kept anymore\n",
+                             (uint32_t)SERVER_MAX_OUTSTANDING_PINS, pins->pin_ids[oldest],
+                             component_type_to_string(pins->stages[oldest]));
+            forget_outstanding_pin(pins, oldest);
+        }
+        slot = add_outstanding_pin(pins, stage, pin->pin_id);
+    }
+    pins->peers[slot] = peer;
+    pins->pins[slot]  = *pin;
+}
+
+static void complete_outstanding_pin(Server server, ComponentType stage, int32_t pin_id) {
+    OutstandingPins* pins = &server->outstanding_pins;
+    pthread_mutex_lock(&server->peers_mutex);
+    const uint32_t slot = find_outstanding_pin(pins, stage, pin_id);
+    if (slot != SERVER_MAX_OUTSTANDING_PINS) {
+        forget_outstanding_pin(pins, slot);
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+}
+
+/// @brief The pins the dead @a peer got wait for the other workers of its
+/// stage. peers_mutex must be held.
+/// @return number of the pins
+static uint32_t orphan_outstanding_pins(OutstandingPins* pins, uint32_t peer) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < SERVER_MAX_OUTSTANDING_PINS && pins->count != 0; i++) {
+        if (pins->is_used[i] && pins->peers[i] == peer) {
+            pins->peers[i] = SERVER_NO_PEER;
+            count++;
+        }
+    }
+    return count;
+}
+
+static bool has_udp_clients(const Server server, ComponentType types) {
+    for (uint32_t i = 0; i < MAX_COMPONENT_TYPES; i++) {
+        if ((types & (1u << i)) != 0 &&
+            __atomic_load_n(&server->udp_clients[i], __ATOMIC_RELAXED) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @param overflowed number of the peers the message was meant for which rings were full
+/// @return number of the peers of the shared memory transport that got the message
+static uint32_t send_message_to_shm_peers(Server server, const UDPMessage* message,
+                                          uint32_t* overflowed) {
+    *overflowed = 0;
+    if (server->shm_transport == NULL) {
+        return 0;
+    }
+    uint32_t delivered = 0;
+    pthread_mutex_lock(&server->shm_send_mutex);
+    shm_transport_broadcast(server->shm_transport, message, &delivered, overflowed);
+    pthread_mutex_unlock(&server->shm_send_mutex);
+    metrics_counter_add(server_metrics.shm_messages_out, delivered);
+    metrics_counter_add(server_metrics.shm_ring_overflows, *overflowed);
+    return delivered;
+}
+
+/// @brief Delivers the pin to the workers attached to the shared memory
+/// transport and to the TCP clients, broadcasts it over UDP only if there are
+/// workers that need it. The pin the full rings took in place of all the
+/// workers is dropped, the UDP broadcast reaches the unregistered workers only.
+static bool forward_pin_message(Server server, const UDPMessage* message) {
+    uint32_t overflowed    = 0;
+    uint32_t reached_peers = send_message_to_shm_peers(server, message, &overflowed);
+    reached_peers += send_message_to_tcp_clients(server, message);
+    const bool has_udp_peers = has_udp_clients(server, message->receiver_type);
+    if (reached_peers != 0 && !has_udp_peers) {
         return true;
     }
+    if (reached_peers == 0 && overflowed != 0 && !has_udp_peers) {
+        metrics_counter_inc(server_metrics.pins_undelivered);
+        handle_error_log(server, "> Rings of the %s workers are full, pin[pin_id=%d] is dropped\n",
+                         component_type_to_string(message->receiver_type),
+                         message->message_content.pin.pin_id);
+    }
+    return send_message_over_udp(server, message);
+}
+
+/// @brief The TCP peer gets the message over its connection. The others get
+/// the broadcast that only the process of the peer takes, the clients of a
+/// host share the address.
+static bool send_message_to_peer(Server server, const ServerPeer* peer,
+                                 const UDPMessage* message) {
+    if (peer->transport != SERVER_PEER_TCP) {
+        return send_message_over_udp(server, message);
+    }
+    const bool ok = server->has_tcp_transport &&
+                    tcp_server_send(&server->tcp_transport, peer->slot, &peer->address, message);
+    if (ok) {
+        metrics_counter_inc(server_metrics.tcp_messages_out);
+        metrics_counter_inc(server_metrics.messages_out[message->message_type]);
+    }
+    return ok;
+}
+
+static bool send_pin_to_shm_peer(Server server, const ServerPeer* peer,
+                                 const UDPMessage* message) {
+    if (server->shm_transport == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&server->shm_send_mutex);
+    const bool ok = shm_transport_send(server->shm_transport, peer->slot, message);
+    pthread_mutex_unlock(&server->shm_send_mutex);
+    metrics_counter_inc(ok ? server_metrics.shm_messages_out : server_metrics.shm_ring_overflows);
+    return ok;
+}
+
+/// @brief Sends the pin to one worker of the receiver stage, the workers get
+/// the pins in proportion to their concurrency. A worker that can not take
+/// the pin (its ring is full, its connection is closed) is passed over for the
+/// next one, the pin none of them took is dropped. Without the failure
+/// detector the dead workers stay registered, so the pin goes to all the workers.
+/// @param is_outstanding the pin is kept with the worker that got it until it comes back
+/// @return false only if the UDP socket of the server failed
+static bool dispatch_pin_message(Server server, UDPMessage* message, bool is_outstanding) {
+    Pin* pin        = &message->message_content.pin;
+    pin->worker_pid = 0;
+    if (!has_failure_detector(server)) {
+        if (is_outstanding) {
+            pthread_mutex_lock(&server->peers_mutex);
+            assign_outstanding_pin(server, message->receiver_type, pin, SERVER_NO_PEER);
+            pthread_mutex_unlock(&server->peers_mutex);
+        }
+        return forward_pin_message(server, message);
+    }
+    uint32_t attempts = 1;
+    for (uint32_t attempt = 0; attempt < attempts; attempt++) {
+        pthread_mutex_lock(&server->peers_mutex);
+        const uint32_t index  = server_peer_table_dispatch(&server->peers, message->receiver_type);
+        const ServerPeer peer = index != SERVER_NO_PEER ? *server_peer_at(&server->peers, index)
+                                                        : (ServerPeer){.is_used = false};
+        if (attempt == 0) {
+            attempts = server_stage_peers(&server->peers, message->receiver_type)->count;
+        }
+        // a stage without workers keeps the pin until one registers
+        if (is_outstanding) {
+            assign_outstanding_pin(server, message->receiver_type, pin, index);
+        }
+        pthread_mutex_unlock(&server->peers_mutex);
+        if (index == SERVER_NO_PEER) {
+            if (attempt == 0) {
+                return forward_pin_message(server, message);
+            }
+            break;
+        }
+        // the UDP workers of a host share the address, the pid tells which one takes the pin
+        pin->worker_pid = peer.pid;
+        if (peer.transport == SERVER_PEER_UDP) {
+            return send_message_over_udp(server, message);
+        }
+        const bool ok = peer.transport == SERVER_PEER_SHM
+                            ? send_pin_to_shm_peer(server, &peer, message)
+                            : send_message_to_peer(server, &peer, message);
+        if (ok) {
+            return true;
+        }
+        metrics_counter_inc(server_metrics.pin_sends_failed);
+        pthread_mutex_lock(&server->peers_mutex);
+        server_peer_table_pass_over(&server->peers, message->receiver_type);
+        pthread_mutex_unlock(&server->peers_mutex);
+    }
+    pin->worker_pid = 0;
+    if (is_outstanding) {
+        complete_outstanding_pin(server, message->receiver_type, pin->pin_id);
+    }
+    metrics_counter_inc(server_metrics.pins_undelivered);
+    handle_error_log(server, "> No worker of the %s took pin[pin_id=%d], it is dropped\n",
+                     component_type_to_string(message->receiver_type), pin->pin_id);
+    return true;
+}
+
+static const struct sockaddr_in* cast_to_sockaddr_in(
+    const struct sockaddr_storage* broadcast_address_storage, socklen_t broadcast_address_size) {
+    return broadcast_address_size == sizeof(struct sockaddr_in)
+               ? (const struct sockaddr_in*)broadcast_address_storage
+               : NULL;
+}
+
+/// @brief Forwards the pins of the @a stages (mask of the stage ComponentTypes)
+/// that lost their workers again, they are kept until they come back. The
+/// live workers keep theirs.
+static void reassign_outstanding_pins(Server server, uint32_t stages) {
+    Pin pins[SERVER_MAX_OUTSTANDING_PINS];
+    ComponentType pin_stages[SERVER_MAX_OUTSTANDING_PINS];
+    uint32_t count = 0;
+    pthread_mutex_lock(&server->peers_mutex);
+    for (uint32_t i = 0; i < SERVER_MAX_OUTSTANDING_PINS; i++) {
+        if (server->outstanding_pins.is_used[i] &&
+            server->outstanding_pins.peers[i] == SERVER_NO_PEER &&
+            (server->outstanding_pins.stages[i] & stages) != 0) {
+            pin_stages[count] = server->outstanding_pins.stages[i];
+            pins[count++]     = server->outstanding_pins.pins[i];
+        }
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
 
-    if (message.sender_type == COMPONENT_TYPE_SERVER) {
+    UDPMessage message = {
+        .sender_type  = COMPONENT_TYPE_SERVER,
+        .message_type = MESSAGE_TYPE_PIN_TRANSFERRING,
+    };
+    for (uint32_t i = 0; i < count; i++) {
+        message.receiver_type       = pin_stages[i];
+        message.message_content.pin = pins[i];
+        dispatch_pin_message(server, &message, true);
+    }
+    server_io_flush(current_server_io(server));
+    metrics_counter_add(server_metrics.pins_reassigned, count);
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        if ((stages & pipeline_stages[stage]) != 0) {
+            handle_log(server, "> Reassigned the outstanding pin(s) of the %s, %u in all\n",
+                       pipeline_stage_names[stage], count);
+        }
+    }
+}
+
+/// @brief Sends the pin of the @a message the @a from stage passed to the
+/// workers of the @a stage.
+static bool send_routed_pin(Server server, UDPMessage* message, uint32_t from, uint32_t stage) {
+    Pin* pin = &message->message_content.pin;
+    handle_pin_log(server, "> Transferring pin[pin_id=%d] to the %s workers\n", pin->pin_id,
+                   pipeline_stage_names[stage]);
+    pin_trace_server_forwarded(pin, from);
+    metrics_counter_inc(server_metrics.pins_routed[stage]);
+    message->sender_type   = COMPONENT_TYPE_SERVER;
+    message->receiver_type = pipeline_stages[stage];
+    // kept until it comes back, in case the worker that gets it dies
+    return dispatch_pin_message(server, message, server->pipeline.stages[stage].next_stages != 0);
+}
+
+/// @brief Not waited for: the dispatchers do not wait for the disk, a crash
+/// loses the pins of the last commit.
+static void journal_queue_pin(Server server, PinJournalRecordKind kind, uint32_t stage,
+                              const Pin* pin) {
+    if (server->has_journal) {
+        pin_journal_append(&server->journal, kind, stage, pin);
+    }
+}
+
+static void log_dropped_queue_pin(Server server, const StageQueueEntry* entry, uint32_t stage,
+                                  bool is_expired, uint64_t now_ns) {
+    journal_queue_pin(server, PIN_JOURNAL_REJECTED, stage, &entry->pin);
+    metrics_counter_inc(is_expired ? server_metrics.pins_expired : server_metrics.pins_shed);
+    handle_pin_log(server,
+                   "> %s pin[pin_id=%d | priority=%u] after %.3f s in the queue of the %s\n",
+                   is_expired ? "Expired" : "Shed", entry->pin.pin_id, entry->pin.priority,
+                   (double)(now_ns - entry->enqueued_ns) / 1e9, pipeline_stage_names[stage]);
+}
+
+/// @return pins the workers of the @a stage may still get from its queue.
+/// queues_mutex must be held.
+static uint64_t stage_queue_window(Server server, uint32_t stage, uint32_t concurrency,
+                                   uint64_t pins_processed) {
+    ServerStageQueue* queue = &server->queues[stage];
+    const uint64_t sent     = queue->queue.pins_popped - queue->window_offset;
+    // the pins the stage got around the queue (e.g. reassigned) give no credit
+    if (sent < pins_processed) {
+        queue->window_offset = queue->queue.pins_popped - pins_processed;
+    }
+    const uint64_t in_flight = sent > pins_processed ? sent - pins_processed : 0;
+    const uint64_t window    = (uint64_t)concurrency * server->queue_window;
+    return window > in_flight ? window - in_flight : 0;
+}
+
+/// @brief The window of the @a stage starts over, the pins its dead workers did not
+/// process hold it no more. peers_mutex must be held.
+static void reset_stage_queue_window(Server server, uint32_t stage) {
+    ServerStageQueue* queue = &server->queues[stage];
+    pthread_mutex_lock(&server->queues_mutex);
+    queue->window_offset = queue->queue.pins_popped - server->balance.pins_processed[stage];
+    pthread_mutex_unlock(&server->queues_mutex);
+}
+
+/// @brief Sends the pins of the queue of the @a stage its window lets
+/// through, all of them if @a is_forced, and drops the expired ones.
+static void release_stage_queue(Server server, uint32_t stage, bool is_forced) {
+    enum { RELEASE_BATCH = 16 };
+    pthread_mutex_lock(&server->peers_mutex);
+    const uint32_t concurrency =
+        server_stage_peers(&server->peers, pipeline_stages[stage])->total_weight;
+    const uint64_t pins_processed = server->balance.pins_processed[stage];
+    pthread_mutex_unlock(&server->peers_mutex);
+
+    UDPMessage message = {
+        .sender_type  = COMPONENT_TYPE_SERVER,
+        .message_type = MESSAGE_TYPE_PIN_TRANSFERRING,
+    };
+    StageQueue* queue = &server->queues[stage].queue;
+    bool is_released  = false;
+    for (bool has_more = true; has_more;) {
+        StageQueueEntry expired[RELEASE_BATCH];
+        StageQueueEntry released[RELEASE_BATCH];
+        uint32_t expired_count  = 0;
+        uint32_t released_count = 0;
+        const uint64_t now_ns   = monotonic_time_ns();
+        pthread_mutex_lock(&server->queues_mutex);
+        while (expired_count < RELEASE_BATCH &&
+               stage_queue_expire(queue, now_ns, &expired[expired_count])) {
+            expired_count++;
+        }
+        uint64_t window = UINT64_MAX;
+        if (!is_forced) {
+            window = stage_queue_window(server, stage, concurrency, pins_processed);
+        }
+        while (expired_count < RELEASE_BATCH && released_count < RELEASE_BATCH &&
+               window != 0 && stage_queue_pop(queue, &released[released_count])) {
+            released_count++;
+            window--;
+        }
+        has_more = (expired_count == RELEASE_BATCH || released_count == RELEASE_BATCH) &&
+                   queue->count != 0;
+        pthread_mutex_unlock(&server->queues_mutex);
+        metrics_gauge_add(server_metrics.queued_pins, -(int64_t)(expired_count + released_count));
+
+        for (uint32_t i = 0; i < expired_count; i++) {
+            log_dropped_queue_pin(server, &expired[i], stage, true, now_ns);
+        }
+        for (uint32_t i = 0; i < released_count; i++) {
+            metrics_histogram_record(server_metrics.pin_queue_time,
+                                     now_ns - released[i].enqueued_ns);
+            message.message_content.pin = released[i].pin;
+            send_routed_pin(server, &message, released[i].from_stage, stage);
+            journal_queue_pin(server, PIN_JOURNAL_PASSED, stage, &released[i].pin);
+        }
+        is_released |= released_count != 0;
+    }
+    if (is_released) {
+        server_io_flush(current_server_io(server));
+    }
+}
+
+static void release_stage_queues(Server server, bool is_forced) {
+    if (server->queue_policy == STAGE_QUEUE_OFF) {
+        return;
+    }
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        if (server->queues[stage].queue.entries != NULL) {
+            release_stage_queue(server, stage, is_forced);
+        }
+    }
+}
+
+/// @brief Queues the @a entry for the workers of the @a stage, a full queue
+/// sheds the pin worth the least.
+static void push_queue_entry(Server server, const StageQueueEntry* entry, uint32_t stage) {
+    // journaled first, its release may come right after the push
+    journal_queue_pin(server, PIN_JOURNAL_STARTED, stage, &entry->pin);
+    StageQueueEntry shed;
+    pthread_mutex_lock(&server->queues_mutex);
+    const bool is_queued = stage_queue_push(&server->queues[stage].queue, entry, &shed);
+    pthread_mutex_unlock(&server->queues_mutex);
+    if (is_queued) {
+        metrics_gauge_add(server_metrics.queued_pins, 1);
+    } else {
+        log_dropped_queue_pin(server, &shed, stage, false, monotonic_time_ns());
+    }
+}
+
+static void queue_routed_pin(Server server, const Pin* pin, uint32_t from, uint32_t stage) {
+    const uint64_t now_ns       = monotonic_time_ns();
+    const uint64_t deadline_ns  = pin->deadline_ms != 0 ? pin->deadline_ms * 1000000ull
+                                                        : server->queue_deadline_ns;
+    const StageQueueEntry entry = {
+        .pin         = *pin,
+        .from_stage  = from,
+        .enqueued_ns = now_ns,
+        .deadline_ns = now_ns + deadline_ns,
+    };
+    push_queue_entry(server, &entry, stage);
+}
+
+/// @brief Routes the pin the @a from stage passed to all its next stages, a
+/// copy to every one of them. With the stage queues the copies wait in the
+/// queues of the next stages until their windows let them through.
+static bool server_route_stage_pin(Server server, UDPMessage* message, uint32_t from) {
+    const Pin* pin             = &message->message_content.pin;
+    const uint32_t next_stages = server->pipeline.stages[from].next_stages;
+    if (!server->pipeline.stages[from].is_entry) {
+        complete_outstanding_pin(server, pipeline_stages[from], pin->pin_id);
+    }
+    if (server->queue_policy != STAGE_QUEUE_OFF) {
+        for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+            if ((next_stages & pipeline_stages[stage]) != 0) {
+                queue_routed_pin(server, pin, from, stage);
+            }
+        }
+        for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+            if ((next_stages & pipeline_stages[stage]) != 0) {
+                release_stage_queue(server, stage, false);
+            }
+        }
         return true;
     }
+    uint32_t copies = pipeline_fan_out(&server->pipeline, from);
+    bool ok         = true;
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        if ((next_stages & pipeline_stages[stage]) == 0) {
+            continue;
+        }
+        // the last copy is the received datagram itself, only its header changes; the others
+        // are sent from the stack, the sends of the datagram may still refer to its buffer
+        UDPMessage copy;
+        UDPMessage* routed = message;
+        if (--copies != 0) {
+            copy   = *message;
+            routed = &copy;
+        }
+        ok &= send_routed_pin(server, routed, from, stage);
+    }
+    return ok;
+}
 
-    ClientMetaInfo info;
-    fill_client_metainfo(&info, sock_addr);
-    switch (message.message_type) {
+/// @return total concurrency of the workers of the entry stages, peers_mutex must be held
+static uint32_t entry_stages_weight(const Server server, uint32_t* workers) {
+    uint32_t weight = 0;
+    *workers        = 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        if (server->pipeline.stages[i].is_entry) {
+            const ServerStagePeers* stage_peers =
+                server_stage_peers(&server->peers, pipeline_stages[i]);
+            weight += stage_peers->total_weight;
+            *workers += stage_peers->count;
+        }
+    }
+    return weight;
+}
+
+/// @brief The pins made at the @a pins_per_minute come to the server after
+/// the step of the entry stage, that delays some more than others, so the
+/// bucket takes SERVER_ADMISSION_TOLERANCE_MS of them on top of the @a burst.
+static void set_admission_bucket(TokenBucket* bucket, uint32_t pins_per_minute, uint32_t burst,
+                                 uint64_t now_ns) {
+    const double rate = pins_per_minute / 60.0;
+    token_bucket_set_rate(bucket, rate, burst + rate * SERVER_ADMISSION_TOLERANCE_MS / 1000.0,
+                          now_ns);
+}
+
+/// @brief Tells the workers of the entry stages their shares of the admission
+/// rate, in proportion to their concurrency: the ones whose share changed or
+/// all of them if @a is_repeated. The rest of a long list is told on the next call.
+static void advertise_admission_rates(Server server, bool is_repeated) {
+    ServerPeer peers[SERVER_ADMISSION_BATCH];
+    uint32_t shares[SERVER_ADMISSION_BATCH];
+    uint32_t count        = 0;
+    const uint64_t now_ns = monotonic_time_ns();
+    const uint32_t rate   = __atomic_load_n(&server->admission_rate, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&server->peers_mutex);
+    uint32_t workers            = 0;
+    const uint32_t total_weight = entry_stages_weight(server, &workers);
+    set_admission_bucket(&server->admission, rate,
+                         server->admission_burst * (workers != 0 ? workers : 1), now_ns);
+    for (uint32_t i = 0; i < PIPELINE_STAGES && count < SERVER_ADMISSION_BATCH; i++) {
+        if (!server->pipeline.stages[i].is_entry) {
+            continue;
+        }
+        const ServerStagePeers* stage_peers =
+            server_stage_peers(&server->peers, pipeline_stages[i]);
+        for (uint32_t j = 0; j < stage_peers->count && count < SERVER_ADMISSION_BATCH; j++) {
+            ServerPeer* peer = server_peer_at(&server->peers, stage_peers->peers[j]);
+            uint32_t share   = 0;
+            if (rate != 0) {
+                share = (uint32_t)((uint64_t)rate * peer->weight / total_weight);
+                share = share != 0 ? share : 1;
+            }
+            if (share == peer->admission_rate && (!is_repeated || share == 0)) {
+                continue;
+            }
+            set_admission_bucket(&peer->admission, share, server->admission_burst, now_ns);
+            peer->admission_rate = share;
+            peers[count]         = *peer;
+            shares[count++]      = share;
+        }
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const UDPMessage message = {
+            .sender_type               = COMPONENT_TYPE_SERVER,
+            .receiver_type             = peers[i].type,
+            .message_type              = MESSAGE_TYPE_ADMISSION_RATE,
+            .message_content.admission = {.pid             = peers[i].pid,
+                                          .pins_per_minute = shares[i],
+                                          .burst           = server->admission_burst},
+        };
+        send_message_to_peer(server, &peers[i], &message);
+    }
+    if (count != 0) {
+        server_io_flush(current_server_io(server));
+    }
+}
+
+/// @brief Checks the pin of a worker of an entry stage against its share of
+/// the admission rate and against the rate itself. The workers pace their
+/// pins, so only the ones that do not or that missed their share are dropped.
+/// @return false if the pin is above the rate
+static bool admit_entry_pin(Server server, const ClientMetaInfo* info) {
+    if (__atomic_load_n(&server->admission_rate, __ATOMIC_RELAXED) == 0) {
+        return true;
+    }
+    const uint64_t now_ns = monotonic_time_ns();
+    pthread_mutex_lock(&server->peers_mutex);
+    const uint32_t index = server_peer_table_find(&server->peers, &info->peer);
+    // the pins of an unknown worker count against the rate only
+    bool is_admitted =
+        index == SERVER_NO_PEER ||
+        token_bucket_take(&server_peer_at(&server->peers, index)->admission, now_ns);
+    is_admitted = is_admitted && token_bucket_take(&server->admission, now_ns);
+    pthread_mutex_unlock(&server->peers_mutex);
+    return is_admitted;
+}
+
+static void server_handle_invalid_pin_source(ComponentType pin_source, Server server,
+                                             const Pin* pin, const ClientMetaInfo* info) {
+    metrics_counter_inc(server_metrics.pins_from_invalid_source);
+    handle_error_log(server,
+                     "> Error: invalid source %s[address=%s:%s | %s:%s] of the pin[pin_id=%d]\n",
+                     component_type_to_string(pin_source), info->host, info->port,
+                     info->numeric_host, info->numeric_port, pin->pin_id);
+}
+
+static bool server_handle_pin_transferring(Server server, UDPMessage* message,
+                                           const ClientMetaInfo* info) {
+    if (message->receiver_type != COMPONENT_TYPE_SERVER) {
+        return true;
+    }
+
+    const Pin* pin = &message->message_content.pin;
+    handle_pin_log(server, "> Received pin[pin_id=%d] from the\n> %s[address=%s:%s | %s:%s]\n",
+                   pin->pin_id, component_type_to_string(message->sender_type), info->host,
+                   info->port, info->numeric_host, info->numeric_port);
+    const int32_t stage = pipeline_stage_index(message->sender_type);
+    if (stage < 0 || server->pipeline.stages[stage].next_stages == 0) {
+        server_handle_invalid_pin_source(message->sender_type, server, pin, info);
+        return true;
+    }
+    if (server->pipeline.stages[stage].is_entry && !admit_entry_pin(server, info)) {
+        metrics_counter_inc(server_metrics.pins_not_admitted);
+        handle_pin_log(server, "> Dropped pin[pin_id=%d] above the admission rate\n",
+                       pin->pin_id);
+        return true;
+    }
+    return server_route_stage_pin(server, message, (uint32_t)stage);
+}
+
+static bool server_handle_new_client(Server server, const UDPMessage* message,
+                                     const ClientMetaInfo* info) {
+    bool regains_stage  = false;
+    const int32_t stage = pipeline_stage_index(message->sender_type);
+    if (message->sender_type != 0) {
+        ServerPeer peer = info->peer;
+        peer.weight     = message->message_content.heartbeat.concurrency;
+        peer.load       = message->message_content.heartbeat.load;
+        peer.has_load   = true;
+        peer.roles      = message->message_content.heartbeat.roles;
+        pthread_mutex_lock(&server->peers_mutex);
+        regains_stage = add_server_peer(server, &peer, monotonic_time_ns());
+        pthread_mutex_unlock(&server->peers_mutex);
+    }
+    const char* client_type_str = component_type_to_string(message->sender_type);
+    bool ret                    = handle_log(
+        server, "> New client with type \"%s\"[address=%s:%s | %s:%s] sent signal of presence\n",
+        client_type_str, info->host, info->port, info->numeric_host, info->numeric_port);
+    if (regains_stage) {
+        reassign_outstanding_pins(server, message->sender_type);
+    }
+    if (stage >= 0 && server->pipeline.stages[stage].is_entry) {
+        advertise_admission_rates(server, false);
+    }
+    return ret;
+}
+
+/// @brief A heartbeat of an unknown client registers it again: it was taken
+/// for a dead one or it registered before a restart of the server.
+static bool server_handle_heartbeat(Server server, const UDPMessage* message,
+                                    const ClientMetaInfo* info) {
+    if (!has_failure_detector(server) || message->sender_type == 0) {
+        return true;
+    }
+    const uint64_t now_ns = monotonic_time_ns();
+    ServerPeer peer       = info->peer;
+    peer.weight           = message->message_content.heartbeat.concurrency;
+    peer.load             = message->message_content.heartbeat.load;
+    peer.has_load         = true;
+    peer.roles            = message->message_content.heartbeat.roles;
+    pthread_mutex_lock(&server->peers_mutex);
+    const uint32_t index = server_peer_table_find(&server->peers, &peer);
+    bool is_rejoined     = index == SERVER_NO_PEER;
+    bool regains_stage   = false;
+    if (is_rejoined) {
+        regains_stage = add_server_peer(server, &peer, now_ns);
+    } else {
+        failure_detector_heartbeat(&server->failure_detector, index, now_ns);
+        update_server_peer_weight(server, index, peer.weight);
+        record_server_peer_load(server, index, peer.load);
+        server_peer_at(&server->peers, index)->roles = peer.roles;
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (!is_rejoined) {
+        return true;
+    }
+
+    char address[64];
+    describe_server_peer(&info->peer, address, sizeof(address));
+    bool ret = handle_log(server, "> %s[%s] is alive again, routing to it\n",
+                          component_type_to_string(message->sender_type), address);
+    if (regains_stage) {
+        reassign_outstanding_pins(server, message->sender_type);
+    }
+    return ret;
+}
+
+static bool server_handle_invalid_message_type(Server server, const UDPMessage* message,
+                                               const ClientMetaInfo* info) {
+    return handle_error_log(
+        server,
+        "> Error: invalid message type %s[value=%u] from the\n> %s[address=%s:%s | %s:%s]\n",
+        message_type_to_string(message->message_type), (uint32_t)message->message_type,
+        component_type_to_string(message->sender_type), info->host, info->port, info->numeric_host,
+        info->numeric_port);
+}
+
+static bool is_single_client_type(ComponentType type) {
+    return type != 0 && (type & (type - 1)) == 0 && (type & COMPONENT_TYPE_ANY_CLIENT) == type;
+}
+
+static ServerCommandResult shutdown_server_clients(Server server, ComponentType type) {
+    switch (type) {
+        case COMPONENT_TYPE_SERVER:
+            alarm(1);
+            return SERVER_COMMAND_SUCCESS;
+        case COMPONENT_TYPE_FIRST_STAGE_WORKER:
+        case COMPONENT_TYPE_SECOND_STAGE_WORKER:
+        case COMPONENT_TYPE_THIRD_STAGE_WORKER:
+        case COMPONENT_TYPE_FOURTH_STAGE_WORKER:
+        case COMPONENT_TYPE_FIFTH_STAGE_WORKER:
+        case COMPONENT_TYPE_LOGS_COLLECTOR:
+        case COMPONENT_TYPE_MANAGER:
+            return send_shutdown_signal_to_client(server, type) ? SERVER_COMMAND_SUCCESS
+                                                                : SERVER_INTERNAL_ERROR;
+        default:
+            return INVALID_SERVER_COMMAND_ARGS;
+    }
+}
+
+static bool send_shutdown_signal_to_peer(Server server, const ServerPeer* peer) {
+    const UDPMessage message = {
+        .sender_type              = COMPONENT_TYPE_SERVER,
+        .receiver_type            = peer->type,
+        .message_type             = MESSAGE_TYPE_SHUTDOWN_MESSAGE,
+        .message_content.shutdown = {.pid = peer->pid},
+    };
+    return send_message_to_peer(server, peer, &message);
+}
+
+/// @brief The client stays in the routing until the failure detector misses its heartbeats.
+static ServerCommandResult stop_server_client(Server server, uint32_t client_id) {
+    pthread_mutex_lock(&server->peers_mutex);
+    const bool is_registered =
+        client_id < server->peers.capacity && server_peer_at(&server->peers, client_id)->is_used;
+    const ServerPeer peer = is_registered ? *server_peer_at(&server->peers, client_id)
+                                          : (ServerPeer){.is_used = false};
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (!is_registered || peer.type == COMPONENT_TYPE_SERVER) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    return send_shutdown_signal_to_peer(server, &peer) ? SERVER_COMMAND_SUCCESS
+                                                       : SERVER_INTERNAL_ERROR;
+}
+
+/// @brief Stops the workers at the end of the dispatch list of the @a stage.
+/// @return number of the workers left in it
+static ServerCommandReply resize_server_stage(Server server, ComponentType stage,
+                                              uint32_t workers) {
+    if (pipeline_stage_index(stage) < 0) {
+        return (ServerCommandReply){.result = INVALID_SERVER_COMMAND_ARGS};
+    }
+    ServerCommandReply reply = {.result = SERVER_COMMAND_SUCCESS, .value = workers};
+    // the peers are sent the signal outside of the lock, a batch at a time
+    ServerPeer peers[SERVER_EXPIRED_PEERS_BATCH];
+    uint32_t position = workers;
+    while (true) {
+        uint32_t count = 0;
+        pthread_mutex_lock(&server->peers_mutex);
+        const ServerStagePeers* stage_peers = server_stage_peers(&server->peers, stage);
+        if (position == workers && stage_peers->count < workers) {
+            reply.value = stage_peers->count;
+        }
+        for (; position < stage_peers->count && count < SERVER_EXPIRED_PEERS_BATCH; position++) {
+            peers[count++] = *server_peer_at(&server->peers, stage_peers->peers[position]);
+        }
+        pthread_mutex_unlock(&server->peers_mutex);
+        if (count == 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (!send_shutdown_signal_to_peer(server, &peers[i])) {
+                reply.result = SERVER_INTERNAL_ERROR;
+            }
+        }
+    }
+    return reply;
+}
+
+static bool is_valid_worker_concurrency(uint32_t concurrency) {
+    return concurrency != 0 && concurrency <= WORKER_MAX_CONCURRENCY;
+}
+
+/// @brief The worker gets the share of the pins of its new concurrency right
+/// away, its next heartbeats confirm it.
+static ServerCommandResult set_server_client_concurrency(Server server, uint32_t client_id,
+                                                         uint32_t concurrency) {
+    if (!is_valid_worker_concurrency(concurrency)) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    pthread_mutex_lock(&server->peers_mutex);
+    const ServerPeer* registered =
+        client_id < server->peers.capacity ? server_peer_at(&server->peers, client_id) : NULL;
+    const bool is_worker = registered != NULL && registered->is_used &&
+                           pipeline_stage_index(registered->type) >= 0;
+    ServerPeer peer = {.is_used = false};
+    if (is_worker) {
+        server_peer_table_set_weight(&server->peers, client_id, concurrency);
+        peer = *registered;
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (!is_worker) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    const UDPMessage message = {
+        .sender_type                 = COMPONENT_TYPE_SERVER,
+        .receiver_type               = peer.type,
+        .message_type                = MESSAGE_TYPE_WORKER_CONCURRENCY,
+        .message_content.concurrency = {.pid = peer.pid, .concurrency = concurrency},
+    };
+    return send_message_to_peer(server, &peer, &message) ? SERVER_COMMAND_SUCCESS
+                                                          : SERVER_INTERNAL_ERROR;
+}
+
+static ServerCommandResult set_server_stage_concurrency(Server server, ComponentType stage,
+                                                        uint32_t concurrency) {
+    if (pipeline_stage_index(stage) < 0 || !is_valid_worker_concurrency(concurrency)) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    pthread_mutex_lock(&server->peers_mutex);
+    const ServerStagePeers* stage_peers = server_stage_peers(&server->peers, stage);
+    for (uint32_t i = 0; i < stage_peers->count; i++) {
+        server_peer_table_set_weight(&server->peers, stage_peers->peers[i], concurrency);
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    const UDPMessage message = {
+        .sender_type                 = COMPONENT_TYPE_SERVER,
+        .receiver_type               = stage,
+        .message_type                = MESSAGE_TYPE_WORKER_CONCURRENCY,
+        .message_content.concurrency = {.pid = 0, .concurrency = concurrency},
+    };
+    return send_message(server, &message) ? SERVER_COMMAND_SUCCESS : SERVER_INTERNAL_ERROR;
+}
+
+static bool is_valid_worker_roles(uint32_t roles) {
+    return roles != 0 && (roles & ~(uint32_t)COMPONENT_TYPE_ANY_WORKER) == 0;
+}
+
+static bool send_worker_roles(Server server, const ServerPeer* peer, uint32_t roles) {
+    const UDPMessage message = {
+        .sender_type           = COMPONENT_TYPE_SERVER,
+        .receiver_type         = peer->type,
+        .message_type          = MESSAGE_TYPE_WORKER_ROLES,
+        .message_content.roles = {.pid = peer->pid, .roles = roles},
+    };
+    return send_message_to_peer(server, peer, &message);
+}
+
+/// @brief Moves the multi-role worker process of the @a client_id worker to the
+/// @a roles stages, the routing follows once its workers register or leave.
+static ServerCommandResult set_server_worker_roles(Server server, uint32_t client_id,
+                                                   uint32_t roles) {
+    if (!is_valid_worker_roles(roles)) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    pthread_mutex_lock(&server->peers_mutex);
+    const bool is_registered =
+        client_id < server->peers.capacity && server_peer_at(&server->peers, client_id)->is_used;
+    const ServerPeer peer = is_registered ? *server_peer_at(&server->peers, client_id)
+                                          : (ServerPeer){.is_used = false};
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (!is_registered || peer.roles == 0) {
+        return INVALID_SERVER_COMMAND_ARGS;
+    }
+    return send_worker_roles(server, &peer, roles) ? SERVER_COMMAND_SUCCESS
+                                                    : SERVER_INTERNAL_ERROR;
+}
+
+static ServerCommandReply get_server_client(Server server, ComponentType type, uint32_t position) {
+    if (!is_single_client_type(type)) {
+        return (ServerCommandReply){.result = INVALID_SERVER_COMMAND_ARGS};
+    }
+    ServerCommandReply reply = {.result = INVALID_SERVER_COMMAND_ARGS};
+    pthread_mutex_lock(&server->peers_mutex);
+    const ServerStagePeers* stage_peers = server_stage_peers(&server->peers, type);
+    if (position < stage_peers->count) {
+        const uint32_t index = stage_peers->peers[position];
+        reply.result         = SERVER_COMMAND_SUCCESS;
+        reply.value =
+            server_command_client_value(index, server_peer_at(&server->peers, index)->pid);
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    return reply;
+}
+
+static ServerCommandReply query_server_stat(Server server, ComponentType type, ServerStat stat) {
+    ServerCommandReply reply = {.result = SERVER_COMMAND_SUCCESS};
+    switch (stat) {
+        case SERVER_STAT_CLIENTS:
+            if (!is_single_client_type(type)) {
+                reply.result = INVALID_SERVER_COMMAND_ARGS;
+                break;
+            }
+            reply.value =
+                __atomic_load_n(&server->clients[component_type_index(type)], __ATOMIC_RELAXED);
+            break;
+        case SERVER_STAT_PINS_ROUTED:
+            if (pipeline_stage_index(type) >= 0) {
+                reply.value =
+                    metrics_counter_value(server_metrics.pins_routed[pipeline_stage_index(type)]);
+            } else {
+                reply.result = INVALID_SERVER_COMMAND_ARGS;
+            }
+            break;
+        case SERVER_STAT_OUTSTANDING_PINS:
+            pthread_mutex_lock(&server->peers_mutex);
+            reply.value = server->outstanding_pins.count;
+            pthread_mutex_unlock(&server->peers_mutex);
+            break;
+        case SERVER_STAT_PEERS_REMOVED:
+            reply.value = metrics_counter_value(server_metrics.peers_removed);
+            break;
+        case SERVER_STAT_LOGS_QUEUE_DEPTH: {
+            const int64_t depth = metrics_gauge_value(server_metrics.logs_queue_depth);
+            reply.value         = depth > 0 ? (uint64_t)depth : 0;
+            break;
+        }
+        case SERVER_STAT_CONCURRENCY:
+            if (pipeline_stage_index(type) < 0) {
+                reply.result = INVALID_SERVER_COMMAND_ARGS;
+                break;
+            }
+            pthread_mutex_lock(&server->peers_mutex);
+            reply.value = server_stage_peers(&server->peers, type)->total_weight;
+            pthread_mutex_unlock(&server->peers_mutex);
+            break;
+        case SERVER_STAT_ARRIVAL_RATE:
+        case SERVER_STAT_SERVICE_TIME:
+        case SERVER_STAT_QUEUE_LENGTH: {
+            const int32_t stage = pipeline_stage_index(type);
+            if (stage < 0) {
+                reply.result = INVALID_SERVER_COMMAND_ARGS;
+                break;
+            }
+            pthread_mutex_lock(&server->peers_mutex);
+            const StageLoad load = server->balance.stages[stage];
+            pthread_mutex_unlock(&server->peers_mutex);
+            if (stat == SERVER_STAT_ARRIVAL_RATE) {
+                reply.value = (uint64_t)(load.arrival_rate * 60 + 0.5);
+            } else if (stat == SERVER_STAT_SERVICE_TIME) {
+                reply.value = (uint64_t)(load.service_time_s * 1000 + 0.5);
+            } else {
+                reply.value = load.queue_length;
+            }
+            break;
+        }
+        case SERVER_STAT_BOTTLENECK:
+            pthread_mutex_lock(&server->peers_mutex);
+            reply.value = server->balance.bottleneck != STAGE_BALANCE_NO_STAGE
+                              ? pipeline_stages[server->balance.bottleneck]
+                              : 0;
+            pthread_mutex_unlock(&server->peers_mutex);
+            break;
+        case SERVER_STAT_QUEUED_PINS:
+        case SERVER_STAT_PINS_SHED: {
+            const int32_t stage = pipeline_stage_index(type);
+            if (stage < 0) {
+                reply.result = INVALID_SERVER_COMMAND_ARGS;
+                break;
+            }
+            const StageQueue* queue = &server->queues[stage].queue;
+            pthread_mutex_lock(&server->queues_mutex);
+            reply.value = stat == SERVER_STAT_QUEUED_PINS ? queue->count
+                                                          : queue->pins_shed + queue->pins_expired;
+            pthread_mutex_unlock(&server->queues_mutex);
+            break;
+        }
+        case SERVER_STAT_ADMISSION_RATE:
+            reply.value = __atomic_load_n(&server->admission_rate, __ATOMIC_RELAXED);
+            break;
+        case SERVER_STAT_PINS_NOT_ADMITTED:
+            reply.value = metrics_counter_value(server_metrics.pins_not_admitted);
+            break;
+        case SERVER_STATS_COUNT:
+        default:
+            reply.result = INVALID_SERVER_COMMAND_ARGS;
+            break;
+    }
+    return reply;
+}
+
+static ServerCommandReply execute_command(Server server, const ServerCommand cmd) {
+    ServerCommandReply reply = {.result = INVALID_SERVER_COMMAND_ARGS};
+    switch (cmd.type) {
+        case SERVER_COMMAND_SHUTDOWN_CLIENTS:
+            reply.result = shutdown_server_clients(server, cmd.client_type);
+            break;
+        case SERVER_COMMAND_STOP_CLIENT:
+            reply.result = stop_server_client(server, cmd.client_id);
+            break;
+        case SERVER_COMMAND_DRAIN_STAGE:
+            if (pipeline_stage_index(cmd.client_type) >= 0) {
+                reply.result = send_drain_request(server, cmd.client_type) ? SERVER_COMMAND_SUCCESS
+                                                                           : SERVER_INTERNAL_ERROR;
+            }
+            break;
+        case SERVER_COMMAND_RESIZE_STAGE:
+            reply = resize_server_stage(server, cmd.client_type, cmd.argument);
+            break;
+        case SERVER_COMMAND_GET_CLIENT:
+            reply = get_server_client(server, cmd.client_type, cmd.argument);
+            break;
+        case SERVER_COMMAND_QUERY_STAT:
+            reply = query_server_stat(server, cmd.client_type, (ServerStat)cmd.argument);
+            break;
+        case SERVER_COMMAND_SET_LOG_LEVEL:
+            if (cmd.argument <= SERVER_LOG_PINS) {
+                __atomic_store_n(&server->log_level, cmd.argument, __ATOMIC_RELAXED);
+                reply.result = SERVER_COMMAND_SUCCESS;
+            }
+            break;
+        case SERVER_COMMAND_SET_CONCURRENCY:
+            reply.result = set_server_client_concurrency(server, cmd.client_id, cmd.argument);
+            break;
+        case SERVER_COMMAND_SET_STAGE_CONCURRENCY:
+            reply.result = set_server_stage_concurrency(server, cmd.client_type, cmd.argument);
+            break;
+        case SERVER_COMMAND_SET_BALANCE_MODE:
+            if (cmd.argument <= SERVER_BALANCE_DIRECT) {
+                __atomic_store_n(&server->balance_mode, cmd.argument, __ATOMIC_RELAXED);
+                reply.result = SERVER_COMMAND_SUCCESS;
+            }
+            break;
+        case SERVER_COMMAND_SET_WORKER_ROLES:
+            reply.result = set_server_worker_roles(server, cmd.client_id, cmd.argument);
+            break;
+        case SERVER_COMMAND_SET_ADMISSION_RATE:
+            __atomic_store_n(&server->admission_rate, cmd.argument, __ATOMIC_RELAXED);
+            advertise_admission_rates(server, false);
+            if (cmd.argument != 0) {
+                handle_log(server, "> Admission rate set to %u pin(s) a minute\n", cmd.argument);
+            } else {
+                handle_log(server, "> Admission rate is not limited anymore\n");
+            }
+            reply.result = SERVER_COMMAND_SUCCESS;
+            break;
+        default:
+            break;
+    }
+    return reply;
+}
+
+/// @brief Answers the manager the batch came from only: the UDP managers send
+/// from their own socket, the TCP ones get it over their connection.
+static bool send_command_results_to_manager(Server server, const ManagerCommandResults* results,
+                                            const ClientMetaInfo* info) {
+    UDPMessage message = {
+        .sender_type                     = COMPONENT_TYPE_SERVER,
+        .receiver_type                   = COMPONENT_TYPE_MANAGER,
+        .message_type                    = MESSAGE_TYPE_MANAGER_COMMAND_RESULT,
+        .message_content.command_results = *results,
+    };
+    bool ok;
+    switch (info->peer.transport) {
+        case SERVER_PEER_UDP:
+            ok = server_io_send_to(current_server_io(server), &message, &info->peer.address);
+            break;
+        case SERVER_PEER_TCP:
+            ok = server->has_tcp_transport &&
+                 tcp_server_send(&server->tcp_transport, info->peer.slot, &info->peer.address,
+                                 &message);
+            metrics_counter_add(server_metrics.tcp_messages_out, ok);
+            break;
+        case SERVER_PEER_SHM:
+        default:
+            ok = send_message(server, &message);
+            break;
+    }
+    if (ok) {
+        metrics_counter_inc(server_metrics.messages_out[message.message_type]);
+    }
+    return ok;
+}
+
+static bool server_handler_manager_command(Server server, const UDPMessage* message,
+                                           const ClientMetaInfo* info) {
+    const ManagerCommandBatch* batch = &message->message_content.command_batch;
+
+    ManagerCommandResults results = {
+        .request_id = batch->request_id,
+        .count      = batch->count,
+    };
+    if (results.count > MANAGER_MAX_BATCH_COMMANDS) {
+        results.count = MANAGER_MAX_BATCH_COMMANDS;
+    }
+    uint32_t succeeded = 0;
+    for (uint32_t i = 0; i < results.count; i++) {
+        results.replies[i] = execute_command(server, batch->commands[i]);
+        succeeded += results.replies[i].result == SERVER_COMMAND_SUCCESS;
+    }
+    // the commands of a batch are logged as one entry, a large batch would flood the logs
+    bool success = handle_log(server,
+                              "> Executed request %u of %u command(s), %u succeeded\n"
+                              "> from manager[address=%s:%s | %s:%s]\n",
+                              results.request_id, results.count, succeeded, info->host, info->port,
+                              info->numeric_host, info->numeric_port);
+    if (results.count == 1) {
+        const ServerCommand* command = &batch->commands[0];
+        success &= handle_log(
+            server, "> Command \"%s\"[client type=%s, client id=%u, argument=%u]: %s\n",
+            server_command_type_to_string(command->type),
+            component_type_to_string(command->client_type), command->client_id, command->argument,
+            server_command_result_to_string(results.replies[0].result));
+    }
+    if (!send_command_results_to_manager(server, &results, info)) {
+        fputs("> Could not send command results to the manager\n", stderr);
+        success = false;
+    }
+    return success;
+}
+
+static bool server_handle_drain_report(Server server, const UDPMessage* message,
+                                       const ClientMetaInfo* info) {
+    const int32_t stage_index = pipeline_stage_index(message->sender_type);
+    if (stage_index < 0) {
+        return server_handle_invalid_message_type(server, message, info);
+    }
+    // the pins forwarded before the report must leave before the next stage is asked to drain
+    server_io_flush(current_server_io(server));
+
+    const PipelineDrainReport report = message->message_content.drain_report;
+    bool ret                         = handle_log(
+        server, "> %s[address=%s:%s | %s:%s] %s: received %u pin(s), sent %u pin(s)\n",
+        component_type_to_string(message->sender_type), info->host, info->port,
+        info->numeric_host, info->numeric_port, report.has_left ? "left" : "drained",
+        report.pins_received, report.pins_sent);
+
+    pthread_mutex_lock(&server->drain_mutex);
+    PipelineStageDrain* stage = &server->drain_stages[stage_index];
+    // the worker that left is no longer counted among the workers of the stage
+    stage->reports += !report.has_left;
+    stage->pins_received += report.pins_received;
+    stage->pins_sent += report.pins_sent;
+    pthread_cond_broadcast(&server->drain_cond);
+    pthread_mutex_unlock(&server->drain_mutex);
+    return ret;
+}
+
+/// @brief Takes the worker out of the routing at its request, e.g. a
+/// multi-role worker that moves to other stages. The confirmation goes the
+/// way of its pins, so the worker gets it behind all the pins routed to it;
+/// the worker finishes them and releases its shared memory slot or TCP
+/// connection itself.
+static bool server_handle_worker_leave(Server server, const UDPMessage* message,
+                                       const ClientMetaInfo* info) {
+    if (pipeline_stage_index(message->sender_type) < 0) {
+        return server_handle_invalid_message_type(server, message, info);
+    }
+    pthread_mutex_lock(&server->peers_mutex);
+    const uint32_t index = server_peer_table_find(&server->peers, &info->peer);
+    ServerPeer peer      = info->peer;
+    if (index != SERVER_NO_PEER) {
+        peer = *server_peer_at(&server->peers, index);
+        failure_detector_untrack(&server->failure_detector, index);
+        server_peer_table_remove(&server->peers, index);
+        count_server_client(server, &peer, -1);
+        if (peer.transport == SERVER_PEER_SHM && peer.slot < SHM_TRANSPORT_MAX_PEERS &&
+            server->shm_peers[peer.slot] == index) {
+            server->shm_peers[peer.slot] = SERVER_NO_PEER;
+        }
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+
+    const UDPMessage confirmation = {
+        .sender_type               = COMPONENT_TYPE_SERVER,
+        .receiver_type             = peer.type,
+        .message_type              = MESSAGE_TYPE_WORKER_LEAVE,
+        .message_content.heartbeat = {.pid = peer.pid},
+    };
+    // an unknown worker is confirmed too, it may have been taken for a dead one
+    const bool is_confirmed = peer.transport == SERVER_PEER_SHM
+                                  ? send_pin_to_shm_peer(server, &peer, &confirmation)
+                                  : send_message_to_peer(server, &peer, &confirmation);
+    char address[64];
+    describe_server_peer(&peer, address, sizeof(address));
+    bool ret = handle_log(server, "> %s[%s] left the routing\n",
+                          component_type_to_string(peer.type), address);
+    if (!is_confirmed) {
+        fputs("> Could not confirm the leave to the worker\n", stderr);
+        ret = false;
+    }
+    return ret;
+}
+
+static void trace_received_pin(UDPMessage* message) {
+    const int32_t stage = pipeline_stage_index(message->sender_type);
+    // the last stage sends nothing, a pin from there is not routed
+    if (stage >= 0 && stage < PIN_TRACE_SERVER_HOPS) {
+        pin_trace_server_received(&message->message_content.pin, (uint32_t)stage);
+    }
+}
+
+/// @brief Stops routing to the dead @a index peer: it is forgotten, the shared
+/// memory slot is freed and the TCP connection is shut down for the poller to
+/// close it. peers_mutex must be held.
+/// @param has_exited the process of the peer is gone, it was not only silent
+/// @return stage ComponentType of the peer if the other workers of the stage
+/// take the outstanding pins it got now, 0 otherwise
+static uint32_t remove_server_peer(Server server, uint32_t index, uint64_t now_ns,
+                                   bool has_exited) {
+    const ServerPeer removed = *server_peer_at(&server->peers, index);
+    const ServerPeer* peer   = &removed;
+    const int32_t stage      = pipeline_stage_index(peer->type);
+    if (stage >= 0 && server->queues[stage].queue.entries != NULL) {
+        reset_stage_queue_window(server, (uint32_t)stage);
+    }
+    failure_detector_untrack(&server->failure_detector, index);
+    server_peer_table_remove(&server->peers, index);
+    count_server_client(server, peer, -1);
+    if (peer->transport == SERVER_PEER_SHM && server->shm_transport != NULL) {
+        if (peer->slot < SHM_TRANSPORT_MAX_PEERS && server->shm_peers[peer->slot] == index) {
+            server->shm_peers[peer->slot] = SERVER_NO_PEER;
+        }
+        pthread_mutex_lock(&server->shm_send_mutex);
+        shm_transport_release_peer(server->shm_transport, peer->slot, (pid_t)peer->pid);
+        pthread_mutex_unlock(&server->shm_send_mutex);
+    } else if (peer->transport == SERVER_PEER_TCP && server->has_tcp_transport) {
+        tcp_server_shutdown_connection(&server->tcp_transport, peer->slot, &peer->address);
+    }
+    metrics_counter_inc(server_metrics.peers_removed);
+
+    char address[64];
+    describe_server_peer(peer, address, sizeof(address));
+    if (has_exited) {
+        handle_log(server, "> %s[%s] exited without detaching, removed from the routing\n",
+                   component_type_to_string(peer->type), address);
+    } else {
+        const uint64_t silence_ns =
+            now_ns - server->failure_detector.peers[index].last_heartbeat_ns;
+        handle_log(server, "> %s[%s] sent no heartbeat for %.1f s, removed from the routing\n",
+                   component_type_to_string(peer->type), address, (double)silence_ns / 1e9);
+    }
+    const uint32_t orphans = orphan_outstanding_pins(&server->outstanding_pins, index);
+    if (stage < 0 || orphans == 0) {
+        return 0;
+    }
+    if (server->clients[component_type_index(peer->type)] == 0) {
+        handle_log(server, "> %u outstanding pin(s) wait for a %s worker\n",
+                   server->outstanding_pins.stage_counts[stage], pipeline_stage_names[stage]);
+        return 0;
+    }
+    return peer->type;
+}
+
+/// @brief Measures the stages once the balance interval passed, in every mode
+/// so that the managers can query them. peers_mutex must be held.
+/// @return true if it did, the @a balance is a copy of the measurements then
+static bool update_server_balance(Server server, uint64_t now_ns, StageBalance* balance) {
+    if (now_ns - server->balance.last_update_ns < server->balance_interval_ns) {
+        return false;
+    }
+    StageSample samples[PIPELINE_STAGES];
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const ServerStagePeers* stage_peers =
+            server_stage_peers(&server->peers, pipeline_stages[i]);
+        samples[i] = (StageSample){
+            .is_used     = server->pipeline.stages[i].is_used,
+            .is_entry    = server->pipeline.stages[i].is_entry,
+            .workers     = stage_peers->count,
+            .concurrency = stage_peers->total_weight,
+            .pins_routed = metrics_counter_value(server_metrics.pins_routed[i]),
+        };
+    }
+    update_stage_balance(&server->balance, samples, now_ns);
+    *balance = server->balance;
+    return true;
+}
+
+/// @brief Moves a multi-role worker process that hosts the from stage of the
+/// @a advice to its to stage.
+/// @return false if the from stage has no multi-role worker
+static bool move_stage_worker(Server server, const StageBalanceAdvice* advice) {
+    const ComponentType from_type = pipeline_stages[advice->from_stage];
+    ServerPeer peer               = {.is_used = false};
+    pthread_mutex_lock(&server->peers_mutex);
+    const ServerStagePeers* stage_peers = server_stage_peers(&server->peers, from_type);
+    for (uint32_t i = 0; i < stage_peers->count && !peer.is_used; i++) {
+        const ServerPeer* candidate = server_peer_at(&server->peers, stage_peers->peers[i]);
+        if (candidate->roles != 0) {
+            peer = *candidate;
+        }
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (!peer.is_used) {
+        return false;
+    }
+    const uint32_t roles = (peer.roles & ~(uint32_t)from_type) | pipeline_stages[advice->to_stage];
+    if (!send_worker_roles(server, &peer, roles)) {
+        fputs("> Could not move the worker to the bottleneck\n", stderr);
+        return false;
+    }
+    char address[64];
+    describe_server_peer(&peer, address, sizeof(address));
+    handle_log(server,
+               "> Moved a worker from the %s to the %s [%s], the pipeline keeps up with %.2f "
+               "pin(s)/s instead of %.2f\n",
+               pipeline_stage_names[advice->from_stage], pipeline_stage_names[advice->to_stage],
+               address, advice->advised_rate, advice->sustained_rate);
+    return true;
+}
+
+/// @brief Logs the load of every stage and the bottleneck as one log, and in
+/// the advise mode the worker that should move to the bottleneck. In the
+/// direct mode a multi-role worker moves there unless there is none to move.
+static void log_stage_balance(Server server, const StageBalance* balance) {
+    const uint32_t mode = __atomic_load_n(&server->balance_mode, __ATOMIC_RELAXED);
+    if (mode == SERVER_BALANCE_OFF) {
+        return;
+    }
+    char report[MAX_SERVER_LOG_SIZE];
+    size_t length = 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES && length < sizeof(report); i++) {
+        const StageLoad* load = &balance->stages[i];
+        if (!server->pipeline.stages[i].is_used) {
+            continue;
+        }
+        int ret = snprintf(report + length, sizeof(report) - length,
+                           "> %s: %.2f pin(s)/s in, %.1f s a pin, %llu queued, %u worker(s) of "
+                           "concurrency %u",
+                           pipeline_stage_names[i], load->arrival_rate,
+                           load->service_time_s, (unsigned long long)load->queue_length,
+                           load->workers, load->concurrency);
+        length += ret > 0 ? (size_t)ret : 0;
+        if (length < sizeof(report)) {
+            ret = load->is_measured
+                      ? snprintf(report + length, sizeof(report) - length,
+                                 ", keep up with %.2f pin(s)/s\n", load->sustained_rate)
+                      : snprintf(report + length, sizeof(report) - length, "\n");
+            length += ret > 0 ? (size_t)ret : 0;
+        }
+    }
+    const char* bottleneck = balance->bottleneck != STAGE_BALANCE_NO_STAGE
+                                 ? pipeline_stage_names[balance->bottleneck]
+                                 : "not measured yet";
+    handle_log(server, "%s> Bottleneck: %s\n", report, bottleneck);
+
+    StageBalanceAdvice advice;
+    if (mode >= SERVER_BALANCE_ADVISE && stage_balance_advise(balance, &advice) &&
+        (mode != SERVER_BALANCE_DIRECT || !move_stage_worker(server, &advice))) {
+        handle_log(server,
+                   "> Advice: move a worker from the %s to the %s, the pipeline keeps up with "
+                   "%.2f pin(s)/s instead of %.2f\n",
+                   pipeline_stage_names[advice.from_stage], pipeline_stage_names[advice.to_stage],
+                   advice.advised_rate, advice.sustained_rate);
+    }
+}
+
+void check_server_peers(Server server) {
+    const uint64_t now_ns = monotonic_time_ns();
+    pthread_mutex_lock(&server->peers_mutex);
+    // the workers attached to the shared memory bump a counter instead of sending heartbeats
+    for (uint32_t slot = 0; slot < SHM_TRANSPORT_MAX_PEERS && server->shm_transport != NULL;
+         slot++) {
+        const uint32_t index = server->shm_peers[slot];
+        if (index == SERVER_NO_PEER) {
+            continue;
+        }
+        ServerPeer* peer = server_peer_at(&server->peers, index);
+        if ((uint32_t)server->shm_transport->peers[slot].pid != peer->pid) {
+            continue;
+        }
+        const uint64_t heartbeats = shm_transport_peer_heartbeats(server->shm_transport, slot);
+        if (heartbeats != peer->shm_heartbeats) {
+            peer->shm_heartbeats = heartbeats;
+            failure_detector_heartbeat(&server->failure_detector, index, now_ns);
+            // the worker stores the load before it bumps the counter
+            record_server_peer_load(server, index,
+                                    shm_transport_peer_load(server->shm_transport, slot));
+        }
+    }
+    uint32_t dead_peers[SERVER_EXPIRED_PEERS_BATCH];
+    uint32_t count       = SERVER_EXPIRED_PEERS_BATCH;
+    uint32_t lost_stages = 0;
+    while (count == SERVER_EXPIRED_PEERS_BATCH) {
+        count = failure_detector_expire(&server->failure_detector, now_ns, dead_peers,
+                                        SERVER_EXPIRED_PEERS_BATCH);
+        for (uint32_t i = 0; i < count; i++) {
+            lost_stages |= remove_server_peer(server, dead_peers[i], now_ns, false);
+        }
+    }
+    StageBalance balance;
+    const bool is_measured = update_server_balance(server, now_ns, &balance);
+    pthread_mutex_unlock(&server->peers_mutex);
+    // every pin goes to one worker, the pins of the dead one would never come back
+    if (lost_stages != 0) {
+        reassign_outstanding_pins(server, lost_stages);
+    }
+    if (is_measured) {
+        log_stage_balance(server, &balance);
+    }
+    release_stage_queues(server, false);
+    // the shares follow the workers and their concurrency, they are repeated for the lost ones
+    const bool is_repeated =
+        now_ns - server->admission_sent_ns >= SERVER_ADMISSION_REPEAT_MS * 1000000ull;
+    if (is_repeated) {
+        server->admission_sent_ns = now_ns;
+    }
+    advertise_admission_rates(server, is_repeated);
+}
+
+static bool server_handle_message(Server server, UDPMessage* message,
+                                  const ClientMetaInfo* info) {
+    switch (message->message_type) {
         case MESSAGE_TYPE_PIN_TRANSFERRING:
-            return server_handle_pin_transferring(server, &message, &info);
+            return server_handle_pin_transferring(server, message, info);
         case MESSAGE_TYPE_NEW_CLIENT:
-            return server_handle_new_client(server, &message, &info);
+            return server_handle_new_client(server, message, info);
         case MESSAGE_TYPE_MANAGER_COMMAND:
-            return server_handler_manager_command(server, &message, &info);
+            return server_handler_manager_command(server, message, info);
+        case MESSAGE_TYPE_DRAIN_REPORT:
+            return server_handle_drain_report(server, message, info);
+        case MESSAGE_TYPE_HEARTBEAT:
+            return server_handle_heartbeat(server, message, info);
+        case MESSAGE_TYPE_WORKER_LEAVE:
+            return server_handle_worker_leave(server, message, info);
         default:
-            return server_handle_invalid_message_type(server, &message, &info);
+            return server_handle_invalid_message_type(server, message, info);
     }
 }
 
-bool nonblocking_enqueue_log(Server server, const ServerLog* log) {
-    assert(log && log->message[0] != '\0');
-    return server_logs_queue_nonblocking_enqueue(&server->logs_queue, log);
+static bool handle_received_datagram(Server server, UDPMessage* message,
+                                     const struct sockaddr_storage* broadcast_address_storage,
+                                     socklen_t broadcast_address_size) {
+    const struct sockaddr_in* sock_addr =
+        cast_to_sockaddr_in(broadcast_address_storage, broadcast_address_size);
+    if (sock_addr == NULL) {
+        fprintf(stderr, "> Unknown message sender of size %u\n", broadcast_address_size);
+        return true;
+    }
+
+    if (message->sender_type == COMPONENT_TYPE_SERVER) {
+        return true;
+    }
+    const uint64_t received_ns = monotonic_time_ns();
+    if (message->message_type < MESSAGE_TYPES_COUNT) {
+        metrics_counter_inc(server_metrics.messages_in[message->message_type]);
+    }
+    if (message->message_type == MESSAGE_TYPE_PIN_TRANSFERRING) {
+        trace_received_pin(message);
+    }
+
+    ClientMetaInfo info = {0};
+    fill_udp_client_metainfo(&info, message, sock_addr);
+    bool ret = server_handle_message(server, message, &info);
+    metrics_histogram_record(server_metrics.message_handling_time,
+                             monotonic_time_ns() - received_ns);
+    return ret;
 }
 
-bool dequeue_log(Server server, ServerLog* log) {
-    assert(log);
-    return server_logs_queue_dequeue(&server->logs_queue, log);
+/// @brief The datagrams of the senders of the other dispatchers reach the
+/// dispatcher only if its socket filter could not be attached.
+static bool is_datagram_of_other_dispatcher(const Server server, uint32_t dispatcher_index,
+                                            const struct sockaddr_storage* sender_address_storage,
+                                            socklen_t sender_address_size) {
+    if (server->dispatchers_count == 1 || server->dispatchers[dispatcher_index].is_steered) {
+        return false;
+    }
+    const struct sockaddr_in* sender =
+        cast_to_sockaddr_in(sender_address_storage, sender_address_size);
+    return sender != NULL &&
+           sender_dispatcher(sender, server->dispatchers_count) != dispatcher_index;
 }
 
-bool send_server_log(const Server server, const ServerLog* log) {
+/// @brief The request takes the path of the pins to the shared memory peers,
+/// so it is behind all the pins forwarded to them. It is broadcast over UDP
+/// too: the workers of the entry stages read only their sockets.
+static bool send_drain_request(Server server, ComponentType stage) {
     UDPMessage message = {
-        .sender_type   = COMPONENT_TYPE_SERVER,
-        .receiver_type = COMPONENT_TYPE_LOGS_COLLECTOR,
-        .message_type  = MESSAGE_TYPE_LOG,
+        .sender_type           = COMPONENT_TYPE_SERVER,
+        .receiver_type         = stage,
+        .message_type          = MESSAGE_TYPE_DRAIN_REQUEST,
+        .message_content.bytes = {0},
     };
-    memcpy(message.message_content.bytes, log, sizeof(*log));
-    return send_message(server, &message);
+    uint32_t overflowed = 0;
+    send_message_to_shm_peers(server, &message, &overflowed);
+    if (overflowed != 0) {
+        handle_error_log(server, "> Rings of %u %s(s) are full, they miss the drain request\n",
+                         overflowed, component_type_to_string(stage));
+    }
+    bool ok = send_message(server, &message);
+    server_io_flush(current_server_io(server));
+    return ok;
+}
+
+/// @return number of the workers of the stage that reported before the @a deadline
+static uint32_t wait_for_drain_reports(Server server, uint32_t stage_index, uint32_t workers,
+                                       const struct timespec* deadline) {
+    pthread_mutex_lock(&server->drain_mutex);
+    int ret = 0;
+    while (server->drain_stages[stage_index].reports < workers && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&server->drain_cond, &server->drain_mutex, deadline);
+    }
+    const uint32_t reports = server->drain_stages[stage_index].reports;
+    pthread_mutex_unlock(&server->drain_mutex);
+    return reports;
+}
+
+bool drain_server_pipeline(Server server, uint32_t stage_timeout_ms) {
+    // a worker moved to a drained stage would take new pins
+    uint32_t direct_mode = SERVER_BALANCE_DIRECT;
+    __atomic_compare_exchange_n(&server->balance_mode, &direct_mode, SERVER_BALANCE_ADVISE, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    bool is_complete = true;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const char* stage_str = component_type_to_string(pipeline_stages[i]);
+        // workers that died without a report are waited for until the timeout
+        const uint32_t workers = __atomic_load_n(
+            &server->clients[component_type_index(pipeline_stages[i])], __ATOMIC_RELAXED);
+        if (workers == 0) {
+            continue;
+        }
+        // the previous stages are drained, no pin comes into the queue anymore
+        if (server->queues[i].queue.entries != NULL) {
+            release_stage_queue(server, i, true);
+        }
+        if (!send_drain_request(server, pipeline_stages[i])) {
+            is_complete = false;
+            continue;
+        }
+        handle_log(server, "> Draining %u %s(s)\n", workers, stage_str);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += stage_timeout_ms / 1000;
+        deadline.tv_nsec += (long)(stage_timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        const uint32_t reports = wait_for_drain_reports(server, i, workers, &deadline);
+        if (reports < workers) {
+            handle_log(server, "> Only %u of %u %s(s) drained in time\n", reports, workers,
+                       stage_str);
+            is_complete = false;
+        }
+    }
+
+    PipelineStageDrain stages[PIPELINE_STAGES];
+    pthread_mutex_lock(&server->drain_mutex);
+    memcpy(stages, server->drain_stages, sizeof(stages));
+    pthread_mutex_unlock(&server->drain_mutex);
+    uint64_t dropped_pins = 0;
+    pthread_mutex_lock(&server->queues_mutex);
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        dropped_pins += server->queues[i].queue.pins_shed + server->queues[i].queue.pins_expired;
+    }
+    pthread_mutex_unlock(&server->queues_mutex);
+    const uint64_t not_admitted_pins = metrics_counter_value(server_metrics.pins_not_admitted);
+    // every pin a stage sends is routed to all its next stages, but the queues and the
+    // admission rate drop some
+    int64_t lost_pins = -(int64_t)(dropped_pins + not_admitted_pins);
+    char summary[MAX_SERVER_LOG_SIZE];
+    size_t length = 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES && length < sizeof(summary); i++) {
+        const PipelineStageConfig* config = &server->pipeline.stages[i];
+        if (!config->is_used) {
+            continue;
+        }
+        lost_pins += (int64_t)(stages[i].pins_sent * pipeline_fan_out(&server->pipeline, i));
+        lost_pins -= config->is_entry ? 0 : (int64_t)stages[i].pins_received;
+        int ret = 0;
+        if (config->is_entry) {
+            ret = snprintf(summary + length, sizeof(summary) - length, "%s sent %llu pin(s), ",
+                           pipeline_stage_names[i], (unsigned long long)stages[i].pins_sent);
+        } else if (config->next_stages != 0) {
+            ret = snprintf(summary + length, sizeof(summary) - length,
+                           "%s received %llu and sent %llu, ", pipeline_stage_names[i],
+                           (unsigned long long)stages[i].pins_received,
+                           (unsigned long long)stages[i].pins_sent);
+        } else {
+            ret = snprintf(summary + length, sizeof(summary) - length, "%s received %llu, ",
+                           pipeline_stage_names[i], (unsigned long long)stages[i].pins_received);
+        }
+        length += ret > 0 ? (size_t)ret : 0;
+    }
+    if (server->queue_policy != STAGE_QUEUE_OFF && length < sizeof(summary)) {
+        const int ret = snprintf(summary + length, sizeof(summary) - length,
+                                 "%llu shed or expired in the queues, ",
+                                 (unsigned long long)dropped_pins);
+        length += ret > 0 ? (size_t)ret : 0;
+    }
+    if (not_admitted_pins != 0 && length < sizeof(summary)) {
+        const int ret = snprintf(summary + length, sizeof(summary) - length,
+                                 "%llu above the admission rate, ",
+                                 (unsigned long long)not_admitted_pins);
+        length += ret > 0 ? (size_t)ret : 0;
+    }
+    handle_log(server, "> Pipeline %s: %s%lld pin(s) lost\n",
+               is_complete ? "drained" : "drain timed out", summary, (long long)lost_pins);
+    return is_complete;
+}
+
+static bool hand_over_peers(const Server server, int conn_fd) {
+    const ServerPeerTable* peers = &server->peers;
+    ServerPeersSnapshot snapshot = {0};
+    for (uint32_t i = 0; i < peers->capacity; i++) {
+        if (peers->peers[i].is_used) {
+            snapshot.indices[snapshot.count] = i;
+            snapshot.peers[snapshot.count++] = peers->peers[i];
+        }
+        const bool is_last = i + 1 == peers->capacity;
+        if (snapshot.count == SERVER_PEERS_PER_SNAPSHOT || (is_last && snapshot.count != 0)) {
+            if (!hot_restart_send(conn_fd, &snapshot, sizeof(snapshot), NULL, 0)) {
+                return false;
+            }
+            snapshot.count = 0;
+        }
+    }
+    return true;
+}
+
+static int compare_queue_entries(const void* left, const void* right) {
+    const uint64_t left_sequence  = ((const StageQueueEntry*)left)->sequence;
+    const uint64_t right_sequence = ((const StageQueueEntry*)right)->sequence;
+    return (left_sequence > right_sequence) - (left_sequence < right_sequence);
+}
+
+/// @brief Sends the pins of every queue in the order they came, the new
+/// server pushes them in that order so that they keep it.
+static bool hand_over_queues(const Server server, int conn_fd) {
+    ServerQueueSnapshot snapshot;
+    for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+        const StageQueue* queue = &server->queues[stage].queue;
+        if (queue->entries == NULL || queue->count == 0) {
+            continue;
+        }
+        StageQueueEntry* entries = malloc(queue->count * sizeof(*entries));
+        if (entries == NULL) {
+            app_perror("malloc");
+            return false;
+        }
+        memcpy(entries, queue->entries, queue->count * sizeof(*entries));
+        qsort(entries, queue->count, sizeof(*entries), &compare_queue_entries);
+        bool ok = true;
+        for (uint32_t i = 0; i < queue->count && ok; i += snapshot.count) {
+            snapshot.stage = stage;
+            snapshot.count = queue->count - i < SERVER_QUEUED_PINS_PER_SNAPSHOT
+                                 ? queue->count - i
+                                 : SERVER_QUEUED_PINS_PER_SNAPSHOT;
+            memcpy(snapshot.entries, entries + i, snapshot.count * sizeof(*entries));
+            ok = hot_restart_send(conn_fd, &snapshot, sizeof(snapshot), NULL, 0);
+        }
+        free(entries);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hand_over_server(Server server, int conn_fd) {
+    // the new process opens the journal once it took over, the queued pins stay in it
+    if (server->has_journal) {
+        close_pin_journal(&server->journal);
+        server->has_journal = false;
+    }
+    UDPMessage* logs[SERVER_MESSAGE_POOL_CAPACITY];
+    uint32_t logs_count = 0;
+    while (logs_count < SERVER_MESSAGE_POOL_CAPACITY &&
+           try_dequeue_log(server, &logs[logs_count])) {
+        logs_count++;
+    }
+
+    ServerSnapshot snapshot = {
+        .magic             = SERVER_SNAPSHOT_MAGIC,
+        .dispatchers_count = server->dispatchers_count,
+        .has_shm_transport = server->shm_transport != NULL,
+        .has_tcp_transport = server->has_tcp_transport,
+        .shm_next_peer     = server->shm_next_peer,
+        .logs              = logs_count,
+    };
+    memcpy(snapshot.udp_clients, server->udp_clients, sizeof(snapshot.udp_clients));
+    memcpy(snapshot.clients, server->clients, sizeof(snapshot.clients));
+    snapshot.peers            = server->peers.count;
+    snapshot.outstanding_pins = server->outstanding_pins;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        snapshot.queued_pins += server->queues[i].queue.count;
+    }
+    int fds[MAX_SERVER_DISPATCHERS + 2];
+    size_t fds_count = 0;
+    for (uint32_t i = 0; i < server->dispatchers_count; i++) {
+        fds[fds_count++] = server->dispatchers[i].sock_fd;
+    }
+    fds[fds_count++] = server->hot_restart_fd;
+    const TcpServer* tcp = &server->tcp_transport;
+    if (server->has_tcp_transport) {
+        fds[fds_count++] = tcp->listen_fd;
+        for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+            snapshot.tcp_connections += tcp->connections[i].fd != -1;
+        }
+    }
+
+    bool ok = hot_restart_send(conn_fd, &snapshot, sizeof(snapshot), fds, fds_count);
+    for (uint32_t i = 0; ok && server->has_tcp_transport && i < TCP_MAX_CONNECTIONS; i++) {
+        if (tcp->connections[i].fd != -1) {
+            TcpConnectionSnapshot connection = {.index = i, .connection = tcp->connections[i]};
+            ok = hot_restart_send(conn_fd, &connection, sizeof(connection),
+                                  &tcp->connections[i].fd, 1);
+        }
+    }
+    ok = ok && hand_over_peers(server, conn_fd) && hand_over_queues(server, conn_fd);
+    for (uint32_t i = 0; i < logs_count; i++) {
+        ok = ok && hot_restart_send(conn_fd, logs[i], sizeof(*logs[i]), NULL, 0);
+        message_pool_release(logs[i]);
+    }
+    char ack = 0;
+    ok       = ok && hot_restart_receive(conn_fd, &ack, sizeof(ack), NULL, NULL) &&
+         ack == HOT_RESTART_ACK;
+    if (!ok) {
+        fputs("> Hot restart failed, shutting down\n", stderr);
+        return false;
+    }
+    server->is_handed_over = true;
+    printf("> Handed over %zu socket(s), %u TCP connection(s), %u queued pin(s) and %u log(s)\n",
+           fds_count, snapshot.tcp_connections, snapshot.queued_pins, logs_count);
+    return true;
+}
+
+void wake_up_server(Server server) {
+    const uint64_t value = 1;
+    // the counter never gets read, so the fd stays readable for all the waiters
+    if (write(server->wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        app_perror("write[wake_up_server]");
+    }
+}
+
+bool wait_server_wakeup(Server server, uint32_t timeout_ms) {
+    struct pollfd fd = {
+        .fd     = server->wakeup_fd,
+        .events = POLLIN,
+    };
+    int ret = poll(&fd, 1, (int)timeout_ms);
+    if (ret == -1 && errno != EINTR) {
+        app_perror("poll[wait_server_wakeup]");
+    }
+    return ret > 0;
+}
+
+bool nonblocking_poll(Server server, uint32_t dispatcher_index) {
+    assert(dispatcher_index < server->dispatchers_count);
+    ServerIo* io  = &server->dispatchers[dispatcher_index].io;
+    dispatcher_io = io;
+
+    struct sockaddr_storage broadcast_address_storage = {0};
+    socklen_t broadcast_address_size                  = sizeof(broadcast_address_storage);
+    UDPMessage* message                               = NULL;
+    while (true) {
+        broadcast_address_size = sizeof(broadcast_address_storage);
+        message = server_io_receive(io, &broadcast_address_storage, &broadcast_address_size);
+        if (message == NULL) {
+            if (!server_io_is_drained(io)) {
+                return false;
+            }
+            // the forwards of the last burst must leave before the shutdown signal
+            server_io_flush(io);
+            return true;
+        }
+        if (!is_datagram_of_other_dispatcher(server, dispatcher_index,
+                                             &broadcast_address_storage, broadcast_address_size)) {
+            break;
+        }
+        server_io_release(io, message);
+    }
+
+    bool ret = handle_received_datagram(server, message, &broadcast_address_storage,
+                                        broadcast_address_size);
+    server_io_release(io, message);
+    if (!server_io_has_buffered_receive(io)) {
+        // submit the forwards of the whole burst at once
+        server_io_flush(io);
+    }
+    return ret;
+}
+
+void bind_server_dispatcher_memory(Server server, uint32_t dispatcher_index, int32_t node) {
+    assert(dispatcher_index < server->dispatchers_count);
+    if (node != PLACEMENT_NO_NODE) {
+        server_io_bind_memory(&server->dispatchers[dispatcher_index].io, node);
+    }
+}
+
+/// @brief Removes the workers that died attached to the shared memory. Their
+/// slots are freed under shm_send_mutex, so that a new worker attaches to a
+/// slot the server pushes no pins into anymore.
+static void reap_dead_shm_peers(Server server) {
+    uint32_t slots[SHM_TRANSPORT_MAX_PEERS];
+    const uint32_t count = shm_transport_find_dead_peers(server->shm_transport, slots);
+    if (count == 0) {
+        return;
+    }
+    const uint64_t now_ns = monotonic_time_ns();
+    uint32_t lost_stages  = 0;
+    pthread_mutex_lock(&server->peers_mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t index = server->shm_peers[slots[i]];
+        const uint32_t pid   = (uint32_t)server->shm_transport->peers[slots[i]].pid;
+        if (index != SERVER_NO_PEER && server_peer_at(&server->peers, index)->pid == pid) {
+            lost_stages |= remove_server_peer(server, index, now_ns, true);
+            continue;
+        }
+        // the worker died before it registered
+        pthread_mutex_lock(&server->shm_send_mutex);
+        shm_transport_release_peer(server->shm_transport, slots[i], (pid_t)pid);
+        pthread_mutex_unlock(&server->shm_send_mutex);
+    }
+    pthread_mutex_unlock(&server->peers_mutex);
+    if (lost_stages != 0) {
+        reassign_outstanding_pins(server, lost_stages);
+    }
+}
+
+/// @brief Handles the messages from the shared memory transport until the
+/// rings are empty or the @a deadline_ns passed.
+/// @param handled number of the handled messages
+/// @return false if the server failed to handle one
+static bool handle_shm_messages(Server server, uint64_t deadline_ns, uint32_t* handled) {
+    assert(server->shm_transport != NULL);
+
+    uint32_t peer_index = 0;
+    UDPMessage* message = NULL;
+    *handled            = 0;
+    // every message gets its own buffer: the forwarded ones are sent from it later
+    while ((message = message_pool_acquire()) != NULL &&
+           shm_transport_poll(server->shm_transport, &server->shm_next_peer, message,
+                              &peer_index)) {
+        (*handled)++;
+        const uint64_t received_ns = monotonic_time_ns();
+        metrics_counter_inc(server_metrics.shm_messages_in);
+        if (message->message_type < MESSAGE_TYPES_COUNT) {
+            metrics_counter_inc(server_metrics.messages_in[message->message_type]);
+        }
+        if (message->message_type == MESSAGE_TYPE_PIN_TRANSFERRING) {
+            trace_received_pin(message);
+        }
+
+        ClientMetaInfo info = {0};
+        fill_shm_client_metainfo(&info, message, &server->shm_transport->peers[peer_index],
+                                 peer_index);
+        bool ret = server_handle_message(server, message, &info);
+        message_pool_release(message);
+        message = NULL;
+        if (!ret) {
+            return false;
+        }
+        metrics_histogram_record(server_metrics.message_handling_time,
+                                 monotonic_time_ns() - received_ns);
+        if (received_ns >= deadline_ns) {
+            break;
+        }
+    }
+    if (message != NULL) {
+        message_pool_release(message);
+    }
+    return true;
+}
+
+bool poll_shm_transport(Server server, uint32_t timeout_ms) {
+    uint32_t handled = 0;
+    if (!handle_shm_messages(server, UINT64_MAX, &handled)) {
+        return false;
+    }
+    if (handled != 0) {
+        server_io_flush(current_server_io(server));
+    } else {
+        reap_dead_shm_peers(server);
+        shm_transport_wait(server->shm_transport, timeout_ms);
+    }
+    return true;
+}
+
+bool drain_shm_transport(Server server, uint64_t deadline_ns) {
+    uint32_t handled = 0;
+    const bool ok    = handle_shm_messages(server, deadline_ns, &handled);
+    server_io_flush(current_server_io(server));
+    return ok && monotonic_time_ns() < deadline_ns;
+}
+
+static void fill_tcp_client_metainfo(ClientMetaInfo* info, const UDPMessage* message,
+                                     const TcpConnection* connection, uint32_t connection_index) {
+    info->peer = (ServerPeer){
+        .type      = message->sender_type,
+        .transport = SERVER_PEER_TCP,
+        .address   = connection->address,
+        .slot      = connection_index,
+    };
+    info->is_tcp_peer = true;
+    // the name lookups are too slow for the heartbeats
+    if (message->message_type != MESSAGE_TYPE_HEARTBEAT) {
+        fill_client_metainfo(info, &connection->address);
+    }
+}
+
+/// @brief Handles the messages from the TCP clients until there are none or
+/// the @a deadline_ns passed, waits up to @a timeout_ms for the first one.
+/// @return false if the server failed to handle one
+static bool handle_tcp_messages(Server server, uint32_t timeout_ms, uint64_t deadline_ns) {
+    assert(server->has_tcp_transport);
+    uint32_t connection_index = 0;
+    UDPMessage* message       = NULL;
+    while ((message = message_pool_acquire()) != NULL &&
+           tcp_server_receive(&server->tcp_transport, message, &connection_index, timeout_ms)) {
+        const uint64_t received_ns = monotonic_time_ns();
+        metrics_counter_inc(server_metrics.tcp_messages_in);
+        if (message->message_type < MESSAGE_TYPES_COUNT) {
+            metrics_counter_inc(server_metrics.messages_in[message->message_type]);
+        }
+        if (message->message_type == MESSAGE_TYPE_PIN_TRANSFERRING) {
+            trace_received_pin(message);
+        }
+
+        ClientMetaInfo info = {0};
+        fill_tcp_client_metainfo(&info, message,
+                                 &server->tcp_transport.connections[connection_index],
+                                 connection_index);
+        bool ret = server_handle_message(server, message, &info);
+        message_pool_release(message);
+        message = NULL;
+        if (!ret) {
+            return false;
+        }
+        metrics_histogram_record(server_metrics.message_handling_time,
+                                 monotonic_time_ns() - received_ns);
+        if (received_ns >= deadline_ns) {
+            break;
+        }
+        // handle everything that is already buffered without waiting
+        timeout_ms = 0;
+    }
+    if (message != NULL) {
+        message_pool_release(message);
+    }
+    server_io_flush(current_server_io(server));
+    return true;
+}
+
+bool poll_tcp_transport(Server server, uint32_t timeout_ms) {
+    return handle_tcp_messages(server, timeout_ms, UINT64_MAX);
+}
+
+bool drain_tcp_transport(Server server, uint64_t deadline_ns) {
+    enum { TCP_DRAIN_POLL_MS = 10 };
+    bool ok = handle_tcp_messages(server, 0, deadline_ns);
+    // the frames the sockets did not take yet are written once they are writable
+    while (ok && tcp_server_has_output(&server->tcp_transport) &&
+           monotonic_time_ns() < deadline_ns) {
+        ok = handle_tcp_messages(server, TCP_DRAIN_POLL_MS, deadline_ns);
+    }
+    return ok && monotonic_time_ns() < deadline_ns;
+}
+
+bool nonblocking_enqueue_log(Server server, UDPMessage* log) {
+    assert(log && log->message_content.bytes[0] != '\0');
+    if (!server_logs_queue_nonblocking_enqueue(&server->logs_queue, log)) {
+        message_pool_release(log);
+        metrics_counter_inc(server_metrics.logs_dropped);
+        return false;
+    }
+    metrics_gauge_add(server_metrics.logs_queue_depth, 1);
+    return true;
+}
+
+bool dequeue_log(Server server, UDPMessage** log) {
+    assert(log);
+    if (!server_logs_queue_dequeue(&server->logs_queue, log)) {
+        return false;
+    }
+    if (*log != NULL) {
+        metrics_gauge_add(server_metrics.logs_queue_depth, -1);
+    }
+    return true;
+}
+
+bool try_dequeue_log(Server server, UDPMessage** log) {
+    assert(log);
+    if (!server_logs_queue_try_dequeue(&server->logs_queue, log)) {
+        return false;
+    }
+    metrics_gauge_add(server_metrics.logs_queue_depth, -1);
+    return true;
+}
+
+void interrupt_dequeue_log(Server server) {
+    server_logs_queue_wake_up(&server->logs_queue);
+}
+
+bool send_server_log(Server server, UDPMessage* log) {
+    bool ok = send_message(server, log);
+    message_pool_release(log);
+    if (!ok) {
+        return false;
+    }
+    server_io_flush(current_server_io(server));
+    metrics_counter_inc(server_metrics.logs_sent);
+    return true;
 }
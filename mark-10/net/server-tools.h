@@ -12,30 +12,304 @@
 #include <stdint.h>
 
 #include "../util/config.h"
+#include "../util/failure-detector.h"
+#include "hot-restart.h"
 #include "net-config.h"
+#include "pin-journal.h"
+#include "pipeline-config.h"
+#include "server-io.h"
 #include "server-logs-queue.h"
+#include "server-peers.h"
+#include "shm-transport.h"
+#include "stage-balance.h"
+#include "stage-queue.h"
+#include "tcp-transport.h"
+
+enum { MAX_SERVER_DISPATCHERS = 8 };
+
+enum {
+    /// Default time every stage has to drain, a worker may be in the middle of a pin.
+    SERVER_PIPELINE_DRAIN_TIMEOUT_MS = (MAX_SLEEP_TIME + 3) * 1000,
+};
+
+/// Time every stage of the pipeline has to drain on the shutdown, 0 to skip the drain.
+#define SERVER_PIPELINE_DRAIN_TIMEOUT_MS_ENV "SERVER_PIPELINE_DRAIN_TIMEOUT_MS"
+
+/// Number of the threads that receive and route the UDP datagrams, 1 by default.
+#define SERVER_DISPATCHERS_ENV "SERVER_DISPATCHERS"
+
+/// Initial ServerLogLevel: 0 errors, 1 events, 2 every pin (default). The managers change it.
+#define SERVER_LOG_LEVEL_ENV "SERVER_LOG_LEVEL"
 
 enum {
-    MAX_NUMBER_OF_FIRST_WORKERS  = 3,
-    MAX_NUMBER_OF_SECOND_WORKERS = 5,
-    MAX_NUMBER_OF_THIRD_WORKERS  = 2,
+    SERVER_MAX_OUTSTANDING_PINS    = 256,
+    SERVER_OUTSTANDING_PIN_BUCKETS = 2 * SERVER_MAX_OUTSTANDING_PINS,
 
-    MAX_WORKERS_PER_SERVER =
-        MAX_NUMBER_OF_FIRST_WORKERS + MAX_NUMBER_OF_SECOND_WORKERS + MAX_NUMBER_OF_THIRD_WORKERS,
-    MAX_CONNECTIONS_PER_SERVER = MAX_WORKERS_PER_SERVER
+    SERVER_EXPIRED_PEERS_BATCH  = 64,
+
+    SERVER_FAILURE_DETECTOR_TICK_MS = 100,
+    SERVER_HEARTBEAT_TIMEOUT_MS     = 5000,
+    SERVER_PHI_THRESHOLD            = 8,
+    SERVER_HEARTBEAT_PAUSE_MS       = 1000,
 };
 
-typedef struct Server {
+/// Initial ServerBalanceMode: 0 off, 1 report (default), 2 advise, 3 direct. The managers
+/// change it.
+#define SERVER_BALANCE_MODE_ENV "SERVER_BALANCE_MODE"
+/// Period of the measurements of the stages, the heartbeats carry the load of the workers.
+#define SERVER_BALANCE_INTERVAL_MS_ENV "SERVER_BALANCE_INTERVAL_MS"
+
+enum { SERVER_BALANCE_INTERVAL_MS = 30000 };
+
+/// Failure detector of the clients: 0 disabled, 1 fixed timeout, 2 phi accrual (default).
+#define SERVER_FAILURE_DETECTOR_ENV "SERVER_FAILURE_DETECTOR"
+/// Silence after which a client is removed in the fixed timeout mode.
+#define SERVER_HEARTBEAT_TIMEOUT_MS_ENV "SERVER_HEARTBEAT_TIMEOUT_MS"
+/// Suspicion level at which a client is removed in the phi accrual mode.
+#define SERVER_PHI_THRESHOLD_ENV "SERVER_PHI_THRESHOLD"
+/// Silence tolerated on top of the heartbeat interval in the phi accrual mode.
+#define SERVER_HEARTBEAT_PAUSE_MS_ENV "SERVER_HEARTBEAT_PAUSE_MS"
+
+/// StageQueuePolicy of the pins routed to the stages: 0 off (default, they are sent as they
+/// come), 1 fifo, 2 priority, 3 edf. The queues need the failure detector.
+#define SERVER_QUEUE_POLICY_ENV "SERVER_QUEUE_POLICY"
+/// Pins every stage queue holds before it sheds them.
+#define SERVER_QUEUE_CAPACITY_ENV "SERVER_QUEUE_CAPACITY"
+/// Pins a stage gets from its queue ahead of its workers, per pin of its concurrency.
+#define SERVER_QUEUE_WINDOW_ENV "SERVER_QUEUE_WINDOW"
+/// Time a pin waits in the edf queue before it expires unless it carries its own.
+#define SERVER_QUEUE_DEADLINE_MS_ENV "SERVER_QUEUE_DEADLINE_MS"
+
+enum {
+    SERVER_QUEUE_CAPACITY     = 64,
+    SERVER_QUEUE_MAX_CAPACITY = 4096,
+    SERVER_QUEUE_WINDOW       = 2,
+    SERVER_QUEUE_DEADLINE_MS  = 30000,
+};
+
+/// Pins a minute the entry stages may make together, 0 (default) for no limit. The
+/// managers change it. Every worker of the entry stages is told its share, in
+/// proportion to its concurrency, and paces its new pins to it.
+#define SERVER_ADMISSION_RATE_ENV "SERVER_ADMISSION_RATE"
+/// Pins a worker of an entry stage may make at once above its share.
+#define SERVER_ADMISSION_BURST_ENV "SERVER_ADMISSION_BURST"
+
+enum {
+    SERVER_ADMISSION_BURST = 4,
+    /// The shares are sent again that often, in case the workers missed them.
+    SERVER_ADMISSION_REPEAT_MS = 5000,
+    /// The pins made at the rate may come together after the step of the entry
+    /// stage, the server takes that much of them on top of the burst.
+    SERVER_ADMISSION_TOLERANCE_MS = (MAX_SLEEP_TIME + 1) * 1000,
+    SERVER_ADMISSION_BATCH        = 64,
+};
+
+typedef struct ServerDispatcher {
+    /// Own socket in the SO_REUSEPORT group of the server port.
     int sock_fd;
+    /// The socket filter drops the datagrams of the other dispatchers in the kernel.
+    bool is_steered;
+    /// Datagram I/O of the sock_fd.
+    ServerIo io;
+} ServerDispatcher;
+
+/// @brief Pins forwarded to the stages that route them on and did not come
+/// back from them yet. A pin is found by an open addressing hash map (linear
+/// probing, backward shift deletion, at most half full) keyed by its id and
+/// its stage. Once it is full the oldest pin is evicted for the new one.
+typedef struct OutstandingPins {
+    uint32_t count;
+    /// Slots taken at least once, the slots below it are reused from free_slots.
+    uint32_t allocated;
+    uint32_t free_count;
+    uint16_t free_slots[SERVER_MAX_OUTSTANDING_PINS];
+    /// The used slots from the oldest pin to the newest one, linked both ways.
+    uint16_t oldest;
+    uint16_t newest;
+    uint16_t older[SERVER_MAX_OUTSTANDING_PINS];
+    uint16_t newer[SERVER_MAX_OUTSTANDING_PINS];
+    /// Slot of the pin plus 1, 0 marks an empty bucket.
+    uint16_t buckets[SERVER_OUTSTANDING_PIN_BUCKETS];
+    bool is_used[SERVER_MAX_OUTSTANDING_PINS];
+    int32_t pin_ids[SERVER_MAX_OUTSTANDING_PINS];
+    /// Stage the pin was forwarded to, a pin of the fan-out is there once for every stage.
+    ComponentType stages[SERVER_MAX_OUTSTANDING_PINS];
+    /// Peer the pin was dispatched to, SERVER_NO_PEER if the stage had none or the peer died.
+    uint32_t peers[SERVER_MAX_OUTSTANDING_PINS];
+    Pin pins[SERVER_MAX_OUTSTANDING_PINS];
+    /// Outstanding pins of every stage.
+    uint32_t stage_counts[PIPELINE_STAGES];
+} OutstandingPins;
+
+/// @brief Queue of the pins routed to a stage. The server sends the stage only
+/// as many pins as its window: the pins it sent and the workers did not report
+/// as processed yet (see WorkerLoad) stay below the concurrency of the stage
+/// times the window, the others wait in the queue.
+typedef struct ServerStageQueue {
+    StageQueue queue;
+    /// Subtracted from the pins popped from the queue, so that the pins the stage
+    /// lost with its dead workers do not hold its window.
+    uint64_t window_offset;
+} ServerStageQueue;
+
+typedef struct PipelineStageDrain {
+    uint32_t reports;
+    uint64_t pins_received;
+    uint64_t pins_sent;
+} PipelineStageDrain;
+
+typedef struct Server {
+    uint16_t port;
     struct sockaddr_in sock_addr;
+    /// Stages and routes of the pipeline, loaded once at the start.
+    PipelineConfig pipeline;
+    /// Eventfd signalled once on the shutdown, wakes up the threads blocked on the server.
+    int wakeup_fd;
     struct ServerLogsQueue logs_queue;
+    /// ServerLogLevel, read without a lock by every log.
+    uint32_t log_level;
+    uint32_t dispatchers_count;
+    ServerDispatcher dispatchers[MAX_SERVER_DISPATCHERS];
+    /// NULL if the shared memory transport is disabled.
+    ShmTransportSegment* shm_transport;
+    uint32_t shm_next_peer;
+    /// Clients that can't be reached by the broadcast connect over TCP.
+    bool has_tcp_transport;
+    TcpServer tcp_transport;
+    /// Serializes pushes into the server -> worker rings (single producer).
+    pthread_mutex_t shm_send_mutex;
+    /// Number of clients of every type that registered over UDP,
+    /// indexed by the bit number of the ComponentType.
+    uint32_t udp_clients[MAX_COMPONENT_TYPES];
+    /// Same over all the transports.
+    uint32_t clients[MAX_COMPONENT_TYPES];
+    /// Reports of the drained workers, filled by the pollers.
+    pthread_mutex_t drain_mutex;
+    pthread_cond_t drain_cond;
+    PipelineStageDrain drain_stages[PIPELINE_STAGES];
+    /// Listens for the server process that takes over on the hot restart, -1 if unavailable.
+    int hot_restart_fd;
+    /// Set by hand_over_server(), deinit_server() leaves the shared memory segment
+    /// to the new process then.
+    bool is_handed_over;
+    /// Guards everything below.
+    pthread_mutex_t peers_mutex;
+    /// Registered clients, indexed as the peers of the failure_detector.
+    ServerPeerTable peers;
+    /// Peer of every slot of the shared memory transport, SERVER_NO_PEER if none.
+    uint32_t shm_peers[SHM_TRANSPORT_MAX_PEERS];
+    FailureDetector failure_detector;
+    OutstandingPins outstanding_pins;
+    /// Load of the stages, measured every balance_interval_ns in the balance_mode.
+    StageBalance balance;
+    /// ServerBalanceMode, set by the managers.
+    uint32_t balance_mode;
+    uint64_t balance_interval_ns;
+    /// StageQueuePolicy of all the stages, the queues are unused if it is off.
+    StageQueuePolicy queue_policy;
+    uint32_t queue_window;
+    uint64_t queue_deadline_ns;
+    /// Pins a minute the entry stages may make, 0 for no limit. Set by the managers.
+    uint32_t admission_rate;
+    uint32_t admission_burst;
+    /// Checks the pins of all the workers of the entry stages against the admission_rate.
+    TokenBucket admission;
+    uint64_t admission_sent_ns;
+    /// Guards the queues, taken after peers_mutex if both are.
+    pthread_mutex_t queues_mutex;
+    ServerStageQueue queues[PIPELINE_STAGES];
+    /// Pins of the queues, see PIN_JOURNAL_ENV. The server queues the pins it
+    /// recovers from it again.
+    PinJournal journal;
+    bool has_journal;
 } Server[1];
 
-bool init_server(Server server, uint16_t server_port);
+/// @brief Initializes the server. With SERVER_HOT_RESTART=1 it takes over the sockets,
+/// the registered clients, the queued pins and the queued logs of the server running on
+/// the same port.
+/// @param tcp_listen_address NULL to accept TCP clients on all the interfaces
+bool init_server(Server server, uint16_t server_port, const char* tcp_listen_address);
 void deinit_server(Server server);
-bool nonblocking_poll(Server server);
-void send_shutdown_signal_to_all(const Server server);
+static inline uint32_t server_dispatchers_count(const Server server) {
+    return server->dispatchers_count;
+}
+/// @brief Wakes up all the threads blocked in nonblocking_poll() and
+/// wait_server_wakeup(), async-signal-safe.
+void wake_up_server(Server server);
+/// @brief Sleeps up to @a timeout_ms or until wake_up_server() is called.
+/// @return true if the server was woken up
+bool wait_server_wakeup(Server server, uint32_t timeout_ms);
+static inline int server_wakeup_fd(const Server server) {
+    return server->wakeup_fd;
+}
+/// @brief Receives and handles the next datagram of the dispatcher, must be
+/// called from one thread per dispatcher. Once the server is woken up it
+/// handles the datagrams that are still buffered and then returns without
+/// receiving, see is_server_dispatcher_drained().
+bool nonblocking_poll(Server server, uint32_t dispatcher_index);
+static inline bool is_server_dispatcher_drained(const Server server, uint32_t dispatcher_index) {
+    return server_io_is_drained(&server->dispatchers[dispatcher_index].io);
+}
+/// @brief Moves the memory of the dispatcher to the NUMA @a node of its thread.
+void bind_server_dispatcher_memory(Server server, uint32_t dispatcher_index, int32_t node);
+static inline bool has_shm_transport(const Server server) {
+    return server->shm_transport != NULL;
+}
+/// @brief Handles all the messages from the shared memory transport,
+/// sleeps up to @a timeout_ms if there are none.
+bool poll_shm_transport(Server server, uint32_t timeout_ms);
+/// @brief Handles the messages the workers pushed into the rings before the
+/// shutdown, until they are empty or the @a deadline_ns passed.
+/// @return false if the server failed or some are left
+bool drain_shm_transport(Server server, uint64_t deadline_ns);
+static inline bool has_tcp_transport(const Server server) {
+    return server->has_tcp_transport;
+}
+/// @brief Handles the messages from the TCP clients, sleeps up to
+/// @a timeout_ms if there are none.
+bool poll_tcp_transport(Server server, uint32_t timeout_ms);
+/// @brief Handles the messages the TCP clients sent before the shutdown and
+/// writes the output the sockets did not take yet, until the @a deadline_ns.
+/// @return false if the server failed or some are left
+bool drain_tcp_transport(Server server, uint64_t deadline_ns);
+void send_shutdown_signal_to_all(Server server);
+static inline bool has_failure_detector(const Server server) {
+    return is_failure_detector_enabled(&server->failure_detector);
+}
+/// @brief Reads the heartbeats of the shared memory peers and removes the
+/// peers the failure detector suspects from the routing. The pins they did
+/// not return are forwarded again to the other workers of their stage or, if
+/// there are none, once a worker of the stage registers.
+/// Measures the stages and logs the bottleneck every balance interval.
+/// Sends the queued pins the windows of the stages let through and expires
+/// the stale ones. Tells the workers of the entry stages their shares of the
+/// admission rate once they change. Must be called every SERVER_FAILURE_DETECTOR_TICK_MS.
+void check_server_peers(Server server);
+static inline int server_hot_restart_fd(const Server server) {
+    return server->hot_restart_fd;
+}
+/// @brief Hands the sockets, the registered clients and the queued logs over to
+/// the server process connected on @a conn_fd, the queued pins are sent first.
+/// All the threads must be stopped, the datagrams that arrived meanwhile wait
+/// in the handed over sockets.
+/// @return true if the new process took them over, the clients keep running then
+bool hand_over_server(Server server, int conn_fd);
+/// @brief Drains the pipeline stage by stage in their order: the first stage
+/// workers stop taking new pins, then every next stage is asked to drain once all the
+/// workers of the previous one reported, so that it already got all their pins,
+/// and the pins in its queue are sent.
+/// Must be called while the pollers are running. The direct balance mode
+/// falls back to the advise one, the workers stay in their stages.
+/// @return true if all the registered workers reported in time
+bool drain_server_pipeline(Server server, uint32_t stage_timeout_ms);
 
-bool nonblocking_enqueue_log(Server server, const ServerLog* log);
-bool dequeue_log(Server server, ServerLog* log);
-bool send_server_log(const Server server, const ServerLog* log);
+/// @brief Queues the @a log (buffer of the message pool), takes its reference.
+bool nonblocking_enqueue_log(Server server, UDPMessage* log);
+/// @brief Blocks until there is a log or interrupt_dequeue_log() is called.
+/// @param log set to NULL if interrupted
+bool dequeue_log(Server server, UDPMessage** log);
+/// @return false if there are no queued logs
+bool try_dequeue_log(Server server, UDPMessage** log);
+void interrupt_dequeue_log(Server server);
+/// @brief Sends the @a log to the logs collectors and releases it.
+bool send_server_log(Server server, UDPMessage* log);
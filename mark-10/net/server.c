@@ -14,129 +14,263 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
-#include <time.h>
 #include <unistd.h>
 
+#include "../util/clock.h"
 #include "../util/config.h"
+#include "../util/metrics-export.h"
+#include "../util/metrics.h"
 #include "../util/parser.h"
+#include "../util/placement.h"
 #include "client-tools.h"
+#include "message-pool.h"
 #include "net-config.h"
 #include "pin.h"
 #include "server-tools.h"
 
+enum {
+    SHM_POLL_TIMEOUT_MS     = 100,
+    TCP_POLL_TIMEOUT_MS     = 100,
+    APP_THREAD_SLEEP_MS     = 1000,
+    SERVER_DRAIN_TIMEOUT_MS = 1000,
+};
+
+/// Longest time the messages the server received before the shutdown are
+/// handled for and the logs still queued are sent for, in milliseconds.
+#define SERVER_DRAIN_TIMEOUT_MS_ENV "SERVER_DRAIN_TIMEOUT_MS"
+
 /// @brief We use global variables so it can be accessed through
-static struct Server server                    = {0};
-static volatile bool is_poller_running         = true;
-static volatile bool is_logger_running         = true;
-static volatile pthread_t app_threads[2]       = {(pthread_t)-1, (pthread_t)-1};
-static volatile atomic_size_t app_threads_size = 0;
-
-static void stop_all_threads(void) {
-    static volatile atomic_bool disposed = false;
-
-    bool value_if_first_call = false;
-    bool disposed_equals_false =
-        atomic_compare_exchange_strong(&disposed, &value_if_first_call, true);
-    if (!disposed_equals_false) {
-        return;
-    }
-
-    is_poller_running = false;
-    is_logger_running = false;
-    for (size_t i = 0; i < sizeof(app_threads) / sizeof(app_threads[0]); i++) {
-        if (app_threads[i] == (pthread_t)-1) {
-            continue;
+static struct Server server         = {0};
+static atomic_bool is_poller_running = true;
+static atomic_bool is_logger_running = true;
+/// Set on the hot restart, the queued logs are handed over instead of drained.
+static atomic_bool is_handing_over   = false;
+static const int shutdown_signals[] = {SIGINT, SIGTERM, SIGQUIT, SIGALRM};
+
+/// @brief Asks the pollers to stop once they handled what they have in hand,
+/// the logger is stopped after them so that it sends their last logs.
+static void request_stop(void) {
+    atomic_store(&is_poller_running, false);
+    wake_up_server(&server);
+}
+
+/// @brief Blocks the shutdown signals in all the threads, the main thread
+/// reads them from the returned signalfd.
+static int setup_signal_fd(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (size_t i = 0; i < sizeof(shutdown_signals) / sizeof(shutdown_signals[0]); i++) {
+        sigaddset(&mask, shutdown_signals[i]);
+    }
+    int ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_sigmask");
+        return -1;
+    }
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        app_perror("signalfd");
+    }
+    return signal_fd;
+}
+
+typedef enum StopReason {
+    STOP_REASON_FAILURE,
+    STOP_REASON_SIGNAL,
+    STOP_REASON_HOT_RESTART,
+} StopReason;
+
+/// @brief Waits for a shutdown signal, for a server that takes over or for a
+/// thread that stopped the server.
+/// @param restart_fd set to the connection of the new server on STOP_REASON_HOT_RESTART
+/// @return why the server stops, the pollers are still running unless STOP_REASON_FAILURE
+static StopReason wait_for_stop(int signal_fd, int* restart_fd) {
+    // poll(2) skips the negative fds, so the server may run without the hot restart
+    struct pollfd fds[] = {
+        {.fd = signal_fd, .events = POLLIN},
+        {.fd = server_wakeup_fd(&server), .events = POLLIN},
+        {.fd = server_hot_restart_fd(&server), .events = POLLIN},
+    };
+    while (atomic_load(&is_poller_running)) {
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            app_perror("poll");
+            break;
         }
-        int err_code   = pthread_cancel(app_threads[i]);
-        app_threads[i] = (pthread_t)-1;
-        if (err_code != 0) {
-            errno = err_code;
-            app_perror("pthread_cancel");
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                fprintf(stderr, "> Received signal %u\n", info.ssi_signo);
+            }
+            return STOP_REASON_SIGNAL;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (fds[2].revents & POLLIN) {
+            *restart_fd = accept_hot_restart(fds[2].fd);
+            if (*restart_fd != -1) {
+                printf("> New server process is taking over\n");
+                return STOP_REASON_HOT_RESTART;
+            }
         }
     }
+    return STOP_REASON_FAILURE;
 }
-static void signal_handler(int sig) {
-    fprintf(stderr, "> Received signal %d\n", sig);
-    stop_all_threads();
+
+/// @brief Paces the thread, returns at once when the server is stopping.
+static void app_thread_sleep(void) {
+    wait_server_wakeup(&server, APP_THREAD_SLEEP_MS);
 }
-static void setup_signal_handler(void) {
-    const int handled_signals[] = {
-        SIGABRT, SIGINT, SIGTERM, SIGSEGV, SIGQUIT, SIGKILL, SIGALRM,
-    };
-    for (size_t i = 0; i < sizeof(handled_signals) / sizeof(handled_signals[0]); i++) {
-        signal(handled_signals[i], signal_handler);
-    }
+
+/// @return end of the drain that starts now, see SERVER_DRAIN_TIMEOUT_MS_ENV
+static uint64_t drain_deadline_ns(void) {
+    const uint64_t timeout_ms =
+        parse_env_uint32(SERVER_DRAIN_TIMEOUT_MS_ENV, SERVER_DRAIN_TIMEOUT_MS);
+    return monotonic_time_ns() + timeout_ms * 1000000u;
 }
 
-static bool app_thread_sleep(void) {
-    const struct timespec sleep_time = {
-        .tv_sec  = 1,
-        .tv_nsec = 0,
-    };
-    if (nanosleep(&sleep_time, NULL) == -1) {
-        if (errno != EINTR) {
-            // if not interrupted by the signal
-            app_perror("nanosleep");
+static void* workers_poller(void* dispatcher_index) {
+    const uint32_t index = (uint32_t)(uintptr_t)dispatcher_index;
+    const ThreadPlacement placement =
+        place_current_thread(SERVER_DISPATCHER_CPUS_ENV, index, "dispatcher");
+    bind_server_dispatcher_memory(&server, index, placement.node);
+
+    // the datagrams received before the shutdown are still handled until the drain deadline
+    uint64_t deadline_ns = UINT64_MAX;
+    while (!is_server_dispatcher_drained(&server, index)) {
+        if (deadline_ns == UINT64_MAX && !atomic_load(&is_poller_running)) {
+            deadline_ns = drain_deadline_ns();
+        } else if (deadline_ns != UINT64_MAX && monotonic_time_ns() >= deadline_ns) {
+            fprintf(stderr, "> Dispatcher %u did not drain in time\n", index);
+            break;
+        }
+        // the receive blocks until a datagram comes, the forwards are not paced
+        if (!nonblocking_poll(&server, index)) {
+            fprintf(stderr, "> Could not poll clients\n");
+            break;
         }
-        return false;
     }
 
-    return true;
+    int32_t ret = atomic_load(&is_poller_running) ? EXIT_FAILURE : EXIT_SUCCESS;
+    request_stop();
+    return (void*)(uintptr_t)(uint32_t)ret;
 }
 
-static void* workers_poller(void* unused) {
+static void* shm_poller(void* unused) {
     (void)unused;
+    place_current_thread(SERVER_POLLER_CPUS_ENV, 0, "shared memory poller");
 
-    while (is_poller_running) {
-        if (!nonblocking_poll(&server)) {
-            fprintf(stderr, "> Could not poll clients\n");
+    while (atomic_load(&is_poller_running)) {
+        if (!poll_shm_transport(&server, SHM_POLL_TIMEOUT_MS)) {
+            fprintf(stderr, "> Could not poll shared memory transport\n");
             break;
         }
-        if (!app_thread_sleep()) {
+    }
+
+    int32_t ret = atomic_load(&is_poller_running) ? EXIT_FAILURE : EXIT_SUCCESS;
+    // the messages the workers pushed before the shutdown are still handled
+    if (ret == EXIT_SUCCESS && !drain_shm_transport(&server, drain_deadline_ns())) {
+        fprintf(stderr, "> Shared memory transport did not drain in time\n");
+    }
+    request_stop();
+    return (void*)(uintptr_t)(uint32_t)ret;
+}
+
+static void* tcp_poller(void* unused) {
+    (void)unused;
+    place_current_thread(SERVER_POLLER_CPUS_ENV, 1, "TCP poller");
+
+    while (atomic_load(&is_poller_running)) {
+        if (!poll_tcp_transport(&server, TCP_POLL_TIMEOUT_MS)) {
+            fprintf(stderr, "> Could not poll TCP clients\n");
             break;
         }
     }
 
-    int32_t ret = is_poller_running ? EXIT_FAILURE : EXIT_SUCCESS;
-    stop_all_threads();
+    int32_t ret = atomic_load(&is_poller_running) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (ret == EXIT_SUCCESS && !drain_tcp_transport(&server, drain_deadline_ns())) {
+        fprintf(stderr, "> TCP clients did not drain in time\n");
+    }
+    request_stop();
     return (void*)(uintptr_t)(uint32_t)ret;
 }
 
+static void* peers_checker(void* unused) {
+    (void)unused;
+    place_current_thread(SERVER_POLLER_CPUS_ENV, 2, "failure detector");
+
+    while (atomic_load(&is_poller_running)) {
+        check_server_peers(&server);
+        wait_server_wakeup(&server, SERVER_FAILURE_DETECTOR_TICK_MS);
+    }
+    return (void*)(uintptr_t)EXIT_SUCCESS;
+}
+
+/// @brief Sends the logs left in the queue until it is empty or the drain timeout expires.
+static void drain_logs(void) {
+    const uint64_t deadline_ns = drain_deadline_ns();
+    uint32_t sent_logs         = 0;
+    UDPMessage* log            = NULL;
+    while (monotonic_time_ns() < deadline_ns && try_dequeue_log(&server, &log)) {
+        if (!send_server_log(&server, log)) {
+            fputs("> Could not send log\n", stderr);
+            break;
+        }
+        sent_logs++;
+    }
+    uint32_t dropped_logs = 0;
+    while (try_dequeue_log(&server, &log)) {
+        message_pool_release(log);
+        dropped_logs++;
+    }
+    printf("> Drained %u queued log(s), dropped %u\n", sent_logs, dropped_logs);
+}
+
 static void* logs_sender(void* unused) {
     (void)unused;
+    place_current_thread(SERVER_LOGGER_CPUS_ENV, 0, "logger");
 
-    ServerLog log = {0};
-    while (is_logger_running) {
+    UDPMessage* log = NULL;
+    while (atomic_load(&is_logger_running)) {
         if (!dequeue_log(&server, &log)) {
             fputs("> Could not get next log\n", stderr);
             break;
         }
-        if (!send_server_log(&server, &log)) {
-            fputs("> Could not send log\n", stderr);
-            break;
+        if (log == NULL) {
+            // interrupted by the shutdown
+            continue;
         }
-        if (!app_thread_sleep()) {
+        if (!send_server_log(&server, log)) {
+            fputs("> Could not send log\n", stderr);
             break;
         }
+        app_thread_sleep();
     }
 
-    int32_t ret = is_logger_running ? EXIT_FAILURE : EXIT_SUCCESS;
-    stop_all_threads();
+    int32_t ret = atomic_load(&is_logger_running) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (ret == EXIT_SUCCESS && !atomic_load(&is_handing_over)) {
+        drain_logs();
+    }
+    request_stop();
     return (void*)(uintptr_t)(uint32_t)ret;
 }
 
-static bool create_thread(pthread_t* pthread_id, void*(handler)(void*)) {
-    int ret = pthread_create(pthread_id, NULL, handler, NULL);
+static bool create_thread(pthread_t* pthread_id, void*(handler)(void*), void* arg) {
+    int ret = pthread_create(pthread_id, NULL, handler, arg);
     if (ret != 0) {
-        stop_all_threads();
+        request_stop();
         errno = ret;
         app_perror("pthread_create");
         return false;
     }
-    assert(app_threads_size < (sizeof(app_threads) / sizeof(app_threads[0])));
-    app_threads[app_threads_size++] = *pthread_id;
     return true;
 }
 
@@ -150,51 +284,139 @@ static int join_thread(pthread_t pthread_id) {
     return (int)(uintptr_t)poll_ret;
 }
 
-static int start_runtime_loop(void) {
-    pthread_t poll_thread;
-    if (!create_thread(&poll_thread, &workers_poller)) {
-        return EXIT_FAILURE;
+static int start_runtime_loop(int signal_fd) {
+    pthread_t poll_threads[MAX_SERVER_DISPATCHERS];
+    const uint32_t dispatchers_count = server_dispatchers_count(&server);
+    uint32_t started_pollers         = 0;
+    while (started_pollers < dispatchers_count &&
+           create_thread(&poll_threads[started_pollers], &workers_poller,
+                         (void*)(uintptr_t)started_pollers)) {
+        started_pollers++;
     }
-    printf("> Started polling thread\n");
+    bool ok = started_pollers == dispatchers_count;
+    printf("> Started %u polling thread(s)\n", started_pollers);
 
     pthread_t logs_thread;
-    if (!create_thread(&logs_thread, &logs_sender)) {
-        stop_all_threads();
-        return EXIT_FAILURE;
+    const bool has_logs_thread = ok && create_thread(&logs_thread, &logs_sender, NULL);
+    ok                         = has_logs_thread;
+    if (has_logs_thread) {
+        printf("> Started logging thread\n");
+    }
+
+    pthread_t shm_thread;
+    bool has_shm_thread = false;
+    if (ok && has_shm_transport(&server)) {
+        has_shm_thread = ok = create_thread(&shm_thread, &shm_poller, NULL);
+        if (has_shm_thread) {
+            printf("> Started shared memory transport polling thread\n");
+        }
     }
-    printf("> Started logging thread\n");
 
-    const int ret_poller = join_thread(poll_thread);
-    printf("> Joined polling thread\n");
-    const int ret_logger = join_thread(logs_thread);
-    printf("> Joined logging thread\n");
+    pthread_t tcp_thread;
+    bool has_tcp_thread = false;
+    if (ok && has_tcp_transport(&server)) {
+        has_tcp_thread = ok = create_thread(&tcp_thread, &tcp_poller, NULL);
+        if (has_tcp_thread) {
+            printf("> Started TCP clients polling thread\n");
+        }
+    }
 
-    printf("> Started sending shutdown signals to all clients\n");
-    send_shutdown_signal_to_all(&server);
-    printf("> Sent shutdown signals to all clients\n");
+    pthread_t peers_thread;
+    bool has_peers_thread = false;
+    if (ok && has_failure_detector(&server)) {
+        has_peers_thread = ok = create_thread(&peers_thread, &peers_checker, NULL);
+        if (has_peers_thread) {
+            printf("> Started failure detector thread\n");
+        }
+    }
 
-    return ret_poller | ret_logger;
+    int restart_fd               = -1;
+    const StopReason stop_reason = ok ? wait_for_stop(signal_fd, &restart_fd)
+                                      : STOP_REASON_FAILURE;
+    if (stop_reason == STOP_REASON_HOT_RESTART) {
+        atomic_store(&is_handing_over, true);
+    } else if (stop_reason == STOP_REASON_SIGNAL) {
+        const uint32_t drain_timeout_ms = parse_env_uint32(SERVER_PIPELINE_DRAIN_TIMEOUT_MS_ENV,
+                                                           SERVER_PIPELINE_DRAIN_TIMEOUT_MS);
+        if (drain_timeout_ms != 0) {
+            printf("> Draining the pipeline\n");
+            drain_server_pipeline(&server, drain_timeout_ms);
+        }
+    }
+    request_stop();
+    printf("> Stopping, draining in-flight messages\n");
+
+    // the pollers stop first: they are the ones that forward pins and queue logs
+    int ret_poller = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < started_pollers; i++) {
+        ret_poller |= join_thread(poll_threads[i]);
+    }
+    printf("> Joined polling thread(s)\n");
+    int ret_shm_poller = EXIT_SUCCESS;
+    if (has_shm_thread) {
+        ret_shm_poller = join_thread(shm_thread);
+        printf("> Joined shared memory transport polling thread\n");
+    }
+    int ret_tcp_poller = EXIT_SUCCESS;
+    if (has_tcp_thread) {
+        ret_tcp_poller = join_thread(tcp_thread);
+        printf("> Joined TCP clients polling thread\n");
+    }
+    if (has_peers_thread) {
+        join_thread(peers_thread);
+        printf("> Joined failure detector thread\n");
+    }
+    atomic_store(&is_logger_running, false);
+    interrupt_dequeue_log(&server);
+    int ret_logger = EXIT_SUCCESS;
+    if (has_logs_thread) {
+        ret_logger = join_thread(logs_thread);
+        printf("> Joined logging thread\n");
+    }
+
+    bool is_handed_over = false;
+    if (restart_fd != -1) {
+        // the threads are joined, nothing touches the sockets until the new server acks
+        is_handed_over = hand_over_server(&server, restart_fd);
+        close(restart_fd);
+    }
+    if (!is_handed_over) {
+        printf("> Started sending shutdown signals to all clients\n");
+        send_shutdown_signal_to_all(&server);
+        printf("> Sent shutdown signals to all clients\n");
+    }
+
+    return (ok ? EXIT_SUCCESS : EXIT_FAILURE) | ret_poller | ret_logger | ret_shm_poller |
+           ret_tcp_poller;
 }
 
-static int run_server(uint16_t server_port) {
-    if (!init_server(&server, server_port)) {
+static int run_server(uint16_t server_port, const char* tcp_listen_address, int signal_fd) {
+    if (!init_server(&server, server_port, tcp_listen_address)) {
         return EXIT_FAILURE;
     }
+    start_metrics_export(component_type_to_string(COMPONENT_TYPE_SERVER));
 
-    int ret = start_runtime_loop();
+    int ret = start_runtime_loop(signal_fd);
+    stop_metrics_export();
+    print_metrics(stdout);
     deinit_server(&server);
     printf("> Deinitialized server resources\n");
     return ret;
 }
 
 int main(int argc, const char* argv[]) {
-    setup_signal_handler();
-
     ParseResult res = parse_args(argc, argv);
     if (res.status != PARSE_SUCCESS) {
         print_invalid_args_error(res.status, argv[0]);
         return EXIT_FAILURE;
     }
 
-    return run_server(res.port);
+    // before any thread is created, so that all of them inherit the mask
+    int signal_fd = setup_signal_fd();
+    if (signal_fd == -1) {
+        return EXIT_FAILURE;
+    }
+    int ret = run_server(res.port, res.ip_address, signal_fd);
+    close(signal_fd);
+    return ret;
 }
@@ -0,0 +1,342 @@
+#ifndef _GNU_SOURCE
+// syscall(SYS_futex)
+#define _GNU_SOURCE
+#endif
+
+#include "shm-transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../util/config.h"
+#include "net-config.h"
+
+static void fill_segment_name(uint16_t server_port, char name[SHM_TRANSPORT_NAME_SIZE]) {
+    snprintf(name, SHM_TRANSPORT_NAME_SIZE, "/idz4-transport-%u", (uint32_t)server_port);
+}
+
+static void futex_wait(uint32_t* word, uint32_t expected, uint32_t timeout_ms) {
+    const struct timespec timeout = {
+        .tv_sec  = timeout_ms / 1000,
+        .tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+    };
+    // word lives in the memory shared between processes: no FUTEX_PRIVATE_FLAG
+    if (syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+        app_perror("futex[FUTEX_WAIT]");
+    }
+}
+
+static void futex_wake_all(uint32_t* word) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0) == -1) {
+        app_perror("futex[FUTEX_WAKE]");
+    }
+}
+
+static void notify(ShmWaitQueue* queue) {
+    __atomic_fetch_add(&queue->wake_sequence, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->sleepers, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake_all(&queue->wake_sequence);
+    }
+}
+
+/// @brief Sleeps on @a queue unless @a has_data(arg) becomes true.
+static void wait_for_data(ShmWaitQueue* queue, bool (*has_data)(const void*), const void* arg,
+                          uint32_t timeout_ms) {
+    __atomic_fetch_add(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+    const uint32_t sequence = __atomic_load_n(&queue->wake_sequence, __ATOMIC_SEQ_CST);
+    if (!has_data(arg)) {
+        futex_wait(&queue->wake_sequence, sequence, timeout_ms);
+    }
+    __atomic_fetch_sub(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool ring_is_empty(const ShmRing* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+static bool ring_has_data(const void* ring) {
+    return !ring_is_empty(ring);
+}
+
+static bool ring_push(ShmRing* ring, const UDPMessage* message) {
+    const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= SHM_RING_CAPACITY) {
+        return false;
+    }
+    memcpy(&ring->slots[head % SHM_RING_CAPACITY], message, sizeof(*message));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool ring_pop(ShmRing* ring, UDPMessage* message) {
+    const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+    memcpy(message, &ring->slots[tail % SHM_RING_CAPACITY], sizeof(*message));
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void reset_ring(ShmRing* ring) {
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+}
+
+static bool is_peer_attached(const ShmPeer* peer) {
+    return __atomic_load_n(&peer->state, __ATOMIC_ACQUIRE) == SHM_PEER_ATTACHED;
+}
+
+ShmTransportSegment* create_shm_transport(uint16_t server_port) {
+    char name[SHM_TRANSPORT_NAME_SIZE];
+    fill_segment_name(server_port, name);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1) {
+        app_perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(ShmTransportSegment)) == -1) {
+        app_perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(ShmTransportSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        app_perror("mmap");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ShmTransportSegment* segment = mem;
+    segment->version             = SHM_TRANSPORT_VERSION;
+    segment->server_pid          = getpid();
+    __atomic_store_n(&segment->magic, SHM_TRANSPORT_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+void destroy_shm_transport(ShmTransportSegment* segment, uint16_t server_port) {
+    char name[SHM_TRANSPORT_NAME_SIZE];
+    fill_segment_name(server_port, name);
+    __atomic_store_n(&segment->magic, 0, __ATOMIC_RELEASE);
+    munmap(segment, sizeof(*segment));
+    if (shm_unlink(name) == -1) {
+        app_perror("shm_unlink");
+    }
+}
+
+ShmTransportSegment* open_shm_transport(uint16_t server_port) {
+    char name[SHM_TRANSPORT_NAME_SIZE];
+    fill_segment_name(server_port, name);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        app_perror("shm_open");
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(ShmTransportSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        app_perror("mmap");
+        return NULL;
+    }
+
+    ShmTransportSegment* segment = mem;
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_TRANSPORT_MAGIC ||
+        segment->version != SHM_TRANSPORT_VERSION) {
+        fputs("> Incompatible shared memory transport segment\n", stderr);
+        munmap(segment, sizeof(*segment));
+        return NULL;
+    }
+    // the workers check that the server is alive by this pid
+    segment->server_pid = getpid();
+    return segment;
+}
+
+void close_shm_transport(ShmTransportSegment* segment) {
+    munmap(segment, sizeof(*segment));
+}
+
+bool shm_transport_poll(ShmTransportSegment* segment, uint32_t* start_peer, UDPMessage* message,
+                        uint32_t* peer_index) {
+    // round robin over the peers so that one busy worker can't starve the others
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        const uint32_t index = (*start_peer + i) % SHM_TRANSPORT_MAX_PEERS;
+        ShmPeer* peer        = &segment->peers[index];
+        if (is_peer_attached(peer) && ring_pop(&peer->to_server, message)) {
+            *start_peer = index + 1;
+            *peer_index = index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool any_ring_to_server_has_data(const void* arg) {
+    const ShmTransportSegment* segment = arg;
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        const ShmPeer* peer = &segment->peers[i];
+        if (is_peer_attached(peer) && !ring_is_empty(&peer->to_server)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void shm_transport_wait(ShmTransportSegment* segment, uint32_t timeout_ms) {
+    wait_for_data(&segment->server_wait_queue, &any_ring_to_server_has_data, segment, timeout_ms);
+}
+
+void shm_transport_broadcast(ShmTransportSegment* segment, const UDPMessage* message,
+                             uint32_t* delivered, uint32_t* overflowed) {
+    *delivered  = 0;
+    *overflowed = 0;
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        ShmPeer* peer = &segment->peers[i];
+        if (!is_peer_attached(peer) || (peer->type & message->receiver_type) == 0) {
+            continue;
+        }
+        if (ring_push(&peer->to_client, message)) {
+            notify(&peer->to_client.consumer_wait_queue);
+            (*delivered)++;
+        } else {
+            (*overflowed)++;
+        }
+    }
+}
+
+bool shm_transport_send(ShmTransportSegment* segment, uint32_t peer_index,
+                        const UDPMessage* message) {
+    ShmPeer* peer = &segment->peers[peer_index];
+    if (!is_peer_attached(peer) || !ring_push(&peer->to_client, message)) {
+        return false;
+    }
+    notify(&peer->to_client.consumer_wait_queue);
+    return true;
+}
+
+uint32_t shm_transport_find_dead_peers(const ShmTransportSegment* segment,
+                                       uint32_t* peer_indices) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        const ShmPeer* peer = &segment->peers[i];
+        if (is_peer_attached(peer) && kill(peer->pid, 0) == -1 && errno == ESRCH) {
+            peer_indices[count++] = i;
+        }
+    }
+    return count;
+}
+
+void shm_transport_release_peer(ShmTransportSegment* segment, uint32_t peer_index, pid_t pid) {
+    ShmPeer* peer = &segment->peers[peer_index];
+    if (is_peer_attached(peer) && peer->pid == pid) {
+        __atomic_store_n(&peer->state, SHM_PEER_FREE, __ATOMIC_RELEASE);
+    }
+}
+
+static bool is_segment_usable(const ShmTransportSegment* segment) {
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_TRANSPORT_MAGIC ||
+        segment->version != SHM_TRANSPORT_VERSION) {
+        return false;
+    }
+    // segment of the crashed server is left in the /dev/shm
+    return kill(segment->server_pid, 0) == 0 || errno == EPERM;
+}
+
+bool attach_shm_transport(ShmPeerHandle* handle, uint16_t server_port, ComponentType type) {
+    handle->segment    = NULL;
+    handle->peer_index = SHM_TRANSPORT_INVALID_PEER;
+
+    char name[SHM_TRANSPORT_NAME_SIZE];
+    fill_segment_name(server_port, name);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        // no server on this host
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ShmTransportSegment)) {
+        close(fd);
+        return false;
+    }
+    void* mem = mmap(NULL, sizeof(ShmTransportSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        app_perror("mmap");
+        return false;
+    }
+
+    ShmTransportSegment* segment = mem;
+    if (!is_segment_usable(segment)) {
+        munmap(mem, sizeof(ShmTransportSegment));
+        return false;
+    }
+    for (uint32_t i = 0; i < SHM_TRANSPORT_MAX_PEERS; i++) {
+        ShmPeer* peer     = &segment->peers[i];
+        uint32_t expected = SHM_PEER_FREE;
+        // claim the slot in two steps so that the server never sees
+        // half initialized peer as attached
+        if (!__atomic_compare_exchange_n(&peer->state, &expected, SHM_PEER_ATTACHING, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        peer->pid        = getpid();
+        peer->type       = type;
+        peer->heartbeats = 0;
+        peer->load       = 0;
+        reset_ring(&peer->to_server);
+        reset_ring(&peer->to_client);
+        __atomic_store_n(&peer->state, SHM_PEER_ATTACHED, __ATOMIC_RELEASE);
+        handle->segment    = segment;
+        handle->peer_index = i;
+        return true;
+    }
+
+    fputs("> No free shared memory transport slots, falling back to UDP\n", stderr);
+    munmap(mem, sizeof(ShmTransportSegment));
+    return false;
+}
+
+void detach_shm_transport(ShmPeerHandle* handle) {
+    if (!is_shm_peer_attached(handle)) {
+        return;
+    }
+    ShmPeer* peer = &handle->segment->peers[handle->peer_index];
+    __atomic_store_n(&peer->state, SHM_PEER_FREE, __ATOMIC_RELEASE);
+    munmap(handle->segment, sizeof(*handle->segment));
+    handle->segment    = NULL;
+    handle->peer_index = SHM_TRANSPORT_INVALID_PEER;
+}
+
+bool shm_peer_send(const ShmPeerHandle* handle, const UDPMessage* message) {
+    ShmTransportSegment* segment = handle->segment;
+    if (!ring_push(&segment->peers[handle->peer_index].to_server, message)) {
+        return false;
+    }
+    notify(&segment->server_wait_queue);
+    return true;
+}
+
+bool shm_peer_receive(const ShmPeerHandle* handle, UDPMessage* message, uint32_t timeout_ms) {
+    ShmRing* ring = &handle->segment->peers[handle->peer_index].to_client;
+    if (ring_pop(ring, message)) {
+        return true;
+    }
+    wait_for_data(&ring->consumer_wait_queue, &ring_has_data, ring, timeout_ms);
+    return ring_pop(ring, message);
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "net-config.h"
+
+/// @brief Shared memory transport for the server and the workers running on one host.
+///
+/// The server creates segment "/idz4-transport-<port>" with SHM_TRANSPORT_MAX_PEERS
+/// peer slots. A worker started on the same host attaches to the segment and
+/// claims a free slot; every slot holds two single producer single consumer
+/// rings of UDPMessage (worker -> server and server -> worker). Consumers sleep
+/// on a futex word in the shared memory, producers wake them only if somebody
+/// is actually sleeping, so a hop is two memcpy of the message and no syscalls
+/// under load.
+///
+/// Only pins (and the client registration) travel through the rings, control
+/// messages (shutdown, logs, manager commands) keep using UDP.
+
+#define SHM_TRANSPORT_ENV "SHM_TRANSPORT"
+
+enum {
+    SHM_TRANSPORT_MAX_PEERS    = 32,
+    SHM_RING_CAPACITY          = 64,
+    SHM_TRANSPORT_CACHE_LINE   = 64,
+    SHM_TRANSPORT_MAGIC        = 0x53484d54u,  // "SHMT"
+    SHM_TRANSPORT_VERSION      = 3,
+    SHM_TRANSPORT_NAME_SIZE    = 64,
+    SHM_TRANSPORT_INVALID_PEER = UINT32_MAX,
+};
+
+typedef struct ShmWaitQueue {
+    uint32_t wake_sequence;
+    uint32_t sleepers;
+} __attribute__((aligned(SHM_TRANSPORT_CACHE_LINE))) ShmWaitQueue;
+
+typedef struct ShmRing {
+    /// Written by the producer only.
+    uint32_t head __attribute__((aligned(SHM_TRANSPORT_CACHE_LINE)));
+    /// Written by the consumer only.
+    uint32_t tail __attribute__((aligned(SHM_TRANSPORT_CACHE_LINE)));
+    ShmWaitQueue consumer_wait_queue;
+    UDPMessage slots[SHM_RING_CAPACITY];
+} ShmRing;
+
+typedef enum ShmPeerState {
+    SHM_PEER_FREE,
+    SHM_PEER_ATTACHING,
+    SHM_PEER_ATTACHED,
+} ShmPeerState;
+
+typedef struct ShmPeer {
+    uint32_t state;
+    pid_t pid;
+    ComponentType type;
+    /// Bumped by the heartbeat thread of the worker: the rings have a single producer.
+    uint64_t heartbeats;
+    /// WorkerLoad of the worker, packed by shm_pack_worker_load() to be stored at once.
+    uint64_t load;
+    ShmRing to_server;
+    ShmRing to_client;
+} ShmPeer;
+
+typedef struct ShmTransportSegment {
+    uint32_t magic;
+    uint32_t version;
+    pid_t server_pid;
+    /// Server sleeps here when all the to_server rings are empty.
+    ShmWaitQueue server_wait_queue;
+    ShmPeer peers[SHM_TRANSPORT_MAX_PEERS];
+} ShmTransportSegment;
+
+static inline uint64_t shm_pack_worker_load(WorkerLoad load) {
+    return (uint64_t)load.pins_processed << 32 | load.service_time_ms;
+}
+
+/// Server side.
+
+ShmTransportSegment* create_shm_transport(uint16_t server_port);
+void destroy_shm_transport(ShmTransportSegment* segment, uint16_t server_port);
+/// @brief Maps the segment of the server that hands over to this process,
+/// the attached peers and the messages in their rings stay.
+ShmTransportSegment* open_shm_transport(uint16_t server_port);
+/// @brief Unmaps the segment handed over to the next server process.
+void close_shm_transport(ShmTransportSegment* segment);
+/// @brief Pops one message from the first non empty worker -> server ring.
+/// @return false if all the rings are empty
+bool shm_transport_poll(ShmTransportSegment* segment, uint32_t* start_peer, UDPMessage* message,
+                        uint32_t* peer_index);
+/// @brief Sleeps until some worker pushes a message or @a timeout_ms expires.
+void shm_transport_wait(ShmTransportSegment* segment, uint32_t timeout_ms);
+/// @brief Pushes message to every attached peer of the message->receiver_type.
+/// Must be called by one thread at a time (rings have a single producer).
+/// @param delivered number of peers that got the message
+/// @param overflowed number of peers which ring was full
+void shm_transport_broadcast(ShmTransportSegment* segment, const UDPMessage* message,
+                             uint32_t* delivered, uint32_t* overflowed);
+/// @brief Pushes message to the @a peer_index peer only, same rules as the broadcast.
+/// @return false if the peer is not attached or its ring is full
+bool shm_transport_send(ShmTransportSegment* segment, uint32_t peer_index,
+                        const UDPMessage* message);
+/// @brief Finds the slots of the workers that died without detaching, they
+/// stay attached until they are released with shm_transport_release_peer().
+/// @param peer_indices SHM_TRANSPORT_MAX_PEERS slots at most
+/// @return number of the slots
+uint32_t shm_transport_find_dead_peers(const ShmTransportSegment* segment,
+                                       uint32_t* peer_indices);
+/// @brief Frees the slot if the process @a pid is still attached to it.
+void shm_transport_release_peer(ShmTransportSegment* segment, uint32_t peer_index, pid_t pid);
+static inline uint64_t shm_transport_peer_heartbeats(const ShmTransportSegment* segment,
+                                                     uint32_t peer_index) {
+    return __atomic_load_n(&segment->peers[peer_index].heartbeats, __ATOMIC_RELAXED);
+}
+static inline WorkerLoad shm_transport_peer_load(const ShmTransportSegment* segment,
+                                                 uint32_t peer_index) {
+    const uint64_t load = __atomic_load_n(&segment->peers[peer_index].load, __ATOMIC_RELAXED);
+    return (WorkerLoad){
+        .pins_processed  = (uint32_t)(load >> 32),
+        .service_time_ms = (uint32_t)load,
+    };
+}
+
+/// Client side.
+
+typedef struct ShmPeerHandle {
+    ShmTransportSegment* segment;
+    uint32_t peer_index;
+} ShmPeerHandle;
+
+static inline bool is_shm_peer_attached(const ShmPeerHandle* handle) {
+    return handle->segment != NULL;
+}
+/// @brief Attaches to the segment of the server on this host if there is one.
+bool attach_shm_transport(ShmPeerHandle* handle, uint16_t server_port, ComponentType type);
+void detach_shm_transport(ShmPeerHandle* handle);
+/// @return false if the ring is full
+bool shm_peer_send(const ShmPeerHandle* handle, const UDPMessage* message);
+static inline void shm_peer_heartbeat(const ShmPeerHandle* handle) {
+    __atomic_fetch_add(&handle->segment->peers[handle->peer_index].heartbeats, 1,
+                       __ATOMIC_RELAXED);
+}
+static inline void shm_peer_report_load(const ShmPeerHandle* handle, WorkerLoad load) {
+    __atomic_store_n(&handle->segment->peers[handle->peer_index].load, shm_pack_worker_load(load),
+                     __ATOMIC_RELAXED);
+}
+/// @return false if no message arrived in @a timeout_ms
+bool shm_peer_receive(const ShmPeerHandle* handle, UDPMessage* message, uint32_t timeout_ms);
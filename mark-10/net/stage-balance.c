@@ -0,0 +1,169 @@
+#include "stage-balance.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Weight of the last interval in the smoothed rates and service times.
+static const double STAGE_BALANCE_SMOOTHING = 0.5;
+
+static double smooth(double average, double sample, bool has_average) {
+    return has_average ? average + STAGE_BALANCE_SMOOTHING * (sample - average) : sample;
+}
+
+void init_stage_balance(StageBalance* balance, uint64_t now_ns) {
+    memset(balance, 0, sizeof(*balance));
+    balance->last_update_ns = now_ns;
+    balance->bottleneck     = STAGE_BALANCE_NO_STAGE;
+}
+
+void stage_balance_record(StageBalance* balance, uint32_t stage, uint32_t pins,
+                          uint32_t service_time_ms) {
+    balance->pins_processed[stage] += pins;
+    balance->service_time_ms[stage] += service_time_ms;
+}
+
+static void measure_stage(StageBalance* balance, uint32_t stage, const StageSample* sample,
+                          double elapsed_s, bool has_average) {
+    StageLoad* load               = &balance->stages[stage];
+    const uint64_t pins_processed = balance->pins_processed[stage];
+    const uint64_t processed      = pins_processed - balance->last_pins_processed[stage];
+    const uint64_t service_ms     = balance->service_time_ms[stage] -
+                                balance->last_service_time_ms[stage];
+    // the entry stages make their pins, they arrive as fast as they are processed
+    const uint64_t arrived =
+        sample->is_entry ? processed : sample->pins_routed - balance->last_pins_routed[stage];
+
+    load->arrival_rate = smooth(load->arrival_rate, (double)arrived / elapsed_s, has_average);
+    if (processed != 0) {
+        const double service_time_s = (double)service_ms / 1000.0 / (double)processed;
+        load->service_time_s        = smooth(load->service_time_s, service_time_s,
+                                             load->service_time_s != 0);
+    }
+    load->is_used      = sample->is_used;
+    load->is_entry     = sample->is_entry;
+    load->queue_length = !sample->is_entry && sample->pins_routed > pins_processed
+                             ? sample->pins_routed - pins_processed
+                             : 0;
+    load->workers      = sample->workers;
+    load->concurrency  = sample->concurrency;
+    load->capacity =
+        load->service_time_s != 0 ? (double)load->concurrency / load->service_time_s : 0;
+
+    balance->last_pins_processed[stage]  = pins_processed;
+    balance->last_service_time_ms[stage] = balance->service_time_ms[stage];
+    balance->last_pins_routed[stage]     = sample->pins_routed;
+}
+
+/// @brief Rates of the stages in the pins the entry stages make, see StageLoad.sustained_rate.
+static void find_bottleneck(StageBalance* balance) {
+    double made_rate      = 0;
+    bool is_made_measured = false;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const StageLoad* load = &balance->stages[i];
+        if (load->is_used && load->is_entry) {
+            made_rate += load->arrival_rate;
+            is_made_measured |= load->service_time_s != 0;
+        }
+    }
+    balance->bottleneck = STAGE_BALANCE_NO_STAGE;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        StageLoad* load          = &balance->stages[i];
+        const double visit_ratio = made_rate != 0 ? load->arrival_rate / made_rate : 0;
+        if (!load->is_used) {
+            load->is_measured    = false;
+            load->sustained_rate = 0;
+        } else if (load->is_entry) {
+            load->is_measured    = load->service_time_s != 0;
+            load->sustained_rate = visit_ratio != 0 ? load->capacity / visit_ratio : load->capacity;
+        } else if (load->workers == 0) {
+            // the pins the entry stages make have nowhere to go
+            load->is_measured    = is_made_measured;
+            load->sustained_rate = 0;
+        } else {
+            load->is_measured    = visit_ratio != 0 && load->service_time_s != 0;
+            load->sustained_rate = load->is_measured ? load->capacity / visit_ratio : 0;
+        }
+        if (load->is_measured &&
+            (balance->bottleneck == STAGE_BALANCE_NO_STAGE ||
+             load->sustained_rate < balance->stages[balance->bottleneck].sustained_rate)) {
+            balance->bottleneck = (int32_t)i;
+        }
+    }
+}
+
+void update_stage_balance(StageBalance* balance, const StageSample samples[PIPELINE_STAGES],
+                          uint64_t now_ns) {
+    if (now_ns <= balance->last_update_ns) {
+        return;
+    }
+    const double elapsed_s = (double)(now_ns - balance->last_update_ns) / 1e9;
+    // the first interval has nothing to smooth with
+    const bool has_average = balance->updates != 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        measure_stage(balance, i, &samples[i], elapsed_s, has_average);
+    }
+    find_bottleneck(balance);
+    balance->last_update_ns = now_ns;
+    balance->updates++;
+}
+
+/// @brief Rate the pipeline keeps up with once a worker moves from the @a from
+/// stage to the @a to stage, the capacity follows the moved concurrency.
+/// A stage without workers does not limit the rate once it gets one.
+static double rate_after_move(const StageBalance* balance, uint32_t from, uint32_t to) {
+    const StageLoad* from_load = &balance->stages[from];
+    const StageLoad* to_load   = &balance->stages[to];
+    const double moved = (double)from_load->concurrency / (double)from_load->workers;
+
+    double rate = -1;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const StageLoad* load = &balance->stages[i];
+        if (!load->is_measured) {
+            continue;
+        }
+        double stage_rate = load->sustained_rate;
+        if (i == from) {
+            stage_rate *= ((double)load->concurrency - moved) / (double)load->concurrency;
+        } else if (i == to) {
+            if (to_load->concurrency == 0) {
+                continue;
+            }
+            stage_rate *= ((double)load->concurrency + moved) / (double)load->concurrency;
+        }
+        if (rate < 0 || stage_rate < rate) {
+            rate = stage_rate;
+        }
+    }
+    return rate < 0 ? 0 : rate;
+}
+
+bool stage_balance_advise(const StageBalance* balance, StageBalanceAdvice* advice) {
+    if (balance->bottleneck == STAGE_BALANCE_NO_STAGE) {
+        return false;
+    }
+    const uint32_t bottleneck = (uint32_t)balance->bottleneck;
+    const double rate         = balance->stages[bottleneck].sustained_rate;
+    bool has_advice           = false;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        const StageLoad* load = &balance->stages[i];
+        // the stage keeps a worker, the pins of the others would stop there
+        if (i == bottleneck || !load->is_measured || load->workers < 2) {
+            continue;
+        }
+        const double advised_rate = rate_after_move(balance, i, bottleneck);
+        if (advised_rate <= rate ||
+            advised_rate * 100 < rate * (100 + STAGE_BALANCE_MIN_GAIN_PERCENT) ||
+            (has_advice && advised_rate <= advice->advised_rate)) {
+            continue;
+        }
+        *advice = (StageBalanceAdvice){
+            .from_stage     = i,
+            .to_stage       = bottleneck,
+            .sustained_rate = rate,
+            .advised_rate   = advised_rate,
+        };
+        has_advice = true;
+    }
+    return has_advice;
+}
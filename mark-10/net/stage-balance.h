@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net-config.h"
+
+/// @brief Load of the pipeline stages and the stage that limits the pipeline.
+///
+/// The workers report the pins they processed and the time the pins took
+/// (cumulative counters, see WorkerLoad); the server routes the pins of the
+/// previous stage to the next ones. At every update each stage gets:
+///  - the arrival rate: the pins per second that reach the stage, the entry
+///    stages make their pins themselves so their rate is the one they
+///    process at;
+///  - the service time: the mean time a worker spends on a pin;
+///  - the queue length: the pins routed to the stage and not processed yet;
+///  - the capacity: its concurrency over the service time, the pins per
+///    second it processes with all the workers busy.
+/// Only a part of the pins the entry stages make reach a stage (the rejected
+/// pins stop, a fan-out copies them), so a stage keeps up with its capacity
+/// divided by that part of the made pins. The bottleneck is the stage that
+/// keeps up with the fewest made pins: the pipeline can not go faster than
+/// it, whatever the other stages do.
+///
+/// The rates and the service times are smoothed over the updates (EWMA), so
+/// a single slow pin does not move the bottleneck.
+enum {
+    /// A worker is advised to move only if the pipeline gets that much faster.
+    STAGE_BALANCE_MIN_GAIN_PERCENT = 10,
+    STAGE_BALANCE_NO_STAGE         = -1,
+};
+
+typedef struct StageLoad {
+    /// Pins per second.
+    double arrival_rate;
+    /// Seconds a worker spends on a pin, 0 until a pin is processed.
+    double service_time_s;
+    uint64_t queue_length;
+    uint32_t workers;
+    uint32_t concurrency;
+    /// Pins per second.
+    double capacity;
+    /// Pins per second the entry stages make that the stage keeps up with.
+    double sustained_rate;
+    /// The pins reached the stage and it processed some, sustained_rate is known.
+    bool is_measured;
+    /// Copied from the StageSample.
+    bool is_used;
+    bool is_entry;
+} StageLoad;
+
+/// @brief State of a stage at an update, read by the caller from its counters.
+typedef struct StageSample {
+    /// The pipeline has the stage, the others are skipped.
+    bool is_used;
+    /// The stage makes its pins, no route leads to it.
+    bool is_entry;
+    /// Pins the server routed to the stage since the start, unused for the entry stages.
+    uint64_t pins_routed;
+    uint32_t workers;
+    /// Sum of the concurrency of the workers.
+    uint32_t concurrency;
+} StageSample;
+
+typedef struct StageBalance {
+    uint64_t last_update_ns;
+    uint32_t updates;
+    /// Reported by the workers since the start.
+    uint64_t pins_processed[PIPELINE_STAGES];
+    uint64_t service_time_ms[PIPELINE_STAGES];
+    /// Counters at the last update.
+    uint64_t last_pins_processed[PIPELINE_STAGES];
+    uint64_t last_service_time_ms[PIPELINE_STAGES];
+    uint64_t last_pins_routed[PIPELINE_STAGES];
+    StageLoad stages[PIPELINE_STAGES];
+    /// Index of the bottleneck stage or STAGE_BALANCE_NO_STAGE.
+    int32_t bottleneck;
+} StageBalance;
+
+/// @brief Worker move that speeds the pipeline up.
+typedef struct StageBalanceAdvice {
+    uint32_t from_stage;
+    uint32_t to_stage;
+    /// Pins per second the entry stages make that the pipeline keeps up with now and after
+    /// the move, a bottleneck without workers is left out after the move.
+    double sustained_rate;
+    double advised_rate;
+} StageBalanceAdvice;
+
+void init_stage_balance(StageBalance* balance, uint64_t now_ns);
+/// @brief Adds the @a pins a worker of the @a stage processed since its previous report.
+void stage_balance_record(StageBalance* balance, uint32_t stage, uint32_t pins,
+                          uint32_t service_time_ms);
+/// @brief Measures the stages over the time since the previous update.
+void update_stage_balance(StageBalance* balance, const StageSample samples[PIPELINE_STAGES],
+                          uint64_t now_ns);
+/// @brief Finds the move of one worker to the bottleneck that speeds the pipeline
+/// up the most, every stage keeps a worker.
+/// @return false if no move gains STAGE_BALANCE_MIN_GAIN_PERCENT
+bool stage_balance_advise(const StageBalance* balance, StageBalanceAdvice* advice);
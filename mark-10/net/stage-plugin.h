@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pin.h"
+
+/// @brief Interface of the shared libraries that add steps to the pipeline,
+/// see pipeline-config.h. The library exports a PipelinePlugin named
+/// PIPELINE_PLUGIN_SYMBOL, e.g.
+///
+///     static const PipelineStep steps[] = {{"polish", &polish_pin}};
+///     const PipelinePlugin pipeline_plugin = {PIPELINE_PLUGIN_API_VERSION, 1, steps};
+///
+/// and is built with -shared -fPIC. The steps run on the threads of the
+/// worker pools, as many pins at once as the concurrency of the stage.
+#define PIPELINE_PLUGIN_SYMBOL "pipeline_plugin"
+
+enum { PIPELINE_PLUGIN_API_VERSION = 2 };
+
+/// @return true if the pin goes on to the next stages, false if it is rejected
+typedef bool (*PipelineStepFunction)(const Pin* pin);
+
+typedef struct PipelineStep {
+    const char* name;
+    PipelineStepFunction process;
+} PipelineStep;
+
+typedef struct PipelinePlugin {
+    /// PIPELINE_PLUGIN_API_VERSION the plugin was built with.
+    uint32_t api_version;
+    uint32_t steps_count;
+    const PipelineStep* steps;
+} PipelinePlugin;
@@ -0,0 +1,154 @@
+#include "stage-queue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/config.h"
+
+bool init_stage_queue(StageQueue* queue, StageQueuePolicy policy, uint32_t capacity) {
+    memset(queue, 0, sizeof(*queue));
+    queue->policy   = policy;
+    queue->capacity = capacity;
+    queue->entries  = malloc(capacity * sizeof(*queue->entries));
+    if (queue->entries == NULL) {
+        app_perror("stage queue");
+        return false;
+    }
+    return true;
+}
+
+void deinit_stage_queue(StageQueue* queue) {
+    free(queue->entries);
+    queue->entries  = NULL;
+    queue->capacity = 0;
+    queue->count    = 0;
+}
+
+const char* stage_queue_policy_to_string(StageQueuePolicy policy) {
+    switch (policy) {
+        case STAGE_QUEUE_OFF:
+            return "off";
+        case STAGE_QUEUE_FIFO:
+            return "fifo";
+        case STAGE_QUEUE_PRIORITY:
+            return "priority";
+        case STAGE_QUEUE_EDF:
+            return "edf";
+        default:
+            return "unknown";
+    }
+}
+
+/// @return true if the entry @a a leaves the queue before the entry @a b
+static bool is_before(const StageQueue* queue, const StageQueueEntry* a,
+                      const StageQueueEntry* b) {
+    if (queue->policy == STAGE_QUEUE_PRIORITY && a->pin.priority != b->pin.priority) {
+        return a->pin.priority > b->pin.priority;
+    }
+    if (queue->policy == STAGE_QUEUE_EDF && a->deadline_ns != b->deadline_ns) {
+        return a->deadline_ns < b->deadline_ns;
+    }
+    return a->sequence < b->sequence;
+}
+
+/// @return true if the entry @a a is worth less than the entry @a b
+static bool is_less_valuable(const StageQueueEntry* a, const StageQueueEntry* b) {
+    if (a->pin.priority != b->pin.priority) {
+        return a->pin.priority < b->pin.priority;
+    }
+    return a->sequence > b->sequence;
+}
+
+static void swap_entries(StageQueueEntry* a, StageQueueEntry* b) {
+    const StageQueueEntry entry = *a;
+    *a                          = *b;
+    *b                          = entry;
+}
+
+static void sift_up(StageQueue* queue, uint32_t index) {
+    while (index != 0) {
+        const uint32_t parent = (index - 1) / 2;
+        if (!is_before(queue, &queue->entries[index], &queue->entries[parent])) {
+            return;
+        }
+        swap_entries(&queue->entries[index], &queue->entries[parent]);
+        index = parent;
+    }
+}
+
+static void sift_down(StageQueue* queue, uint32_t index) {
+    for (;;) {
+        uint32_t first      = index;
+        const uint32_t left = 2 * index + 1;
+        if (left < queue->count &&
+            is_before(queue, &queue->entries[left], &queue->entries[first])) {
+            first = left;
+        }
+        if (left + 1 < queue->count &&
+            is_before(queue, &queue->entries[left + 1], &queue->entries[first])) {
+            first = left + 1;
+        }
+        if (first == index) {
+            return;
+        }
+        swap_entries(&queue->entries[index], &queue->entries[first]);
+        index = first;
+    }
+}
+
+static void remove_entry(StageQueue* queue, uint32_t index, StageQueueEntry* entry) {
+    *entry = queue->entries[index];
+    queue->count--;
+    if (index == queue->count) {
+        return;
+    }
+    queue->entries[index] = queue->entries[queue->count];
+    sift_up(queue, index);
+    sift_down(queue, index);
+}
+
+bool stage_queue_push(StageQueue* queue, const StageQueueEntry* entry, StageQueueEntry* shed) {
+    StageQueueEntry pushed = *entry;
+    pushed.sequence        = queue->next_sequence++;
+    bool is_shed           = false;
+    if (queue->count == queue->capacity) {
+        // the heap orders the pins to send, the least valuable one can be anywhere
+        uint32_t victim = 0;
+        for (uint32_t i = 1; i < queue->count; i++) {
+            if (is_less_valuable(&queue->entries[i], &queue->entries[victim])) {
+                victim = i;
+            }
+        }
+        queue->pins_shed++;
+        if (queue->count == 0 || !is_less_valuable(&queue->entries[victim], &pushed)) {
+            *shed = pushed;
+            return false;
+        }
+        remove_entry(queue, victim, shed);
+        is_shed = true;
+    }
+    queue->entries[queue->count] = pushed;
+    sift_up(queue, queue->count++);
+    return !is_shed;
+}
+
+bool stage_queue_pop(StageQueue* queue, StageQueueEntry* entry) {
+    if (queue->count == 0) {
+        return false;
+    }
+    remove_entry(queue, 0, entry);
+    queue->pins_popped++;
+    return true;
+}
+
+bool stage_queue_expire(StageQueue* queue, uint64_t now_ns, StageQueueEntry* entry) {
+    if (queue->policy != STAGE_QUEUE_EDF || queue->count == 0 ||
+        queue->entries[0].deadline_ns > now_ns) {
+        return false;
+    }
+    remove_entry(queue, 0, entry);
+    queue->pins_expired++;
+    return true;
+}
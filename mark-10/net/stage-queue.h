@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pin.h"
+
+/// @brief Bounded queue of the pins the server routed to a stage and did not
+/// send to its workers yet.
+///
+/// The policy orders the pins that leave the queue:
+///  - fifo: in the order they came;
+///  - priority: the higher Pin::priority first, in the order they came within a class;
+///  - edf: the earliest deadline first, the pins past their deadline are
+///    stale and expire instead of being sent.
+/// A full queue sheds the least valuable pin whatever the policy: the lowest
+/// priority and, within it, the one that came last. A new pin that is worth
+/// no more than that one is shed itself.
+typedef enum StageQueuePolicy {
+    /// The server sends the pins as they come, there are no queues.
+    STAGE_QUEUE_OFF,
+    STAGE_QUEUE_FIFO,
+    STAGE_QUEUE_PRIORITY,
+    STAGE_QUEUE_EDF,
+    STAGE_QUEUE_POLICIES_COUNT,
+} StageQueuePolicy;
+
+typedef struct StageQueueEntry {
+    Pin pin;
+    /// Stage that passed the pin.
+    uint32_t from_stage;
+    /// Monotonic ns.
+    uint64_t enqueued_ns;
+    uint64_t deadline_ns;
+    /// Order of the arrival, set by the queue.
+    uint64_t sequence;
+} StageQueueEntry;
+
+typedef struct StageQueue {
+    StageQueuePolicy policy;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t next_sequence;
+    /// Binary heap, the next pin to leave is the first one.
+    StageQueueEntry* entries;
+    /// Since the start.
+    uint64_t pins_popped;
+    uint64_t pins_shed;
+    uint64_t pins_expired;
+} StageQueue;
+
+bool init_stage_queue(StageQueue* queue, StageQueuePolicy policy, uint32_t capacity);
+void deinit_stage_queue(StageQueue* queue);
+const char* stage_queue_policy_to_string(StageQueuePolicy policy);
+/// @brief Queues the @a entry, a full queue sheds its least valuable pin.
+/// @return false if a pin was shed, @a shed is a copy of it then (the @a entry or a queued one)
+bool stage_queue_push(StageQueue* queue, const StageQueueEntry* entry, StageQueueEntry* shed);
+/// @return false if the queue is empty
+bool stage_queue_pop(StageQueue* queue, StageQueueEntry* entry);
+/// @brief Removes a stale pin, only the edf policy has them.
+/// @return false if no pin is past its deadline at @a now_ns
+bool stage_queue_expire(StageQueue* queue, uint64_t now_ns, StageQueueEntry* entry);
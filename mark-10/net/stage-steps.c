@@ -0,0 +1,132 @@
+#include "stage-steps.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/config.h"
+#include "pipeline-config.h"
+#include "stage-plugin.h"
+
+enum { PIPELINE_MAX_STEPS = 64 };
+
+static struct PipelineSteps {
+    PipelineStep steps[PIPELINE_MAX_STEPS];
+    uint32_t steps_count;
+    void* plugins[PIPELINE_MAX_PLUGINS];
+    uint32_t plugins_count;
+} pipeline_steps;
+
+static void sleep_random_time(void) {
+    uint32_t sleep_time = (uint32_t)rand() % (MAX_SLEEP_TIME - MIN_SLEEP_TIME + 1) + MIN_SLEEP_TIME;
+    sleep(sleep_time);
+}
+
+static bool check_pin_crookness(const Pin* pin) {
+    sleep_random_time();
+    uint32_t x = (uint32_t)pin->pin_id;
+#if defined(__GNUC__)
+    return __builtin_parity(x) & 1;
+#else
+    return x & 1;
+#endif
+}
+
+static bool sharpen_pin(const Pin* pin) {
+    (void)pin;
+    sleep_random_time();
+    return true;
+}
+
+static bool check_sharpened_pin_quality(const Pin* pin) {
+    sleep_random_time();
+    return cos(pin->pin_id) >= 0;
+}
+
+static const PipelineStep builtin_steps[] = {
+    {"check-crookness", &check_pin_crookness},
+    {"sharpen", &sharpen_pin},
+    {"check-quality", &check_sharpened_pin_quality},
+};
+
+static bool register_pipeline_steps(const PipelineStep* steps, uint32_t count, const char* origin) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (steps[i].name == NULL || steps[i].process == NULL) {
+            fprintf(stderr, "%s: step %u has no name or no function\n", origin, i);
+            return false;
+        }
+        if (find_pipeline_step(steps[i].name) != NULL) {
+            fprintf(stderr, "%s: step \"%s\" is already loaded\n", origin, steps[i].name);
+            return false;
+        }
+        if (pipeline_steps.steps_count == PIPELINE_MAX_STEPS) {
+            fprintf(stderr, "%s: too many steps\n", origin);
+            return false;
+        }
+        pipeline_steps.steps[pipeline_steps.steps_count++] = steps[i];
+    }
+    return true;
+}
+
+static bool load_pipeline_plugin(const char* path) {
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return false;
+    }
+    pipeline_steps.plugins[pipeline_steps.plugins_count++] = handle;
+    const PipelinePlugin* plugin = dlsym(handle, PIPELINE_PLUGIN_SYMBOL);
+    if (plugin == NULL) {
+        fprintf(stderr, "%s: no %s symbol\n", path, PIPELINE_PLUGIN_SYMBOL);
+        return false;
+    }
+    if (plugin->api_version != PIPELINE_PLUGIN_API_VERSION) {
+        fprintf(stderr, "%s: plugin API version %u, expected %u\n", path, plugin->api_version,
+                PIPELINE_PLUGIN_API_VERSION);
+        return false;
+    }
+    return register_pipeline_steps(plugin->steps, plugin->steps_count, path);
+}
+
+bool load_pipeline_steps(const PipelineConfig* config) {
+    bool ok = register_pipeline_steps(
+        builtin_steps, sizeof(builtin_steps) / sizeof(builtin_steps[0]), "built-in");
+    for (uint32_t i = 0; ok && i < config->plugins_count; i++) {
+        ok = load_pipeline_plugin(config->plugins[i]);
+    }
+    for (uint32_t i = 0; ok && i < PIPELINE_STAGES; i++) {
+        const PipelineStageConfig* stage = &config->stages[i];
+        if (stage->is_used && find_pipeline_step(stage->step) == NULL) {
+            fprintf(stderr, "Unknown step \"%s\" of the %s stage\n", stage->step,
+                    pipeline_stage_name(i));
+            ok = false;
+        }
+    }
+    if (!ok) {
+        unload_pipeline_steps();
+    }
+    return ok;
+}
+
+PipelineStepFunction find_pipeline_step(const char* name) {
+    for (uint32_t i = 0; i < pipeline_steps.steps_count; i++) {
+        if (strcmp(pipeline_steps.steps[i].name, name) == 0) {
+            return pipeline_steps.steps[i].process;
+        }
+    }
+    return NULL;
+}
+
+void unload_pipeline_steps(void) {
+    // the names of the steps live in the plugins
+    pipeline_steps.steps_count = 0;
+    for (uint32_t i = 0; i < pipeline_steps.plugins_count; i++) {
+        dlclose(pipeline_steps.plugins[i]);
+    }
+    pipeline_steps.plugins_count = 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "pipeline-config.h"
+#include "stage-plugin.h"
+
+/// @brief Registers the built-in steps (check-crookness, sharpen and
+/// check-quality) and the steps of the plugins of the @a config.
+/// @return false if a plugin could not be loaded or two steps share a name
+bool load_pipeline_steps(const PipelineConfig* config);
+/// @return the step named @a name, NULL if no loaded step has it
+PipelineStepFunction find_pipeline_step(const char* name);
+/// @brief Unloads the plugins, no step runs anymore.
+void unload_pipeline_steps(void);
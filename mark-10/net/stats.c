@@ -0,0 +1,182 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../util/clock.h"
+#include "../util/config.h"
+#include "../util/histogram.h"
+#include "../util/metrics-export.h"
+#include "../util/metrics.h"
+
+enum { STATS_REFRESH_PERIOD_MS = 1000 };
+
+static volatile sig_atomic_t is_running = true;
+
+static void signal_handler(int sig) {
+    (void)sig;
+    is_running = false;
+}
+
+static bool is_metrics_segment(const char* file_name) {
+    return strncmp(file_name, METRICS_EXPORT_SHM_PREFIX, sizeof(METRICS_EXPORT_SHM_PREFIX) - 1) ==
+           0;
+}
+
+static bool is_process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static bool is_publisher_alive(const MetricsExportSegment* segment) {
+    return is_process_alive(segment->pid);
+}
+
+/// @brief Finds the segment of the process with given pid or prints all the segments.
+static bool find_segment(const char* pid_str, char segment_name[METRICS_EXPORT_NAME_SIZE]) {
+    DIR* dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        app_perror("opendir");
+        return false;
+    }
+    bool found = false;
+    const struct dirent* entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (!is_metrics_segment(entry->d_name)) {
+            continue;
+        }
+        const char* pid_suffix = strrchr(entry->d_name, '-');
+        if (pid_str == NULL) {
+            bool is_alive = pid_suffix != NULL && is_process_alive((pid_t)atoi(pid_suffix + 1));
+            printf("> %s%s\n", entry->d_name, is_alive ? "" : " (not running)");
+            continue;
+        }
+        if (pid_suffix != NULL && strcmp(pid_suffix + 1, pid_str) == 0) {
+            snprintf(segment_name, METRICS_EXPORT_NAME_SIZE, "/%.*s", METRICS_EXPORT_NAME_SIZE - 2,
+                     entry->d_name);
+            found = true;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+static void print_histogram_row(const char* name, const Histogram* hist) {
+    printf("| %-32s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %12" PRIu64 "\n",
+           name, hist->count, histogram_value_at_percentile(hist, 50.0) / 1000,
+           histogram_value_at_percentile(hist, 90.0) / 1000,
+           histogram_value_at_percentile(hist, 99.0) / 1000, hist->max / 1000);
+}
+
+static void print_stats_view(const MetricsExportSegment* segment, const MetricsSnapshot* current,
+                             const MetricsSnapshot* previous, double elapsed_sec,
+                             uint64_t published_ns) {
+    // clear screen and move cursor home, like top(1)
+    printf("\033[H\033[2J");
+    printf(
+        "+-------------------------------------------------------------------------------\n"
+        "| %s[pid=%d], published %.1f s ago\n"
+        "+-------------------------------------------------------------------------------\n"
+        "| %-46s %12s %12s\n",
+        segment->component, (int)segment->pid,
+        (double)(monotonic_time_ns() - published_ns) / 1e9, "counter", "total", "per sec");
+    for (uint32_t i = 0; i < current->counters_size; i++) {
+        const uint64_t prev = i < previous->counters_size ? previous->counters[i] : 0;
+        const double rate =
+            elapsed_sec > 0 ? (double)(current->counters[i] - prev) / elapsed_sec : 0.0;
+        printf("| %-46s %12" PRIu64 " %12.1f\n", current->counter_names[i], current->counters[i],
+               rate);
+    }
+    if (current->gauges_size != 0) {
+        printf("| %-46s %12s\n", "gauge", "value");
+    }
+    for (uint32_t i = 0; i < current->gauges_size; i++) {
+        printf("| %-46s %12" PRId64 "\n", current->gauge_names[i], current->gauges[i]);
+    }
+    if (current->histograms_size != 0) {
+        printf("| %-32s %10s %10s %10s %10s %12s\n", "latency (us)", "count", "p50", "p90", "p99",
+               "max");
+    }
+    for (uint32_t i = 0; i < current->histograms_size; i++) {
+        print_histogram_row(current->histogram_names[i], &current->histograms[i]);
+    }
+    printf("+-------------------------------------------------------------------------------\n");
+    fflush(stdout);
+}
+
+static int watch_segment(const char* segment_name) {
+    const MetricsExportSegment* segment = attach_metrics_export(segment_name);
+    if (segment == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    static MetricsSnapshot snapshots[2];
+    size_t current_index   = 0;
+    uint64_t published_ns  = 0;
+    uint64_t previous_ns   = 0;
+    const struct timespec period = {
+        .tv_sec  = STATS_REFRESH_PERIOD_MS / 1000,
+        .tv_nsec = (STATS_REFRESH_PERIOD_MS % 1000) * 1000000L,
+    };
+    while (is_running) {
+        if (!is_publisher_alive(segment)) {
+            printf("> %s[pid=%d] is not running anymore\n", segment->component, (int)segment->pid);
+            break;
+        }
+        MetricsSnapshot* current        = &snapshots[current_index];
+        const MetricsSnapshot* previous = &snapshots[current_index ^ 1];
+        if (read_metrics_export(segment, current, &published_ns)) {
+            const double elapsed_sec =
+                previous_ns == 0 ? 0.0 : (double)(published_ns - previous_ns) / 1e9;
+            print_stats_view(segment, current, previous, elapsed_sec, published_ns);
+            previous_ns = published_ns;
+            current_index ^= 1;
+        }
+        nanosleep(&period, NULL);
+    }
+
+    detach_metrics_export(segment);
+    return EXIT_SUCCESS;
+}
+
+static void print_usage(const char* program_path) {
+    fprintf(stderr,
+            "Usage: %s [pid]\n"
+            "Without arguments prints metrics segments of the running components,\n"
+            "with pid shows live metrics of the component\n"
+            "Example: %s 4242\n",
+            program_path, program_path);
+}
+
+int main(int argc, const char* argv[]) {
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    if (argc > 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char segment_name[METRICS_EXPORT_NAME_SIZE] = {0};
+    if (argc == 1) {
+        find_segment(NULL, segment_name);
+        return EXIT_SUCCESS;
+    }
+    if (!find_segment(argv[1], segment_name)) {
+        fprintf(stderr, "> No metrics of the process with pid %s\n", argv[1]);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    return watch_segment(segment_name);
+}
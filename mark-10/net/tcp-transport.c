@@ -0,0 +1,534 @@
+#include "tcp-transport.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../util/config.h"
+#include "net-config.h"
+
+enum { TCP_EPOLL_EVENTS = 32 };
+
+static bool set_nodelay(int sock_fd) {
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &(int){true}, sizeof(int)) == -1) {
+        app_perror("setsockopt[IPPROTO_TCP,TCP_NODELAY]");
+        return false;
+    }
+    return true;
+}
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        app_perror("fcntl");
+        return false;
+    }
+    return true;
+}
+
+static bool write_frame(int sock_fd, const UDPMessage* message) {
+    const uint32_t header = htonl((uint32_t)sizeof(*message));
+    struct iovec iov[2]   = {
+        {.iov_base = (void*)&header, .iov_len = sizeof(header)},
+        {.iov_base = (void*)message, .iov_len = sizeof(*message)},
+    };
+    size_t left = TCP_FRAME_SIZE;
+    int iov_cnt = 2;
+    struct iovec* iov_ptr = iov;
+    while (left != 0) {
+        ssize_t written = writev(sock_fd, iov_ptr, iov_cnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        left -= (size_t)written;
+        // skip what is already written, partial writes are rare with
+        // TCP_FRAME_SIZE much smaller than the socket buffer
+        while (iov_cnt > 0 && (size_t)written >= iov_ptr->iov_len) {
+            written -= (ssize_t)iov_ptr->iov_len;
+            iov_ptr++;
+            iov_cnt--;
+        }
+        if (iov_cnt > 0) {
+            iov_ptr->iov_base = (char*)iov_ptr->iov_base + written;
+            iov_ptr->iov_len -= (size_t)written;
+        }
+    }
+    return true;
+}
+
+/// @brief Writes what the socket takes of the output of the connection and
+/// watches it for EPOLLOUT while some is left. The connection mutex must be held.
+/// @return false if the connection broke
+static bool flush_output(TcpServer* server, uint32_t index) {
+    TcpConnection* connection = &server->connections[index];
+    size_t written_size       = 0;
+    while (written_size < connection->output_size) {
+        ssize_t written = send(connection->fd, connection->output + written_size,
+                               connection->output_size - written_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        written_size += (size_t)written;
+    }
+    connection->output_size -= written_size;
+    memmove(connection->output, connection->output + written_size, connection->output_size);
+
+    const bool is_output_pending = connection->output_size != 0;
+    if (is_output_pending == connection->is_output_pending) {
+        return true;
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP | (is_output_pending ? EPOLLOUT : 0),
+        .data.u32 = index,
+    };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1) {
+        app_perror("epoll_ctl");
+        return false;
+    }
+    connection->is_output_pending = is_output_pending;
+    return true;
+}
+
+/// @brief Appends the frame of the @a message to the output of the connection,
+/// it is written at once unless the socket is full already. A broken connection
+/// is shut down for the polling thread to close it. The connection mutex must be held.
+/// @return false if the output is full or the connection broke
+static bool send_frame(TcpServer* server, uint32_t index, const UDPMessage* message) {
+    TcpConnection* connection = &server->connections[index];
+    if (connection->output_size + TCP_FRAME_SIZE > sizeof(connection->output)) {
+        // stalled client, it misses the message rather than the sender waits for it
+        return false;
+    }
+    const uint32_t header = htonl((uint32_t)sizeof(*message));
+    unsigned char* frame  = connection->output + connection->output_size;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + TCP_FRAME_HEADER_SIZE, message, sizeof(*message));
+    connection->output_size += TCP_FRAME_SIZE;
+    // the polling thread writes it with the rest once the socket is writable
+    if (connection->is_output_pending) {
+        return true;
+    }
+    if (!flush_output(server, index)) {
+        shutdown(connection->fd, SHUT_RDWR);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_frame(const unsigned char* frame, UDPMessage* message) {
+    uint32_t header;
+    memcpy(&header, frame, sizeof(header));
+    if (ntohl(header) != sizeof(*message)) {
+        return false;
+    }
+    memcpy(message, frame + TCP_FRAME_HEADER_SIZE, sizeof(*message));
+    return true;
+}
+
+static void init_connections(TcpServer* server) {
+    memset(server, 0, sizeof(*server));
+    for (size_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        server->connections[i].fd = -1;
+    }
+}
+
+/// @brief Creates the epoll set of the listening socket.
+static bool init_tcp_server_events(TcpServer* server) {
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd == -1) {
+        app_perror("epoll_create1");
+        return false;
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.u32 = TCP_INVALID_CONNECTION,
+    };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) == -1) {
+        app_perror("epoll_ctl");
+        close(server->epoll_fd);
+        return false;
+    }
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        pthread_mutex_init(&server->connection_mutexes[i], NULL);
+    }
+    return true;
+}
+
+bool init_tcp_server(TcpServer* server, const char* listen_address, uint16_t port) {
+    init_connections(server);
+
+    struct sockaddr_in address = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (listen_address != NULL && inet_pton(AF_INET, listen_address, &address.sin_addr) != 1) {
+        fprintf(stderr, "> Invalid TCP listen address %s\n", listen_address);
+        return false;
+    }
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server->listen_fd == -1) {
+        app_perror("socket");
+        return false;
+    }
+    if (setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){true}, sizeof(int)) ==
+        -1) {
+        app_perror("setsockopt[SOL_SOCKET,SO_REUSEADDR]");
+        goto init_tcp_server_cleanup_socket;
+    }
+    if (bind(server->listen_fd, (const struct sockaddr*)&address, sizeof(address)) == -1) {
+        app_perror("bind");
+        goto init_tcp_server_cleanup_socket;
+    }
+    if (listen(server->listen_fd, TCP_LISTEN_BACKLOG) == -1) {
+        app_perror("listen");
+        goto init_tcp_server_cleanup_socket;
+    }
+    if (!set_nonblocking(server->listen_fd) || !init_tcp_server_events(server)) {
+        goto init_tcp_server_cleanup_socket;
+    }
+    return true;
+
+init_tcp_server_cleanup_socket:
+    close(server->listen_fd);
+    return false;
+}
+
+bool adopt_tcp_server(TcpServer* server, int listen_fd) {
+    init_connections(server);
+    server->listen_fd = listen_fd;
+    return init_tcp_server_events(server);
+}
+
+bool tcp_server_adopt_connection(TcpServer* server, uint32_t index,
+                                 const TcpConnection* connection) {
+    if (index >= TCP_MAX_CONNECTIONS || server->connections[index].fd != -1 ||
+        connection->output_size > sizeof(connection->output)) {
+        fputs("> Invalid TCP connection to adopt\n", stderr);
+        return false;
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP,
+        .data.u32 = index,
+    };
+    if (!set_nonblocking(connection->fd)) {
+        return false;
+    }
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) == -1) {
+        app_perror("epoll_ctl");
+        return false;
+    }
+    pthread_mutex_lock(&server->connection_mutexes[index]);
+    server->connections[index]                   = *connection;
+    server->connections[index].is_output_pending = false;
+    // the output the previous server did not write goes first
+    if (!flush_output(server, index)) {
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->connection_mutexes[index]);
+    return true;
+}
+
+static void close_connection(TcpServer* server, uint32_t index) {
+    TcpConnection* connection = &server->connections[index];
+    pthread_mutex_lock(&server->connection_mutexes[index]);
+    if (connection->fd != -1) {
+        // closing fd removes it from the epoll set
+        close(connection->fd);
+        connection->fd = -1;
+    }
+    connection->type              = 0;
+    connection->buffered_size     = 0;
+    connection->output_size       = 0;
+    connection->is_output_pending = false;
+    pthread_mutex_unlock(&server->connection_mutexes[index]);
+}
+
+/// @return true if the connection is open and still the one of the client at @a address
+static bool is_connection_of(const TcpConnection* connection, const struct sockaddr_in* address) {
+    return connection->fd != -1 && connection->address.sin_addr.s_addr == address->sin_addr.s_addr &&
+           connection->address.sin_port == address->sin_port;
+}
+
+void tcp_server_shutdown_connection(TcpServer* server, uint32_t index,
+                                 const struct sockaddr_in* address) {
+    TcpConnection* connection = &server->connections[index];
+    pthread_mutex_lock(&server->connection_mutexes[index]);
+    if (is_connection_of(connection, address)) {
+        // the polling thread sees the hang up and closes it, it owns the buffer
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->connection_mutexes[index]);
+}
+
+void deinit_tcp_server(TcpServer* server) {
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        close_connection(server, i);
+    }
+    close(server->epoll_fd);
+    close(server->listen_fd);
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        pthread_mutex_destroy(&server->connection_mutexes[i]);
+    }
+}
+
+static void accept_connections(TcpServer* server) {
+    while (true) {
+        struct sockaddr_in address = {0};
+        socklen_t address_size     = sizeof(address);
+        int fd = accept(server->listen_fd, (struct sockaddr*)&address, &address_size);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                app_perror("accept");
+            }
+            return;
+        }
+
+        uint32_t index = TCP_INVALID_CONNECTION;
+        for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+            if (server->connections[i].fd == -1) {
+                index = i;
+                break;
+            }
+        }
+        if (index == TCP_INVALID_CONNECTION || !set_nodelay(fd) || !set_nonblocking(fd)) {
+            fputs("> Could not accept TCP client\n", stderr);
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLRDHUP,
+            .data.u32 = index,
+        };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            app_perror("epoll_ctl");
+            close(fd);
+            continue;
+        }
+
+        TcpConnection* connection = &server->connections[index];
+        pthread_mutex_lock(&server->connection_mutexes[index]);
+        connection->fd                = fd;
+        connection->type              = 0;
+        connection->address           = address;
+        connection->buffered_size     = 0;
+        connection->output_size       = 0;
+        connection->is_output_pending = false;
+        pthread_mutex_unlock(&server->connection_mutexes[index]);
+    }
+}
+
+static void read_connection(TcpServer* server, uint32_t index) {
+    TcpConnection* connection = &server->connections[index];
+    while (connection->buffered_size < sizeof(connection->buffer)) {
+        ssize_t read_bytes = recv(connection->fd, connection->buffer + connection->buffered_size,
+                                  sizeof(connection->buffer) - connection->buffered_size,
+                                  MSG_DONTWAIT);
+        if (read_bytes > 0) {
+            connection->buffered_size += (size_t)read_bytes;
+            continue;
+        }
+        if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        // EOF or connection error
+        close_connection(server, index);
+        return;
+    }
+}
+
+static bool pop_buffered_message(TcpServer* server, UDPMessage* message,
+                                 uint32_t* connection_index) {
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        const uint32_t index      = (server->next_connection + i) % TCP_MAX_CONNECTIONS;
+        TcpConnection* connection = &server->connections[index];
+        if (connection->fd == -1 || connection->buffered_size < TCP_FRAME_SIZE) {
+            continue;
+        }
+        if (!parse_frame(connection->buffer, message)) {
+            fputs("> Invalid TCP frame, closing connection\n", stderr);
+            close_connection(server, index);
+            continue;
+        }
+        connection->buffered_size -= TCP_FRAME_SIZE;
+        memmove(connection->buffer, connection->buffer + TCP_FRAME_SIZE,
+                connection->buffered_size);
+        if (message->sender_type != COMPONENT_TYPE_SERVER && connection->type == 0) {
+            pthread_mutex_lock(&server->connection_mutexes[index]);
+            connection->type = message->sender_type;
+            pthread_mutex_unlock(&server->connection_mutexes[index]);
+        }
+        server->next_connection = index + 1;
+        *connection_index       = index;
+        return true;
+    }
+    return false;
+}
+
+bool tcp_server_receive(TcpServer* server, UDPMessage* message, uint32_t* connection_index,
+                        uint32_t timeout_ms) {
+    if (pop_buffered_message(server, message, connection_index)) {
+        return true;
+    }
+
+    struct epoll_event events[TCP_EPOLL_EVENTS];
+    int events_count = epoll_wait(server->epoll_fd, events, TCP_EPOLL_EVENTS, (int)timeout_ms);
+    if (events_count == -1) {
+        if (errno != EINTR) {
+            app_perror("epoll_wait");
+        }
+        return false;
+    }
+    for (int i = 0; i < events_count; i++) {
+        const uint32_t index = events[i].data.u32;
+        if (index == TCP_INVALID_CONNECTION) {
+            accept_connections(server);
+            continue;
+        }
+        if ((events[i].events & EPOLLOUT) != 0) {
+            pthread_mutex_lock(&server->connection_mutexes[index]);
+            TcpConnection* connection = &server->connections[index];
+            if (connection->fd != -1 && !flush_output(server, index)) {
+                shutdown(connection->fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&server->connection_mutexes[index]);
+        }
+        if ((events[i].events & ~EPOLLOUT) != 0 && server->connections[index].fd != -1) {
+            read_connection(server, index);
+        }
+    }
+    return pop_buffered_message(server, message, connection_index);
+}
+
+uint32_t tcp_server_broadcast(TcpServer* server, const UDPMessage* message) {
+    uint32_t delivered = 0;
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+        const TcpConnection* connection = &server->connections[i];
+        pthread_mutex_lock(&server->connection_mutexes[i]);
+        // type is unknown until the client introduces itself, send it everything
+        if (connection->fd != -1 &&
+            (connection->type == 0 || (connection->type & message->receiver_type) != 0)) {
+            delivered += send_frame(server, i, message);
+        }
+        pthread_mutex_unlock(&server->connection_mutexes[i]);
+    }
+    return delivered;
+}
+
+bool tcp_server_has_output(TcpServer* server) {
+    bool has_output = false;
+    for (uint32_t i = 0; i < TCP_MAX_CONNECTIONS && !has_output; i++) {
+        pthread_mutex_lock(&server->connection_mutexes[i]);
+        has_output = server->connections[i].fd != -1 && server->connections[i].output_size != 0;
+        pthread_mutex_unlock(&server->connection_mutexes[i]);
+    }
+    return has_output;
+}
+
+bool tcp_server_send(TcpServer* server, uint32_t index, const struct sockaddr_in* address,
+                     const UDPMessage* message) {
+    if (index >= TCP_MAX_CONNECTIONS) {
+        return false;
+    }
+    bool ok = false;
+    pthread_mutex_lock(&server->connection_mutexes[index]);
+    if (is_connection_of(&server->connections[index], address)) {
+        ok = send_frame(server, index, message);
+    }
+    pthread_mutex_unlock(&server->connection_mutexes[index]);
+    return ok;
+}
+
+int connect_tcp_client(const char* server_address, uint16_t port) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+    };
+    if (inet_pton(AF_INET, server_address, &address.sin_addr) != 1) {
+        fprintf(stderr, "> Invalid server address %s\n", server_address);
+        return -1;
+    }
+    int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock_fd == -1) {
+        app_perror("socket");
+        return -1;
+    }
+    if (connect(sock_fd, (const struct sockaddr*)&address, sizeof(address)) == -1) {
+        app_perror("connect");
+        close(sock_fd);
+        return -1;
+    }
+    if (!set_nodelay(sock_fd)) {
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+bool tcp_send_message(int sock_fd, const UDPMessage* message) {
+    return write_frame(sock_fd, message);
+}
+
+ssize_t tcp_recv_message(int sock_fd, UDPMessage* message, int flags) {
+    unsigned char frame[TCP_FRAME_SIZE];
+    if ((flags & MSG_DONTWAIT) != 0 && (flags & MSG_PEEK) == 0) {
+        // never consume half of the frame
+        ssize_t peeked = tcp_recv_message(sock_fd, message, flags | MSG_PEEK);
+        if (peeked < 0) {
+            return peeked;
+        }
+        flags &= ~MSG_DONTWAIT;
+    }
+    // peeking reads take the frame only if it is whole,
+    // blocking reads wait for the rest of it
+    const bool wait_whole_frame = (flags & (MSG_DONTWAIT | MSG_PEEK)) == 0;
+    size_t read_size            = 0;
+    while (read_size < sizeof(frame)) {
+        ssize_t read_bytes = recv(sock_fd, frame + read_size, sizeof(frame) - read_size, flags);
+        if (read_bytes == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (read_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        read_size += (size_t)read_bytes;
+        if (read_size < sizeof(frame) && !wait_whole_frame) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    if (!parse_frame(frame, message)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return (ssize_t)sizeof(*message);
+}
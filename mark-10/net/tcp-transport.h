@@ -0,0 +1,107 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "net-config.h"
+
+/// @brief Stream transport for the deployments where UDP broadcast does not reach
+/// every component (routed networks).
+///
+/// Every UDPMessage is sent as a frame: 4 byte big endian payload length followed
+/// by the message itself, header and payload are written by one writev(2).
+/// Connections are persistent and use TCP_NODELAY. Semantics are the same as
+/// for the UDP broadcast: the server sends every message to every connected
+/// client which type matches message receiver_type, clients filter as usual.
+///
+/// The sockets of the server are non-blocking. The senders append the frames
+/// to the output buffer of the connection under its own lock and write what
+/// the socket takes, the polling thread writes the rest once the socket is
+/// writable again (EPOLLOUT), together with the frames that came meanwhile. A
+/// client that stops reading fills its buffer and misses the next messages,
+/// the senders never wait for it.
+
+#define TCP_TRANSPORT_ENV "TCP_TRANSPORT"
+
+enum {
+    TCP_MAX_CONNECTIONS        = 64,
+    TCP_FRAME_HEADER_SIZE      = sizeof(uint32_t),
+    TCP_FRAME_SIZE             = TCP_FRAME_HEADER_SIZE + sizeof(UDPMessage),
+    TCP_CONNECTION_BUFFER_SIZE = 4 * TCP_FRAME_SIZE,
+    TCP_OUTPUT_BUFFER_SIZE     = 64 * TCP_FRAME_SIZE,
+    TCP_LISTEN_BACKLOG         = 64,
+    TCP_INVALID_CONNECTION     = UINT32_MAX,
+};
+
+typedef struct TcpConnection {
+    int fd;
+    /// Type of the client, 0 until the first message from it.
+    ComponentType type;
+    struct sockaddr_in address;
+    size_t buffered_size;
+    unsigned char buffer[TCP_CONNECTION_BUFFER_SIZE];
+    /// Frames the socket did not take yet.
+    size_t output_size;
+    unsigned char output[TCP_OUTPUT_BUFFER_SIZE];
+    /// The socket is watched for EPOLLOUT, the polling thread writes the output.
+    bool is_output_pending;
+} TcpConnection;
+
+typedef struct TcpServer {
+    int listen_fd;
+    int epoll_fd;
+    /// Guard the fd, the type and the output of every connection: the fd and
+    /// the type are written by the polling thread and read by every thread
+    /// that sends messages.
+    pthread_mutex_t connection_mutexes[TCP_MAX_CONNECTIONS];
+    uint32_t next_connection;
+    TcpConnection connections[TCP_MAX_CONNECTIONS];
+} TcpServer;
+
+/// Server side.
+
+/// @param listen_address NULL to listen on all the interfaces
+bool init_tcp_server(TcpServer* server, const char* listen_address, uint16_t port);
+void deinit_tcp_server(TcpServer* server);
+/// @brief Takes over the listening socket of the server that hands over to this process.
+bool adopt_tcp_server(TcpServer* server, int listen_fd);
+/// @brief Takes over the @a connection (fd, buffered data and output) of the previous server.
+bool tcp_server_adopt_connection(TcpServer* server, uint32_t index,
+                                 const TcpConnection* connection);
+/// @brief Accepts connections and reads frames until one full message is available.
+/// @return false if no message arrived in @a timeout_ms
+bool tcp_server_receive(TcpServer* server, UDPMessage* message, uint32_t* connection_index,
+                        uint32_t timeout_ms);
+/// @brief Shuts the connection down if it is still the one of the client at @a address.
+void tcp_server_shutdown_connection(TcpServer* server, uint32_t index,
+                                 const struct sockaddr_in* address);
+/// @return number of the clients that got the message
+uint32_t tcp_server_broadcast(TcpServer* server, const UDPMessage* message);
+/// @return true if some connection has output its socket did not take yet
+bool tcp_server_has_output(TcpServer* server);
+/// @brief Sends the @a message to the client of the @a index connection only,
+/// if it is still the one at @a address.
+/// @return false if the connection is gone, broken or its output is full
+bool tcp_server_send(TcpServer* server, uint32_t index, const struct sockaddr_in* address,
+                     const UDPMessage* message);
+
+/// Client side.
+
+/// @return connected socket or -1
+int connect_tcp_client(const char* server_address, uint16_t port);
+bool tcp_send_message(int sock_fd, const UDPMessage* message);
+/// @brief recv(2) of one framed message, supports MSG_PEEK and MSG_DONTWAIT.
+/// @return sizeof(UDPMessage) on success, -1 with errno set otherwise
+/// (EAGAIN if the whole frame is not available yet, ECONNRESET on EOF)
+ssize_t tcp_recv_message(int sock_fd, UDPMessage* message, int flags);
@@ -0,0 +1,101 @@
+#include "worker-pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../util/config.h"
+#include "client-tools.h"
+
+static void* process_pins(void* arg) {
+    WorkerPool* pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->queue_size == 0 && !pool->should_stop) {
+            pthread_cond_wait(&pool->pin_queued, &pool->mutex);
+        }
+        if (pool->queue_size == 0) {
+            break;
+        }
+        const Pin pin    = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % WORKER_MAX_CONCURRENCY;
+        pool->queue_size--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        const bool ok = pool->handler(pool->worker, pin, pool->context);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->pins_in_flight--;
+        pool->has_failed |= !ok;
+        pthread_cond_broadcast(&pool->pin_processed);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void init_worker_pool(WorkerPool* pool, const Client worker, WorkerPinHandler handler,
+                      void* context) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker  = worker;
+    pool->handler = handler;
+    pool->context = context;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->pin_queued, NULL);
+    pthread_cond_init(&pool->pin_processed, NULL);
+}
+
+/// @brief Every pin in flight has a thread, mutex must be held.
+/// @return false if there is no thread for the pin
+static bool start_pool_thread(WorkerPool* pool) {
+    if (pool->threads_count >= pool->pins_in_flight) {
+        return true;
+    }
+    int ret = pthread_create(&pool->threads[pool->threads_count], NULL, &process_pins, pool);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_create");
+        // the started threads take the pin later
+        return pool->threads_count != 0;
+    }
+    pool->threads_count++;
+    return true;
+}
+
+bool worker_pool_submit(WorkerPool* pool, Pin pin) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->has_failed && pool->pins_in_flight >= client_concurrency(pool->worker)) {
+        pthread_cond_wait(&pool->pin_processed, &pool->mutex);
+    }
+    // the pins in flight do not exceed the concurrency, the queue has room
+    bool ok = !pool->has_failed;
+    if (ok) {
+        pool->queue[(pool->queue_head + pool->queue_size) % WORKER_MAX_CONCURRENCY] = pin;
+        pool->queue_size++;
+        pool->pins_in_flight++;
+        ok = start_pool_thread(pool);
+        pthread_cond_signal(&pool->pin_queued);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return ok;
+}
+
+bool deinit_worker_pool(WorkerPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pins_in_flight != 0 && pool->threads_count != 0) {
+        pthread_cond_wait(&pool->pin_processed, &pool->mutex);
+    }
+    pool->should_stop = true;
+    pthread_cond_broadcast(&pool->pin_queued);
+    const bool ok = !pool->has_failed;
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->threads_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->pin_processed);
+    pthread_cond_destroy(&pool->pin_queued);
+    pthread_mutex_destroy(&pool->mutex);
+    return ok;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "client-tools.h"
+#include "net-config.h"
+#include "pin.h"
+
+/// @brief Processes one pin on a thread of the pool.
+/// @return false if the worker must stop, e.g. the pin could not be sent
+typedef bool (*WorkerPinHandler)(const Client worker, Pin pin, void* context);
+
+/// @brief Threads that process the pins of a worker, as many pins at once as
+/// client_concurrency(). The threads that receive the pins hand them over
+/// and block while the worker is at its concurrency, so the pins that wait
+/// stay in the socket or in the ring of the worker, or with the worker of the
+/// previous stage in the same process. The threads are started
+/// as the concurrency grows and stay idle once it shrinks.
+typedef struct WorkerPool {
+    const struct Client* worker;
+    WorkerPinHandler handler;
+    void* context;
+    /// Guards everything below.
+    pthread_mutex_t mutex;
+    /// Signaled when a pin is queued and on the stop.
+    pthread_cond_t pin_queued;
+    /// Signaled when a pin is processed.
+    pthread_cond_t pin_processed;
+    Pin queue[WORKER_MAX_CONCURRENCY];
+    uint32_t queue_head;
+    uint32_t queue_size;
+    /// Queued pins and the pins being processed.
+    uint32_t pins_in_flight;
+    uint32_t threads_count;
+    pthread_t threads[WORKER_MAX_CONCURRENCY];
+    bool has_failed;
+    bool should_stop;
+} WorkerPool;
+
+void init_worker_pool(WorkerPool* pool, const Client worker, WorkerPinHandler handler,
+                      void* context);
+/// @brief Waits for the pins in flight and stops the threads.
+/// @return false if a handler failed
+bool deinit_worker_pool(WorkerPool* pool);
+/// @brief Hands the @a pin over to the threads, blocks while the worker
+/// processes as many pins as its concurrency.
+/// @return false if a handler failed, the worker must stop then
+bool worker_pool_submit(WorkerPool* pool, Pin pin);
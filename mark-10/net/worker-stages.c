@@ -0,0 +1,530 @@
+#include "worker-stages.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../util/config.h"
+#include "../util/metrics.h"
+#include "client-tools.h"
+#include "message-pool.h"
+#include "net-config.h"
+#include "pin-journal.h"
+#include "pin-trace.h"
+#include "pin.h"
+#include "pipeline-config.h"
+#include "stage-steps.h"
+#include "worker-pool.h"
+
+/// @brief The server changes the stages of the process at most that late.
+enum { WORKER_ROLES_POLL_MS = 100 };
+
+/// @brief An entry stage waiting for the admission of its next pin reads the
+/// signals of the server at least that often.
+enum { WORKER_ADMISSION_POLL_MS = 100 };
+
+/// @brief Print latency percentiles after every that many completed traces.
+enum { PIN_TRACE_STATS_REPORT_PERIOD = 16 };
+
+typedef struct WorkerStage {
+    Client worker;
+    WorkerPool pool;
+    pthread_t thread;
+    /// The thread of the stage runs or did not join yet.
+    bool is_hosted;
+    /// The stage leaves the routing, the server confirms it to its worker.
+    bool should_leave;
+    /// Set by the thread of the stage once it stopped.
+    bool has_stopped;
+    int status;
+    /// Guards is_active and hand_overs: the previous stage hands its pins over
+    /// only while the pool of the stage takes them.
+    pthread_mutex_t mutex;
+    bool is_active;
+    /// Hand-overs of the previous stage in progress, the pool is not stopped under them.
+    uint32_t hand_overs;
+    /// Signaled when the last hand-over of an inactive stage ends.
+    pthread_cond_t handed_over;
+} WorkerStage;
+
+static struct WorkerStages {
+    uint16_t server_port;
+    const char* server_ip_address;
+    PipelineConfig pipeline;
+    /// Steps of the stages, NULL for the stages the pipeline does not use.
+    PipelineStepFunction steps[PIPELINE_STAGES];
+    WorkerStage stages[PIPELINE_STAGES];
+    /// Pins of all the stages, see PIN_JOURNAL_ENV.
+    PinJournal journal;
+    bool has_journal;
+} worker_stages;
+
+/// @brief Pins the journal recovered, every stage replays its own once it runs.
+static Pin recovered_pins[PIN_JOURNAL_MAX_LIVE_PINS];
+static uint32_t recovered_pins_counts[PIPELINE_STAGES];
+
+/// @brief Too big for the stack of the runtime loop.
+static PinTraceStats pin_trace_stats;
+/// @brief The threads of the pool complete the traces.
+static pthread_mutex_t pin_trace_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t worker_stage_index(const WorkerStage* stage) {
+    return (uint32_t)(stage - worker_stages.stages);
+}
+
+static const PipelineStageConfig* worker_stage_config(const WorkerStage* stage) {
+    return &worker_stages.pipeline.stages[worker_stage_index(stage)];
+}
+
+/// @return "First", "Second"... for the boxes
+static const char* worker_stage_title(uint32_t stage) {
+    static const char* const titles[PIPELINE_STAGES] = {"First", "Second", "Third", "Fourth",
+                                                        "Fifth"};
+    return titles[stage];
+}
+
+static void log_received_pin(uint32_t stage, Pin pin) {
+    printf(
+        "+-----------------------------------------------------\n"
+        "| %s worker received pin[pin_id=%d]\n"
+        "| and started the %s step...\n"
+        "+-----------------------------------------------------\n",
+        worker_stage_title(stage), pin.pin_id, worker_stages.pipeline.stages[stage].step);
+}
+
+static void log_processed_pin(uint32_t stage, Pin pin, bool is_accepted) {
+    printf(
+        "+-----------------------------------------------------\n"
+        "| %s worker decision after the %s step:\n"
+        "| pin[pin_id=%d] is %s.\n"
+        "+-----------------------------------------------------\n",
+        worker_stage_title(stage), worker_stages.pipeline.stages[stage].step, pin.pin_id,
+        is_accepted ? "accepted" : "rejected");
+}
+
+static void log_sent_pin(uint32_t stage, Pin pin) {
+    printf(
+        "+-----------------------------------------------------\n"
+        "| %s worker sent pin[pin_id=%d]\n"
+        "| to the next stage workers.\n"
+        "+-----------------------------------------------------\n",
+        worker_stage_title(stage), pin.pin_id);
+}
+
+static void log_stopping_stage(uint32_t stage) {
+    printf(
+        "+------------------------------+\n"
+        "| %-6s worker is stopping... |\n"
+        "+------------------------------+\n",
+        worker_stage_title(stage));
+}
+
+static void handle_completed_pin_trace(const Pin* pin) {
+    if (!pin_is_traced(pin)) {
+        return;
+    }
+    pthread_mutex_lock(&pin_trace_stats_mutex);
+    print_pin_trace_record(pin);
+    pin_trace_stats_record(&pin_trace_stats, pin);
+    if (pin_trace_stats.hops[PIN_TRACE_HOP_END_TO_END].count % PIN_TRACE_STATS_REPORT_PERIOD ==
+        0) {
+        print_pin_trace_stats(&pin_trace_stats);
+    }
+    pthread_mutex_unlock(&pin_trace_stats_mutex);
+}
+
+/// @brief The step starts once the pin is in the journal, the records of all
+/// the threads are committed at once.
+/// @return false if the journal failed
+static bool journal_started_pin(uint32_t stage, const Pin* pin) {
+    if (!worker_stages.has_journal) {
+        return true;
+    }
+    const uint64_t record =
+        pin_journal_append(&worker_stages.journal, PIN_JOURNAL_STARTED, stage, pin);
+    if (!pin_journal_wait(&worker_stages.journal, record)) {
+        fprintf(stderr, "Could not journal pin[pin_id=%d]\n", pin->pin_id);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Not waited for: a pin whose record is lost in a crash is replayed once more.
+static void journal_finished_pin(uint32_t stage, const Pin* pin, PinJournalRecordKind kind) {
+    if (worker_stages.has_journal) {
+        pin_journal_append(&worker_stages.journal, kind, stage, pin);
+    }
+}
+
+/// @brief Hands the @a pin to the worker of the next stage if it is the only
+/// one and the process hosts it, sends it to the server otherwise: the
+/// server makes the copies of the fan-out. A handed over pin is journaled
+/// as started by the next stage first, so it is not lost in its queue.
+/// @return true if it was sent, the pin was handed over or not
+static bool forward_pin(WorkerStage* stage, Pin pin, bool* is_handed_over) {
+    const uint32_t next_stages = worker_stage_config(stage)->next_stages;
+    *is_handed_over            = false;
+    if (__builtin_popcount(next_stages) != 1) {
+        return send_stage_pin(stage->worker, pin);
+    }
+    const uint32_t next_index = pipeline_stage_index((ComponentType)next_stages);
+    WorkerStage* next         = &worker_stages.stages[next_index];
+    pthread_mutex_lock(&next->mutex);
+    *is_handed_over = next->is_active;
+    if (*is_handed_over) {
+        next->hand_overs++;
+    }
+    pthread_mutex_unlock(&next->mutex);
+    if (!*is_handed_over) {
+        return send_stage_pin(stage->worker, pin);
+    }
+
+    // the journal commit and the full pool of the next stage hold up this hand-over only
+    hand_over_pin_locally(stage->worker, next->worker, &pin);
+    bool ok = journal_started_pin(next_index, &pin);
+    if (ok && worker_stages.has_journal) {
+        pin.flags |= PIN_FLAG_JOURNALED;
+    }
+    // blocks while the next stage is at its concurrency, as a receive would
+    ok = ok && worker_pool_submit(&next->pool, pin);
+    pthread_mutex_lock(&next->mutex);
+    if (--next->hand_overs == 0 && !next->is_active) {
+        pthread_cond_broadcast(&next->handed_over);
+    }
+    pthread_mutex_unlock(&next->mutex);
+    return ok;
+}
+
+/// @brief Runs on the threads of the pool.
+static bool process_pin(const Client worker, Pin pin, void* context) {
+    WorkerStage* stage   = context;
+    const uint32_t index = worker_stage_index(stage);
+    // the previous stage of the process journaled it before the hand-over
+    if ((pin.flags & PIN_FLAG_JOURNALED) != 0) {
+        pin.flags &= ~(uint32_t)PIN_FLAG_JOURNALED;
+    } else if (!journal_started_pin(index, &pin)) {
+        return false;
+    }
+    pin_trace_stage_started(&pin, index);
+    log_received_pin(index, pin);
+    const uint64_t started_ns = monotonic_time_ns();
+    const bool is_accepted    = worker_stages.steps[index](&pin);
+    record_client_processing(worker, started_ns, is_accepted);
+    pin_trace_stage_finished(&pin, index);
+    log_processed_pin(index, pin, is_accepted);
+    if (!is_accepted) {
+        journal_finished_pin(index, &pin, PIN_JOURNAL_REJECTED);
+        return true;
+    }
+    if (worker_stage_config(stage)->next_stages == 0) {
+        handle_completed_pin_trace(&pin);
+        journal_finished_pin(index, &pin, PIN_JOURNAL_PASSED);
+        return true;
+    }
+
+    // the pin is sent even if the server asked to stop meanwhile
+    bool is_handed_over = false;
+    if (!forward_pin(stage, pin, &is_handed_over)) {
+        return false;
+    }
+    journal_finished_pin(index, &pin, PIN_JOURNAL_PASSED);
+    if (!is_handed_over) {
+        log_sent_pin(index, pin);
+    }
+    return true;
+}
+
+static bool has_left(const WorkerStage* stage) {
+    // the entry stages receive nothing from the server, nothing comes before the confirmation
+    return stage->worker->makes_pins ? __atomic_load_n(&stage->should_leave, __ATOMIC_RELAXED)
+                                     : client_has_left(stage->worker);
+}
+
+/// @return false if the stage must stop
+static bool take_pin(WorkerStage* stage, Pin* pin) {
+    if (stage->worker->makes_pins) {
+        *pin = receive_new_pin();
+        return true;
+    }
+    return receive_stage_pin(stage->worker, pin);
+}
+
+/// @brief An inactive stage takes no more pins from the previous one, the
+/// hand-overs in progress end first.
+static void set_stage_active(WorkerStage* stage, bool is_active) {
+    pthread_mutex_lock(&stage->mutex);
+    stage->is_active = is_active;
+    while (!is_active && stage->hand_overs != 0) {
+        pthread_cond_wait(&stage->handed_over, &stage->mutex);
+    }
+    pthread_mutex_unlock(&stage->mutex);
+}
+
+static void* run_stage(void* arg) {
+    WorkerStage* stage   = arg;
+    const uint32_t index = worker_stage_index(stage);
+    int ret              = EXIT_SUCCESS;
+    while (!client_should_stop(stage->worker) && !has_left(stage)) {
+        // the stop and the new rates are read between the waits
+        if (stage->worker->makes_pins &&
+            !wait_client_admission(stage->worker, WORKER_ADMISSION_POLL_MS)) {
+            continue;
+        }
+        Pin pin;
+        if (!take_pin(stage, &pin)) {
+            if (!client_is_draining(stage->worker) && !has_left(stage)) {
+                ret = EXIT_FAILURE;
+            }
+            break;
+        }
+        if (!worker_pool_submit(&stage->pool, pin)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    // the previous stage sends its pins to the server from now on
+    set_stage_active(stage, false);
+    // the pins taken before the stop are finished
+    if (!deinit_worker_pool(&stage->pool)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (worker_stage_config(stage)->next_stages == 0) {
+        pthread_mutex_lock(&pin_trace_stats_mutex);
+        if (pin_trace_stats.hops[PIN_TRACE_HOP_END_TO_END].count != 0) {
+            print_pin_trace_stats(&pin_trace_stats);
+        }
+        pthread_mutex_unlock(&pin_trace_stats_mutex);
+    }
+
+    const bool is_leaving = has_left(stage);
+    if (ret == EXIT_SUCCESS && is_leaving && !finish_client_leave(stage->worker)) {
+        ret = EXIT_FAILURE;
+    }
+    if (ret == EXIT_SUCCESS && !is_leaving && client_is_draining(stage->worker) &&
+        !finish_client_drain(stage->worker)) {
+        ret = EXIT_FAILURE;
+    }
+    if (ret == EXIT_SUCCESS && !is_leaving) {
+        printf(
+            "+------------------------------------------+\n"
+            "| Received shutdown signal from the server |\n"
+            "+------------------------------------------+\n");
+    }
+    log_stopping_stage(index);
+
+    message_pool_return_cache();
+    stage->status = ret;
+    __atomic_store_n(&stage->has_stopped, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static bool start_stage(WorkerStage* stage) {
+    const uint32_t index = worker_stage_index(stage);
+    if (!init_client(stage->worker, worker_stages.server_port, pipeline_stage_type(index),
+                     worker_stages.server_ip_address)) {
+        return false;
+    }
+    stage->worker->makes_pins = worker_stage_config(stage)->is_entry;
+    print_client_info(stage->worker);
+    stage->should_leave = false;
+    stage->has_stopped  = false;
+    init_worker_pool(&stage->pool, stage->worker, &process_pin, stage);
+    set_stage_active(stage, true);
+    int ret = pthread_create(&stage->thread, NULL, &run_stage, stage);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_create");
+        set_stage_active(stage, false);
+        deinit_worker_pool(&stage->pool);
+        deinit_client(stage->worker);
+        return false;
+    }
+    stage->is_hosted = true;
+    return true;
+}
+
+/// @brief The stage gets no new pins, it finishes the ones it got before the
+/// server confirms that it left.
+static void leave_stage(WorkerStage* stage) {
+    set_stage_active(stage, false);
+    __atomic_store_n(&stage->should_leave, true, __ATOMIC_RELAXED);
+    if (!send_worker_leave(stage->worker)) {
+        fputs("Could not ask the server to take the worker out of the routing\n", stderr);
+    }
+}
+
+/// @return exit status of the stage
+static int join_stage(WorkerStage* stage) {
+    pthread_join(stage->thread, NULL);
+    deinit_client(stage->worker);
+    stage->is_hosted = false;
+    return stage->status;
+}
+
+static void log_worker_roles(uint32_t roles) {
+    printf(
+        "+----------------------------------------------------------+\n"
+        "| Hosting the stages: %-6s %-6s %-6s %-6s %-8s |\n"
+        "+----------------------------------------------------------+\n",
+        (roles & COMPONENT_TYPE_FIRST_STAGE_WORKER) != 0 ? "first" : "",
+        (roles & COMPONENT_TYPE_SECOND_STAGE_WORKER) != 0 ? "second" : "",
+        (roles & COMPONENT_TYPE_THIRD_STAGE_WORKER) != 0 ? "third" : "",
+        (roles & COMPONENT_TYPE_FOURTH_STAGE_WORKER) != 0 ? "fourth" : "",
+        (roles & COMPONENT_TYPE_FIFTH_STAGE_WORKER) != 0 ? "fifth" : "");
+}
+
+/// @brief Takes the pins in flight of the previous run of the process from the journal.
+static void collect_recovered_pins(void) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES && worker_stages.has_journal; i++) {
+        recovered_pins_counts[i] = pin_journal_live_pins(
+            &worker_stages.journal, i, recovered_pins + count, PIN_JOURNAL_MAX_LIVE_PINS - count);
+        count += recovered_pins_counts[i];
+    }
+}
+
+/// @brief Hands the recovered pins of the hosted stages to their pools. The
+/// pins of the other stages stay in the journal for a run that hosts them.
+/// @return false if a stage failed
+static bool replay_recovered_pins(void) {
+    bool ok               = true;
+    const Pin* stage_pins = recovered_pins;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        WorkerStage* stage   = &worker_stages.stages[i];
+        const uint32_t count = recovered_pins_counts[i];
+        if (count == 0 || !stage->is_hosted || stage->should_leave) {
+            stage_pins += count;
+            continue;
+        }
+        printf(
+            "+-----------------------------------------------------\n"
+            "| %s worker replays %u pin(s) of the journal\n"
+            "+-----------------------------------------------------\n",
+            worker_stage_title(i), count);
+        for (uint32_t j = 0; j < count && ok; j++) {
+            ok = worker_pool_submit(&stage->pool, stage_pins[j]);
+        }
+        recovered_pins_counts[i] = 0;
+        stage_pins += count;
+    }
+    return ok;
+}
+
+/// @brief Brings the hosted stages to the @a roles: the new ones start before
+/// the old ones leave, so the process always has a client. The stages that
+/// could not start are dropped from the @a roles.
+/// @return false if a stage could not start
+static bool host_worker_stages(uint32_t* roles) {
+    bool ok = true;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        WorkerStage* stage = &worker_stages.stages[i];
+        if ((*roles & pipeline_stage_type(i)) != 0 && !stage->is_hosted && !start_stage(stage)) {
+            *roles &= ~(uint32_t)pipeline_stage_type(i);
+            ok = false;
+        }
+    }
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        WorkerStage* stage = &worker_stages.stages[i];
+        if ((*roles & pipeline_stage_type(i)) == 0 && stage->is_hosted && !stage->should_leave) {
+            leave_stage(stage);
+        }
+    }
+    return ok;
+}
+
+int run_worker_stages(uint16_t server_port, const char* server_ip_address, uint32_t roles,
+                      bool can_change_roles) {
+    worker_stages.server_port       = server_port;
+    worker_stages.server_ip_address = server_ip_address;
+    if (!load_pipeline_config(&worker_stages.pipeline) ||
+        !load_pipeline_steps(&worker_stages.pipeline)) {
+        return EXIT_FAILURE;
+    }
+    uint32_t used_stages = 0;
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        if (worker_stages.pipeline.stages[i].is_used) {
+            worker_stages.steps[i] = find_pipeline_step(worker_stages.pipeline.stages[i].step);
+            used_stages |= pipeline_stage_type(i);
+        }
+    }
+    char pipeline[256];
+    describe_pipeline_config(&worker_stages.pipeline, pipeline, sizeof(pipeline));
+    printf("Pipeline: %s\n", pipeline);
+    roles &= used_stages;
+    if (roles == 0) {
+        fputs("The pipeline does not use the stages of the worker\n", stderr);
+        unload_pipeline_steps();
+        return EXIT_FAILURE;
+    }
+
+    if (!open_pin_journal(&worker_stages.journal, PIN_JOURNAL_MAX_LIVE_PINS,
+                          &worker_stages.has_journal)) {
+        unload_pipeline_steps();
+        return EXIT_FAILURE;
+    }
+    collect_recovered_pins();
+
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        pthread_mutex_init(&worker_stages.stages[i].mutex, NULL);
+        pthread_cond_init(&worker_stages.stages[i].handed_over, NULL);
+    }
+    init_pin_trace_stats(&pin_trace_stats);
+    if (can_change_roles) {
+        set_client_roles(roles);
+        log_worker_roles(roles);
+    }
+
+    int ret = EXIT_SUCCESS;
+    while (true) {
+        uint32_t requested_roles = 0;
+        if (can_change_roles && take_requested_client_roles(&requested_roles) &&
+            (requested_roles & used_stages) != roles) {
+            roles = requested_roles & used_stages;
+            set_client_roles(roles);
+            log_worker_roles(roles);
+        }
+        if (!host_worker_stages(&roles) || !replay_recovered_pins()) {
+            ret = EXIT_FAILURE;
+        }
+
+        bool is_hosting = false;
+        for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+            WorkerStage* stage = &worker_stages.stages[i];
+            if (!stage->is_hosted) {
+                continue;
+            }
+            if (!__atomic_load_n(&stage->has_stopped, __ATOMIC_ACQUIRE)) {
+                is_hosting = true;
+                continue;
+            }
+            const bool has_left_stage = stage->should_leave;
+            if (join_stage(stage) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            }
+            // the stages stopped by the server are not started again
+            if (!has_left_stage) {
+                roles &= ~(uint32_t)pipeline_stage_type(i);
+            }
+        }
+        if (!is_hosting && roles == 0) {
+            break;
+        }
+        nanosleep(&(struct timespec){.tv_nsec = WORKER_ROLES_POLL_MS * 1000000L}, NULL);
+    }
+
+    if (worker_stages.has_journal) {
+        close_pin_journal(&worker_stages.journal);
+    }
+    print_metrics(stdout);
+    for (uint32_t i = 0; i < PIPELINE_STAGES; i++) {
+        pthread_cond_destroy(&worker_stages.stages[i].handed_over);
+        pthread_mutex_destroy(&worker_stages.stages[i].mutex);
+    }
+    unload_pipeline_steps();
+    return ret;
+}
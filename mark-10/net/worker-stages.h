@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Stages the multi-role worker hosts at the start, their names separated by
+/// commas (e.g. "first,second"), all the stages of the pipeline by default.
+#define WORKER_ROLES_ENV "WORKER_ROLES"
+
+/// @brief Runs the workers of the @a roles stages (mask of the stage
+/// ComponentTypes) in this process, every one on its own thread with its own
+/// client and pool. A worker hands its pins to the worker of the next stage
+/// in the process instead of sending them to the server, the pool of the
+/// next stage is the queue between them.
+///
+/// The server moves a multi-role worker to other stages with the roles
+/// messages: the new workers start right away, the old ones leave the routing
+/// and finish the pins they got first.
+///
+/// The workers run the steps of their stages and route the pins as the
+/// pipeline of PIPELINE_CONFIG_ENV defines, the stages it does not use are
+/// dropped from the @a roles. With PIN_JOURNAL_ENV the process journals the
+/// pins of its stages and replays the ones a crash interrupted, see pin-journal.h.
+/// @param can_change_roles the server can move the process to other stages
+/// @return exit status of the process once no stage runs
+int run_worker_stages(uint16_t server_port, const char* server_ip_address, uint32_t roles,
+                      bool can_change_roles);
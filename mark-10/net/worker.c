@@ -0,0 +1,37 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../util/parser.h"
+#include "net-config.h"
+#include "pipeline-config.h"
+#include "worker-stages.h"
+
+/// @return mask of the stages named in WORKER_ROLES_ENV, 0 if it is malformed
+static uint32_t parse_worker_roles(void) {
+    const char* value = getenv(WORKER_ROLES_ENV);
+    if (value == NULL || *value == '\0') {
+        return COMPONENT_TYPE_ANY_WORKER;
+    }
+    uint32_t roles = 0;
+    if (!parse_pipeline_stages(value, &roles)) {
+        fprintf(stderr, "Malformed %s: \"%s\"\n", WORKER_ROLES_ENV, value);
+        return 0;
+    }
+    return roles;
+}
+
+int main(int argc, const char* argv[]) {
+    ParseResult res = parse_args(argc, argv);
+    if (res.status != PARSE_SUCCESS) {
+        print_invalid_args_error(res.status, argv[0]);
+        return EXIT_FAILURE;
+    }
+    const uint32_t roles = parse_worker_roles();
+    if (roles == 0) {
+        return EXIT_FAILURE;
+    }
+
+    return run_worker_stages(res.port, res.ip_address, roles, true);
+}
@@ -0,0 +1,6 @@
+#! /bin/sh
+# Runs the test programs built by compile.sh, stops at the first failure.
+for test in failure-detector-test server-peers-test stage-queue-test token-bucket-test pin-journal-test
+do
+    ./$test || exit 1
+done
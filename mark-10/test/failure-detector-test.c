@@ -0,0 +1,193 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../util/failure-detector.h"
+#include "test-check.h"
+
+enum {
+    TEST_TICK_NS     = 1000000,
+    TEST_TIMEOUT_NS  = 10 * TEST_TICK_NS,
+    TEST_MAX_SUSPECT = 64,
+};
+
+static void init_fixed_timeout_detector(FailureDetector* detector, uint64_t timeout_ns,
+                                        uint64_t now_ns) {
+    const FailureDetectorConfig config = {
+        .mode       = FAILURE_DETECTOR_FIXED_TIMEOUT,
+        .tick_ns    = TEST_TICK_NS,
+        .timeout_ns = timeout_ns,
+    };
+    init_failure_detector(detector, &config, now_ns);
+}
+
+/// @return bit mask of the peers suspected at @a now_ns
+static uint64_t expire_peers(FailureDetector* detector, uint64_t now_ns) {
+    uint32_t suspected[TEST_MAX_SUSPECT];
+    const uint32_t count =
+        failure_detector_expire(detector, now_ns, suspected, TEST_MAX_SUSPECT);
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        mask |= 1ull << suspected[i];
+    }
+    return mask;
+}
+
+/// @brief A peer is suspected by the first expiry after the tick of its deadline.
+static void test_suspected_after_deadline_tick(void) {
+    FailureDetector detector;
+    init_fixed_timeout_detector(&detector, TEST_TIMEOUT_NS, 0);
+    TEST_CHECK(failure_detector_reserve(&detector, 3));
+    failure_detector_track(&detector, 0, 0);
+    failure_detector_track(&detector, 1, TEST_TICK_NS / 2);
+    failure_detector_track(&detector, 2, 3 * TEST_TICK_NS);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS) == 0);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + TEST_TICK_NS - 1) == 0);
+    // the first two deadlines fall into the same tick
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + TEST_TICK_NS) == 0x3);
+    TEST_CHECK(!detector.peers[0].is_tracked && !detector.peers[1].is_tracked);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + 3 * TEST_TICK_NS) == 0);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + 4 * TEST_TICK_NS) == 0x4);
+    TEST_CHECK(expire_peers(&detector, 100 * TEST_TIMEOUT_NS) == 0);
+    deinit_failure_detector(&detector);
+}
+
+/// @brief The heartbeats move the peers to later slots, an untracked peer in
+/// the middle of a slot list leaves the others there.
+static void test_heartbeat_and_untrack(void) {
+    FailureDetector detector;
+    init_fixed_timeout_detector(&detector, TEST_TIMEOUT_NS, 0);
+    TEST_CHECK(failure_detector_reserve(&detector, 4));
+    for (uint32_t peer = 0; peer < 4; peer++) {
+        failure_detector_track(&detector, peer, 0);
+    }
+    failure_detector_untrack(&detector, 1);
+    failure_detector_heartbeat(&detector, 2, 5 * TEST_TICK_NS);
+    // a heartbeat from the past does not move the deadline back
+    failure_detector_heartbeat(&detector, 3, 8 * TEST_TICK_NS);
+    failure_detector_heartbeat(&detector, 3, 2 * TEST_TICK_NS);
+    // untracked peers ignore the heartbeats
+    failure_detector_heartbeat(&detector, 1, 9 * TEST_TICK_NS);
+    TEST_CHECK(!detector.peers[1].is_tracked);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + TEST_TICK_NS) == 0x1);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + 6 * TEST_TICK_NS) == 0x4);
+    TEST_CHECK(expire_peers(&detector, TEST_TIMEOUT_NS + 9 * TEST_TICK_NS) == 0x8);
+    deinit_failure_detector(&detector);
+}
+
+/// @brief A deadline further than one wheel turn is skipped in the turns before its own.
+static void test_deadline_beyond_wheel_turn(void) {
+    const uint64_t timeout_ns = (FAILURE_DETECTOR_WHEEL_SLOTS * 2 + 7) * (uint64_t)TEST_TICK_NS;
+    FailureDetector detector;
+    init_fixed_timeout_detector(&detector, timeout_ns, 0);
+    TEST_CHECK(failure_detector_reserve(&detector, 1));
+    failure_detector_track(&detector, 0, 0);
+    uint64_t now_ns = 0;
+    while (now_ns < timeout_ns) {
+        now_ns += TEST_TICK_NS;
+        TEST_CHECK(expire_peers(&detector, now_ns) == 0);
+    }
+    TEST_CHECK(expire_peers(&detector, now_ns + TEST_TICK_NS) == 0x1);
+    deinit_failure_detector(&detector);
+}
+
+/// @brief After a stall longer than the wheel every due peer is suspected at
+/// once, the ones still on time stay tracked.
+static void test_stall(void) {
+    FailureDetector detector;
+    init_fixed_timeout_detector(&detector, TEST_TIMEOUT_NS, 0);
+    TEST_CHECK(failure_detector_reserve(&detector, 3));
+    failure_detector_track(&detector, 0, 0);
+    failure_detector_track(&detector, 1, 0);
+    const uint64_t stall_ns = 3 * FAILURE_DETECTOR_WHEEL_SLOTS * (uint64_t)TEST_TICK_NS;
+    failure_detector_heartbeat(&detector, 1, stall_ns - TEST_TICK_NS);
+    failure_detector_track(&detector, 2, stall_ns - 2 * TEST_TIMEOUT_NS);
+    TEST_CHECK(expire_peers(&detector, stall_ns) == 0x5);
+    TEST_CHECK(detector.peers[1].is_tracked);
+    TEST_CHECK(expire_peers(&detector, stall_ns + TEST_TIMEOUT_NS) == 0x2);
+    deinit_failure_detector(&detector);
+}
+
+/// @brief The suspected peers that did not fit are returned by the next call,
+/// the array of the peers moves as it grows meanwhile.
+static void test_expire_in_portions(void) {
+    enum { PEERS = 40, PORTION = 16 };
+    FailureDetector detector;
+    init_fixed_timeout_detector(&detector, TEST_TIMEOUT_NS, 0);
+    for (uint32_t peer = 0; peer < PEERS; peer++) {
+        TEST_CHECK(failure_detector_reserve(&detector, peer + 1));
+        failure_detector_track(&detector, peer, (peer % 2) * TEST_TICK_NS / 2);
+    }
+    uint32_t suspected[PORTION];
+    uint64_t mask        = 0;
+    uint32_t total_count = 0;
+    uint32_t count       = 0;
+    do {
+        count = failure_detector_expire(&detector, 2 * TEST_TIMEOUT_NS, suspected, PORTION);
+        for (uint32_t i = 0; i < count; i++) {
+            TEST_CHECK((mask & (1ull << suspected[i])) == 0);
+            mask |= 1ull << suspected[i];
+        }
+        total_count += count;
+    } while (count == PORTION);
+    TEST_CHECK(total_count == PEERS && mask == (1ull << PEERS) - 1);
+    deinit_failure_detector(&detector);
+}
+
+/// @brief A peer of steady heartbeats is suspected once phi reaches the threshold.
+static void test_phi_accrual(void) {
+    const uint64_t interval_ns         = 100 * TEST_TICK_NS;
+    const FailureDetectorConfig config = {
+        .mode              = FAILURE_DETECTOR_PHI_ACCRUAL,
+        .tick_ns           = TEST_TICK_NS,
+        .phi_threshold     = 8,
+        .first_interval_ns = interval_ns,
+    };
+    uint64_t now_ns = 0;
+    FailureDetector detector;
+    init_failure_detector(&detector, &config, now_ns);
+    TEST_CHECK(failure_detector_reserve(&detector, 1));
+    failure_detector_track(&detector, 0, now_ns);
+    for (int i = 0; i < 100; i++) {
+        now_ns += interval_ns;
+        failure_detector_heartbeat(&detector, 0, now_ns);
+        TEST_CHECK(expire_peers(&detector, now_ns) == 0);
+    }
+    const uint64_t deadline_ns = detector.peers[0].deadline_ns;
+    TEST_CHECK(deadline_ns > now_ns + interval_ns);
+    TEST_CHECK(failure_detector_phi(&detector, 0, now_ns + interval_ns) < 1);
+    TEST_CHECK(fabs(failure_detector_phi(&detector, 0, deadline_ns) - 8) < 0.01);
+    // the phi does not decrease with the silence
+    double previous_phi = 0;
+    for (uint64_t silence_ns = 0; silence_ns < 2 * (deadline_ns - now_ns);
+         silence_ns += TEST_TICK_NS) {
+        const double phi = failure_detector_phi(&detector, 0, now_ns + silence_ns);
+        TEST_CHECK(phi >= previous_phi && !isnan(phi));
+        previous_phi = phi;
+    }
+    TEST_CHECK(expire_peers(&detector, deadline_ns - TEST_TICK_NS) == 0);
+    TEST_CHECK(expire_peers(&detector, deadline_ns + TEST_TICK_NS) == 0x1);
+    deinit_failure_detector(&detector);
+}
+
+static void test_disabled(void) {
+    const FailureDetectorConfig config = {.mode = FAILURE_DETECTOR_DISABLED};
+    FailureDetector detector;
+    init_failure_detector(&detector, &config, 0);
+    TEST_CHECK(failure_detector_reserve(&detector, 1));
+    failure_detector_track(&detector, 0, 0);
+    TEST_CHECK(!detector.peers[0].is_tracked);
+    TEST_CHECK(expire_peers(&detector, UINT64_MAX) == 0);
+    deinit_failure_detector(&detector);
+}
+
+int main(void) {
+    test_suspected_after_deadline_tick();
+    test_heartbeat_and_untrack();
+    test_deadline_beyond_wheel_turn();
+    test_stall();
+    test_expire_in_portions();
+    test_phi_accrual();
+    test_disabled();
+    return test_report("failure-detector-test");
+}
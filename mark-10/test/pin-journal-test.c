@@ -0,0 +1,234 @@
+#include "../net/pin-journal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "test-check.h"
+
+enum {
+    TEST_LIVE_PIN_IDS  = 12,
+    TEST_LIVE_CAPACITY = TEST_LIVE_PIN_IDS * PIPELINE_STAGES,
+    TEST_MAX_PINS      = 16,
+};
+
+static char test_directory[] = "/tmp/pin-journal-test-XXXXXX";
+static char test_path[PIN_JOURNAL_MAX_PATH_SIZE];
+
+static uint64_t file_size(const char* path) {
+    struct stat file_stat;
+    return stat(path, &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0;
+}
+
+static void append_bytes(const char* path, const void* bytes, size_t size) {
+    FILE* file = fopen(path, "ab");
+    TEST_CHECK(file != NULL);
+    if (file != NULL) {
+        TEST_CHECK(fwrite(bytes, 1, size, file) == size);
+        fclose(file);
+    }
+}
+
+static void count_record(const PinJournalRecord* record, void* context) {
+    (void)record;
+    (*(uint32_t*)context)++;
+}
+
+/// @return the pin ids of the pins in flight of the @a stage as a bit mask
+static uint32_t live_pin_mask(PinJournal* journal, uint32_t stage) {
+    Pin pins[TEST_MAX_PINS];
+    const uint32_t count = pin_journal_live_pins(journal, stage, pins, TEST_MAX_PINS);
+    uint32_t mask        = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        mask |= 1u << pins[i].pin_id;
+    }
+    return mask;
+}
+
+static bool open_test_journal(PinJournal* journal, uint32_t max_live_pins) {
+    bool is_enabled = false;
+    const bool ok   = open_pin_journal(journal, max_live_pins, &is_enabled);
+    TEST_CHECK(ok && is_enabled);
+    return ok;
+}
+
+static void journal_pins(PinJournal* journal, PinJournalRecordKind kind, uint32_t stage,
+                         int first_pin_id, int pins_count) {
+    Pin pin;
+    memset(&pin, 0, sizeof(pin));
+    uint64_t number = 0;
+    for (int pin_id = first_pin_id; pin_id < first_pin_id + pins_count; pin_id++) {
+        pin.pin_id = pin_id;
+        number     = pin_journal_append(journal, kind, stage, &pin);
+    }
+    TEST_CHECK(pin_journal_wait(journal, number));
+}
+
+/// @brief A crash tears the last record, the records after it are not trusted
+/// either: the journal recovers the pins up to it and drops the rest of the file.
+static void test_torn_record_recovery(void) {
+    PinJournal journal;
+    if (!open_test_journal(&journal, TEST_MAX_PINS)) {
+        return;
+    }
+    journal_pins(&journal, PIN_JOURNAL_STARTED, 1, 1, 5);
+    journal_pins(&journal, PIN_JOURNAL_PASSED, 1, 2, 1);
+    close_pin_journal(&journal);
+    const uint64_t valid_size = 6 * sizeof(PinJournalRecord);
+    TEST_CHECK(file_size(test_path) == valid_size);
+
+    PinJournalRecord record;
+    FILE* file = fopen(test_path, "rb");
+    TEST_CHECK(file != NULL && fread(&record, sizeof(record), 1, file) == 1);
+    if (file != NULL) {
+        fclose(file);
+    }
+    // a record of a wrong checksum, then a valid one
+    PinJournalRecord torn = record;
+    torn.pin_id           = 9;
+    append_bytes(test_path, &torn, sizeof(torn));
+    append_bytes(test_path, &record, sizeof(record));
+    uint32_t records_count = 0;
+    uint64_t read_size     = 0;
+    TEST_CHECK(read_pin_journal(test_path, &count_record, &records_count, &read_size));
+    TEST_CHECK(records_count == 6 && read_size == valid_size);
+
+    if (!open_test_journal(&journal, TEST_MAX_PINS)) {
+        return;
+    }
+    TEST_CHECK(journal.live.count == 4);
+    TEST_CHECK(live_pin_mask(&journal, 1) == ((1u << 1) | (1u << 3) | (1u << 4) | (1u << 5)));
+    // the file is rewritten with the pins in flight only
+    TEST_CHECK(file_size(test_path) == 4 * sizeof(PinJournalRecord));
+    journal_pins(&journal, PIN_JOURNAL_REJECTED, 1, 3, 1);
+    close_pin_journal(&journal);
+
+    // a half written record at the end
+    append_bytes(test_path, &record, sizeof(record) / 2);
+    records_count = 0;
+    TEST_CHECK(read_pin_journal(test_path, &count_record, &records_count, &read_size));
+    TEST_CHECK(records_count == 5 && read_size == 5 * sizeof(PinJournalRecord));
+    if (!open_test_journal(&journal, TEST_MAX_PINS)) {
+        return;
+    }
+    TEST_CHECK(live_pin_mask(&journal, 1) == ((1u << 1) | (1u << 4) | (1u << 5)));
+    TEST_CHECK(file_size(test_path) == 3 * sizeof(PinJournalRecord));
+    journal_pins(&journal, PIN_JOURNAL_PASSED, 1, 1, 5);
+    close_pin_journal(&journal);
+    unlink(test_path);
+}
+
+/// @brief The pins in flight above the capacity stay in the file for a later run.
+static void test_recovery_above_capacity(void) {
+    PinJournal journal;
+    if (!open_test_journal(&journal, TEST_MAX_PINS)) {
+        return;
+    }
+    journal_pins(&journal, PIN_JOURNAL_STARTED, 2, 0, 10);
+    close_pin_journal(&journal);
+    // a torn end is dropped even if the file is kept
+    append_bytes(test_path, "torn", 4);
+
+    if (!open_test_journal(&journal, 4)) {
+        return;
+    }
+    TEST_CHECK(journal.live.count == 4 && journal.has_lost_live);
+    TEST_CHECK(file_size(test_path) == 10 * sizeof(PinJournalRecord));
+    close_pin_journal(&journal);
+
+    if (!open_test_journal(&journal, TEST_MAX_PINS)) {
+        return;
+    }
+    TEST_CHECK(journal.live.count == 10 && !journal.has_lost_live);
+    TEST_CHECK(live_pin_mask(&journal, 2) == (1u << 10) - 1);
+    close_pin_journal(&journal);
+    unlink(test_path);
+}
+
+static bool track_pin(PinJournalLive* live, PinJournalRecordKind kind, int32_t pin_id,
+                      uint32_t stage) {
+    PinJournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind   = (uint8_t)kind;
+    record.pin_id = pin_id;
+    record.stage  = (uint8_t)stage;
+    return pin_journal_track(live, &record);
+}
+
+/// @brief Every record of the live set is found under its own key.
+static void check_live_records(PinJournalLive* live) {
+    for (uint32_t i = 0; i < live->count; i++) {
+        const PinJournalRecord record = live->records[i];
+        const uint32_t count          = live->count;
+        // a repeated start finds the record and leaves the set as it is
+        TEST_CHECK(track_pin(live, PIN_JOURNAL_STARTED, record.pin_id, record.stage));
+        TEST_CHECK(live->count == count && live->records[i].pin_id == record.pin_id);
+    }
+}
+
+/// @brief The pins finish in another order than they started: the removals
+/// shift the probed records back and move the last record into the hole.
+static void test_live_tracking(void) {
+    PinJournalLive live;
+    TEST_CHECK(init_pin_journal_live(&live, TEST_LIVE_CAPACITY));
+    // the same pin ids at every stage, the keys differ by few bits
+    for (int32_t pin_id = 0; pin_id < TEST_LIVE_PIN_IDS; pin_id++) {
+        for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+            TEST_CHECK(track_pin(&live, PIN_JOURNAL_STARTED, pin_id, stage));
+        }
+    }
+    TEST_CHECK(live.count == TEST_LIVE_CAPACITY);
+    TEST_CHECK(!track_pin(&live, PIN_JOURNAL_STARTED, TEST_LIVE_CAPACITY, 0));
+    // a finish of a pin out of the set is ignored
+    TEST_CHECK(track_pin(&live, PIN_JOURNAL_PASSED, TEST_LIVE_CAPACITY, 0));
+    check_live_records(&live);
+
+    // every other pin finishes from the front, the rest from the back
+    uint32_t finished = 0;
+    for (int32_t pin_id = 0; pin_id < TEST_LIVE_PIN_IDS; pin_id += 2) {
+        for (uint32_t stage = 0; stage < PIPELINE_STAGES; stage++) {
+            TEST_CHECK(track_pin(&live, PIN_JOURNAL_PASSED, pin_id, stage));
+            TEST_CHECK(live.count == TEST_LIVE_CAPACITY - ++finished);
+            check_live_records(&live);
+        }
+    }
+    for (int32_t pin_id = TEST_LIVE_PIN_IDS - 1; pin_id >= 0; pin_id -= 2) {
+        for (uint32_t stage = PIPELINE_STAGES; stage-- > 0;) {
+            TEST_CHECK(track_pin(&live, PIN_JOURNAL_REJECTED, pin_id, stage));
+            // a repeated finish is ignored
+            TEST_CHECK(track_pin(&live, PIN_JOURNAL_REJECTED, pin_id, stage));
+            TEST_CHECK(live.count == TEST_LIVE_CAPACITY - ++finished);
+            check_live_records(&live);
+        }
+    }
+    TEST_CHECK(live.count == 0);
+    for (uint32_t bucket = 0; bucket < live.buckets_count; bucket++) {
+        TEST_CHECK(live.buckets[bucket] == 0);
+    }
+
+    TEST_CHECK(track_pin(&live, PIN_JOURNAL_STARTED, 1, 1));
+    clear_pin_journal_live(&live);
+    TEST_CHECK(live.count == 0);
+    TEST_CHECK(track_pin(&live, PIN_JOURNAL_STARTED, 1, 1) && live.count == 1);
+    deinit_pin_journal_live(&live);
+}
+
+int main(void) {
+    if (mkdtemp(test_directory) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(test_path, sizeof(test_path), "%s/pins.journal", test_directory);
+    setenv(PIN_JOURNAL_ENV, test_path, 1);
+    setenv(PIN_JOURNAL_SYNC_ENV, "0", 1);
+    test_live_tracking();
+    test_torn_record_recovery();
+    test_recovery_above_capacity();
+    unlink(test_path);
+    rmdir(test_directory);
+    return test_report("pin-journal-test");
+}
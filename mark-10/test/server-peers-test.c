@@ -0,0 +1,150 @@
+#include "../net/server-peers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "test-check.h"
+
+enum { TEST_PEERS = 300 };
+
+static const ComponentType test_types[] = {
+    COMPONENT_TYPE_FIRST_STAGE_WORKER,
+    COMPONENT_TYPE_SECOND_STAGE_WORKER,
+    COMPONENT_TYPE_LOGS_COLLECTOR,
+};
+enum { TEST_TYPES = sizeof(test_types) / sizeof(test_types[0]) };
+
+/// @brief The identity of the @a key peer, the peers differ by few bits, so
+/// their probe sequences cross.
+static ServerPeer make_peer(uint32_t key) {
+    ServerPeer peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.type                    = test_types[key % TEST_TYPES];
+    peer.transport               = (ServerPeerTransport)(key / TEST_TYPES % 3);
+    peer.address.sin_family      = AF_INET;
+    peer.address.sin_addr.s_addr = htonl(0x7f000001);
+    peer.address.sin_port        = htons((uint16_t)(40000 + key % 7));
+    peer.pid                     = 1000 + key / 7;
+    peer.slot                    = key % 5;
+    peer.weight                  = 1 + key % 4;
+    return peer;
+}
+
+/// @brief No probe sequence has a hole: every peer is found from its home bucket
+/// without passing an empty one.
+static void check_buckets(const ServerPeerTable* table) {
+    const uint32_t mask = table->buckets_count - 1;
+    uint32_t used       = 0;
+    for (uint32_t bucket = 0; bucket < table->buckets_count; bucket++) {
+        const uint32_t hash = table->bucket_hashes[bucket];
+        if (hash == 0) {
+            continue;
+        }
+        used++;
+        for (uint32_t probed = hash & mask; probed != bucket; probed = (probed + 1) & mask) {
+            TEST_CHECK(table->bucket_hashes[probed] != 0);
+        }
+        TEST_CHECK(table->peers[table->bucket_peers[bucket]].is_used);
+    }
+    TEST_CHECK(used == table->count && 2 * table->count <= table->buckets_count);
+}
+
+static void check_stages(const ServerPeerTable* table) {
+    uint32_t members = 0;
+    for (uint32_t type = 0; type < TEST_TYPES; type++) {
+        const ServerStagePeers* stage = server_stage_peers(table, test_types[type]);
+        uint32_t total_weight         = 0;
+        for (uint32_t position = 0; position < stage->count; position++) {
+            const ServerPeer* peer = server_peer_at(table, stage->peers[position]);
+            TEST_CHECK(peer->is_used && peer->type == test_types[type]);
+            TEST_CHECK(peer->stage_position == position);
+            TEST_CHECK(stage->transports[position] == peer->transport);
+            TEST_CHECK(stage->slots[position] == peer->slot);
+            TEST_CHECK(stage->weights[position] == peer->weight);
+            total_weight += peer->weight;
+        }
+        TEST_CHECK(stage->total_weight == total_weight);
+        members += stage->count;
+    }
+    TEST_CHECK(members == table->count);
+}
+
+static void check_table(const ServerPeerTable* table, const uint32_t* indices) {
+    check_buckets(table);
+    check_stages(table);
+    for (uint32_t key = 0; key < TEST_PEERS; key++) {
+        const ServerPeer peer = make_peer(key);
+        TEST_CHECK(server_peer_table_find(table, &peer) == indices[key]);
+    }
+}
+
+static void remove_peer(ServerPeerTable* table, uint32_t* indices, uint32_t key) {
+    server_peer_table_remove(table, indices[key]);
+    indices[key] = SERVER_NO_PEER;
+    check_table(table, indices);
+}
+
+/// @brief The removals shift the probed peers back: every third peer goes
+/// first, then the rest in the reverse order of their registration.
+static void test_backward_shift_deletion(void) {
+    ServerPeerTable table;
+    TEST_CHECK(init_server_peer_table(&table));
+    static uint32_t indices[TEST_PEERS];
+    for (uint32_t key = 0; key < TEST_PEERS; key++) {
+        // the buckets grow on the way
+        const ServerPeer peer = make_peer(key);
+        indices[key]          = server_peer_table_add(&table, &peer);
+        TEST_CHECK(indices[key] != SERVER_NO_PEER);
+    }
+    check_table(&table, indices);
+    TEST_CHECK(table.count == TEST_PEERS);
+    for (uint32_t key = 0; key < TEST_PEERS; key += 3) {
+        remove_peer(&table, indices, key);
+    }
+    for (uint32_t key = TEST_PEERS; key-- > 0;) {
+        if (indices[key] != SERVER_NO_PEER) {
+            remove_peer(&table, indices, key);
+        }
+    }
+    TEST_CHECK(table.count == 0);
+    deinit_server_peer_table(&table);
+}
+
+/// @brief Every worker gets as many pins in a row as its weight.
+static void test_weighted_dispatch(void) {
+    ServerPeerTable table;
+    TEST_CHECK(init_server_peer_table(&table));
+    const ComponentType type = COMPONENT_TYPE_SECOND_STAGE_WORKER;
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == SERVER_NO_PEER);
+    uint32_t indices[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        ServerPeer peer = make_peer(1 + 3 * i);
+        peer.weight     = i + 1;
+        indices[i]      = server_peer_table_add(&table, &peer);
+    }
+    const uint32_t expected[] = {0, 1, 1, 2, 2, 2, 0, 1};
+    for (uint32_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[expected[i]]);
+    }
+    // the second worker got one of its pins, the rest goes to the third one
+    server_peer_table_pass_over(&table, type);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[2]);
+    // a lower weight cuts the pins left in the turn
+    server_peer_table_set_weight(&table, indices[2], 1);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[2]);
+    // the turn of the removed worker goes to the worker that takes its place
+    server_peer_table_remove(&table, indices[0]);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[2]);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[1]);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[1]);
+    TEST_CHECK(server_peer_table_dispatch(&table, type) == indices[2]);
+    check_stages(&table);
+    deinit_server_peer_table(&table);
+}
+
+int main(void) {
+    test_backward_shift_deletion();
+    test_weighted_dispatch();
+    return test_report("server-peers-test");
+}
@@ -0,0 +1,199 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../net/stage-queue.h"
+#include "test-check.h"
+
+enum {
+    TEST_QUEUE_CAPACITY = 16,
+    TEST_QUEUE_STEPS    = 20000,
+};
+
+/// @brief Unordered copy of the queue, the pins that leave it are found by a scan.
+typedef struct QueueModel {
+    StageQueueEntry entries[TEST_QUEUE_CAPACITY];
+    uint32_t count;
+    uint64_t next_sequence;
+} QueueModel;
+
+/// @brief xorshift64, the same walk in every run.
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static StageQueueEntry make_entry(int pin_id, uint32_t priority, uint64_t deadline_ns) {
+    StageQueueEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.pin.pin_id   = pin_id;
+    entry.pin.priority = priority;
+    entry.deadline_ns  = deadline_ns;
+    return entry;
+}
+
+static bool model_is_before(StageQueuePolicy policy, const StageQueueEntry* a,
+                            const StageQueueEntry* b) {
+    if (policy == STAGE_QUEUE_PRIORITY && a->pin.priority != b->pin.priority) {
+        return a->pin.priority > b->pin.priority;
+    }
+    if (policy == STAGE_QUEUE_EDF && a->deadline_ns != b->deadline_ns) {
+        return a->deadline_ns < b->deadline_ns;
+    }
+    return a->sequence < b->sequence;
+}
+
+static bool model_is_less_valuable(const StageQueueEntry* a, const StageQueueEntry* b) {
+    if (a->pin.priority != b->pin.priority) {
+        return a->pin.priority < b->pin.priority;
+    }
+    return a->sequence > b->sequence;
+}
+
+static void model_remove(QueueModel* model, uint32_t index, StageQueueEntry* entry) {
+    *entry                = model->entries[index];
+    model->entries[index] = model->entries[--model->count];
+}
+
+/// @return false if a pin was shed, the same as stage_queue_push()
+static bool model_push(QueueModel* model, const StageQueueEntry* entry, StageQueueEntry* shed) {
+    StageQueueEntry pushed = *entry;
+    pushed.sequence        = model->next_sequence++;
+    bool is_shed           = false;
+    if (model->count == TEST_QUEUE_CAPACITY) {
+        uint32_t victim = 0;
+        for (uint32_t i = 1; i < model->count; i++) {
+            if (model_is_less_valuable(&model->entries[i], &model->entries[victim])) {
+                victim = i;
+            }
+        }
+        if (!model_is_less_valuable(&model->entries[victim], &pushed)) {
+            *shed = pushed;
+            return false;
+        }
+        model_remove(model, victim, shed);
+        is_shed = true;
+    }
+    model->entries[model->count++] = pushed;
+    return !is_shed;
+}
+
+static bool model_pop(QueueModel* model, StageQueuePolicy policy, StageQueueEntry* entry) {
+    if (model->count == 0) {
+        return false;
+    }
+    uint32_t first = 0;
+    for (uint32_t i = 1; i < model->count; i++) {
+        if (model_is_before(policy, &model->entries[i], &model->entries[first])) {
+            first = i;
+        }
+    }
+    model_remove(model, first, entry);
+    return true;
+}
+
+/// @brief The shedding removes the pins from the middle of the heap, the pops
+/// still come in the order of the policy.
+static void test_shedding_keeps_heap_order(StageQueuePolicy policy) {
+    StageQueue queue;
+    TEST_CHECK(init_stage_queue(&queue, policy, TEST_QUEUE_CAPACITY));
+    QueueModel model    = {0};
+    uint64_t random     = 0x9e3779b97f4a7c15ull + policy;
+    uint64_t shed_count = 0;
+    for (int step = 0; step < TEST_QUEUE_STEPS; step++) {
+        StageQueueEntry expected;
+        StageQueueEntry actual;
+        memset(&expected, 0, sizeof(expected));
+        memset(&actual, 0, sizeof(actual));
+        // pushes outnumber pops to keep the queue full most of the time
+        if (next_random(&random) % 4 != 0) {
+            const StageQueueEntry entry =
+                make_entry(step, (uint32_t)(next_random(&random) % PIN_PRIORITY_CLASSES),
+                           next_random(&random) % 64);
+            const bool is_kept = model_push(&model, &entry, &expected);
+            TEST_CHECK(stage_queue_push(&queue, &entry, &actual) == is_kept);
+            if (!is_kept) {
+                shed_count++;
+                TEST_CHECK(actual.pin.pin_id == expected.pin.pin_id);
+            }
+        } else {
+            const bool has_entry = model_pop(&model, policy, &expected);
+            TEST_CHECK(stage_queue_pop(&queue, &actual) == has_entry);
+            if (has_entry) {
+                TEST_CHECK(actual.pin.pin_id == expected.pin.pin_id);
+            }
+        }
+        TEST_CHECK(queue.count == model.count);
+    }
+    TEST_CHECK(queue.pins_shed == shed_count);
+    StageQueueEntry expected;
+    StageQueueEntry actual;
+    while (model_pop(&model, policy, &expected)) {
+        TEST_CHECK(stage_queue_pop(&queue, &actual));
+        TEST_CHECK(actual.pin.pin_id == expected.pin.pin_id);
+    }
+    TEST_CHECK(!stage_queue_pop(&queue, &actual));
+    deinit_stage_queue(&queue);
+}
+
+static void test_full_queue_sheds_new_pin_of_no_more_worth(void) {
+    StageQueue queue;
+    TEST_CHECK(init_stage_queue(&queue, STAGE_QUEUE_PRIORITY, 2));
+    StageQueueEntry shed;
+    StageQueueEntry entry = make_entry(1, 1, 0);
+    TEST_CHECK(stage_queue_push(&queue, &entry, &shed));
+    entry = make_entry(2, 2, 0);
+    TEST_CHECK(stage_queue_push(&queue, &entry, &shed));
+    // the same priority as the least valuable pin, the new one came last
+    entry = make_entry(3, 1, 0);
+    TEST_CHECK(!stage_queue_push(&queue, &entry, &shed));
+    TEST_CHECK(shed.pin.pin_id == 3);
+    entry = make_entry(4, 3, 0);
+    TEST_CHECK(!stage_queue_push(&queue, &entry, &shed));
+    TEST_CHECK(shed.pin.pin_id == 1);
+    TEST_CHECK(stage_queue_pop(&queue, &shed) && shed.pin.pin_id == 4);
+    TEST_CHECK(stage_queue_pop(&queue, &shed) && shed.pin.pin_id == 2);
+    TEST_CHECK(queue.pins_shed == 2);
+    deinit_stage_queue(&queue);
+}
+
+static void test_edf_expiry(void) {
+    StageQueue queue;
+    TEST_CHECK(init_stage_queue(&queue, STAGE_QUEUE_EDF, 8));
+    const uint64_t deadlines[] = {50, 10, 40, 10, 30};
+    StageQueueEntry entry;
+    for (uint32_t i = 0; i < sizeof(deadlines) / sizeof(deadlines[0]); i++) {
+        entry = make_entry((int)i, 0, deadlines[i]);
+        TEST_CHECK(stage_queue_push(&queue, &entry, &entry));
+    }
+    TEST_CHECK(!stage_queue_expire(&queue, 9, &entry));
+    // the deadline itself is stale already, the equal ones leave in the order they came
+    TEST_CHECK(stage_queue_expire(&queue, 30, &entry) && entry.pin.pin_id == 1);
+    TEST_CHECK(stage_queue_expire(&queue, 30, &entry) && entry.pin.pin_id == 3);
+    TEST_CHECK(stage_queue_expire(&queue, 30, &entry) && entry.pin.pin_id == 4);
+    TEST_CHECK(!stage_queue_expire(&queue, 30, &entry));
+    TEST_CHECK(queue.pins_expired == 3 && queue.count == 2);
+    TEST_CHECK(stage_queue_pop(&queue, &entry) && entry.pin.pin_id == 2);
+    TEST_CHECK(stage_queue_expire(&queue, UINT64_MAX, &entry) && entry.pin.pin_id == 0);
+    TEST_CHECK(!stage_queue_expire(&queue, UINT64_MAX, &entry));
+    deinit_stage_queue(&queue);
+
+    // the other policies have no stale pins
+    TEST_CHECK(init_stage_queue(&queue, STAGE_QUEUE_FIFO, 8));
+    entry = make_entry(0, 0, 1);
+    TEST_CHECK(stage_queue_push(&queue, &entry, &entry));
+    TEST_CHECK(!stage_queue_expire(&queue, UINT64_MAX, &entry));
+    TEST_CHECK(queue.count == 1 && queue.pins_expired == 0);
+    deinit_stage_queue(&queue);
+}
+
+int main(void) {
+    test_shedding_keeps_heap_order(STAGE_QUEUE_FIFO);
+    test_shedding_keeps_heap_order(STAGE_QUEUE_PRIORITY);
+    test_shedding_keeps_heap_order(STAGE_QUEUE_EDF);
+    test_full_queue_sheds_new_pin_of_no_more_worth();
+    test_edf_expiry();
+    return test_report("stage-queue-test");
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// @brief Checks of a standalone test program, a failed one is printed and the
+/// program goes on to report all of them.
+static uint32_t test_checks_failed;
+
+#define TEST_CHECK(condition)                                                              \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, \
+                    #condition);                                                           \
+            test_checks_failed++;                                                          \
+        }                                                                                  \
+    } while (0)
+
+/// @return exit status of the test program
+static inline int test_report(const char* test_name) {
+    if (test_checks_failed != 0) {
+        fprintf(stderr, "%s: %u check(s) failed\n", test_name, test_checks_failed);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", test_name);
+    return EXIT_SUCCESS;
+}
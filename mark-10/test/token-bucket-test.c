@@ -0,0 +1,77 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../util/token-bucket.h"
+#include "test-check.h"
+
+enum { TEST_NS_PER_S = 1000000000 };
+
+static uint32_t take_all(TokenBucket* bucket, uint64_t now_ns) {
+    uint32_t taken = 0;
+    while (token_bucket_take(bucket, now_ns)) {
+        taken++;
+    }
+    return taken;
+}
+
+static void test_refill_is_capped_by_burst(void) {
+    TokenBucket bucket;
+    init_token_bucket(&bucket, 10, 5, 0);
+    TEST_CHECK(take_all(&bucket, 0) == 5);
+    TEST_CHECK(take_all(&bucket, TEST_NS_PER_S / 10) == 1);
+    // a long idle time collects no more than the burst
+    TEST_CHECK(take_all(&bucket, 3600ull * TEST_NS_PER_S) == 5);
+    // the whole range of the clock does not overflow the tokens either
+    TEST_CHECK(take_all(&bucket, UINT64_MAX) == 5);
+    TEST_CHECK(bucket.tokens >= 0 && bucket.tokens < 1);
+}
+
+static void test_clock_going_back_adds_no_tokens(void) {
+    TokenBucket bucket;
+    init_token_bucket(&bucket, 1, 1, 10ull * TEST_NS_PER_S);
+    TEST_CHECK(take_all(&bucket, 10ull * TEST_NS_PER_S) == 1);
+    TEST_CHECK(take_all(&bucket, 5ull * TEST_NS_PER_S) == 0);
+    TEST_CHECK(bucket.tokens >= 0 && bucket.tokens < 1);
+    // the refill goes on from the earlier time
+    TEST_CHECK(take_all(&bucket, 6ull * TEST_NS_PER_S) == 1);
+    TEST_CHECK(token_bucket_wait_ns(&bucket, 5ull * TEST_NS_PER_S) > 0);
+}
+
+static void test_wait_until_next_token(void) {
+    TokenBucket bucket;
+    // the slowest admission rate, a pin a minute
+    init_token_bucket(&bucket, 1.0 / 60, 1, 0);
+    TEST_CHECK(token_bucket_wait_ns(&bucket, 0) == 0);
+    TEST_CHECK(take_all(&bucket, 0) == 1);
+    const uint64_t wait_ns = token_bucket_wait_ns(&bucket, 0);
+    TEST_CHECK(wait_ns > 59ull * TEST_NS_PER_S && wait_ns <= 61ull * TEST_NS_PER_S);
+    TEST_CHECK(!token_bucket_take(&bucket, wait_ns - TEST_NS_PER_S));
+    TEST_CHECK(token_bucket_take(&bucket, wait_ns));
+    TEST_CHECK(token_bucket_wait_ns(&bucket, UINT64_MAX) == 0);
+}
+
+static void test_set_rate(void) {
+    TokenBucket bucket;
+    // a bucket without limit admits everything and is full once limited
+    init_token_bucket(&bucket, 0, 1, 0);
+    for (uint32_t i = 0; i < 1000; i++) {
+        TEST_CHECK(token_bucket_take(&bucket, 0));
+    }
+    token_bucket_set_rate(&bucket, 1, 3, TEST_NS_PER_S);
+    TEST_CHECK(take_all(&bucket, TEST_NS_PER_S) == 3);
+    TEST_CHECK(take_all(&bucket, 3ull * TEST_NS_PER_S) == 2);
+    // the collected tokens are kept up to the new burst
+    token_bucket_set_rate(&bucket, 1, 2, 13ull * TEST_NS_PER_S);
+    TEST_CHECK(take_all(&bucket, 13ull * TEST_NS_PER_S) == 2);
+    // a burst below a token still admits one
+    token_bucket_set_rate(&bucket, 1, 0, 20ull * TEST_NS_PER_S);
+    TEST_CHECK(take_all(&bucket, 20ull * TEST_NS_PER_S) == 1);
+}
+
+int main(void) {
+    test_refill_is_capped_by_burst();
+    test_clock_going_back_adds_no_tokens();
+    test_wait_until_next_token();
+    test_set_rate();
+    return test_report("token-bucket-test");
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+/// @brief Cheap monotonic timestamp in nanoseconds (vDSO, no syscall on Linux).
+/// CLOCK_MONOTONIC is shared by all processes of the host, so timestamps taken
+/// by the server and the workers running on the same machine are comparable.
+static inline uint64_t monotonic_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
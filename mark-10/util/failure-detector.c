@@ -0,0 +1,228 @@
+#include "failure-detector.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    /// Weight of a new interval in the moving mean and variance is 1 / 8.
+    FAILURE_DETECTOR_EWMA_SHIFT = 3,
+    /// The standard deviation is not allowed below mean / 4.
+    FAILURE_DETECTOR_MIN_STDDEV_DIVISOR = 4,
+};
+
+/// Coefficients of the logistic approximation of the normal CDF.
+static const double LOGISTIC_A = 1.5976;
+static const double LOGISTIC_B = 0.070566;
+
+const char* failure_detector_mode_to_string(FailureDetectorMode mode) {
+    switch (mode) {
+        case FAILURE_DETECTOR_DISABLED:
+            return "disabled";
+        case FAILURE_DETECTOR_FIXED_TIMEOUT:
+            return "fixed timeout";
+        case FAILURE_DETECTOR_PHI_ACCRUAL:
+            return "phi accrual";
+        default:
+            return "unknown";
+    }
+}
+
+/// @brief Solves LOGISTIC_A * y + LOGISTIC_B * y^3 = ln(10^threshold - 1) by
+/// Newton's method, the left side is monotonic.
+static double threshold_score(double phi_threshold) {
+    const double target = log(pow(10.0, phi_threshold) - 1.0);
+    double y            = target / LOGISTIC_A;
+    for (int i = 0; i < 32; i++) {
+        const double value = LOGISTIC_A * y + LOGISTIC_B * y * y * y - target;
+        const double slope = LOGISTIC_A + 3.0 * LOGISTIC_B * y * y;
+        const double step  = value / slope;
+        y -= step;
+        if (fabs(step) < 1e-9) {
+            break;
+        }
+    }
+    return y;
+}
+
+void init_failure_detector(FailureDetector* detector, const FailureDetectorConfig* config,
+                           uint64_t now_ns) {
+    memset(detector, 0, sizeof(*detector));
+    detector->config = *config;
+    assert(config->mode == FAILURE_DETECTOR_DISABLED || config->tick_ns != 0);
+    if (config->mode == FAILURE_DETECTOR_PHI_ACCRUAL) {
+        detector->threshold_score = threshold_score(config->phi_threshold);
+    }
+    detector->next_tick = config->tick_ns != 0 ? now_ns / config->tick_ns : 0;
+    for (uint32_t i = 0; i < FAILURE_DETECTOR_WHEEL_SLOTS; i++) {
+        detector->wheel[i] = FAILURE_DETECTOR_NO_PEER;
+    }
+}
+
+void deinit_failure_detector(FailureDetector* detector) {
+    free(detector->peers);
+    detector->peers    = NULL;
+    detector->capacity = 0;
+}
+
+bool failure_detector_reserve(FailureDetector* detector, uint32_t capacity) {
+    if (capacity <= detector->capacity) {
+        return true;
+    }
+    uint32_t new_capacity =
+        detector->capacity != 0 ? detector->capacity : FAILURE_DETECTOR_MIN_PEERS;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    FailureDetectorPeer* peers = realloc(detector->peers, new_capacity * sizeof(*peers));
+    if (peers == NULL) {
+        return false;
+    }
+    memset(&peers[detector->capacity], 0,
+           (new_capacity - detector->capacity) * sizeof(*peers));
+    detector->peers    = peers;
+    detector->capacity = new_capacity;
+    return true;
+}
+
+static double interval_stddev(const FailureDetectorPeer* peer) {
+    const double min_stddev = peer->interval_mean_ns / FAILURE_DETECTOR_MIN_STDDEV_DIVISOR;
+    const double stddev     = sqrt(peer->interval_variance);
+    return stddev > min_stddev ? stddev : min_stddev;
+}
+
+static uint64_t suspicion_deadline(const FailureDetector* detector,
+                                   const FailureDetectorPeer* peer) {
+    if (detector->config.mode == FAILURE_DETECTOR_FIXED_TIMEOUT) {
+        return peer->last_heartbeat_ns + detector->config.timeout_ns;
+    }
+    const double silence_ns = peer->interval_mean_ns +
+                              detector->threshold_score * interval_stddev(peer) +
+                              (double)detector->config.acceptable_pause_ns;
+    return peer->last_heartbeat_ns + (uint64_t)silence_ns;
+}
+
+static void unlink_peer(FailureDetector* detector, uint32_t index) {
+    FailureDetectorPeer* peer = &detector->peers[index];
+    if (peer->prev != FAILURE_DETECTOR_NO_PEER) {
+        detector->peers[peer->prev].next = peer->next;
+    } else {
+        detector->wheel[peer->slot] = peer->next;
+    }
+    if (peer->next != FAILURE_DETECTOR_NO_PEER) {
+        detector->peers[peer->next].prev = peer->prev;
+    }
+}
+
+static void schedule_peer(FailureDetector* detector, uint32_t index, uint64_t deadline_ns) {
+    FailureDetectorPeer* peer = &detector->peers[index];
+    uint64_t tick             = deadline_ns / detector->config.tick_ns;
+    if (tick < detector->next_tick) {
+        tick = detector->next_tick;
+    }
+    peer->deadline_ns = deadline_ns;
+    peer->slot        = (uint32_t)(tick % FAILURE_DETECTOR_WHEEL_SLOTS);
+    peer->prev        = FAILURE_DETECTOR_NO_PEER;
+    peer->next        = detector->wheel[peer->slot];
+    if (peer->next != FAILURE_DETECTOR_NO_PEER) {
+        detector->peers[peer->next].prev = index;
+    }
+    detector->wheel[peer->slot] = index;
+}
+
+void failure_detector_track(FailureDetector* detector, uint32_t index, uint64_t now_ns) {
+    assert(index < detector->capacity);
+    if (!is_failure_detector_enabled(detector)) {
+        return;
+    }
+    FailureDetectorPeer* peer = &detector->peers[index];
+    if (peer->is_tracked) {
+        unlink_peer(detector, index);
+    }
+    // the bootstrap deviation is the smallest one allowed
+    const double first_interval_ns = (double)detector->config.first_interval_ns;
+    const double first_stddev_ns   = first_interval_ns / FAILURE_DETECTOR_MIN_STDDEV_DIVISOR;
+    *peer                          = (FailureDetectorPeer){
+        .is_tracked        = true,
+        .last_heartbeat_ns = now_ns,
+        .interval_mean_ns  = first_interval_ns,
+        .interval_variance = first_stddev_ns * first_stddev_ns,
+    };
+    schedule_peer(detector, index, suspicion_deadline(detector, peer));
+}
+
+void failure_detector_untrack(FailureDetector* detector, uint32_t index) {
+    assert(index < detector->capacity);
+    FailureDetectorPeer* peer = &detector->peers[index];
+    if (peer->is_tracked) {
+        unlink_peer(detector, index);
+        peer->is_tracked = false;
+    }
+}
+
+void failure_detector_heartbeat(FailureDetector* detector, uint32_t index, uint64_t now_ns) {
+    assert(index < detector->capacity);
+    FailureDetectorPeer* peer = &detector->peers[index];
+    if (!peer->is_tracked) {
+        return;
+    }
+    if (now_ns > peer->last_heartbeat_ns) {
+        const double interval_ns = (double)(now_ns - peer->last_heartbeat_ns);
+        const double delta       = interval_ns - peer->interval_mean_ns;
+        peer->interval_mean_ns += delta / (1u << FAILURE_DETECTOR_EWMA_SHIFT);
+        peer->interval_variance +=
+            (delta * delta - peer->interval_variance) / (1u << FAILURE_DETECTOR_EWMA_SHIFT);
+        peer->last_heartbeat_ns = now_ns;
+    }
+    unlink_peer(detector, index);
+    schedule_peer(detector, index, suspicion_deadline(detector, peer));
+}
+
+double failure_detector_phi(const FailureDetector* detector, uint32_t index, uint64_t now_ns) {
+    assert(index < detector->capacity);
+    const FailureDetectorPeer* peer = &detector->peers[index];
+    const double silence_ns =
+        now_ns > peer->last_heartbeat_ns ? (double)(now_ns - peer->last_heartbeat_ns) : 0.0;
+    if (detector->config.mode == FAILURE_DETECTOR_FIXED_TIMEOUT) {
+        return silence_ns / (double)detector->config.timeout_ns;
+    }
+    const double y = (silence_ns - (double)detector->config.acceptable_pause_ns -
+                      peer->interval_mean_ns) /
+                     interval_stddev(peer);
+    const double e = exp(-y * (LOGISTIC_A + LOGISTIC_B * y * y));
+    return y > 0 ? -log10(e / (1.0 + e)) : -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+uint32_t failure_detector_expire(FailureDetector* detector, uint64_t now_ns, uint32_t* suspected,
+                                 uint32_t capacity) {
+    if (!is_failure_detector_enabled(detector)) {
+        return 0;
+    }
+    // a slot is expired once its whole tick passed, so all its deadlines of this turn are due
+    const uint64_t now_tick = now_ns / detector->config.tick_ns;
+    // after a long stall every slot is visited once
+    if (now_tick > detector->next_tick + FAILURE_DETECTOR_WHEEL_SLOTS) {
+        detector->next_tick = now_tick - FAILURE_DETECTOR_WHEEL_SLOTS;
+    }
+
+    uint32_t count = 0;
+    for (; detector->next_tick < now_tick; detector->next_tick++) {
+        const uint32_t slot = (uint32_t)(detector->next_tick % FAILURE_DETECTOR_WHEEL_SLOTS);
+        uint32_t index      = detector->wheel[slot];
+        while (index != FAILURE_DETECTOR_NO_PEER) {
+            FailureDetectorPeer* peer = &detector->peers[index];
+            const uint32_t next       = peer->next;
+            if (peer->deadline_ns <= now_ns) {
+                if (count == capacity) {
+                    return count;
+                }
+                failure_detector_untrack(detector, index);
+                suspected[count++] = index;
+            }
+            index = next;
+        }
+    }
+    return count;
+}
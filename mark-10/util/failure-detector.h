@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief Heartbeat failure detector over a hashed timer wheel.
+///
+/// Every tracked peer sits in the wheel slot of the time it is suspected at,
+/// so a heartbeat moves it between two doubly linked lists and a tick visits
+/// only the peers of one slot: the cost per peer is constant whatever the
+/// number of peers. Deadlines further than one wheel turn stay in their slot
+/// and are skipped until their turn comes.
+///
+/// With the fixed timeout the peer is suspected once it was silent for
+/// timeout_ns. The phi accrual detector (Hayashibara et al.) keeps the mean and
+/// the variance of the heartbeat intervals (EWMA, constant memory) and suspects
+/// the peer once phi = -log10(P(interval > silence)) reaches phi_threshold, with
+/// the normal distribution approximated by the logistic function. The silence
+/// at which phi crosses the threshold is computed on the heartbeat, the wheel
+/// does not evaluate phi of the peers that are on time.
+///
+/// The peers are indexed by the caller, the array of their state grows with
+/// failure_detector_reserve().
+enum {
+    FAILURE_DETECTOR_MIN_PEERS   = 16,
+    FAILURE_DETECTOR_WHEEL_SLOTS = 256,
+    FAILURE_DETECTOR_NO_PEER     = UINT32_MAX,
+};
+
+typedef enum FailureDetectorMode {
+    FAILURE_DETECTOR_DISABLED,
+    FAILURE_DETECTOR_FIXED_TIMEOUT,
+    FAILURE_DETECTOR_PHI_ACCRUAL,
+} FailureDetectorMode;
+
+typedef struct FailureDetectorConfig {
+    FailureDetectorMode mode;
+    /// Resolution of the wheel.
+    uint64_t tick_ns;
+    /// Silence after which the peer is suspected in the fixed timeout mode.
+    uint64_t timeout_ns;
+    double phi_threshold;
+    /// Interval assumed before the first heartbeats of the peer arrive.
+    uint64_t first_interval_ns;
+    /// Silence tolerated on top of the expected interval (GC, scheduling).
+    uint64_t acceptable_pause_ns;
+} FailureDetectorConfig;
+
+typedef struct FailureDetectorPeer {
+    bool is_tracked;
+    uint64_t last_heartbeat_ns;
+    double interval_mean_ns;
+    double interval_variance;
+    uint64_t deadline_ns;
+    uint32_t slot;
+    uint32_t prev;
+    uint32_t next;
+} FailureDetectorPeer;
+
+typedef struct FailureDetector {
+    FailureDetectorConfig config;
+    /// Standard score at which phi reaches the threshold.
+    double threshold_score;
+    /// Tick the wheel expires next.
+    uint64_t next_tick;
+    uint32_t wheel[FAILURE_DETECTOR_WHEEL_SLOTS];
+    FailureDetectorPeer* peers;
+    uint32_t capacity;
+} FailureDetector;
+
+const char* failure_detector_mode_to_string(FailureDetectorMode mode);
+void init_failure_detector(FailureDetector* detector, const FailureDetectorConfig* config,
+                           uint64_t now_ns);
+void deinit_failure_detector(FailureDetector* detector);
+/// @brief Makes room for the peers with the indices below @a capacity.
+bool failure_detector_reserve(FailureDetector* detector, uint32_t capacity);
+static inline bool is_failure_detector_enabled(const FailureDetector* detector) {
+    return detector->config.mode != FAILURE_DETECTOR_DISABLED;
+}
+/// @brief Starts watching the @a peer as if it just sent a heartbeat.
+void failure_detector_track(FailureDetector* detector, uint32_t peer, uint64_t now_ns);
+void failure_detector_untrack(FailureDetector* detector, uint32_t peer);
+void failure_detector_heartbeat(FailureDetector* detector, uint32_t peer, uint64_t now_ns);
+/// @brief Suspicion level of the @a peer, the silence in the timeouts in the fixed timeout mode.
+double failure_detector_phi(const FailureDetector* detector, uint32_t peer, uint64_t now_ns);
+/// @brief Advances the wheel up to @a now_ns and untracks the suspected peers,
+/// their last_heartbeat_ns stays valid.
+/// @return number of the suspected peers written to @a suspected, the rest of
+/// them is returned by the next call once it is full
+uint32_t failure_detector_expire(FailureDetector* detector, uint64_t now_ns, uint32_t* suspected,
+                                 uint32_t capacity);
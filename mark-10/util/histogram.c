@@ -0,0 +1,124 @@
+#include "histogram.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (uint32_t)value;
+    }
+    // position of the highest set bit, >= HISTOGRAM_SUB_BUCKET_BITS here
+    const uint32_t msb   = 63u - (uint32_t)__builtin_clzll(value);
+    const uint32_t shift = msb - HISTOGRAM_SUB_BUCKET_BITS + 1;
+    const uint32_t sub   = (uint32_t)(value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return shift * (HISTOGRAM_SUB_BUCKETS / 2) + sub;
+}
+
+/// @brief Highest value that falls into the bucket with index @a index.
+static uint64_t bucket_upper_bound(uint32_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    const uint32_t shift = index / (HISTOGRAM_SUB_BUCKETS / 2) - 1;
+    const uint64_t sub   = index % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram* hist) {
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void histogram_record(Histogram* hist, uint64_t value) {
+    const uint32_t index = bucket_index(value);
+    assert(index < HISTOGRAM_BUCKETS);
+    hist->buckets[index]++;
+    hist->count++;
+    hist->sum += value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void histogram_merge(Histogram* dst, const Histogram* src) {
+    if (src->count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+// Single writer: plain load + store with relaxed atomics, no locked instructions.
+#define SINGLE_WRITER_ADD(ptr, value) \
+    __atomic_store_n((ptr), __atomic_load_n((ptr), __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+
+void histogram_record_shared(Histogram* hist, uint64_t value) {
+    const uint32_t index = bucket_index(value);
+    assert(index < HISTOGRAM_BUCKETS);
+    SINGLE_WRITER_ADD(&hist->buckets[index], 1);
+    SINGLE_WRITER_ADD(&hist->sum, value);
+    const uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (count == 0 || value < __atomic_load_n(&hist->min, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+    // count is published last so that readers never see more samples than buckets hold
+    __atomic_store_n(&hist->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void histogram_merge_shared(Histogram* dst, const Histogram* src) {
+    const uint64_t count = __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count += count;
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    const uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    const uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (min < dst->min) {
+        dst->min = min;
+    }
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+uint64_t histogram_value_at_percentile(const Histogram* hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    if (percentile >= 100.0) {
+        return hist->max;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            const uint64_t bound = bucket_upper_bound(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief Log-linear (HDR-style) histogram of unsigned 64-bit values.
+/// Values below HISTOGRAM_SUB_BUCKETS are stored exactly, every larger power
+/// of two range is split into HISTOGRAM_SUB_BUCKETS / 2 linear sub-buckets,
+/// so the relative error of any reported value is below 2 / HISTOGRAM_SUB_BUCKETS
+/// (~6%) for the whole uint64_t range.
+/// Recording is a couple of shifts and one increment, no allocation.
+enum {
+    HISTOGRAM_SUB_BUCKET_BITS = 5,
+    HISTOGRAM_SUB_BUCKETS     = 1u << HISTOGRAM_SUB_BUCKET_BITS,
+    HISTOGRAM_BUCKETS         = (64 - HISTOGRAM_SUB_BUCKET_BITS + 2) * (HISTOGRAM_SUB_BUCKETS / 2),
+};
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_reset(Histogram* hist);
+void histogram_record(Histogram* hist, uint64_t value);
+void histogram_merge(Histogram* dst, const Histogram* src);
+/// @brief Same as histogram_record() but safe to read concurrently with
+/// histogram_merge_shared(). Only one thread may record into @a hist.
+/// Zero initialized histogram is a valid empty one for this function.
+void histogram_record_shared(Histogram* hist, uint64_t value);
+/// @brief Merges histogram that is concurrently updated by histogram_record_shared().
+void histogram_merge_shared(Histogram* dst, const Histogram* src);
+/// @param percentile value in [0; 100]
+uint64_t histogram_value_at_percentile(const Histogram* hist, double percentile);
+static inline uint64_t histogram_mean(const Histogram* hist) {
+    return hist->count == 0 ? 0 : hist->sum / hist->count;
+}
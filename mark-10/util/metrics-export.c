@@ -0,0 +1,184 @@
+#include "metrics-export.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "config.h"
+#include "metrics.h"
+
+enum { METRICS_EXPORT_READ_ATTEMPTS = 64 };
+
+static struct MetricsExporter {
+    MetricsExportSegment* segment;
+    char segment_name[METRICS_EXPORT_NAME_SIZE];
+    pthread_t thread;
+    atomic_bool is_running;
+    /// Snapshot is taken outside of the seqlock write section to keep it short.
+    MetricsSnapshot scratch;
+} exporter;
+
+static void publish_snapshot(void) {
+    MetricsExportSegment* segment = exporter.segment;
+    metrics_snapshot(&exporter.scratch);
+
+    const uint64_t seq = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->sequence, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&segment->snapshot, &exporter.scratch, sizeof(segment->snapshot));
+    segment->published_ns = monotonic_time_ns();
+    __atomic_store_n(&segment->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void* metrics_exporter(void* unused) {
+    (void)unused;
+
+    const struct timespec period = {
+        .tv_sec  = METRICS_EXPORT_PERIOD_MS / 1000,
+        .tv_nsec = (METRICS_EXPORT_PERIOD_MS % 1000) * 1000000L,
+    };
+    while (atomic_load_explicit(&exporter.is_running, memory_order_acquire)) {
+        publish_snapshot();
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+static void fill_segment_name(const char* component, pid_t pid,
+                              char segment_name[METRICS_EXPORT_NAME_SIZE]) {
+    int len = snprintf(segment_name, METRICS_EXPORT_NAME_SIZE,
+                       "/" METRICS_EXPORT_SHM_PREFIX "%s-%d", component, (int)pid);
+    for (int i = 1; i < len && segment_name[i] != '\0'; i++) {
+        if (segment_name[i] == ' ' || segment_name[i] == '/') {
+            segment_name[i] = '-';
+        }
+    }
+}
+
+bool start_metrics_export(const char* component) {
+    const pid_t pid = getpid();
+    fill_segment_name(component, pid, exporter.segment_name);
+    int fd = shm_open(exporter.segment_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+        app_perror("shm_open");
+        return false;
+    }
+    if (ftruncate(fd, sizeof(MetricsExportSegment)) == -1) {
+        app_perror("ftruncate");
+        goto start_metrics_export_cleanup_fd;
+    }
+    void* mem = mmap(NULL, sizeof(MetricsExportSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        app_perror("mmap");
+        goto start_metrics_export_cleanup_fd;
+    }
+    close(fd);
+
+    MetricsExportSegment* segment = mem;
+    segment->version              = METRICS_EXPORT_VERSION;
+    segment->pid                  = pid;
+    strncpy(segment->component, component, sizeof(segment->component) - 1);
+    __atomic_store_n(&segment->magic, METRICS_EXPORT_MAGIC, __ATOMIC_RELEASE);
+    exporter.segment = segment;
+
+    atomic_store_explicit(&exporter.is_running, true, memory_order_release);
+    int ret = pthread_create(&exporter.thread, NULL, &metrics_exporter, NULL);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_create");
+        atomic_store_explicit(&exporter.is_running, false, memory_order_release);
+        munmap(segment, sizeof(*segment));
+        exporter.segment = NULL;
+        shm_unlink(exporter.segment_name);
+        return false;
+    }
+    return true;
+
+start_metrics_export_cleanup_fd:
+    close(fd);
+    shm_unlink(exporter.segment_name);
+    return false;
+}
+
+void stop_metrics_export(void) {
+    if (exporter.segment == NULL) {
+        return;
+    }
+    atomic_store_explicit(&exporter.is_running, false, memory_order_release);
+    int ret = pthread_join(exporter.thread, NULL);
+    if (ret != 0) {
+        errno = ret;
+        app_perror("pthread_join");
+    }
+    // the readers that are still attached keep the mapping and see the final counters
+    publish_snapshot();
+    munmap(exporter.segment, sizeof(*exporter.segment));
+    exporter.segment = NULL;
+    if (shm_unlink(exporter.segment_name) == -1) {
+        app_perror("shm_unlink");
+    }
+}
+
+const MetricsExportSegment* attach_metrics_export(const char* segment_name) {
+    int fd = shm_open(segment_name, O_RDONLY, 0);
+    if (fd == -1) {
+        app_perror("shm_open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(MetricsExportSegment)) {
+        fprintf(stderr, "> Segment %s is not a metrics segment\n", segment_name);
+        close(fd);
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(MetricsExportSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        app_perror("mmap");
+        return NULL;
+    }
+    const MetricsExportSegment* segment = mem;
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != METRICS_EXPORT_MAGIC ||
+        segment->version != METRICS_EXPORT_VERSION) {
+        fprintf(stderr, "> Segment %s has unknown format\n", segment_name);
+        munmap(mem, sizeof(MetricsExportSegment));
+        return NULL;
+    }
+    return segment;
+}
+
+void detach_metrics_export(const MetricsExportSegment* segment) {
+    munmap((void*)segment, sizeof(*segment));
+}
+
+bool read_metrics_export(const MetricsExportSegment* segment, MetricsSnapshot* snapshot,
+                         uint64_t* published_ns) {
+    for (uint32_t attempt = 0; attempt < METRICS_EXPORT_READ_ATTEMPTS; attempt++) {
+        const uint64_t seq_before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if (seq_before == 0) {
+            return false;
+        }
+        if (seq_before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(snapshot, &segment->snapshot, sizeof(*snapshot));
+        *published_ns = segment->published_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == seq_before) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "metrics.h"
+
+/// @brief Publishes metrics of the process into the POSIX shared memory
+/// segment "/idz4-metrics-<component>-<pid>" so that they can be read by
+/// the `stats` tool without any request to the process.
+///
+/// A background exporter thread takes metrics_snapshot() every
+/// METRICS_EXPORT_PERIOD_MS and copies it into the segment under a seqlock:
+/// readers retry on a torn copy and never block the exporter, the hot path
+/// only touches its own metrics shard.
+
+#define METRICS_EXPORT_SHM_PREFIX "idz4-metrics-"
+
+enum {
+    METRICS_EXPORT_MAGIC          = 0x4d545253u,  // "MTRS"
+    METRICS_EXPORT_VERSION        = 1,
+    METRICS_EXPORT_PERIOD_MS      = 250,
+    METRICS_EXPORT_COMPONENT_SIZE = 32,
+    METRICS_EXPORT_NAME_SIZE      = 96,
+};
+
+typedef struct MetricsExportSegment {
+    uint32_t magic;
+    uint32_t version;
+    pid_t pid;
+    char component[METRICS_EXPORT_COMPONENT_SIZE];
+    /// Odd while the exporter is writing the snapshot.
+    uint64_t sequence;
+    /// CLOCK_MONOTONIC time of the last publication.
+    uint64_t published_ns;
+    MetricsSnapshot snapshot;
+} MetricsExportSegment;
+
+/// @brief Creates the segment and starts the exporter thread.
+/// Failure is not fatal for the caller: the process just stays unobservable.
+bool start_metrics_export(const char* component);
+/// @brief Publishes the last snapshot, stops the exporter and removes the segment.
+void stop_metrics_export(void);
+
+/// @brief Maps the segment created by the other process read-only.
+const MetricsExportSegment* attach_metrics_export(const char* segment_name);
+void detach_metrics_export(const MetricsExportSegment* segment);
+/// @brief Consistent copy of the published snapshot.
+/// @return false if no consistent copy could be taken (e.g. the publisher is
+/// being written to all the time or has not published anything yet)
+bool read_metrics_export(const MetricsExportSegment* segment, MetricsSnapshot* snapshot,
+                         uint64_t* published_ns);
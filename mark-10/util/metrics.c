@@ -0,0 +1,195 @@
+#include "metrics.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+/// @brief Shared by the threads that did not get their own shard, see MetricsShard.is_shared.
+enum { METRICS_OVERFLOW_SHARD = METRICS_MAX_SHARDS };
+
+static MetricsShard shards[METRICS_MAX_SHARDS + 1] = {
+    [METRICS_OVERFLOW_SHARD] = {.is_shared = true},
+};
+/// Shards handed out so far, METRICS_MAX_SHARDS + 1 once the shared one is used.
+static atomic_uint_fast32_t claimed_shards = 0;
+
+/// Guards the shards the exited threads returned and the histograms of the shared shard.
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t free_shards[METRICS_MAX_SHARDS];
+static uint32_t free_shards_count = 0;
+/// Returns the shard of an exiting thread.
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char counter_names[METRICS_MAX_COUNTERS][METRICS_MAX_NAME_SIZE];
+static char gauge_names[METRICS_MAX_GAUGES][METRICS_MAX_NAME_SIZE];
+static char histogram_names[METRICS_MAX_HISTOGRAMS][METRICS_MAX_NAME_SIZE];
+static atomic_uint_fast32_t counters_size   = 0;
+static atomic_uint_fast32_t gauges_size     = 0;
+static atomic_uint_fast32_t histograms_size = 0;
+
+_Thread_local MetricsShard* metrics_local_shard = NULL;
+
+static void release_shard(void* value) {
+    MetricsShard* shard = value;
+    metrics_local_shard = NULL;
+    if (shard->is_shared) {
+        return;
+    }
+    // the values stay in the shard, the readers keep summing them
+    pthread_mutex_lock(&shards_mutex);
+    free_shards[free_shards_count++] = (uint32_t)(shard - shards);
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, &release_shard);
+}
+
+MetricsShard* metrics_claim_shard(void) {
+    pthread_once(&shard_key_once, &create_shard_key);
+    pthread_mutex_lock(&shards_mutex);
+    uint32_t index = METRICS_OVERFLOW_SHARD;
+    if (free_shards_count != 0) {
+        index = free_shards[--free_shards_count];
+    } else {
+        const uint_fast32_t claimed = atomic_load_explicit(&claimed_shards, memory_order_relaxed);
+        index = claimed < METRICS_MAX_SHARDS ? (uint32_t)claimed : METRICS_OVERFLOW_SHARD;
+        if (claimed <= METRICS_MAX_SHARDS) {
+            atomic_store_explicit(&claimed_shards, claimed + 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    MetricsShard* shard = &shards[index];
+    metrics_local_shard = shard;
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+void metrics_record_shared_histogram(MetricId id, uint64_t value) {
+    pthread_mutex_lock(&shards_mutex);
+    histogram_record_shared(&shards[METRICS_OVERFLOW_SHARD].histograms[id], value);
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static MetricId register_metric(const char* name, char (*names)[METRICS_MAX_NAME_SIZE],
+                                atomic_uint_fast32_t* size, uint32_t max_size) {
+    pthread_mutex_lock(&registry_mutex);
+    const uint32_t current_size = (uint32_t)atomic_load_explicit(size, memory_order_relaxed);
+    MetricId id                 = current_size;
+    for (uint32_t i = 0; i < current_size; i++) {
+        if (strcmp(names[i], name) == 0) {
+            id = i;
+            break;
+        }
+    }
+    if (id == current_size) {
+        assert(current_size < max_size && "too many metrics, increase METRICS_MAX_*");
+        if (current_size < max_size) {
+            strncpy(names[id], name, METRICS_MAX_NAME_SIZE - 1);
+            atomic_store_explicit(size, current_size + 1, memory_order_release);
+        } else {
+            // reuse the last slot rather than writing out of bounds
+            id = max_size - 1;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return id;
+}
+
+MetricId metrics_register_counter(const char* name) {
+    return register_metric(name, counter_names, &counters_size, METRICS_MAX_COUNTERS);
+}
+
+MetricId metrics_register_gauge(const char* name) {
+    return register_metric(name, gauge_names, &gauges_size, METRICS_MAX_GAUGES);
+}
+
+MetricId metrics_register_histogram(const char* name) {
+    return register_metric(name, histogram_names, &histograms_size, METRICS_MAX_HISTOGRAMS);
+}
+
+static uint_fast32_t used_shards_count(void) {
+    return atomic_load_explicit(&claimed_shards, memory_order_acquire);
+}
+
+uint64_t metrics_counter_value(MetricId id) {
+    assert(id < METRICS_MAX_COUNTERS);
+    uint64_t value                  = 0;
+    const uint_fast32_t used_shards = used_shards_count();
+    for (uint_fast32_t s = 0; s < used_shards; s++) {
+        value += __atomic_load_n(&shards[s].counters[id], __ATOMIC_RELAXED);
+    }
+    return value;
+}
+
+int64_t metrics_gauge_value(MetricId id) {
+    assert(id < METRICS_MAX_GAUGES);
+    int64_t value                   = 0;
+    const uint_fast32_t used_shards = used_shards_count();
+    for (uint_fast32_t s = 0; s < used_shards; s++) {
+        value += __atomic_load_n(&shards[s].gauges[id], __ATOMIC_RELAXED);
+    }
+    return value;
+}
+
+void metrics_snapshot(MetricsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->counters_size = (uint32_t)atomic_load_explicit(&counters_size, memory_order_acquire);
+    snapshot->gauges_size   = (uint32_t)atomic_load_explicit(&gauges_size, memory_order_acquire);
+    snapshot->histograms_size =
+        (uint32_t)atomic_load_explicit(&histograms_size, memory_order_acquire);
+    memcpy(snapshot->counter_names, counter_names, sizeof(counter_names));
+    memcpy(snapshot->gauge_names, gauge_names, sizeof(gauge_names));
+    memcpy(snapshot->histogram_names, histogram_names, sizeof(histogram_names));
+    for (size_t i = 0; i < METRICS_MAX_HISTOGRAMS; i++) {
+        histogram_reset(&snapshot->histograms[i]);
+    }
+
+    const uint_fast32_t used_shards = used_shards_count();
+    for (uint_fast32_t s = 0; s < used_shards; s++) {
+        const MetricsShard* shard = &shards[s];
+        for (uint32_t i = 0; i < snapshot->counters_size; i++) {
+            snapshot->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (uint32_t i = 0; i < snapshot->gauges_size; i++) {
+            snapshot->gauges[i] += __atomic_load_n(&shard->gauges[i], __ATOMIC_RELAXED);
+        }
+        for (uint32_t i = 0; i < snapshot->histograms_size; i++) {
+            histogram_merge_shared(&snapshot->histograms[i], &shard->histograms[i]);
+        }
+    }
+}
+
+void print_metrics_snapshot(FILE* stream, const MetricsSnapshot* snapshot) {
+    fputs("+------------------------------------------------------------\n", stream);
+    for (uint32_t i = 0; i < snapshot->counters_size; i++) {
+        fprintf(stream, "| %-46s %12" PRIu64 "\n", snapshot->counter_names[i],
+                snapshot->counters[i]);
+    }
+    for (uint32_t i = 0; i < snapshot->gauges_size; i++) {
+        fprintf(stream, "| %-46s %12" PRId64 "\n", snapshot->gauge_names[i], snapshot->gauges[i]);
+    }
+    for (uint32_t i = 0; i < snapshot->histograms_size; i++) {
+        const Histogram* hist = &snapshot->histograms[i];
+        fprintf(stream,
+                "| %s (us): count=%" PRIu64 " p50=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64 "\n",
+                snapshot->histogram_names[i], hist->count,
+                histogram_value_at_percentile(hist, 50.0) / 1000,
+                histogram_value_at_percentile(hist, 99.0) / 1000, hist->max / 1000);
+    }
+    fputs("+------------------------------------------------------------\n", stream);
+}
+
+void print_metrics(FILE* stream) {
+    static MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+    print_metrics_snapshot(stream, &snapshot);
+}
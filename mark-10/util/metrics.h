@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+/// @brief Process wide metrics registry.
+///
+/// Every thread that updates a metric gets its own cache line aligned shard,
+/// so the hot path is a relaxed load and store into memory owned by the
+/// current core: no locked instructions and no cache lines shared between
+/// writers. Readers merge all the shards (see metrics_snapshot()). A thread
+/// returns its shard when it exits, the next thread adds to its values. The
+/// threads above METRICS_MAX_SHARDS share one shard and update it atomically.
+///
+/// Metrics are registered by name before the threads are started and are
+/// addressed by the returned MetricId afterwards.
+enum {
+    METRICS_MAX_COUNTERS   = 64,
+    METRICS_MAX_GAUGES     = 16,
+    METRICS_MAX_HISTOGRAMS = 4,
+    METRICS_MAX_SHARDS     = 16,
+    METRICS_MAX_NAME_SIZE  = 48,
+    METRICS_CACHE_LINE     = 64,
+};
+
+typedef uint32_t MetricId;
+
+typedef struct MetricsShard {
+    uint64_t counters[METRICS_MAX_COUNTERS];
+    /// Gauges are sharded as deltas: e.g. producer adds +1 and consumer adds -1
+    /// and the sum over all the shards is the queue depth.
+    int64_t gauges[METRICS_MAX_GAUGES];
+    Histogram histograms[METRICS_MAX_HISTOGRAMS];
+    /// Written by several threads, see metrics_record_shared_histogram().
+    bool is_shared;
+} __attribute__((aligned(METRICS_CACHE_LINE))) MetricsShard;
+
+extern _Thread_local MetricsShard* metrics_local_shard;
+MetricsShard* metrics_claim_shard(void);
+/// @brief Records into the histogram of the shared shard under a lock.
+void metrics_record_shared_histogram(MetricId id, uint64_t value);
+
+static inline MetricsShard* metrics_current_shard(void) {
+    MetricsShard* shard = metrics_local_shard;
+    return __builtin_expect(shard != NULL, 1) ? shard : metrics_claim_shard();
+}
+
+MetricId metrics_register_counter(const char* name);
+MetricId metrics_register_gauge(const char* name);
+MetricId metrics_register_histogram(const char* name);
+
+static inline void metrics_counter_add(MetricId id, uint64_t delta) {
+    MetricsShard* shard = metrics_current_shard();
+    uint64_t* counter   = &shard->counters[id];
+    if (__builtin_expect(shard->is_shared, 0)) {
+        __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+static inline void metrics_counter_inc(MetricId id) {
+    metrics_counter_add(id, 1);
+}
+
+static inline void metrics_gauge_add(MetricId id, int64_t delta) {
+    MetricsShard* shard = metrics_current_shard();
+    int64_t* gauge      = &shard->gauges[id];
+    if (__builtin_expect(shard->is_shared, 0)) {
+        __atomic_fetch_add(gauge, delta, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(gauge, __atomic_load_n(gauge, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_histogram_record(MetricId id, uint64_t value) {
+    MetricsShard* shard = metrics_current_shard();
+    if (__builtin_expect(shard->is_shared, 0)) {
+        metrics_record_shared_histogram(id, value);
+        return;
+    }
+    histogram_record_shared(&shard->histograms[id], value);
+}
+
+typedef struct MetricsSnapshot {
+    uint32_t counters_size;
+    uint32_t gauges_size;
+    uint32_t histograms_size;
+    char counter_names[METRICS_MAX_COUNTERS][METRICS_MAX_NAME_SIZE];
+    char gauge_names[METRICS_MAX_GAUGES][METRICS_MAX_NAME_SIZE];
+    char histogram_names[METRICS_MAX_HISTOGRAMS][METRICS_MAX_NAME_SIZE];
+    uint64_t counters[METRICS_MAX_COUNTERS];
+    int64_t gauges[METRICS_MAX_GAUGES];
+    Histogram histograms[METRICS_MAX_HISTOGRAMS];
+} MetricsSnapshot;
+
+/// @brief Merges all the shards. Never blocks the writers.
+void metrics_snapshot(MetricsSnapshot* snapshot);
+/// @brief Sum of the counter over all the shards, cheaper than a snapshot for one metric.
+uint64_t metrics_counter_value(MetricId id);
+int64_t metrics_gauge_value(MetricId id);
+void print_metrics_snapshot(FILE* stream, const MetricsSnapshot* snapshot);
+/// @brief Takes snapshot and prints it, e.g. at component shutdown.
+void print_metrics(FILE* stream);
@@ -36,7 +36,7 @@ ParseResult parse_args(int argc, const char* argv[]) {
         .port       = 0,
         .status     = PARSE_INVALID_ARGC,
     };
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         return res;
     }
 
@@ -44,6 +44,13 @@ ParseResult parse_args(int argc, const char* argv[]) {
         res.status = PARSE_INVALID_PORT;
         return res;
     }
+    if (argc == 3) {
+        if (!verify_ip(argv[2], true)) {
+            res.status = PARSE_INVALID_IP_ADDRESS;
+            return res;
+        }
+        res.ip_address = argv[2];
+    }
     res.status = PARSE_SUCCESS;
     return res;
 }
@@ -67,7 +74,24 @@ void print_invalid_args_error(ParseStatus status, const char* program_path) {
 
     fprintf(stderr,
             "CLI args error: %s\n"
-            "Usage: %s <server port>\n"
-            "Example: %s 31457\n",
-            error_str, program_path, program_path);
+            "Usage: %s <server port> [server ip address]\n"
+            "Without ip address components talk over UDP broadcast, with it over TCP\n"
+            "(the server listens for TCP clients on this address)\n"
+            "Example: %s 31457\n"
+            "Example: %s 31457 10.0.0.1\n",
+            error_str, program_path, program_path, program_path);
+}
+
+uint32_t parse_env_uint32(const char* name, uint32_t default_value) {
+    const char* value_str = getenv(name);
+    if (value_str == NULL || *value_str == '\0') {
+        return default_value;
+    }
+    char* end_ptr       = NULL;
+    unsigned long value = strtoul(value_str, &end_ptr, 10);
+    if (end_ptr == NULL || *end_ptr != '\0' || value > UINT32_MAX) {
+        fprintf(stderr, "> Ignoring invalid value \"%s\" of %s\n", value_str, name);
+        return default_value;
+    }
+    return (uint32_t)value;
 }
@@ -10,6 +10,7 @@ typedef enum ParseStatus {
 } ParseStatus;
 
 typedef struct ParseResult {
+    /// NULL if not specified.
     const char* ip_address;
     uint16_t port;
     ParseStatus status;
@@ -17,3 +18,6 @@ typedef struct ParseResult {
 
 ParseResult parse_args(int argc, const char* argv[]);
 void print_invalid_args_error(ParseStatus status, const char* program_path);
+/// @brief Reads optional unsigned tuning knob from the environment.
+/// @return @a default_value if variable is not set or malformed
+uint32_t parse_env_uint32(const char* name, uint32_t default_value);
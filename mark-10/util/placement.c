@@ -0,0 +1,127 @@
+#ifndef _GNU_SOURCE
+// sched_setaffinity(2), CPU_SET(3), syscall(SYS_mbind)
+#define _GNU_SOURCE
+#endif
+
+#include "placement.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+
+/// @brief Parses the list of CPUs like "0,2,8-11".
+/// @return number of the CPUs written to @a cpus or 0 if the list is malformed
+static uint32_t parse_cpu_list(const char* list, uint32_t cpus[PLACEMENT_MAX_CPUS]) {
+    uint32_t count  = 0;
+    const char* ptr = list;
+    while (*ptr != '\0') {
+        char* end_ptr       = NULL;
+        unsigned long first = strtoul(ptr, &end_ptr, 10);
+        if (end_ptr == ptr) {
+            return 0;
+        }
+        unsigned long last = first;
+        ptr                = end_ptr;
+        if (*ptr == '-') {
+            ptr++;
+            last = strtoul(ptr, &end_ptr, 10);
+            if (end_ptr == ptr || last < first) {
+                return 0;
+            }
+            ptr = end_ptr;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            if (cpu >= PLACEMENT_MAX_CPUS || count >= PLACEMENT_MAX_CPUS) {
+                return 0;
+            }
+            cpus[count++] = (uint32_t)cpu;
+        }
+        if (*ptr == ',') {
+            ptr++;
+        } else if (*ptr != '\0') {
+            return 0;
+        }
+    }
+    return count;
+}
+
+int32_t cpu_numa_node(uint32_t cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return PLACEMENT_NO_NODE;
+    }
+    int32_t node               = PLACEMENT_NO_NODE;
+    const struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned node_number = 0;
+        if (sscanf(entry->d_name, "node%u", &node_number) == 1) {
+            node = (int32_t)node_number;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+ThreadPlacement place_current_thread(const char* cpus_env, uint32_t index,
+                                     const char* thread_name) {
+    ThreadPlacement placement = {.cpu = PLACEMENT_NO_CPU, .node = PLACEMENT_NO_NODE};
+    const char* list          = getenv(cpus_env);
+    if (list == NULL || *list == '\0') {
+        return placement;
+    }
+    uint32_t cpus[PLACEMENT_MAX_CPUS];
+    const uint32_t cpus_count = parse_cpu_list(list, cpus);
+    if (cpus_count == 0) {
+        fprintf(stderr, "> Ignoring invalid value \"%s\" of %s\n", list, cpus_env);
+        return placement;
+    }
+
+    const uint32_t cpu = cpus[index % cpus_count];
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    // pid 0 is the calling thread
+    if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == -1) {
+        app_perror("sched_setaffinity");
+        return placement;
+    }
+    placement.cpu  = (int32_t)cpu;
+    placement.node = cpu_numa_node(cpu);
+    printf("> Pinned %s thread %u to CPU %u, NUMA node %d\n", thread_name, index, cpu,
+           placement.node);
+    return placement;
+}
+
+bool placement_bind_memory(void* addr, size_t size, int32_t node) {
+    if (node < 0 || size == 0) {
+        return false;
+    }
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const uintptr_t begin     = (uintptr_t)addr & ~(page_size - 1);
+    const uintptr_t end       = ((uintptr_t)addr + size + page_size - 1) & ~(page_size - 1);
+
+    enum { NODE_MASK_BITS = 8 * sizeof(unsigned long) };
+    if (node >= NODE_MASK_BITS) {
+        return false;
+    }
+    const unsigned long node_mask = 1UL << node;
+    if (syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &node_mask, NODE_MASK_BITS + 1,
+                MPOL_MF_MOVE) == -1) {
+        app_perror("mbind");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Pinning of the threads to the CPUs and of their memory to the NUMA nodes.
+///
+/// Every kind of thread has its own environment variable with the list of
+/// CPUs in the cpuset(7) format, e.g. SERVER_DISPATCHER_CPUS="0,2,8-11".
+/// The n-th thread of the kind is pinned to the n-th CPU of the list (round
+/// robin if there are more threads than CPUs). Threads of the kinds without
+/// the variable are left to the scheduler.
+///
+/// Pinned threads allocate memory from their local node: the kernel does it
+/// for the pages first touched by the thread, memory allocated before the
+/// thread started is moved with placement_bind_memory().
+enum {
+    PLACEMENT_MAX_CPUS = 1024,
+    PLACEMENT_NO_NODE  = -1,
+    PLACEMENT_NO_CPU   = -1,
+};
+
+#define SERVER_DISPATCHER_CPUS_ENV "SERVER_DISPATCHER_CPUS"
+#define SERVER_LOGGER_CPUS_ENV "SERVER_LOGGER_CPUS"
+#define SERVER_POLLER_CPUS_ENV "SERVER_POLLER_CPUS"
+#define WORKER_CPUS_ENV "WORKER_CPUS"
+
+typedef struct ThreadPlacement {
+    /// PLACEMENT_NO_CPU if the thread is not pinned.
+    int32_t cpu;
+    /// PLACEMENT_NO_NODE if the thread is not pinned or the node is unknown.
+    int32_t node;
+} ThreadPlacement;
+
+/// @brief Pins the calling thread to the @a index-th CPU of the list
+/// from the @a cpus_env variable and prints the placement.
+/// @param thread_name name of the thread in the report
+ThreadPlacement place_current_thread(const char* cpus_env, uint32_t index,
+                                     const char* thread_name);
+/// @return NUMA node of the @a cpu or PLACEMENT_NO_NODE
+int32_t cpu_numa_node(uint32_t cpu);
+/// @brief Moves the pages of [@a addr, @a addr + @a size) to the @a node
+/// and makes it the preferred node of their future allocations.
+bool placement_bind_memory(void* addr, size_t size, int32_t node);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief Token bucket: the tokens come at the rate up to the burst, every
+/// admitted event takes one. Not thread-safe.
+typedef struct TokenBucket {
+    /// Tokens a second, 0 for no limit.
+    double rate;
+    double burst;
+    double tokens;
+    /// Monotonic ns of the last refill.
+    uint64_t last_ns;
+} TokenBucket;
+
+static inline void token_bucket_refill(TokenBucket* bucket, uint64_t now_ns) {
+    if (now_ns > bucket->last_ns) {
+        bucket->tokens += bucket->rate * (double)(now_ns - bucket->last_ns) / 1e9;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+    }
+    bucket->last_ns = now_ns;
+}
+
+/// @brief Starts the bucket full.
+static inline void init_token_bucket(TokenBucket* bucket, double rate, double burst,
+                                     uint64_t now_ns) {
+    *bucket = (TokenBucket){
+        .rate    = rate,
+        .burst   = burst < 1 ? 1 : burst,
+        .tokens  = burst < 1 ? 1 : burst,
+        .last_ns = now_ns,
+    };
+}
+
+/// @brief Changes the rate, the tokens collected so far are kept up to the new
+/// burst. A bucket without limit was full.
+static inline void token_bucket_set_rate(TokenBucket* bucket, double rate, double burst,
+                                         uint64_t now_ns) {
+    token_bucket_refill(bucket, now_ns);
+    if (bucket->rate == 0) {
+        bucket->tokens = burst;
+    }
+    bucket->rate  = rate;
+    bucket->burst = burst < 1 ? 1 : burst;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+}
+
+/// @return false if there is no token at @a now_ns
+static inline bool token_bucket_take(TokenBucket* bucket, uint64_t now_ns) {
+    if (bucket->rate == 0) {
+        return true;
+    }
+    token_bucket_refill(bucket, now_ns);
+    if (bucket->tokens < 1) {
+        return false;
+    }
+    bucket->tokens -= 1;
+    return true;
+}
+
+/// @return ns from @a now_ns until the next token, 0 if there is one
+static inline uint64_t token_bucket_wait_ns(const TokenBucket* bucket, uint64_t now_ns) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+    const double elapsed_s = now_ns > bucket->last_ns ? (double)(now_ns - bucket->last_ns) / 1e9
+                                                      : 0;
+    const double missing   = 1 - bucket->tokens - bucket->rate * elapsed_s;
+    return missing > 0 ? (uint64_t)(missing / bucket->rate * 1e9) + 1 : 0;
+}